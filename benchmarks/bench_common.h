@@ -0,0 +1,102 @@
+// Shared helpers for the C benchmarks. Include after _bpe.c.
+
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <time.h>
+
+#define BENCH_REPEATS 7
+
+typedef struct bench_vocab {
+    unsigned char* data;
+    trie_entry_t* entries;
+    int num_entries;
+} bench_vocab_t;
+
+typedef struct bench_chunks {
+    unsigned char* text;
+    size_t text_length;
+    const unsigned char** texts;
+    int* lengths;
+    size_t num_chunks;
+} bench_chunks_t;
+
+static double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned char* bench_read_file(const char* path, size_t* length)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *length = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char* data = malloc(*length ? *length : 1);
+    if (data == NULL || fread(data, 1, *length, f) != *length)
+    {
+        fprintf(stderr, "%s: read failed\n", path);
+        exit(1);
+    }
+    fclose(f);
+    return data;
+}
+
+// Reads a vocab written by dump_vocab.py. The entries point into data.
+static void bench_load_vocab(const char* path, bench_vocab_t* vocab)
+{
+    size_t length;
+    vocab->data = bench_read_file(path, &length);
+    uint32_t count;
+    memcpy(&count, vocab->data, 4);
+    vocab->entries = malloc(count * sizeof(trie_entry_t));
+    vocab->num_entries = (int)count;
+    size_t pos = 4;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t token_id, token_length;
+        memcpy(&token_id, vocab->data + pos, 4);
+        memcpy(&token_length, vocab->data + pos + 4, 4);
+        pos += 8;
+        vocab->entries[i].bytes = vocab->data + pos;
+        vocab->entries[i].length = (int)token_length;
+        vocab->entries[i].token_id = (int)token_id;
+        vocab->entries[i].order = (int)i;
+        pos += token_length;
+    }
+}
+
+// Splits the text with the built-in GPT-2 pattern once, so the timed loops
+// only walk the trie.
+static void bench_load_chunks(const char* path, bench_chunks_t* chunks)
+{
+    init_ascii_runs();
+    chunks->text = bench_read_file(path, &chunks->text_length);
+    size_t capacity = 1 << 16;
+    chunks->texts = malloc(capacity * sizeof(unsigned char*));
+    chunks->lengths = malloc(capacity * sizeof(int));
+    chunks->num_chunks = 0;
+    Py_ssize_t length = (Py_ssize_t)chunks->text_length;
+    for (Py_ssize_t pos = 0; pos < length;)
+    {
+        Py_ssize_t end = gpt2_next_chunk(chunks->text, length, pos);
+        if (chunks->num_chunks == capacity)
+        {
+            capacity *= 2;
+            chunks->texts = realloc(chunks->texts, capacity * sizeof(unsigned char*));
+            chunks->lengths = realloc(chunks->lengths, capacity * sizeof(int));
+        }
+        chunks->texts[chunks->num_chunks] = chunks->text + pos;
+        chunks->lengths[chunks->num_chunks++] = (int)(end - pos);
+        pos = end;
+    }
+}
+
+#endif // BENCH_COMMON_H
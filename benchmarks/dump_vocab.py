@@ -0,0 +1,66 @@
+"""
+Write a vocab and a text for the C benchmarks in this directory.
+
+The vocab file is a little-endian u32 entry count followed by, for each
+entry, a u32 token id, a u32 byte length and the token bytes.
+
+    python benchmarks/dump_vocab.py TEXT VOCAB_OUT --tokenizer tok.json
+    python benchmarks/dump_vocab.py TEXT VOCAB_OUT --size 200000
+
+With --tokenizer the vocab of a saved tokenizer is written, without its
+special tokens. Otherwise a large synthetic vocab is made from the 256
+bytes plus every prefix of the most common pre-tokenized chunks of TEXT,
+up to --size entries.
+"""
+
+import argparse
+import collections
+import struct
+
+from bytephase import Tokenizer
+
+
+def write_vocab(path, vocab):
+    with open(path, "wb") as f:
+        f.write(struct.pack("<I", len(vocab)))
+        for idx, token in vocab.items():
+            f.write(struct.pack("<II", idx, len(token)))
+            f.write(token)
+
+
+def synthetic_vocab(tokenizer, text, size):
+    counts = collections.Counter(chunk.encode("utf-8") for chunk in tokenizer._split(text))
+    vocab = {idx: bytes([idx]) for idx in range(256)}
+    seen = set(vocab.values())
+    for chunk, _ in counts.most_common():
+        for end in range(2, len(chunk) + 1):
+            prefix = chunk[:end]
+            if prefix not in seen:
+                seen.add(prefix)
+                vocab[len(vocab)] = prefix
+        if len(vocab) >= size:
+            break
+    return vocab
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("text", help="UTF-8 text the benchmarks encode")
+    parser.add_argument("vocab_out", help="path of the vocab file to write")
+    parser.add_argument("--tokenizer", help="saved tokenizer (.json or .bpe) to take the vocab from")
+    parser.add_argument("--size", type=int, default=200000, help="entries in the synthetic vocab")
+    args = parser.parse_args()
+
+    tokenizer = Tokenizer()
+    if args.tokenizer:
+        tokenizer.load(args.tokenizer)
+        vocab = tokenizer._base_vocab()
+    else:
+        with open(args.text, encoding="utf-8", errors="ignore") as f:
+            vocab = synthetic_vocab(tokenizer, f.read(), args.size)
+    write_vocab(args.vocab_out, vocab)
+    print(f"wrote {len(vocab)} tokens to {args.vocab_out}")
+
+
+if __name__ == "__main__":
+    main()
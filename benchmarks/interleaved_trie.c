@@ -0,0 +1,204 @@
+// Greedy trie encoding one chunk at a time, the loop encode_inference runs
+// through encode_chunk_tokens, against a kernel that interleaves the walks
+// of TRIE_LANES chunks and prefetches each lane's next node. The kernel is
+// kept here only to reproduce the measurement, encode_inference does not
+// use it.
+//
+// Usage: interleaved_trie VOCAB TEXT
+
+#include "../bytephase/_bpe.c"
+#include "bench_common.h"
+
+#define TRIE_LANES 8
+
+#if defined(__GNUC__)
+#define TRIE_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define TRIE_PREFETCH(address) ((void)0)
+#endif
+
+// One chunk in encode_chunks_trie. The greedy match in progress starts at
+// pos and has walked depth bytes down to state.
+typedef struct trie_lane {
+    const unsigned char* text;
+    int length;
+    int pos;
+    int depth;
+    int32_t state;
+    int32_t match_id;
+    int match_length;
+    uint32_t* out;
+    int num_tokens;
+    int chunk;
+} trie_lane_t;
+
+// Starts lane on the next chunk that is not empty. Returns 0 if none is left.
+static int trie_lane_start(trie_lane_t* lane, const unsigned char* const* texts, const int* lengths, int num_chunks,
+                           uint32_t* const* outs, int* num_tokens, int* next_chunk)
+{
+    while (*next_chunk < num_chunks)
+    {
+        int chunk = (*next_chunk)++;
+        if (lengths[chunk] == 0)
+        {
+            num_tokens[chunk] = 0;
+            continue;
+        }
+        lane->text = texts[chunk];
+        lane->length = lengths[chunk];
+        lane->pos = 0;
+        lane->depth = 0;
+        lane->state = 0;
+        lane->match_id = -1;
+        lane->match_length = 0;
+        lane->out = outs[chunk];
+        lane->num_tokens = 0;
+        lane->chunk = chunk;
+        return 1;
+    }
+    return 0;
+}
+
+// Greedy longest-match encoding of many chunks, the same tokens as
+// encode_chunk_trie gives each one. Up to TRIE_LANES walks take turns a
+// byte at a time. Chunk i's tokens go to outs[i], which must have room for
+// lengths[i], and their number to num_tokens[i].
+static void encode_chunks_trie(Trie* trie, const unsigned char* const* texts, const int* lengths, int num_chunks,
+                               uint32_t* const* outs, int* num_tokens)
+{
+    const trie_node* nodes = trie->nodes;
+    trie_lane_t lanes[TRIE_LANES];
+    int next_chunk = 0;
+    int num_lanes = 0;
+    while (num_lanes < TRIE_LANES && trie_lane_start(&lanes[num_lanes], texts, lengths, num_chunks, outs, num_tokens, &next_chunk))
+    {
+        num_lanes++;
+    }
+
+    while (num_lanes > 0)
+    {
+        for (int l = 0; l < num_lanes; l++)
+        {
+            trie_lane_t* lane = &lanes[l];
+            const unsigned char* text = lane->text + lane->pos;
+            int remaining = lane->length - lane->pos;
+            if (lane->depth < remaining)
+            {
+                int32_t next = nodes[lane->state].base + text[lane->depth];
+                if (nodes[next].check == lane->state)
+                {
+                    lane->state = next;
+                    lane->depth++;
+                    if (nodes[next].token_id != -1)
+                    {
+                        lane->match_id = nodes[next].token_id;
+                        lane->match_length = lane->depth;
+                    }
+                    if (lane->depth < remaining)
+                    {
+                        TRIE_PREFETCH(&nodes[nodes[next].base + text[lane->depth]]);
+                    }
+                    continue;
+                }
+            }
+
+            // The walk can go no further, so the longest match is final
+            if (lane->match_id != -1)
+            {
+                lane->out[lane->num_tokens++] = lane->match_id;
+                lane->pos += lane->match_length;
+            }
+            else
+            {
+                lane->out[lane->num_tokens++] = text[0];
+                lane->pos++;
+            }
+            lane->depth = 0;
+            lane->state = 0;
+            lane->match_id = -1;
+            if (lane->pos < lane->length)
+            {
+                continue;
+            }
+            num_tokens[lane->chunk] = lane->num_tokens;
+            if (!trie_lane_start(lane, texts, lengths, num_chunks, outs, num_tokens, &next_chunk))
+            {
+                // Out of chunks: the last lane takes this one's turn
+                lanes[l--] = lanes[--num_lanes];
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s VOCAB TEXT\n", argv[0]);
+        return 2;
+    }
+    bench_vocab_t vocab;
+    bench_chunks_t chunks;
+    bench_load_vocab(argv[1], &vocab);
+    bench_load_chunks(argv[2], &chunks);
+    Trie* trie = create_trie(vocab.entries, vocab.num_entries);
+    if (trie == NULL)
+    {
+        fprintf(stderr, "create_trie failed\n");
+        return 1;
+    }
+    printf("vocab %d tokens, trie %zu nodes (%.2f MB)\n", vocab.num_entries, trie->num_nodes,
+           trie->num_nodes * sizeof(trie_node) / 1e6);
+    printf("text %.1f MB, %zu chunks\n", chunks.text_length / 1e6, chunks.num_chunks);
+
+    size_t num_chunks = chunks.num_chunks;
+    uint32_t* single_out = malloc(chunks.text_length * sizeof(uint32_t) + 1);
+    uint32_t* lanes_out = malloc(chunks.text_length * sizeof(uint32_t) + 1);
+    uint32_t** outs = malloc(num_chunks * sizeof(uint32_t*) + 1);
+    int* num_tokens = malloc(num_chunks * sizeof(int) + 1);
+    size_t offset = 0;
+    for (size_t i = 0; i < num_chunks; i++)
+    {
+        outs[i] = lanes_out + offset;
+        offset += chunks.lengths[i];
+    }
+
+    double best_single = 1e9;
+    double best_lanes = 1e9;
+    size_t total_tokens = 0;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        double start = bench_now();
+        size_t k = 0;
+        for (size_t i = 0; i < num_chunks; i++)
+        {
+            k += encode_chunk_trie(trie, chunks.texts[i], chunks.lengths[i], single_out + k);
+        }
+        double elapsed = bench_now() - start;
+        if (elapsed < best_single) best_single = elapsed;
+        total_tokens = k;
+
+        start = bench_now();
+        encode_chunks_trie(trie, chunks.texts, chunks.lengths, (int)num_chunks, outs, num_tokens);
+        elapsed = bench_now() - start;
+        if (elapsed < best_lanes) best_lanes = elapsed;
+    }
+
+    size_t k = 0;
+    int same = 1;
+    for (size_t i = 0; i < num_chunks && same; i++)
+    {
+        for (int j = 0; j < num_tokens[i]; j++)
+        {
+            same &= k < total_tokens && single_out[k++] == outs[i][j];
+        }
+    }
+    same &= k == total_tokens;
+
+    printf("%zu tokens, outputs %s\n", total_tokens, same ? "identical" : "DIFFER");
+    printf("one chunk at a time  %8.1f ms  %6.1fM tok/s\n", best_single * 1e3, total_tokens / best_single / 1e6);
+    printf("interleaved x%d       %8.1f ms  %6.1fM tok/s\n", TRIE_LANES, best_lanes * 1e3, total_tokens / best_lanes / 1e6);
+
+    free_trie(trie);
+    return same ? 0 : 1;
+}
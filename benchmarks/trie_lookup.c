@@ -0,0 +1,189 @@
+// Greedy longest-match lookups in the double-array trie against the
+// 256-pointer trie it replaced, which is rebuilt here as it was: one calloc
+// per node, each holding a child pointer for every byte value. Both encode
+// the same pre-split GPT-2 chunks through their search_trie.
+//
+// Usage: trie_lookup VOCAB TEXT
+
+#include "../bytephase/_bpe.c"
+#include "bench_common.h"
+
+typedef struct pointer_trie_node {
+    struct pointer_trie_node* children[256];
+    int token_id;
+} pointer_trie_node;
+
+static size_t pointer_trie_nodes = 0;
+
+static pointer_trie_node* pointer_trie_create_node(void)
+{
+    pointer_trie_node* node = calloc(1, sizeof(pointer_trie_node));
+    if (node == NULL)
+    {
+        fprintf(stderr, "pointer trie node allocation failed\n");
+        exit(1);
+    }
+    node->token_id = -1;
+    pointer_trie_nodes++;
+    return node;
+}
+
+static void pointer_trie_insert(pointer_trie_node* root, const unsigned char* token, int token_length, int token_id)
+{
+    pointer_trie_node* current = root;
+    for (int i = 0; i < token_length; i++)
+    {
+        if (!current->children[token[i]])
+        {
+            current->children[token[i]] = pointer_trie_create_node();
+        }
+        current = current->children[token[i]];
+    }
+    current->token_id = token_id;
+}
+
+static int pointer_trie_search(pointer_trie_node* root, const unsigned char* text, int text_length, int* match_length)
+{
+    pointer_trie_node* current = root;
+    int last_valid_match = -1;
+    int last_valid_match_length = 0;
+    for (int i = 0; i < text_length; i++)
+    {
+        if (!current->children[text[i]])
+        {
+            break;
+        }
+        current = current->children[text[i]];
+        if (current->token_id != -1)
+        {
+            last_valid_match = current->token_id;
+            last_valid_match_length = i + 1;
+        }
+    }
+    *match_length = last_valid_match_length;
+    return last_valid_match;
+}
+
+static void pointer_trie_free(pointer_trie_node* node)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        if (node->children[i])
+        {
+            pointer_trie_free(node->children[i]);
+        }
+    }
+    free(node);
+}
+
+// The greedy loop of encode_inference, one search per token with a single
+// byte falling back to its own id
+static size_t encode_pointer(pointer_trie_node* root, const bench_chunks_t* chunks, uint32_t* out)
+{
+    size_t num_tokens = 0;
+    for (size_t c = 0; c < chunks->num_chunks; c++)
+    {
+        const unsigned char* text = chunks->texts[c];
+        int length = chunks->lengths[c];
+        for (int i = 0; i < length;)
+        {
+            int match_length;
+            int token_id = pointer_trie_search(root, text + i, length - i, &match_length);
+            if (token_id == -1)
+            {
+                token_id = text[i];
+                match_length = 1;
+            }
+            out[num_tokens++] = (uint32_t)token_id;
+            i += match_length;
+        }
+    }
+    return num_tokens;
+}
+
+static size_t encode_double_array(Trie* trie, const bench_chunks_t* chunks, uint32_t* out)
+{
+    size_t num_tokens = 0;
+    for (size_t c = 0; c < chunks->num_chunks; c++)
+    {
+        unsigned char* text = (unsigned char*)chunks->texts[c];
+        int length = chunks->lengths[c];
+        for (int i = 0; i < length;)
+        {
+            int match_length;
+            int token_id = search_trie(trie, text + i, length - i, &match_length);
+            if (token_id == -1)
+            {
+                token_id = text[i];
+                match_length = 1;
+            }
+            out[num_tokens++] = (uint32_t)token_id;
+            i += match_length;
+        }
+    }
+    return num_tokens;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s VOCAB TEXT\n", argv[0]);
+        return 2;
+    }
+    bench_vocab_t vocab;
+    bench_chunks_t chunks;
+    bench_load_vocab(argv[1], &vocab);
+    bench_load_chunks(argv[2], &chunks);
+    printf("vocab %d tokens, text %.1f MB, %zu chunks\n", vocab.num_entries, chunks.text_length / 1e6, chunks.num_chunks);
+
+    double start = bench_now();
+    pointer_trie_node* root = pointer_trie_create_node();
+    for (int i = 0; i < vocab.num_entries; i++)
+    {
+        pointer_trie_insert(root, vocab.entries[i].bytes, vocab.entries[i].length, vocab.entries[i].token_id);
+    }
+    double pointer_build = bench_now() - start;
+
+    // create_trie sorts the entries in place, so it runs second
+    start = bench_now();
+    Trie* trie = create_trie(vocab.entries, vocab.num_entries);
+    double double_array_build = bench_now() - start;
+    if (trie == NULL)
+    {
+        fprintf(stderr, "create_trie failed\n");
+        return 1;
+    }
+
+    uint32_t* pointer_out = malloc(chunks.text_length * sizeof(uint32_t) + 1);
+    uint32_t* double_array_out = malloc(chunks.text_length * sizeof(uint32_t) + 1);
+    double best_pointer = 1e9;
+    double best_double_array = 1e9;
+    size_t pointer_tokens = 0;
+    size_t double_array_tokens = 0;
+    for (int r = 0; r < BENCH_REPEATS; r++)
+    {
+        start = bench_now();
+        pointer_tokens = encode_pointer(root, &chunks, pointer_out);
+        double elapsed = bench_now() - start;
+        if (elapsed < best_pointer) best_pointer = elapsed;
+
+        start = bench_now();
+        double_array_tokens = encode_double_array(trie, &chunks, double_array_out);
+        elapsed = bench_now() - start;
+        if (elapsed < best_double_array) best_double_array = elapsed;
+    }
+    int same = pointer_tokens == double_array_tokens &&
+               memcmp(pointer_out, double_array_out, pointer_tokens * sizeof(uint32_t)) == 0;
+
+    printf("%zu tokens, outputs %s\n", double_array_tokens, same ? "identical" : "DIFFER");
+    printf("              %10s  %10s  %8s  %12s\n", "nodes", "size", "build", "lookups");
+    printf("pointer       %10zu  %7.1f MB  %5.1f ms  %6.1fM tok/s\n", pointer_trie_nodes,
+           pointer_trie_nodes * sizeof(pointer_trie_node) / 1e6, pointer_build * 1e3, pointer_tokens / best_pointer / 1e6);
+    printf("double-array  %10zu  %7.1f MB  %5.1f ms  %6.1fM tok/s\n", trie->num_nodes,
+           trie->num_nodes * sizeof(trie_node) / 1e6, double_array_build * 1e3, double_array_tokens / best_double_array / 1e6);
+
+    pointer_trie_free(root);
+    free_trie(trie);
+    return same ? 0 : 1;
+}
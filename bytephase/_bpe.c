@@ -1,51 +1,73 @@
 #define PY_SSIZE_T_CLEAN
 #include "_bpe.h"
+#include <structmember.h>
+#include "_unicode_tables.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void print_bytes(text_chunk_node_t* node)
+static inline bpe_token_t word_token(const text_table_t* text_table, size_t i)
 {
-    for(int i = 0; i < (node->array_size/2)+1;i++)
+    return text_table->wide ? ((const uint32_t*)text_table->tokens)[i] : ((const uint16_t*)text_table->tokens)[i];
+}
+
+static inline void set_word_token(text_table_t* text_table, size_t i, bpe_token_t token)
+{
+    if (text_table->wide)
     {
-        printf("%hu ", node->bytes[i]);
-        if (node->bytes[i] == 0){
-            break;
-        }
+        ((uint32_t*)text_table->tokens)[i] = token;
+    }
+    else
+    {
+        ((uint16_t*)text_table->tokens)[i] = (uint16_t)token;
     }
-    printf("\n");
 }
 
-unsigned long hash_text(unsigned short unigram1, unsigned short unigram2)
+size_t hash_bigram(uint64_t key, size_t mask)
 {
-    unsigned long hash = 5381;
-    hash = ((hash << 5) + hash) + unigram1; /* hash * 33 + c */
-    hash = ((hash << 5) + hash) + unigram2; /* hash * 33 + c */
-
-    return hash % BIGRAM_TABLE_SIZE;
+    /* Fibonacci hashing, the high bits of the product are the best mixed */
+    return (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
 }
 
-void dfs(unsigned short* token, unsigned short index, token_node_t** token_table, int* result_count, unsigned short token_idx_end, size_t max_size) 
+// Writes the bytes of token index to token, appending at *result_count.
+// Returns -1 if the token refers to a missing token or does not fit in
+// max_size bytes.
+int dfs(unsigned char* token, bpe_token_t index, token_node_t** token_table, size_t* result_count, bpe_token_t token_idx_end, size_t max_size)
 {
-    if (index > token_idx_end || token_table[index] == NULL || *result_count >= max_size) 
+    if (index >= token_idx_end || token_table[index] == NULL)
     {
-        fprintf(stderr, "ERROR IN DFS");
-        return;
+        return -1;
     }
 
     token_node_t* node = token_table[index];
 
     for (int i = 0; i < 2; i++) 
     {
+        if (node->token[i] == 0)
+        {
+            // An alias has only its left token's bytes
+            continue;
+        }
         if (node->token[i] < 256) 
         {
-           token[(*result_count)++] = node->token[i];
+            if (*result_count >= max_size)
+            {
+                return -1;
+            }
+            token[(*result_count)++] = node->token[i];
         } 
-        else 
+        else if (dfs(token, node->token[i], token_table, result_count, token_idx_end, max_size) != 0)
         {
-            dfs(token, node->token[i], token_table, result_count, token_idx_end, max_size);
+            return -1;
         }
     }
+    return 0;
 }
 
 token_node_t* create_token(bigram_node_t** max_node)
@@ -53,693 +75,6652 @@ token_node_t* create_token(bigram_node_t** max_node)
     token_node_t* new_node = malloc(sizeof(token_node_t));
     if (new_node == NULL)
     {
-        fprintf(stderr, "Memory allocation failed for token node\n");
-    }    
+        return NULL;
+    }
     new_node->token[0] = (*max_node)->bigram[0];
     new_node->token[1] = (*max_node)->bigram[1];
     
     return new_node;
 }
 
-text_chunk_node_t* create_text_chunk_node(unsigned short* word, size_t size, unsigned short count)
-{   
-    unsigned short i;
-    unsigned short loc = 0;
-    text_chunk_node_t* node = malloc(sizeof(text_chunk_node_t) + size);
-    if (node == NULL)
+// Sizes the table for num_words words of num_tokens tokens in total, it
+// grows past that if more are added
+int init_text_table(text_table_t* text_table, size_t num_words, size_t num_tokens, int wide)
+{
+    memset(text_table, 0, sizeof(text_table_t));
+    text_table->wide = wide;
+    text_table->words_capacity = num_words > 0 ? num_words : 1;
+    text_table->tokens_capacity = num_tokens > 0 ? num_tokens : 1;
+    text_table->tokens = malloc(text_table->tokens_capacity * (wide ? sizeof(uint32_t) : sizeof(uint16_t)));
+    text_table->offsets = malloc(text_table->words_capacity * sizeof(size_t));
+    text_table->lengths = malloc(text_table->words_capacity * sizeof(uint32_t));
+    text_table->counts = malloc(text_table->words_capacity * sizeof(bpe_count_t));
+    if (text_table->tokens == NULL || text_table->offsets == NULL || text_table->lengths == NULL || text_table->counts == NULL)
+    {
+        free_text_table(text_table);
+        return -1;
+    }
+    return 0;
+}
+
+static int text_table_grow(text_table_t* text_table, size_t num_tokens)
+{
+    if (text_table->num_words == text_table->words_capacity)
+    {
+        size_t capacity = text_table->words_capacity * 2;
+        size_t* offsets = realloc(text_table->offsets, capacity * sizeof(size_t));
+        if (offsets == NULL) return -1;
+        text_table->offsets = offsets;
+        uint32_t* lengths = realloc(text_table->lengths, capacity * sizeof(uint32_t));
+        if (lengths == NULL) return -1;
+        text_table->lengths = lengths;
+        bpe_count_t* counts = realloc(text_table->counts, capacity * sizeof(bpe_count_t));
+        if (counts == NULL) return -1;
+        text_table->counts = counts;
+        text_table->words_capacity = capacity;
+    }
+    if (text_table->tokens_capacity - text_table->num_tokens < num_tokens)
     {
-        fprintf(stderr, "Memory allocation failed for text chunk node\n");
-    }    
-    memset(node, 0, sizeof(text_chunk_node_t) + size);
-    while ((i = *word++)!=0)
-    { 
-        node->bytes[loc] = i;
-        loc++;
+        size_t capacity = text_table->tokens_capacity * 2;
+        if (capacity - text_table->num_tokens < num_tokens)
+        {
+            capacity = text_table->num_tokens + num_tokens;
+        }
+        unsigned char* tokens = realloc(text_table->tokens, capacity * (text_table->wide ? sizeof(uint32_t) : sizeof(uint16_t)));
+        if (tokens == NULL) return -1;
+        text_table->tokens = tokens;
+        text_table->tokens_capacity = capacity;
     }
-    node -> array_size =  size;
-    node -> num_elements = size / sizeof(unsigned short);
-    node -> count = count;
-    return node;
+    return 0;
 }
 
-bigram_node_t* create_bigram_node(unsigned short unigram1, unsigned short unigram2, int freq)
+// Appends a word of length tokens. Its tokens are the bytes of word, or are
+// left for the caller to fill when word is NULL.
+int text_table_add(text_table_t* text_table, const unsigned char* word, uint32_t length, bpe_count_t count)
 {
-    bigram_node_t* node = malloc(sizeof(bigram_node_t));
-    if (node == NULL)
+    if (text_table_grow(text_table, length) != 0)
+    {
+        return -1;
+    }
+    size_t start = text_table->num_tokens;
+    text_table->offsets[text_table->num_words] = start;
+    text_table->lengths[text_table->num_words] = length;
+    text_table->counts[text_table->num_words] = count;
+    text_table->num_words++;
+    text_table->num_tokens += length;
+    for (uint32_t i = 0; word != NULL && i < length; i++)
     {
-        fprintf(stderr, "Memory allocation failed for bigram node\n");
-    } 
-    node->bigram[0] = unigram1;
-    node->bigram[1] = unigram2;
-    node -> next = NULL;
-    node -> freq = freq;
+        set_word_token(text_table, start + i, word[i]);
+    }
+    return 0;
+}
 
-    return node;
+void free_text_table(text_table_t* text_table)
+{
+    free(text_table->tokens);
+    free(text_table->offsets);
+    free(text_table->lengths);
+    free(text_table->counts);
+    memset(text_table, 0, sizeof(text_table_t));
 }
 
-void update_text_table (text_chunk_node_t** text_table, unsigned short* word, size_t size, unsigned short count, unsigned int* text_table_idx)
+bigram_table_t* create_bigram_table(size_t expected_size)
 {
-    text_chunk_node_t* new_node = NULL;
-    new_node = create_text_chunk_node(word, size, count);
-    text_table[*text_table_idx] = new_node;
-    (*text_table_idx)++;
+    bigram_table_t* table = calloc(1, sizeof(bigram_table_t));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    size_t capacity = BIGRAM_TABLE_MIN_SIZE;
+    while (capacity < expected_size * 2)
+    {
+        capacity <<= 1;
+    }
+    table->slots = calloc(capacity, sizeof(bigram_slot_t));
+    if (table->slots == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+    table->mask = capacity - 1;
+    table->free_node = BIGRAM_NODE_NONE;
+    return table;
 }
 
-void update_bigram_table (unsigned short unigram1, unsigned short unigram2, int count, bigram_node_t **bigram_table)
+static bigram_node_t* bigram_table_node(bigram_table_t* table, uint32_t node_idx)
 {
-    int hash = hash_text(unigram1, unigram2);
+    return &table->blocks[node_idx >> BIGRAM_ARENA_BLOCK_BITS][node_idx & (BIGRAM_ARENA_BLOCK_SIZE - 1)];
+}
 
-    bigram_node_t* check;
-    bigram_node_t* new_node = NULL;
-    int comparison;
-    if ((check = bigram_table[hash]))
+// Hand out a node from the arena. Freed nodes are reused first, otherwise the
+// arena grows by whole blocks so existing node pointers stay valid.
+static uint32_t bigram_table_alloc_node(bigram_table_t* table)
+{
+    if (table->free_node != BIGRAM_NODE_NONE)
+    {
+        uint32_t node_idx = table->free_node;
+        table->free_node = (uint32_t)bigram_table_node(table, node_idx)->heap_idx;
+        return node_idx;
+    }
+    if ((table->num_nodes & (BIGRAM_ARENA_BLOCK_SIZE - 1)) == 0)
     {
-        comparison = (check -> bigram[0] == unigram1 && check->bigram[1] == unigram2);
-        while ((comparison != 1) && (check -> next))
+        size_t block = table->num_nodes >> BIGRAM_ARENA_BLOCK_BITS;
+        if (block == table->num_blocks)
         {
-            check = check -> next;
-            comparison = (check -> bigram[0] == unigram1 && check->bigram[1] == unigram2);
-
+            size_t new_num_blocks = table->num_blocks ? table->num_blocks * 2 : 16;
+            bigram_node_t** new_blocks = realloc(table->blocks, new_num_blocks * sizeof(bigram_node_t*));
+            if (new_blocks == NULL)
+            {
+                return BIGRAM_NODE_NONE;
+            }
+            memset(new_blocks + table->num_blocks, 0, (new_num_blocks - table->num_blocks) * sizeof(bigram_node_t*));
+            table->blocks = new_blocks;
+            table->num_blocks = new_num_blocks;
         }
-        if (comparison == 1)
+        if (table->blocks[block] == NULL)
         {
-            check -> freq += count;
+            table->blocks[block] = malloc(BIGRAM_ARENA_BLOCK_SIZE * sizeof(bigram_node_t));
+            if (table->blocks[block] == NULL)
+            {
+                return BIGRAM_NODE_NONE;
+            }
         }
-        else
+    }
+    return table->num_nodes++;
+}
+
+static int bigram_table_grow(bigram_table_t* table)
+{
+    size_t new_mask = table->mask * 2 + 1;
+    bigram_slot_t* new_slots = calloc(new_mask + 1, sizeof(bigram_slot_t));
+    if (new_slots == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        if (table->slots[i].key == 0) continue;
+        size_t pos = hash_bigram(table->slots[i].key, new_mask);
+        while (new_slots[pos].key != 0)
         {
-            new_node = create_bigram_node(unigram1, unigram2, count);
-            check -> next = new_node;
+            pos = (pos + 1) & new_mask;
         }
+        new_slots[pos] = table->slots[i];
     }
-    else
+    free(table->slots);
+    table->slots = new_slots;
+    table->mask = new_mask;
+    return 0;
+}
+
+static int bigram_node_higher(bigram_node_t* a, bigram_node_t* b)
+{
+    if (a->freq != b->freq)
+    {
+        return a->freq > b->freq;
+    }
+    if (a->bigram[0] != b->bigram[0])
     {
-        new_node = create_bigram_node(unigram1, unigram2, count);
-        bigram_table[hash] = new_node;
+        return a->bigram[0] < b->bigram[0];
     }
+    return a->bigram[1] < b->bigram[1];
 }
 
-unsigned short* word_to_ints(char* word)
+static void bigram_heap_swap(bigram_heap_t* heap, size_t i, size_t j)
 {
-    unsigned short* int_word = (unsigned short*)malloc((strlen(word)+1) * sizeof(unsigned short));
-    unsigned short current_loc = 0;
-    unsigned char* current_char = (unsigned char*)word;  
+    bigram_node_t* tmp = heap->nodes[i];
+    heap->nodes[i] = heap->nodes[j];
+    heap->nodes[j] = tmp;
+    heap->nodes[i]->heap_idx = i;
+    heap->nodes[j]->heap_idx = j;
+}
 
-    for (int i = 0;i < strlen(word); i++)
+static void bigram_heap_sift_up(bigram_heap_t* heap, size_t idx)
+{
+    while (idx > 0)
     {
-        int_word[i] = (unsigned short)*current_char;
-        current_char++;
-        current_loc++;
+        size_t parent = (idx - 1) / 2;
+        if (!bigram_node_higher(heap->nodes[idx], heap->nodes[parent]))
+        {
+            break;
+        }
+        bigram_heap_swap(heap, idx, parent);
+        idx = parent;
     }
-    int_word[current_loc] = 0;
-    return int_word;
 }
 
-void init_stats(text_chunk_node_t* text_node, bigram_node_t **bigram_table)
+static void bigram_heap_sift_down(bigram_heap_t* heap, size_t idx)
 {
-    unsigned short* unigram_1 = text_node -> bytes;
-    unsigned short* unigram_2 = unigram_1 + 1;
-    unsigned short element = 0;
-    while (element < text_node->num_elements)
-    {   
-        if (*unigram_1 != 0 && *unigram_2 != 0)
+    while (1)
+    {
+        size_t left = 2 * idx + 1;
+        size_t right = left + 1;
+        size_t best = idx;
+        if (left < heap->size && bigram_node_higher(heap->nodes[left], heap->nodes[best]))
+        {
+            best = left;
+        }
+        if (right < heap->size && bigram_node_higher(heap->nodes[right], heap->nodes[best]))
         {
-            update_bigram_table(*unigram_1, *unigram_2, text_node->count, bigram_table);
+            best = right;
         }
-        unigram_1++;
-        unigram_2++;
-        element++;
+        if (best == idx)
+        {
+            break;
+        }
+        bigram_heap_swap(heap, idx, best);
+        idx = best;
     }
 }
 
-bigram_node_t** build_bigram_table(text_chunk_node_t** text_table, unsigned int text_table_len)
+bigram_heap_t* create_bigram_heap(size_t capacity)
 {
-    bigram_node_t** bigram_table = (bigram_node_t**)malloc(BIGRAM_TABLE_SIZE * sizeof(bigram_node_t*));
-    memset(bigram_table, 0, BIGRAM_TABLE_SIZE * sizeof(bigram_node_t*));
-    for (int i=0; i < text_table_len; i++)
+    bigram_heap_t* heap = malloc(sizeof(bigram_heap_t));
+    if (heap == NULL)
+    {
+        return NULL;
+    }
+    heap->nodes = malloc(capacity * sizeof(bigram_node_t*));
+    if (heap->nodes == NULL)
     {
-        init_stats(text_table[i], bigram_table);
+        free(heap);
+        return NULL;
     }
-    return bigram_table;
+    heap->size = 0;
+    heap->capacity = capacity;
+    return heap;
 }
 
-void word_retokenize(text_chunk_node_t* text_chunk_node, bigram_node_t **max_node, bigram_node_t** bigram_table, unsigned short token_idx)
+int bigram_heap_push(bigram_heap_t* heap, bigram_node_t* node)
 {
-    unsigned short* unigram_L = text_chunk_node -> bytes;
-    unsigned short* unigram_R = NULL;
-    
-    unsigned short* bytes_start = text_chunk_node -> bytes;
+    if (heap->size == heap->capacity)
+    {
+        size_t new_capacity = heap->capacity * 2;
+        bigram_node_t** new_nodes = realloc(heap->nodes, new_capacity * sizeof(bigram_node_t*));
+        if (new_nodes == NULL)
+        {
+            return -1;
+        }
+        heap->nodes = new_nodes;
+        heap->capacity = new_capacity;
+    }
+    node->heap_idx = heap->size;
+    heap->nodes[heap->size++] = node;
+    bigram_heap_sift_up(heap, node->heap_idx);
+    return 0;
+}
 
-    unsigned short* unigram_1 = text_chunk_node -> bytes;
-    unsigned short* unigram_2 = unigram_1 + 1;
-    unsigned short element = 1;
-    size_t remaining_bytes;
+// Restore heap order after node->freq has changed.
+void bigram_heap_update(bigram_heap_t* heap, bigram_node_t* node)
+{
+    size_t idx = node->heap_idx;
+    bigram_heap_sift_up(heap, idx);
+    if (node->heap_idx == idx)
+    {
+        bigram_heap_sift_down(heap, idx);
+    }
+}
 
-    while (element < text_chunk_node->num_elements)
-    {   
-        if (*unigram_1 == (*max_node)->bigram[0] && *unigram_2 == (*max_node)->bigram[1])
-        {
-            if (unigram_L != unigram_1)
-            {
-                unigram_L = unigram_1 - 1;
-                update_bigram_table(*unigram_L,*unigram_1, -1 * text_chunk_node ->count, bigram_table);
-                update_bigram_table(*unigram_L, token_idx, text_chunk_node ->count, bigram_table);
-            }
-            unigram_R = unigram_2 + 1;
-            
-            if (*unigram_R != 0)
-            {
-                update_bigram_table(*unigram_2,*unigram_R, -1 * text_chunk_node ->count, bigram_table);
-                update_bigram_table(token_idx, *unigram_R, text_chunk_node ->count, bigram_table);
-            }
-            *unigram_1 = token_idx;
-            remaining_bytes = (text_chunk_node->num_elements - element - 2) * sizeof(unsigned short);
+void bigram_heap_remove(bigram_heap_t* heap, bigram_node_t* node)
+{
+    size_t idx = node->heap_idx;
+    heap->size--;
+    if (idx == heap->size)
+    {
+        return;
+    }
+    heap->nodes[idx] = heap->nodes[heap->size];
+    heap->nodes[idx]->heap_idx = idx;
+    bigram_heap_update(heap, heap->nodes[idx]);
+}
 
-            memmove(unigram_2, unigram_R, remaining_bytes);
-            *(unigram_2 + (remaining_bytes / sizeof(unsigned short))) = 0;
-            text_chunk_node->array_size -= sizeof(unsigned short);
-            text_chunk_node->num_elements--;
+void free_bigram_heap(bigram_heap_t* heap)
+{
+    if (heap == NULL) return;
+    free(heap->nodes);
+    free(heap);
+}
 
-        }
-        if (unigram_1 != bytes_start)
+// Record that text_table[word_idx] contains the pair. Entries are only ever
+// appended, so a list can hold words that no longer contain the pair; those
+// are skipped by word_retokenize when the pair is merged. Returns -1 if the
+// list cannot grow.
+static int bigram_add_word(bigram_node_t* node, unsigned int word_idx)
+{
+    if (node->num_words > 0 && node->words[node->num_words - 1] == word_idx)
+    {
+        return 0;
+    }
+    if (node->num_words == node->words_capacity)
+    {
+        unsigned int new_capacity = node->words_capacity ? node->words_capacity * 2 : 4;
+        unsigned int* new_words = realloc(node->words, new_capacity * sizeof(unsigned int));
+        if (new_words == NULL)
         {
-            unigram_L++;
+            return -1;
         }
-        element++;
-        unigram_1++;
-        unigram_2++;
+        node->words = new_words;
+        node->words_capacity = new_capacity;
     }
+    node->words[node->num_words++] = word_idx;
+    return 0;
 }
 
-void retokenize(int text_table_len, text_chunk_node_t** text_table, bigram_node_t** max_node,  bigram_node_t** bigram_table, unsigned short token_idx)
+// Remove a pair from the table and the heap, and return its node to the
+// arena. Uses backward-shift deletion so probe chains never hold tombstones.
+void remove_bigram(bigram_table_t* table, bigram_heap_t* heap, bigram_node_t* node)
 {
-    for (int i = 0; i < text_table_len; i++)
+    uint64_t key = BIGRAM_KEY(node->bigram[0], node->bigram[1]);
+    size_t i = hash_bigram(key, table->mask);
+    while (table->slots[i].key != key)
     {
-        word_retokenize(text_table[i], max_node, bigram_table, token_idx);
+        if (table->slots[i].key == 0) return;
+        i = (i + 1) & table->mask;
     }
-}
+    uint32_t node_idx = table->slots[i].node_idx;
+
+    size_t j = i;
+    while (1)
+    {
+        j = (j + 1) & table->mask;
+        if (table->slots[j].key == 0) break;
+        size_t home = hash_bigram(table->slots[j].key, table->mask);
+        // Leave the entry if its home slot lies cyclically in (i, j]
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) continue;
+        table->slots[i] = table->slots[j];
+        i = j;
+    }
+    table->slots[i].key = 0;
+    table->size--;
 
+    bigram_heap_remove(heap, node);
+    free(node->words);
+    node->words = NULL;
+    node->heap_idx = table->free_node;
+    table->free_node = node_idx;
+}
 
-void update_max_node(bigram_node_t** max_node, bigram_node_t** bigram_table, token_node_t** token_table, unsigned short token_idx)
+// Add count to a pair and set *out to its node, or to NULL if the pair is
+// not (or no longer) in the table. With a NULL heap the table only
+// accumulates signed deltas, as the per-thread tables of a parallel step do,
+// and entries are never removed. Returns -1 if memory runs out.
+static int bigram_table_add(bigram_table_t* bigram_table, bigram_heap_t* heap, bpe_token_t unigram1, bpe_token_t unigram2, bpe_count_t count, bigram_node_t** out)
 {
-    (*max_node) -> freq = 0;
+    uint64_t key = BIGRAM_KEY(unigram1, unigram2);
+    size_t pos = hash_bigram(key, bigram_table->mask);
     bigram_node_t* check;
-    for (int i = 0; i < BIGRAM_TABLE_SIZE; i++)
+
+    while (bigram_table->slots[pos].key != 0 && bigram_table->slots[pos].key != key)
+    {
+        pos = (pos + 1) & bigram_table->mask;
+    }
+
+    if (bigram_table->slots[pos].key == key)
     {
-        check = bigram_table[i];
-        while (check != NULL)
+        check = bigram_table_node(bigram_table, bigram_table->slots[pos].node_idx);
+        check -> freq += count;
+        if (heap != NULL)
         {
-            if (check -> freq > 
-            (*max_node) -> freq)
+            if (check -> freq <= 0)
+            {
+                remove_bigram(bigram_table, heap, check);
+                check = NULL;
+            }
+            else
             {
-                (*max_node) = check;
+                bigram_heap_update(heap, check);
             }
-            check = check -> next;
         }
+        *out = check;
+        return 0;
     }
-    token_node_t* new_node = create_token(max_node);
-    token_table[token_idx] = new_node;
-}
 
-void free_bigram_table(bigram_node_t** bigram_table)
-{
-    bigram_node_t* current;
-    bigram_node_t* next;
-    for (int i = 0; i < BIGRAM_TABLE_SIZE; i++)
-    {        
-        current = bigram_table[i];
-        while (current != NULL)
-        {
-            next = current -> next;
-            free(current);
-            current = next;
-        }
+    *out = NULL;
+    if (count <= 0 && heap != NULL) return 0;
+    uint32_t node_idx = bigram_table_alloc_node(bigram_table);
+    if (node_idx == BIGRAM_NODE_NONE)
+    {
+        return -1;
+    }
+    check = bigram_table_node(bigram_table, node_idx);
+    check->bigram[0] = unigram1;
+    check->bigram[1] = unigram2;
+    check -> freq = count;
+    check -> words = NULL;
+    check -> num_words = 0;
+    check -> words_capacity = 0;
+
+    // Push before the slot is taken, so a failed push leaves the table as
+    // it was and the node goes back to the arena
+    if (heap != NULL && bigram_heap_push(heap, check) != 0)
+    {
+        check->heap_idx = bigram_table->free_node;
+        bigram_table->free_node = node_idx;
+        return -1;
+    }
+    bigram_table->slots[pos].key = key;
+    bigram_table->slots[pos].node_idx = node_idx;
+    bigram_table->size++;
+    // A table that cannot grow would eventually fill, and a probe for a
+    // missing pair would never stop
+    if (bigram_table->size * 4 > (bigram_table->mask + 1) * 3 && bigram_table_grow(bigram_table) != 0)
+    {
+        return -1;
     }
+    *out = check;
+    return 0;
 }
 
-size_t get_array_size(unsigned short* array)
+int update_bigram_table (bpe_token_t unigram1, bpe_token_t unigram2, bpe_count_t count, unsigned int word_idx, bigram_table_t* bigram_table, bigram_heap_t* heap)
 {
-    size_t size = 0;
-    while (array[size] != 0) 
+    bigram_node_t* check;
+    if (bigram_table_add(bigram_table, heap, unigram1, unigram2, count, &check) != 0)
+    {
+        return -1;
+    }
+    if (check != NULL && count > 0)
     {
-        size++;
+        return bigram_add_word(check, word_idx);
     }
-    return (1 + size) * sizeof(unsigned short);
+    return 0;
 }
 
-void cleanup_train_resources(text_chunk_node_t **text_table, int text_table_len, 
-                       bigram_node_t **bigram_table, token_node_t **token_table, 
-                       int token_idx_start, int token_idx_end, unsigned short *token) 
+// Fold a delta table into the main table. Word lists are appended in order,
+// so merging thread tables in thread order matches a single-threaded pass.
+int merge_bigram_table(bigram_table_t* bigram_table, bigram_heap_t* heap, bigram_table_t* delta)
 {
-    if (text_table) {
-        for (int i = 0; i < text_table_len; i++) {
-            free(text_table[i]);
+    for (uint32_t i = 0; i < delta->num_nodes; i++)
+    {
+        bigram_node_t* node = bigram_table_node(delta, i);
+        bigram_node_t* check;
+        if (bigram_table_add(bigram_table, heap, node->bigram[0], node->bigram[1], node->freq, &check) != 0)
+        {
+            return -1;
         }
-        free(text_table);
-    }
-    if (bigram_table) {
-        free_bigram_table(bigram_table);
-        free(bigram_table);
-    }
-    if (token_table) {
-        for (int i = token_idx_start; i < token_idx_end; i++) {
-            free(token_table[i]);
+        if (check == NULL) continue;
+        for (unsigned int j = 0; j < node->num_words; j++)
+        {
+            if (bigram_add_word(check, node->words[j]) != 0)
+            {
+                return -1;
+            }
         }
-        free(token_table);
     }
-    free(token);
+    return 0;
 }
 
-trie_node* create_node() 
+// Empty a delta table for reuse, keeping its slots and arena blocks.
+void clear_bigram_table(bigram_table_t* bigram_table)
 {
-    trie_node* node = (trie_node*)calloc(1, sizeof(trie_node));
-    node->token_id = -1;
-    
-    return node;
+    for (uint32_t i = 0; i < bigram_table->num_nodes; i++)
+    {
+        free(bigram_table_node(bigram_table, i) -> words);
+    }
+    memset(bigram_table->slots, 0, (bigram_table->mask + 1) * sizeof(bigram_slot_t));
+    bigram_table->size = 0;
+    bigram_table->num_nodes = 0;
+    bigram_table->free_node = BIGRAM_NODE_NONE;
 }
 
-Trie* create_trie() 
+int init_stats(const text_table_t* text_table, unsigned int word_idx, bigram_table_t* bigram_table, bigram_heap_t* heap)
 {
-    Trie* trie = (Trie*)malloc(sizeof(Trie));
-    trie->root = create_node();
-    
-    return trie;
-}
-
-void insert_trie(Trie* trie, unsigned char* token, int token_length, int token_id) {
-    trie_node* current = trie->root;
-    for (int i = 0; i < token_length; i++) {
-        if (!current->children[token[i]]) {
-            current->children[token[i]] = create_node();
-            if (!current->children[token[i]]) {
-                printf("ERROR LINE 335");
-                return;
-            }
+    size_t start = text_table->offsets[word_idx];
+    bpe_count_t count = text_table->counts[word_idx];
+    for (size_t i = start; i + 1 < start + text_table->lengths[word_idx]; i++)
+    {   
+        if (update_bigram_table(word_token(text_table, i), word_token(text_table, i + 1), count, word_idx, bigram_table, heap) != 0)
+        {
+            return -1;
         }
-        current = current->children[token[i]];
     }
-    current->token_id = token_id;
+    return 0;
 }
 
-int search_trie(Trie* trie, unsigned char* text, int text_length, int* match_length) 
+static void* train_pool_worker(void* arg)
 {
-    trie_node* current = trie->root;
-    int last_valid_match = -1;
-    *match_length = 0;
+    train_worker_t* worker = arg;
+    train_pool_t* pool = worker->pool;
+    unsigned long seen = 0;
 
-    int last_valid_match_length = 0;
-
-    for (int i = 0; i < text_length; i++) 
+    pthread_mutex_lock(&pool->lock);
+    while (1)
     {
-        if (!current->children[text[i]]) 
+        while (pool->generation == seen && !pool->shutdown)
         {
-            break;
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
         }
-        current = current->children[text[i]];
-        (*match_length)++;
-        if (current->token_id != -1) 
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->job(pool->job_arg, worker->thread_idx, pool->num_threads);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
         {
-            last_valid_match = current->token_id;
-            last_valid_match_length = *match_length;
+            pthread_cond_signal(&pool->done_cond);
         }
     }
-    *match_length = last_valid_match_length;
-
-    return last_valid_match;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-void free_trie_node(trie_node* node) 
+// The calling thread takes part in every job as thread 0, so a pool of
+// num_threads runs num_threads - 1 workers.
+train_pool_t* create_train_pool(int num_threads)
 {
-    if (node == NULL) return;
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        if (node->children[i]) {
-            free_trie_node(node->children[i]);
+    train_pool_t* pool = calloc(1, sizeof(train_pool_t));
+    if (pool == NULL) return NULL;
+    pool->num_threads = num_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    pool->workers = calloc(num_threads, sizeof(train_worker_t));
+    pool->deltas = calloc(num_threads, sizeof(bigram_table_t*));
+    if (pool->workers == NULL || pool->deltas == NULL)
+    {
+        free_train_pool(pool);
+        return NULL;
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        pool->deltas[i] = create_bigram_table(0);
+        if (pool->deltas[i] == NULL)
+        {
+            free_train_pool(pool);
+            return NULL;
+        }
+    }
+    for (int i = 1; i < num_threads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].thread_idx = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, train_pool_worker, &pool->workers[i]) != 0)
+        {
+            free_train_pool(pool);
+            return NULL;
         }
+        pool->workers[i].started = 1;
     }
-    free(node);
+    return pool;
 }
 
-void free_trie(Trie* trie) 
+void train_pool_run(train_pool_t* pool, train_job_fn job, void* job_arg)
 {
-    if (trie == NULL) return;
-    free_trie_node(trie->root);
-    free(trie);
-} 
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->job_arg = job_arg;
+    pool->pending = pool->num_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
 
-static void trie_capsule_destructor(PyObject *capsule) 
-{
-    Trie *trie = PyCapsule_GetPointer(capsule, "bpe_trie");
-    if (trie) {
-        free_trie(trie);
+    job(job_arg, 0, pool->num_threads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
     }
+    pthread_mutex_unlock(&pool->lock);
 }
 
-
-static PyObject* train(PyObject* self, PyObject* args) 
+void free_train_pool(train_pool_t* pool)
 {
-    PyObject* dict;
-    int text_table_len;
-    int num_merges;
-    PyObject* key;
-    PyObject* value;
-    Py_ssize_t pos = 0;
-
-    // Parse the input dictionary and integer pass from python call
-    if (!PyArg_ParseTuple(args, "O!ii", &PyDict_Type, &dict, &text_table_len, &num_merges)) 
+    if (pool == NULL) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; pool->workers && i < pool->num_threads; i++)
     {
-        return NULL;
+        if (pool->workers[i].started)
+        {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+    }
+    for (int i = 0; pool->deltas && i < pool->num_threads; i++)
+    {
+        free_bigram_table(pool->deltas[i]);
     }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->workers);
+    free(pool->deltas);
+    free(pool);
+}
 
-    text_chunk_node_t **text_table = malloc(sizeof(text_chunk_node_t*) * text_table_len);
-    if (text_table == NULL) 
+// Each thread takes a contiguous shard of the words (or of the whole text
+// table) so that merging the thread tables in order keeps every word list
+// in the same order a single thread would have built it.
+static void count_shard_job(void* arg, int thread_idx, int num_threads)
+{
+    train_job_t* job = arg;
+    unsigned int begin = (unsigned int)((uint64_t)job->num_words * thread_idx / num_threads);
+    unsigned int end = (unsigned int)((uint64_t)job->num_words * (thread_idx + 1) / num_threads);
+    for (unsigned int i = begin; i < end && !atomic_load(&job->failed); i++)
     {
-        PyErr_SetString(PyExc_MemoryError, "Failed to allocate text table");
-        goto error;
+        if (init_stats(job->text_table, i, job->deltas[thread_idx], NULL) != 0)
+        {
+            atomic_store(&job->failed, 1);
+        }
     }
-    memset(text_table, 0, sizeof(text_chunk_node_t*) * text_table_len);
+}
 
-    token_node_t** token_table = malloc(sizeof(token_node_t*) * (num_merges + 257));
-    if (token_table == NULL)
+static void retokenize_shard_job(void* arg, int thread_idx, int num_threads)
+{
+    train_job_t* job = arg;
+    unsigned int begin = (unsigned int)((uint64_t)job->num_words * thread_idx / num_threads);
+    unsigned int end = (unsigned int)((uint64_t)job->num_words * (thread_idx + 1) / num_threads);
+    for (unsigned int i = begin; i < end && !atomic_load(&job->failed); i++)
     {
-        PyErr_SetString(PyExc_MemoryError,"token table malloc failed");
-        goto error;    
+        unsigned int word_idx = job->words[i];
+        if (word_retokenize(job->text_table, word_idx, job->merge_pair, job->deltas[thread_idx], NULL, job->token_idx) != 0)
+        {
+            atomic_store(&job->failed, 1);
+        }
     }
-    memset(token_table, 0, sizeof(token_node_t*) * (num_merges + 257));
-    unsigned short token_idx_start = 256;
-    unsigned short token_idx = 256;
+}
 
-    // Iterate through the input dictionary
-    unsigned int text_table_idx = 0;
-    unsigned int* idx = &text_table_idx;
-    unsigned short* byte_word;
-    unsigned short size;
-    size_t max_size = 0;
+bigram_table_t* build_bigram_table(text_table_t* text_table, bigram_heap_t* heap, train_pool_t* pool)
+{
+    unsigned int text_table_len = (unsigned int)text_table->num_words;
 
-    while (PyDict_Next(dict, &pos, &key, &value)) 
+    // Distinct pairs track the number of distinct words closely, so size the
+    // table from it and let it grow from there
+    bigram_table_t* bigram_table = create_bigram_table(text_table_len);
+    if (bigram_table == NULL)
     {
-        if (PyUnicode_Check(key) && PyLong_Check(value)) 
+        return NULL;
+    }
+    if (pool == NULL)
+    {
+        for (unsigned int i = 0; i < text_table_len; i++)
         {
-            const char* key_str = PyUnicode_AsUTF8(key);
-            long count = PyLong_AsLong(value);
-
-            byte_word = word_to_ints(key_str);
-            size = get_array_size(byte_word);
-            if (size > max_size)
+            if (init_stats(text_table, i, bigram_table, heap) != 0)
             {
-                max_size = size;
+                free_bigram_table(bigram_table);
+                return NULL;
             }
-
-            update_text_table(text_table, byte_word, size, count, idx);
-            free(byte_word);
         }
+        return bigram_table;
     }
 
-    bigram_node_t** bigram_table;
-    bigram_table = build_bigram_table(text_table, text_table_len);
-
-    bigram_node_t* init_max_node = malloc(sizeof(bigram_node_t));
-    init_max_node->freq = 0;
-    bigram_node_t* max_node = init_max_node;
-
-    for (int i = 0; i < num_merges; i++)
+    // Count into fresh per-thread tables sized for their shard, the pool's
+    // own delta tables stay small for the retokenize steps
+    train_job_t job = {text_table, NULL, text_table_len, {0, 0}, 0, NULL};
+    atomic_init(&job.failed, 0);
+    job.deltas = calloc(pool->num_threads, sizeof(bigram_table_t*));
+    if (job.deltas == NULL)
     {
-        update_max_node(&max_node, bigram_table, token_table, token_idx);
-        retokenize(text_table_len, text_table,&max_node, bigram_table, token_idx);
-
-        token_idx++;
+        free_bigram_table(bigram_table);
+        return NULL;
     }
-    free(init_max_node);
-
-    PyObject* token_output = PyList_New(0); 
-    unsigned short* token = malloc(max_size);
-    int token_idx_end = token_idx_start + num_merges;
-    
-    for (int i = token_idx_start; i < token_idx_end; i++) 
+    for (int i = 0; i < pool->num_threads; i++)
     {
-        if (!token_table[i]) continue;
-        memset(token, 0, max_size);
-        int result_count = 0;
-        dfs(token, i, token_table, &result_count, token_idx_end, max_size);
-        PyObject* token_list = PyList_New(0);
-
-        if (!token_list) 
+        job.deltas[i] = create_bigram_table(text_table_len / pool->num_threads);
+        if (job.deltas[i] == NULL)
         {
-            PyErr_SetString(PyExc_MemoryError, "Failed to create Python list for dfs token\n");
-            goto error;
+            for (int j = 0; j < i; j++) free_bigram_table(job.deltas[j]);
+            free(job.deltas);
+            free_bigram_table(bigram_table);
+            return NULL;
         }
-
-        // Append each unsigned short value from token array to token_list
-        for (int j = 0; j < result_count; j++) 
+    }
+    train_pool_run(pool, count_shard_job, &job);
+    int failed = atomic_load(&job.failed);
+    for (int i = 0; i < pool->num_threads; i++)
+    {
+        if (!failed && merge_bigram_table(bigram_table, heap, job.deltas[i]) != 0)
         {
-            PyObject* py_value = PyLong_FromUnsignedLong(token[j]);
-            if (!py_value) 
-            {
-                PyErr_SetString(PyExc_MemoryError, "Failed to convert unsigned short to Python object\n");
-                Py_DECREF(token_list);
+            failed = 1;
+        }
+        free_bigram_table(job.deltas[i]);
+    }
+    free(job.deltas);
+    if (failed)
+    {
+        free_bigram_table(bigram_table);
+        return NULL;
+    }
+    return bigram_table;
+}
+
+// Merges every occurrence of the pair in one pass, reading at r and writing
+// the shortened word back at w. Returns -1 if memory runs out.
+int word_retokenize(text_table_t* text_table, unsigned int word_idx, const bpe_token_t* merge_pair, bigram_table_t* bigram_table, bigram_heap_t* heap, bpe_token_t token_idx)
+{
+    size_t start = text_table->offsets[word_idx];
+    uint32_t length = text_table->lengths[word_idx];
+    bpe_count_t count = text_table->counts[word_idx];
+    uint32_t w = 0;
+
+    // Left to right, so overlapping occurrences (a a a) merge the first pair
+    for (uint32_t r = 0; r < length; r++, w++)
+    {   
+        bpe_token_t token = word_token(text_table, start + r);
+        if (token == merge_pair[0] && r + 1 < length && word_token(text_table, start + r + 1) == merge_pair[1])
+        {
+            if (w > 0)
+            {
+                bpe_token_t left = word_token(text_table, start + w - 1);
+                if (update_bigram_table(left, merge_pair[0], -count, word_idx, bigram_table, heap) != 0 ||
+                    update_bigram_table(left, token_idx, count, word_idx, bigram_table, heap) != 0)
+                {
+                    return -1;
+                }
+            }
+            if (r + 2 < length)
+            {
+                bpe_token_t right = word_token(text_table, start + r + 2);
+                if (update_bigram_table(merge_pair[1], right, -count, word_idx, bigram_table, heap) != 0 ||
+                    update_bigram_table(token_idx, right, count, word_idx, bigram_table, heap) != 0)
+                {
+                    return -1;
+                }
+            }
+            token = token_idx;
+            r++;
+        }
+        set_word_token(text_table, start + w, token);
+    }
+    text_table->lengths[word_idx] = w;
+    return 0;
+}
+
+// Returns -1 if memory runs out, the tables are then only fit to be freed
+int retokenize(text_table_t* text_table, bigram_node_t** max_node, bigram_table_t* bigram_table, bigram_heap_t* heap, bpe_token_t token_idx, train_pool_t* pool)
+{
+    // Only the words indexed under the max pair can contain it. The list is
+    // detached first, pairs created by the merge all contain token_idx so
+    // nothing is appended to it while it is walked.
+    bpe_token_t merge_pair[2] = {(*max_node)->bigram[0], (*max_node)->bigram[1]};
+    unsigned int* words = (*max_node)->words;
+    unsigned int num_words = (*max_node)->num_words;
+    (*max_node)->words = NULL;
+    (*max_node)->num_words = 0;
+    (*max_node)->words_capacity = 0;
+    int failed = 0;
+
+    if (pool != NULL && num_words >= TRAIN_PARALLEL_MIN_WORDS)
+    {
+        train_job_t job = {text_table, words, num_words, {merge_pair[0], merge_pair[1]}, token_idx, pool->deltas};
+        atomic_init(&job.failed, 0);
+        train_pool_run(pool, retokenize_shard_job, &job);
+        failed = atomic_load(&job.failed);
+        for (int i = 0; i < pool->num_threads; i++)
+        {
+            if (!failed && merge_bigram_table(bigram_table, heap, pool->deltas[i]) != 0)
+            {
+                failed = 1;
+            }
+            clear_bigram_table(pool->deltas[i]);
+        }
+    }
+    else
+    {
+        for (unsigned int i = 0; i < num_words && !failed; i++)
+        {
+            failed = word_retokenize(text_table, words[i], merge_pair, bigram_table, heap, token_idx) != 0;
+        }
+    }
+    free(words);
+    if (failed)
+    {
+        return -1;
+    }
+
+    // Every occurrence is merged now, the pair itself is retired
+    remove_bigram(bigram_table, heap, *max_node);
+    *max_node = NULL;
+    return 0;
+}
+
+// Returns 1 with the most frequent pair in max_node, 0 if no pair is left
+// and -1 if memory runs out
+int update_max_node(bigram_node_t** max_node, bigram_heap_t* heap, token_node_t** token_table, bpe_token_t token_idx)
+{
+    if (heap->size == 0 || heap->nodes[0]->freq <= 0)
+    {
+        return 0;
+    }
+    (*max_node) = heap->nodes[0];
+
+    token_node_t* new_node = create_token(max_node);
+    if (new_node == NULL)
+    {
+        return -1;
+    }
+    token_table[token_idx] = new_node;
+    return 1;
+}
+
+void free_bigram_table(bigram_table_t* bigram_table)
+{
+    if (bigram_table == NULL) return;
+    for (size_t i = 0; i <= bigram_table->mask; i++)
+    {
+        if (bigram_table->slots[i].key != 0)
+        {
+            free(bigram_table_node(bigram_table, bigram_table->slots[i].node_idx) -> words);
+        }
+    }
+    for (size_t i = 0; i < bigram_table->num_blocks; i++)
+    {
+        free(bigram_table->blocks[i]);
+    }
+    free(bigram_table->blocks);
+    free(bigram_table->slots);
+    free(bigram_table);
+}
+
+bigram_node_t* find_bigram(bigram_table_t* bigram_table, bpe_token_t unigram1, bpe_token_t unigram2)
+{
+    uint64_t key = BIGRAM_KEY(unigram1, unigram2);
+    size_t pos = hash_bigram(key, bigram_table->mask);
+    while (bigram_table->slots[pos].key != 0)
+    {
+        if (bigram_table->slots[pos].key == key)
+        {
+            return bigram_table_node(bigram_table, bigram_table->slots[pos].node_idx);
+        }
+        pos = (pos + 1) & bigram_table->mask;
+    }
+    return NULL;
+}
+
+// Saves the state after the merges below token_idx to the checkpoint path.
+// It is written to a temporary file that then replaces the old checkpoint,
+// so a run killed mid-write still has the previous one. Returns -1 with
+// errno set on failure.
+int write_checkpoint(const train_options_t* options, const text_table_t* text_table, token_node_t** token_table, bpe_token_t token_idx, size_t max_length)
+{
+    size_t path_length = strlen(options->checkpoint_path);
+    char* temp_path = malloc(path_length + 5);
+    if (temp_path == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(temp_path, options->checkpoint_path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.byte_order = BINARY_BYTE_ORDER;
+    header.pattern_length = options->pattern_length;
+    header.num_merges = token_idx - 256;
+    header.num_words = text_table->num_words;
+    header.max_length = max_length;
+    header.wide = text_table->wide;
+
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL)
+    {
+        free(temp_path);
+        return -1;
+    }
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+        (options->pattern_length > 0 && fwrite(options->pattern, options->pattern_length, 1, file) != 1);
+    for (bpe_token_t i = 256; !failed && i < token_idx; i++)
+    {
+        uint32_t pair[2] = {token_table[i]->token[0], token_table[i]->token[1]};
+        failed = fwrite(pair, sizeof(pair), 1, file) != 1;
+    }
+    size_t unit = text_table->wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    for (size_t i = 0; !failed && i < text_table->num_words; i++)
+    {
+        int64_t count = text_table->counts[i];
+        uint32_t num_tokens = text_table->lengths[i];
+        failed = fwrite(&count, sizeof(count), 1, file) != 1 ||
+            fwrite(&num_tokens, sizeof(num_tokens), 1, file) != 1 ||
+            (num_tokens > 0 && fwrite(text_table->tokens + text_table->offsets[i] * unit, unit, num_tokens, file) != num_tokens);
+    }
+    failed = (fclose(file) != 0) || failed;
+    if (!failed && rename(temp_path, options->checkpoint_path) != 0)
+    {
+        failed = 1;
+    }
+    if (failed)
+    {
+        int saved_errno = errno ? errno : EIO;
+        unlink(temp_path);
+        errno = saved_errno;
+    }
+    free(temp_path);
+    return failed ? -1 : 0;
+}
+
+void cleanup_train_resources(text_table_t* text_table, 
+                       bigram_table_t* bigram_table, bigram_heap_t* heap, token_node_t **token_table, 
+                       int token_idx_start, int token_idx_end, unsigned char *token) 
+{
+    free_text_table(text_table);
+    free_bigram_table(bigram_table);
+    free_bigram_heap(heap);
+    if (token_table) {
+        for (int i = token_idx_start; i < token_idx_end; i++) {
+            free(token_table[i]);
+        }
+        free(token_table);
+    }
+    free(token);
+}
+
+static int trie_entry_cmp(const void* a, const void* b)
+{
+    const trie_entry_t* x = a;
+    const trie_entry_t* y = b;
+    int min_length = x->length < y->length ? x->length : y->length;
+    int cmp = memcmp(x->bytes, y->bytes, min_length);
+    if (cmp != 0) return cmp;
+    if (x->length != y->length) return x->length < y->length ? -1 : 1;
+    // Same bytes, keep insertion order so the last token id wins
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// Grow the builder so that slots up to and including index are valid.
+static int trie_reserve(trie_builder_t* builder, size_t index)
+{
+    if (index < builder->capacity)
+    {
+        return 0;
+    }
+    size_t new_capacity = builder->capacity ? builder->capacity : TRIE_INIT_SIZE;
+    while (new_capacity <= index)
+    {
+        new_capacity *= 2;
+    }
+    trie_node* new_nodes = realloc(builder->nodes, new_capacity * sizeof(trie_node));
+    if (new_nodes == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = builder->capacity; i < new_capacity; i++)
+    {
+        new_nodes[i].base = 0;
+        new_nodes[i].check = TRIE_FREE;
+        new_nodes[i].token_id = -1;
+    }
+    builder->nodes = new_nodes;
+    builder->capacity = new_capacity;
+    return 0;
+}
+
+// First base at which every child label lands on a free slot. The scan
+// starts at first_free, which is moved past regions that are nearly full so
+// wide nodes do not rescan the same crowded slots over and over.
+static int32_t trie_find_base(trie_builder_t* builder, unsigned char* labels, int num_labels)
+{
+    size_t pos = builder->first_free > labels[0] ? builder->first_free : (size_t)labels[0] + 1;
+    size_t start = pos;
+    size_t occupied = 0;
+    while (1)
+    {
+        if (trie_reserve(builder, pos + MAX_CHILDREN) != 0)
+        {
+            return -1;
+        }
+        if (builder->nodes[pos].check != TRIE_FREE)
+        {
+            occupied++;
+            pos++;
+            continue;
+        }
+        size_t base = pos - labels[0];
+        int fits = 1;
+        for (int i = 1; i < num_labels; i++)
+        {
+            if (builder->nodes[base + labels[i]].check != TRIE_FREE)
+            {
+                fits = 0;
+                break;
+            }
+        }
+        if (fits)
+        {
+            if (occupied * 20 >= (pos - start + 1) * 19)
+            {
+                builder->first_free = pos;
+            }
+            return (int32_t)base;
+        }
+        pos++;
+    }
+}
+
+// entries[lo, hi) are sorted and share their first depth bytes, which spell
+// out state. Places the children of state, then recurses into each of them.
+static int trie_build_node(trie_builder_t* builder, trie_entry_t* entries, int lo, int hi, int depth, int32_t state)
+{
+    while (lo < hi && entries[lo].length == depth)
+    {
+        builder->nodes[state].token_id = entries[lo].token_id;
+        lo++;
+    }
+    if (lo == hi)
+    {
+        return 0;
+    }
+
+    unsigned char labels[MAX_CHILDREN];
+    int num_labels = 0;
+    for (int i = lo; i < hi; i++)
+    {
+        if (i == lo || entries[i].bytes[depth] != entries[i - 1].bytes[depth])
+        {
+            labels[num_labels++] = entries[i].bytes[depth];
+        }
+    }
+
+    int32_t base = trie_find_base(builder, labels, num_labels);
+    if (base < 0)
+    {
+        return -1;
+    }
+    builder->nodes[state].base = base;
+    for (int i = 0; i < num_labels; i++)
+    {
+        builder->nodes[base + labels[i]].check = state;
+        if ((size_t)(base + labels[i]) + 1 > builder->size)
+        {
+            builder->size = base + labels[i] + 1;
+        }
+    }
+    while (builder->first_free < builder->capacity && builder->nodes[builder->first_free].check != TRIE_FREE)
+    {
+        builder->first_free++;
+    }
+    if (builder->first_free >= builder->capacity && trie_reserve(builder, builder->first_free + MAX_CHILDREN) != 0)
+    {
+        return -1;
+    }
+
+    int start = lo;
+    while (start < hi)
+    {
+        unsigned char byte = entries[start].bytes[depth];
+        int end = start + 1;
+        while (end < hi && entries[end].bytes[depth] == byte)
+        {
+            end++;
+        }
+        if (trie_build_node(builder, entries, start, end, depth + 1, base + byte) != 0)
+        {
+            return -1;
+        }
+        start = end;
+    }
+    return 0;
+}
+
+// Builds a double-array trie: the child of state s along byte c is
+// t = nodes[s].base + c, valid when nodes[t].check == s. The result is a
+// single allocation, the Trie header followed by the node array, padded so
+// that base + c never needs a bounds check. Sorts entries.
+Trie* create_trie(trie_entry_t* entries, int num_entries)
+{
+    qsort(entries, num_entries, sizeof(trie_entry_t), trie_entry_cmp);
+
+    trie_builder_t builder;
+    builder.nodes = NULL;
+    builder.capacity = 0;
+    builder.size = 1;
+    builder.first_free = 1;
+    if (trie_reserve(&builder, 0) != 0)
+    {
+        return NULL;
+    }
+    builder.nodes[0].check = TRIE_ROOT;
+
+    if (trie_build_node(&builder, entries, 0, num_entries, 0, 0) != 0)
+    {
+        free(builder.nodes);
+        return NULL;
+    }
+
+    size_t num_nodes = builder.size + MAX_CHILDREN;
+    Trie* trie = malloc(sizeof(Trie) + num_nodes * sizeof(trie_node));
+    if (trie == NULL)
+    {
+        free(builder.nodes);
+        return NULL;
+    }
+    trie->num_nodes = num_nodes;
+    trie->nodes = (trie_node*)(trie + 1);
+    trie->mapping = NULL;
+    if (trie_reserve(&builder, num_nodes) != 0)
+    {
+        free(trie);
+        free(builder.nodes);
+        return NULL;
+    }
+    memcpy(trie->nodes, builder.nodes, num_nodes * sizeof(trie_node));
+    free(builder.nodes);
+    return trie;
+}
+
+int search_trie(Trie* trie, unsigned char* text, int text_length, int* match_length) 
+{
+    const trie_node* nodes = trie->nodes;
+    int32_t current = 0;
+    int last_valid_match = -1;
+    int last_valid_match_length = 0;
+
+    for (int i = 0; i < text_length; i++) 
+    {
+        int32_t next = nodes[current].base + text[i];
+        if (nodes[next].check != current) 
+        {
+            break;
+        }
+        current = next;
+        if (nodes[current].token_id != -1) 
+        {
+            last_valid_match = nodes[current].token_id;
+            last_valid_match_length = i + 1;
+        }
+    }
+    *match_length = last_valid_match_length;
+
+    return last_valid_match;
+}
+
+void free_trie(Trie* trie) 
+{
+    release_mapping(trie->mapping);
+    free(trie);
+} 
+
+// Builds the automaton for entries of non-empty token strings. A string
+// given twice keeps the first id.
+special_tokens_t* create_special_tokens(const trie_entry_t* entries, int num_entries)
+{
+    size_t max_states = 1;
+    for (int i = 0; i < num_entries; i++)
+    {
+        max_states += entries[i].length;
+    }
+    special_tokens_t* special = calloc(1, sizeof(special_tokens_t));
+    int32_t* fail = malloc(max_states * sizeof(int32_t));
+    int32_t* queue = malloc(max_states * sizeof(int32_t));
+    if (special != NULL)
+    {
+        special->next = malloc(max_states * 256 * sizeof(int32_t));
+        special->depth = calloc(max_states, sizeof(uint32_t));
+        special->match_length = calloc(max_states, sizeof(uint32_t));
+        special->match_id = calloc(max_states, sizeof(uint32_t));
+    }
+    if (special == NULL || fail == NULL || queue == NULL || special->next == NULL ||
+        special->depth == NULL || special->match_length == NULL || special->match_id == NULL)
+    {
+        free_special_tokens(special);
+        free(fail);
+        free(queue);
+        return NULL;
+    }
+    memset(special->next, 0xff, max_states * 256 * sizeof(int32_t));
+    special->num_states = 1;
+    special->first_byte = num_entries > 0 ? entries[0].bytes[0] : -1;
+
+    // The trie of the tokens, missing transitions are -1
+    for (int i = 0; i < num_entries; i++)
+    {
+        int32_t state = 0;
+        for (int j = 0; j < entries[i].length; j++)
+        {
+            int32_t* next = &special->next[(size_t)state * 256 + entries[i].bytes[j]];
+            if (*next < 0)
+            {
+                *next = special->num_states++;
+                special->depth[*next] = special->depth[state] + 1;
+            }
+            state = *next;
+        }
+        if (special->match_length[state] == 0)
+        {
+            special->match_length[state] = entries[i].length;
+            special->match_id[state] = entries[i].token_id;
+        }
+        if ((uint32_t)entries[i].length > special->max_length)
+        {
+            special->max_length = entries[i].length;
+        }
+        if (entries[i].bytes[0] != special->first_byte)
+        {
+            special->first_byte = -1;
+        }
+        special->starts[entries[i].bytes[0]] = 1;
+    }
+
+    // Breadth first, so a state's failure link is done before the state. A
+    // missing transition takes the one of the failure link instead, and a
+    // state with no token of its own ends the longest one its link ends.
+    size_t head = 0;
+    size_t tail = 0;
+    for (int c = 0; c < 256; c++)
+    {
+        int32_t child = special->next[c];
+        if (child < 0)
+        {
+            special->next[c] = 0;
+            continue;
+        }
+        fail[child] = 0;
+        queue[tail++] = child;
+    }
+    while (head < tail)
+    {
+        int32_t state = queue[head++];
+        if (special->match_length[state] == 0)
+        {
+            special->match_length[state] = special->match_length[fail[state]];
+            special->match_id[state] = special->match_id[fail[state]];
+        }
+        int32_t* next = &special->next[(size_t)state * 256];
+        const int32_t* fail_next = &special->next[(size_t)fail[state] * 256];
+        for (int c = 0; c < 256; c++)
+        {
+            if (next[c] < 0)
+            {
+                next[c] = fail_next[c];
+                continue;
+            }
+            fail[next[c]] = fail_next[c];
+            queue[tail++] = next[c];
+        }
+    }
+    free(fail);
+    free(queue);
+    return special;
+}
+
+// Finds the leftmost special token in text, the longest of those that start
+// there. Returns where it starts, or length if there is none.
+Py_ssize_t find_special_token(const special_tokens_t* special, const unsigned char* text, Py_ssize_t length, uint32_t* match_length, uint32_t* token_id)
+{
+    Py_ssize_t best = -1;
+    int32_t state = 0;
+    Py_ssize_t pos = 0;
+    while (pos < length)
+    {
+        // Stop once no token still in progress can start at or before the best
+        if (best >= 0 && pos - (Py_ssize_t)special->depth[state] > best)
+        {
+            break;
+        }
+        // Skip to the next byte a token starts with
+        if (state == 0 && special->first_byte >= 0)
+        {
+            const unsigned char* hit = memchr(text + pos, special->first_byte, length - pos);
+            if (hit == NULL)
+            {
+                break;
+            }
+            pos = hit - text;
+        }
+        else if (state == 0)
+        {
+            while (pos < length && !special->starts[text[pos]])
+            {
+                pos++;
+            }
+            if (pos == length)
+            {
+                break;
+            }
+        }
+        state = special->next[(size_t)state * 256 + text[pos++]];
+        uint32_t found = special->match_length[state];
+        if (found > 0 && (best < 0 || pos - (Py_ssize_t)found <= best))
+        {
+            best = pos - found;
+            *match_length = found;
+            *token_id = special->match_id[state];
+        }
+    }
+    return best >= 0 ? best : length;
+}
+
+// Byte length of the special token with token_id, 0 if there is none. Walks
+// every state, so meant for the occasional token rather than text scans.
+uint32_t special_token_length(const special_tokens_t* special, uint32_t token_id)
+{
+    for (uint32_t state = 1; state < special->num_states; state++)
+    {
+        if (special->match_id[state] == token_id && special->match_length[state] == special->depth[state])
+        {
+            return special->depth[state];
+        }
+    }
+    return 0;
+}
+
+// Whether a special token in text starts before cut and ends after it. Any
+// token that does lies within max_length - 1 bytes of cut on either side.
+int special_token_spans(const special_tokens_t* special, const unsigned char* text, size_t length, size_t cut)
+{
+    size_t reach = special->max_length > 0 ? special->max_length - 1 : 0;
+    size_t pos = cut > reach ? cut - reach : 0;
+    size_t end = length - cut > reach ? cut + reach : length;
+    int32_t state = 0;
+    while (pos < end)
+    {
+        state = special->next[(size_t)state * 256 + text[pos++]];
+        // The longest token ending here starts the earliest
+        if (pos > cut && special->match_length[state] > pos - cut)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void free_special_tokens(special_tokens_t* special)
+{
+    if (special == NULL)
+    {
+        return;
+    }
+    free(special->next);
+    free(special->depth);
+    free(special->match_length);
+    free(special->match_id);
+    free(special);
+}
+
+static size_t hash_merge(uint64_t key, size_t mask)
+{
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+merge_table_t* create_merge_table(size_t expected_size, size_t cache_capacity)
+{
+    merge_table_t* table = calloc(1, sizeof(merge_table_t));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    size_t capacity = MERGE_TABLE_MIN_SIZE;
+    while (capacity < expected_size * 2)
+    {
+        capacity <<= 1;
+    }
+    table->slots = calloc(capacity, sizeof(merge_slot_t));
+    if (table->slots == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+    table->mask = capacity - 1;
+    if (init_encode_cache(&table->cache, cache_capacity) != 0)
+    {
+        free(table->slots);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Token ids of merges are always above 256, so 0 marks an empty slot.
+uint32_t merge_table_lookup(merge_table_t* table, uint32_t left, uint32_t right)
+{
+    uint64_t key = MERGE_KEY(left, right);
+    size_t pos = hash_merge(key, table->mask);
+    while (table->slots[pos].token_id != 0)
+    {
+        if (table->slots[pos].key == key)
+        {
+            return table->slots[pos].token_id;
+        }
+        pos = (pos + 1) & table->mask;
+    }
+    return 0;
+}
+
+int merge_table_insert(merge_table_t* table, uint32_t left, uint32_t right, uint32_t token_id)
+{
+    free(table->token_lengths);
+    table->token_lengths = NULL;
+    table->num_token_lengths = 0;
+    if ((table->size + 1) * 2 > table->mask + 1)
+    {
+        size_t new_mask = table->mask * 2 + 1;
+        merge_slot_t* new_slots = calloc(new_mask + 1, sizeof(merge_slot_t));
+        if (new_slots == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i <= table->mask; i++)
+        {
+            if (table->slots[i].token_id == 0) continue;
+            size_t pos = hash_merge(table->slots[i].key, new_mask);
+            while (new_slots[pos].token_id != 0)
+            {
+                pos = (pos + 1) & new_mask;
+            }
+            new_slots[pos] = table->slots[i];
+        }
+        free(table->slots);
+        table->slots = new_slots;
+        table->mask = new_mask;
+    }
+    uint64_t key = MERGE_KEY(left, right);
+    size_t pos = hash_merge(key, table->mask);
+    while (table->slots[pos].token_id != 0 && table->slots[pos].key != key)
+    {
+        pos = (pos + 1) & table->mask;
+    }
+    if (table->slots[pos].token_id == 0)
+    {
+        table->size++;
+    }
+    table->slots[pos].key = key;
+    table->slots[pos].token_id = token_id;
+    return 0;
+}
+
+static int merge_candidate_less(merge_candidate_t a, merge_candidate_t b)
+{
+    return a.rank < b.rank || (a.rank == b.rank && a.left < b.left);
+}
+
+static void merge_heap_push(merge_candidate_t* heap, int* size, merge_candidate_t item)
+{
+    int idx = (*size)++;
+    while (idx > 0)
+    {
+        int parent = (idx - 1) / 2;
+        if (!merge_candidate_less(item, heap[parent])) break;
+        heap[idx] = heap[parent];
+        idx = parent;
+    }
+    heap[idx] = item;
+}
+
+static merge_candidate_t merge_heap_pop(merge_candidate_t* heap, int* size)
+{
+    merge_candidate_t top = heap[0];
+    merge_candidate_t last = heap[--(*size)];
+    int idx = 0;
+    while (1)
+    {
+        int child = 2 * idx + 1;
+        if (child >= *size) break;
+        if (child + 1 < *size && merge_candidate_less(heap[child + 1], heap[child])) child++;
+        if (!merge_candidate_less(heap[child], last)) break;
+        heap[idx] = heap[child];
+        idx = child;
+    }
+    heap[idx] = last;
+    return top;
+}
+
+// Applies the learned merges to one chunk in training order: the pending
+// pair with the lowest rank (token id) is merged first, ties going to the
+// leftmost pair, exactly as a pass over the merge list would. Symbols are a
+// doubly linked list over the chunk, candidates sit in a min-heap and are
+// checked for staleness when popped. Writes at most length ids to out.
+int bpe_merge_chunk(merge_table_t* table, const unsigned char* text, int length, uint32_t* out)
+{
+    if (length <= 1)
+    {
+        if (length == 1) out[0] = text[0];
+        return length;
+    }
+
+    uint32_t stack_ids[MERGE_STACK_SIZE];
+    int stack_links[2 * MERGE_STACK_SIZE];
+    merge_candidate_t stack_heap[3 * MERGE_STACK_SIZE];
+    uint32_t* ids = stack_ids;
+    int* prev = stack_links;
+    merge_candidate_t* heap = stack_heap;
+    void* scratch = NULL;
+    if (length > MERGE_STACK_SIZE)
+    {
+        scratch = malloc(length * (sizeof(uint32_t) + 2 * sizeof(int) + 3 * sizeof(merge_candidate_t)));
+        if (scratch == NULL)
+        {
+            return -1;
+        }
+        heap = scratch;
+        ids = (uint32_t*)(heap + 3 * length);
+        prev = (int*)(ids + length);
+    }
+    int* next = prev + length;
+    int heap_size = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        ids[i] = text[i];
+        prev[i] = i - 1;
+        next[i] = i + 1 < length ? i + 1 : -1;
+    }
+    for (int i = 0; i + 1 < length; i++)
+    {
+        uint32_t rank = merge_table_lookup(table, ids[i], ids[i + 1]);
+        if (rank != 0)
+        {
+            merge_candidate_t candidate = {rank, i, i + 1};
+            merge_heap_push(heap, &heap_size, candidate);
+        }
+    }
+
+    while (heap_size > 0)
+    {
+        merge_candidate_t top = merge_heap_pop(heap, &heap_size);
+        // Skip candidates whose symbols were merged away or changed since
+        if (ids[top.left] == MERGE_DEAD || next[top.left] != top.right || ids[top.right] == MERGE_DEAD)
+        {
+            continue;
+        }
+        if (merge_table_lookup(table, ids[top.left], ids[top.right]) != top.rank)
+        {
+            continue;
+        }
+
+        ids[top.left] = top.rank;
+        ids[top.right] = MERGE_DEAD;
+        next[top.left] = next[top.right];
+        if (next[top.left] != -1)
+        {
+            prev[next[top.left]] = top.left;
+        }
+
+        if (prev[top.left] != -1)
+        {
+            uint32_t rank = merge_table_lookup(table, ids[prev[top.left]], ids[top.left]);
+            if (rank != 0)
+            {
+                merge_candidate_t candidate = {rank, prev[top.left], top.left};
+                merge_heap_push(heap, &heap_size, candidate);
+            }
+        }
+        if (next[top.left] != -1)
+        {
+            uint32_t rank = merge_table_lookup(table, ids[top.left], ids[next[top.left]]);
+            if (rank != 0)
+            {
+                merge_candidate_t candidate = {rank, top.left, next[top.left]};
+                merge_heap_push(heap, &heap_size, candidate);
+            }
+        }
+    }
+
+    int num_tokens = 0;
+    for (int i = 0; i != -1; i = next[i])
+    {
+        out[num_tokens++] = ids[i];
+    }
+    free(scratch);
+    return num_tokens;
+}
+
+static uint64_t hash_bytes(const unsigned char* bytes, int length)
+{
+    // Mixes eight bytes per step, chunks are short so this is a handful of
+    // multiplies
+    uint64_t hash = 0x9E3779B97F4A7C15ULL ^ (uint64_t)length;
+    uint64_t word;
+    int i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    if (i < length)
+    {
+        word = 0;
+        memcpy(&word, bytes + i, length - i);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 32;
+    }
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    return hash ^ (hash >> 29);
+}
+
+int init_encode_cache(encode_cache_t* cache, size_t capacity)
+{
+    memset(cache, 0, sizeof(encode_cache_t));
+    cache->capacity = capacity;
+    if (capacity == 0)
+    {
+        return 0;
+    }
+    size_t num_buckets = 16;
+    while (num_buckets < capacity)
+    {
+        num_buckets <<= 1;
+    }
+    cache->buckets = calloc(num_buckets, sizeof(encode_cache_entry_t*));
+    if (cache->buckets == NULL)
+    {
+        return -1;
+    }
+    cache->mask = num_buckets - 1;
+    return 0;
+}
+
+static void encode_cache_unlink(encode_cache_t* cache, encode_cache_entry_t* entry)
+{
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else cache->lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else cache->lru_tail = entry->lru_prev;
+}
+
+static void encode_cache_push_front(encode_cache_t* cache, encode_cache_entry_t* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (cache->lru_tail == NULL) cache->lru_tail = entry;
+}
+
+encode_cache_entry_t* encode_cache_get(encode_cache_t* cache, const unsigned char* text, int length, uint64_t hash)
+{
+    if (cache->capacity == 0)
+    {
+        return NULL;
+    }
+    encode_cache_entry_t* entry = cache->buckets[hash & cache->mask];
+    while (entry != NULL)
+    {
+        if (entry->hash == hash && entry->key_length == (uint32_t)length &&
+            memcmp(ENCODE_CACHE_KEY(entry), text, length) == 0)
+        {
+            // Entries used recently enough to be in the younger half of the
+            // list stay put, which spares the relink on most hits
+            if (cache->clock - entry->last_used > cache->capacity / 2)
+            {
+                encode_cache_unlink(cache, entry);
+                encode_cache_push_front(cache, entry);
+                entry->last_used = ++cache->clock;
+            }
+            return entry;
+        }
+        entry = entry->bucket_next;
+    }
+    return NULL;
+}
+
+static void encode_cache_evict(encode_cache_t* cache)
+{
+    encode_cache_entry_t* entry = cache->lru_tail;
+    encode_cache_entry_t** link = &cache->buckets[entry->hash & cache->mask];
+    while (*link != entry)
+    {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    encode_cache_unlink(cache, entry);
+    free(entry);
+    cache->size--;
+}
+
+void encode_cache_put(encode_cache_t* cache, const unsigned char* text, int length, uint64_t hash, const uint32_t* tokens, int num_tokens)
+{
+    if (cache->capacity == 0 || length > ENCODE_CACHE_MAX_KEY)
+    {
+        return;
+    }
+    if (cache->size >= cache->capacity)
+    {
+        encode_cache_evict(cache);
+    }
+    encode_cache_entry_t* entry = malloc(sizeof(encode_cache_entry_t) + num_tokens * sizeof(uint32_t) + length);
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->hash = hash;
+    entry->last_used = ++cache->clock;
+    entry->key_length = length;
+    entry->num_tokens = num_tokens;
+    memcpy(entry->tokens, tokens, num_tokens * sizeof(uint32_t));
+    memcpy(ENCODE_CACHE_KEY(entry), text, length);
+
+    entry->bucket_next = cache->buckets[hash & cache->mask];
+    cache->buckets[hash & cache->mask] = entry;
+    encode_cache_push_front(cache, entry);
+    cache->size++;
+}
+
+void free_encode_cache(encode_cache_t* cache)
+{
+    encode_cache_entry_t* entry = cache->lru_head;
+    while (entry != NULL)
+    {
+        encode_cache_entry_t* next = entry->lru_next;
+        free(entry);
+        entry = next;
+    }
+    free(cache->buckets);
+    memset(cache, 0, sizeof(encode_cache_t));
+}
+
+// Merge-order encoding of one chunk through an LRU cache, normally the
+// table's own.
+int encode_chunk_merges(merge_table_t* table, encode_cache_t* cache, const unsigned char* text, int length, uint32_t* out)
+{
+    if (length == 1)
+    {
+        out[0] = text[0];
+        return 1;
+    }
+    uint64_t hash = hash_bytes(text, length);
+    encode_cache_entry_t* entry = encode_cache_get(cache, text, length, hash);
+    if (entry != NULL)
+    {
+        memcpy(out, entry->tokens, entry->num_tokens * sizeof(uint32_t));
+        return entry->num_tokens;
+    }
+    int num_tokens = bpe_merge_chunk(table, text, length, out);
+    if (num_tokens > 0)
+    {
+        encode_cache_put(cache, text, length, hash, out, num_tokens);
+    }
+    return num_tokens;
+}
+
+static int merge_slot_id_cmp(const void* a, const void* b)
+{
+    uint32_t id_a = ((const merge_slot_t*)a)->token_id;
+    uint32_t id_b = ((const merge_slot_t*)b)->token_id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+// Fills token_lengths with the byte length of every token the table can
+// produce: single bytes, and each merge as the sum of its pair. A pair is
+// always made of lower ids, so the merges are summed in id order. Returns -1
+// with errno EINVAL for a table that breaks that order, ENOMEM otherwise.
+int merge_table_token_lengths(merge_table_t* table)
+{
+    if (table->token_lengths != NULL)
+    {
+        return 0;
+    }
+    size_t num_merges = 0;
+    uint32_t max_id = 255;
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        if (table->slots[i].token_id == 0) continue;
+        num_merges++;
+        if (table->slots[i].token_id > max_id) max_id = table->slots[i].token_id;
+    }
+    merge_slot_t* merges = malloc((num_merges ? num_merges : 1) * sizeof(merge_slot_t));
+    uint32_t* lengths = calloc((size_t)max_id + 1, sizeof(uint32_t));
+    if (merges == NULL || lengths == NULL)
+    {
+        free(merges);
+        free(lengths);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t merge_idx = 0;
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        if (table->slots[i].token_id != 0) merges[merge_idx++] = table->slots[i];
+    }
+    qsort(merges, num_merges, sizeof(merge_slot_t), merge_slot_id_cmp);
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        lengths[i] = 1;
+    }
+    for (size_t i = 0; i < num_merges; i++)
+    {
+        uint32_t left = (uint32_t)(merges[i].key >> 32);
+        uint32_t right = (uint32_t)merges[i].key;
+        // The slots may come from a mapped file, a pair that does not
+        // precede its token would read an unset or missing length
+        if (left >= merges[i].token_id || right >= merges[i].token_id)
+        {
+            free(merges);
+            free(lengths);
+            errno = EINVAL;
+            return -1;
+        }
+        lengths[merges[i].token_id] = lengths[left] + lengths[right];
+    }
+    free(merges);
+    table->token_lengths = lengths;
+    table->num_token_lengths = (size_t)max_id + 1;
+    return 0;
+}
+
+void free_merge_table(merge_table_t* table)
+{
+    if (table == NULL) return;
+    free(table->token_lengths);
+    free_encode_cache(&table->cache);
+    if (table->mapping != NULL)
+    {
+        release_mapping(table->mapping);
+    }
+    else
+    {
+        free(table->slots);
+    }
+    free(table);
+}
+
+// Maps a whole file read-only. Returns NULL with errno set on failure.
+bpe_mapping_t* map_file(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    bpe_mapping_t* mapping = malloc(sizeof(bpe_mapping_t));
+    if (mapping == NULL)
+    {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    mapping->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping->data == MAP_FAILED)
+    {
+        free(mapping);
+        return NULL;
+    }
+    mapping->length = st.st_size;
+    atomic_init(&mapping->refs, 1);
+    return mapping;
+}
+
+void release_mapping(bpe_mapping_t* mapping)
+{
+    if (mapping != NULL && atomic_fetch_sub(&mapping->refs, 1) == 1)
+    {
+        munmap(mapping->data, mapping->length);
+        free(mapping);
+    }
+}
+
+void free_vocab(vocab_t* vocab)
+{
+    if (vocab == NULL) return;
+    release_mapping(vocab->mapping);
+    free(vocab);
+}
+
+static int binary_section_valid(uint64_t offset, uint64_t length, uint64_t file_size)
+{
+    return offset % 8 == 0 && offset <= file_size && length <= file_size - offset;
+}
+
+// Checks everything the encoders rely on without looking further, so a
+// truncated or corrupt file is rejected instead of read out of bounds.
+// Returns 0 if the file can be used.
+int validate_binary(const unsigned char* data, size_t length)
+{
+    if (length < sizeof(binary_header_t))
+    {
+        return -1;
+    }
+    const binary_header_t* header = (const binary_header_t*)data;
+    if (memcmp(header->magic, BINARY_MAGIC, 8) != 0 || header->version < 1 || header->version > BINARY_VERSION ||
+        header->byte_order != BINARY_BYTE_ORDER || header->file_size != length)
+    {
+        return -1;
+    }
+    if (header->version >= 2 && (header->num_special > length / sizeof(uint32_t) ||
+        !binary_section_valid(header->special_offset, header->num_special * sizeof(uint32_t), length)))
+    {
+        return -1;
+    }
+    if (header->num_ids > UINT32_MAX ||
+        !binary_section_valid(header->pattern_offset, header->pattern_length, length) ||
+        !binary_section_valid(header->vocab_offsets_offset, (header->num_ids + 1) * sizeof(uint64_t), length) ||
+        !binary_section_valid(header->vocab_pool_offset, header->vocab_pool_length, length) ||
+        header->trie_num_nodes > length / sizeof(trie_node) ||
+        !binary_section_valid(header->trie_offset, header->trie_num_nodes * sizeof(trie_node), length) ||
+        header->merges_num_slots > length / sizeof(merge_slot_t) ||
+        !binary_section_valid(header->merges_offset, header->merges_num_slots * sizeof(merge_slot_t), length))
+    {
+        return -1;
+    }
+
+    const uint64_t* offsets = (const uint64_t*)(data + header->vocab_offsets_offset);
+    if (offsets[0] != 0 || offsets[header->num_ids] != header->vocab_pool_length)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < header->num_ids; i++)
+    {
+        if (offsets[i] > offsets[i + 1])
+        {
+            return -1;
+        }
+    }
+
+    const uint32_t* special = (const uint32_t*)(data + header->special_offset);
+    for (uint64_t i = 0; header->version >= 2 && i < header->num_special; i++)
+    {
+        if (special[i] >= header->num_ids || offsets[special[i]] == offsets[special[i] + 1])
+        {
+            return -1;
+        }
+    }
+
+    // search_trie follows base + c without bounds checks
+    const trie_node* nodes = (const trie_node*)(data + header->trie_offset);
+    if (header->trie_num_nodes <= MAX_CHILDREN || nodes[0].check != TRIE_ROOT)
+    {
+        return -1;
+    }
+    for (uint64_t i = 0; i < header->trie_num_nodes; i++)
+    {
+        if (nodes[i].base < 0 || (uint64_t)nodes[i].base + MAX_CHILDREN > header->trie_num_nodes ||
+            nodes[i].token_id < -1 || (nodes[i].token_id >= 0 && (uint64_t)nodes[i].token_id >= header->num_ids))
+        {
+            return -1;
+        }
+    }
+
+    // Probing stops at the first empty slot, so there must be one
+    uint64_t num_slots = header->merges_num_slots;
+    if (num_slots == 0 || (num_slots & (num_slots - 1)) != 0)
+    {
+        return -1;
+    }
+    const merge_slot_t* slots = (const merge_slot_t*)(data + header->merges_offset);
+    uint64_t used = 0;
+    for (uint64_t i = 0; i < num_slots; i++)
+    {
+        if (slots[i].token_id == 0)
+        {
+            continue;
+        }
+        // Token lengths are summed in id order, a pair must precede its token
+        if (slots[i].token_id >= header->num_ids || (slots[i].key >> 32) >= slots[i].token_id ||
+            (uint32_t)slots[i].key >= slots[i].token_id)
+        {
+            return -1;
+        }
+        used++;
+    }
+    if (used != header->merges_size || used >= num_slots)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Class of a code point above ASCII, by binary search over the generated
+// ranges
+int unicode_char_class(uint32_t codepoint)
+{
+    size_t lo = 0;
+    size_t hi = NUM_UNICODE_CHAR_RANGES;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (codepoint < unicode_char_ranges[mid].first)
+        {
+            hi = mid;
+        }
+        else if (codepoint > unicode_char_ranges[mid].last)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            return unicode_char_ranges[mid].char_class;
+        }
+    }
+    return CHAR_OTHER;
+}
+
+// Nibble tables for the SIMD run scans: ASCII byte c is in class k if
+// ascii_nibbles[k][0][c & 15] & ascii_nibbles[k][1][c >> 4] is not zero.
+// Each high nibble below 8 has its own bit, bytes from 0x80 have none.
+static unsigned char ascii_nibbles[NUM_CHAR_CLASSES][2][16];
+
+static Py_ssize_t ascii_run_end_scalar(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos, int char_class)
+{
+    while (pos < length && text[pos] < 0x80 && ascii_char_class[text[pos]] == char_class)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+#ifdef ASCII_RUN_SIMD
+// Classifies 16 bytes at a time with two pshufb table lookups
+__attribute__((target("ssse3")))
+static Py_ssize_t ascii_run_end_ssse3(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos, int char_class)
+{
+    const __m128i low_table = _mm_loadu_si128((const __m128i*)ascii_nibbles[char_class][0]);
+    const __m128i high_table = _mm_loadu_si128((const __m128i*)ascii_nibbles[char_class][1]);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    while (pos + 16 <= length)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(text + pos));
+        __m128i low = _mm_shuffle_epi8(low_table, _mm_and_si128(bytes, nibble));
+        __m128i high = _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i outside = _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(outside);
+        if (mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+    return ascii_run_end_scalar(text, length, pos, char_class);
+}
+
+// The same 32 bytes at a time
+__attribute__((target("avx2")))
+static Py_ssize_t ascii_run_end_avx2(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos, int char_class)
+{
+    const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ascii_nibbles[char_class][0]));
+    const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)ascii_nibbles[char_class][1]));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    while (pos + 32 <= length)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)(text + pos));
+        __m256i low = _mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, nibble));
+        __m256i high = _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        __m256i outside = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(outside);
+        if (mask != 0)
+        {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+    return ascii_run_end_scalar(text, length, pos, char_class);
+}
+#endif
+
+static ascii_run_fn ascii_run_end = ascii_run_end_scalar;
+
+// Whether the byte at pos is ASCII of char_class, so a run scan is worth
+// starting there
+static inline int ascii_in_class(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos, int char_class)
+{
+    return pos < length && text[pos] < 0x80 && ascii_char_class[text[pos]] == char_class;
+}
+
+// Builds the nibble tables and picks the widest run scan the CPU supports.
+// Called once at import, before any thread encodes.
+void init_ascii_runs(void)
+{
+    memset(ascii_nibbles, 0, sizeof(ascii_nibbles));
+    for (int c = 0; c < 0x80; c++)
+    {
+        ascii_nibbles[ascii_char_class[c]][0][c & 15] |= 1 << (c >> 4);
+    }
+    for (int k = 0; k < NUM_CHAR_CLASSES; k++)
+    {
+        for (int high = 0; high < 8; high++)
+        {
+            ascii_nibbles[k][1][high] = 1 << high;
+        }
+    }
+    ascii_run_end = ascii_run_end_scalar;
+#ifdef ASCII_RUN_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ascii_run_end = ascii_run_end_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        ascii_run_end = ascii_run_end_ssse3;
+    }
+#endif
+}
+
+// Class of the UTF-8 character at pos, storing its length in bytes. Bytes
+// that do not start a well-formed sequence count as one CHAR_OTHER byte.
+static inline int char_class_at(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos, int* char_length)
+{
+    unsigned char c = text[pos];
+    if (c < 0x80)
+    {
+        *char_length = 1;
+        return ascii_char_class[c];
+    }
+
+    uint32_t codepoint;
+    int num_bytes;
+    if ((c & 0xE0) == 0xC0)
+    {
+        codepoint = c & 0x1F;
+        num_bytes = 2;
+    }
+    else if ((c & 0xF0) == 0xE0)
+    {
+        codepoint = c & 0x0F;
+        num_bytes = 3;
+    }
+    else if ((c & 0xF8) == 0xF0)
+    {
+        codepoint = c & 0x07;
+        num_bytes = 4;
+    }
+    else
+    {
+        *char_length = 1;
+        return CHAR_OTHER;
+    }
+    if (pos + num_bytes > length)
+    {
+        *char_length = 1;
+        return CHAR_OTHER;
+    }
+    for (int i = 1; i < num_bytes; i++)
+    {
+        if ((text[pos + i] & 0xC0) != 0x80)
+        {
+            *char_length = 1;
+            return CHAR_OTHER;
+        }
+        codepoint = (codepoint << 6) | (text[pos + i] & 0x3F);
+    }
+    *char_length = num_bytes;
+    return unicode_char_class(codepoint);
+}
+
+// End of the GPT-2 pattern match starting at pos. The alternatives are
+// tried in the pattern's order:
+//   '(?:[sdmt]|ll|ve|re)| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+Py_ssize_t gpt2_next_chunk(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos)
+{
+    int char_length;
+    int char_class = char_class_at(text, length, pos, &char_length);
+    Py_ssize_t end = pos + char_length;
+
+    if (text[pos] == '\'' && end < length)
+    {
+        unsigned char c = text[end];
+        if (c == 's' || c == 'd' || c == 'm' || c == 't')
+        {
+            return end + 1;
+        }
+        if (end + 1 < length)
+        {
+            unsigned char c2 = text[end + 1];
+            if ((c == 'l' && c2 == 'l') || (c == 'v' && c2 == 'e') || (c == 'r' && c2 == 'e'))
+            {
+                return end + 2;
+            }
+        }
+    }
+
+    // A single space joins the run after it, unless that run is whitespace
+    if (text[pos] == ' ' && end < length)
+    {
+        int next_length;
+        int next_class = char_class_at(text, length, end, &next_length);
+        if (next_class != CHAR_SPACE)
+        {
+            char_class = next_class;
+            end += next_length;
+        }
+    }
+
+    // ASCII stretches of a run are skipped by ascii_run_end, the characters
+    // where it stops are classified one by one
+    if (char_class != CHAR_SPACE)
+    {
+        while (end < length)
+        {
+            if (ascii_in_class(text, length, end, char_class))
+            {
+                end = ascii_run_end(text, length, end, char_class);
+            }
+            if (end == length || text[end] < 0x80 || char_class_at(text, length, end, &char_length) != char_class)
+            {
+                break;
+            }
+            end += char_length;
+        }
+        return end;
+    }
+
+    // A whitespace run followed by a non-space gives up its last character,
+    // which then prefixes the next chunk. A lone one is matched by \s+.
+    Py_ssize_t last = pos;
+    while (end < length)
+    {
+        if (ascii_in_class(text, length, end, CHAR_SPACE))
+        {
+            end = ascii_run_end(text, length, end, CHAR_SPACE);
+            last = end - 1;
+        }
+        if (end == length || text[end] < 0x80 || char_class_at(text, length, end, &char_length) != CHAR_SPACE)
+        {
+            break;
+        }
+        last = end;
+        end += char_length;
+    }
+    if (end < length && last > pos)
+    {
+        return last;
+    }
+    return end;
+}
+
+// Greedy longest-match encoding of one chunk through the trie. Bytes with no
+// match are emitted as their byte value.
+int encode_chunk_trie(Trie* trie, const unsigned char* text, int length, uint32_t* out)
+{
+    int num_tokens = 0;
+    int i = 0;
+    while (i < length)
+    {
+        int match_length;
+        int token_id = search_trie(trie, (unsigned char*)text + i, length - i, &match_length);
+        if (token_id != -1)
+        {
+            out[num_tokens++] = token_id;
+            i += match_length;
+        }
+        else
+        {
+            out[num_tokens++] = text[i];
+            i++;
+        }
+    }
+    return num_tokens;
+}
+
+int token_buffer_reserve(token_buffer_t* buffer, size_t extra)
+{
+    if (buffer->size + extra <= buffer->capacity)
+    {
+        return 0;
+    }
+    size_t new_capacity = buffer->capacity ? buffer->capacity : 1024;
+    while (new_capacity < buffer->size + extra)
+    {
+        new_capacity *= 2;
+    }
+    uint32_t* new_tokens = realloc(buffer->tokens, new_capacity * sizeof(uint32_t));
+    if (new_tokens == NULL)
+    {
+        return -1;
+    }
+    buffer->tokens = new_tokens;
+    if (buffer->with_spans)
+    {
+        uint64_t* new_spans = realloc(buffer->spans, new_capacity * 2 * sizeof(uint64_t));
+        if (new_spans == NULL)
+        {
+            return -1;
+        }
+        buffer->spans = new_spans;
+    }
+    buffer->capacity = new_capacity;
+    return 0;
+}
+
+void free_token_buffer(token_buffer_t* buffer)
+{
+    free(buffer->tokens);
+    free(buffer->spans);
+    memset(buffer, 0, sizeof(token_buffer_t));
+}
+
+// Like encode_chunk_tokens, and also appends the start and end byte of each
+// token, counted from start. Greedy matches give them directly, merge-order
+// tokens take theirs from the table's token_lengths, which must be built.
+int encode_chunk_spans(const bpe_encoder_t* encoder, const unsigned char* text, int length, uint64_t start, token_buffer_t* out)
+{
+    if (token_buffer_reserve(out, length) != 0)
+    {
+        return -1;
+    }
+    Trie* trie = encoder->trie;
+    uint32_t* tokens = out->tokens + out->size;
+    uint64_t* spans = out->spans + out->size * 2;
+    int num_tokens = 0;
+    int i = 0;
+    if (encoder->merges != NULL)
+    {
+        num_tokens = encode_chunk_merges(encoder->merges, encoder->cache, text, length, tokens);
+        if (num_tokens < 0)
+        {
+            return -1;
+        }
+        const uint32_t* token_lengths = encoder->merges->token_lengths;
+        for (int k = 0; k < num_tokens; k++)
+        {
+            spans[2 * k] = start + i;
+            i += token_lengths[tokens[k]];
+            spans[2 * k + 1] = start + i;
+        }
+    }
+    else
+    {
+        while (i < length)
+        {
+            int match_length;
+            int token_id = search_trie(trie, (unsigned char*)text + i, length - i, &match_length);
+            if (token_id == -1)
+            {
+                token_id = text[i];
+                match_length = 1;
+            }
+            tokens[num_tokens] = token_id;
+            spans[2 * num_tokens] = start + i;
+            i += match_length;
+            spans[2 * num_tokens + 1] = start + i;
+            num_tokens++;
+        }
+    }
+    out->size += num_tokens;
+    return 0;
+}
+
+// Appends the encoding of one chunk to out. Returns -1 if memory runs out.
+int encode_chunk_tokens(const bpe_encoder_t* encoder, const unsigned char* text, int length, token_buffer_t* out)
+{
+    // Every byte becomes at most one token
+    if (token_buffer_reserve(out, length) != 0)
+    {
+        return -1;
+    }
+    int num_tokens;
+    if (encoder->merges != NULL)
+    {
+        num_tokens = encode_chunk_merges(encoder->merges, encoder->cache, text, length, out->tokens + out->size);
+    }
+    else
+    {
+        num_tokens = encode_chunk_trie(encoder->trie, text, length, out->tokens + out->size);
+    }
+    if (num_tokens < 0)
+    {
+        return -1;
+    }
+    out->size += num_tokens;
+    return 0;
+}
+
+// Pre-tokenizes text with the GPT-2 pattern and appends the encoding of each
+// chunk to out. Special tokens are appended as their ids, and the text
+// between them is pre-tokenized on its own.
+int encode_text_tokens(const bpe_encoder_t* encoder, const unsigned char* text, Py_ssize_t length, token_buffer_t* out)
+{
+    if (token_buffer_reserve(out, length) != 0)
+    {
+        return -1;
+    }
+    Py_ssize_t pos = 0;
+    while (pos < length)
+    {
+        uint32_t special_length = 0;
+        uint32_t special_id = 0;
+        Py_ssize_t span_end = length;
+        if (encoder->special != NULL)
+        {
+            span_end = pos + find_special_token(encoder->special, text + pos, length - pos, &special_length, &special_id);
+        }
+        while (pos < span_end)
+        {
+            Py_ssize_t end = gpt2_next_chunk(text, span_end, pos);
+            int status = out->with_spans ? encode_chunk_spans(encoder, text + pos, (int)(end - pos), pos, out)
+                                         : encode_chunk_tokens(encoder, text + pos, (int)(end - pos), out);
+            if (status != 0)
+            {
+                return -1;
+            }
+            pos = end;
+        }
+        if (special_length > 0)
+        {
+            if (token_buffer_reserve(out, 1) != 0)
+            {
+                return -1;
+            }
+            if (out->with_spans)
+            {
+                out->spans[out->size * 2] = pos;
+                out->spans[out->size * 2 + 1] = pos + special_length;
+            }
+            out->tokens[out->size++] = special_id;
+            pos += special_length;
+        }
+    }
+    return 0;
+}
+
+// Number of tokens encode_chunk_trie gives for one chunk, without writing
+// them anywhere
+int count_chunk_trie(Trie* trie, const unsigned char* text, int length)
+{
+    int num_tokens = 0;
+    int i = 0;
+    while (i < length)
+    {
+        int match_length;
+        int token_id = search_trie(trie, (unsigned char*)text + i, length - i, &match_length);
+        i += token_id != -1 ? match_length : 1;
+        num_tokens++;
+    }
+    return num_tokens;
+}
+
+// Adds the number of tokens of one chunk to count. Merge-order encoding
+// needs the tokens themselves, they go to scratch and are dropped.
+int count_chunk_tokens(const bpe_encoder_t* encoder, const unsigned char* text, int length, token_buffer_t* scratch, size_t* count)
+{
+    if (encoder->merges == NULL)
+    {
+        *count += count_chunk_trie(encoder->trie, text, length);
+        return 0;
+    }
+    scratch->size = 0;
+    if (encode_chunk_tokens(encoder, text, length, scratch) != 0)
+    {
+        return -1;
+    }
+    *count += scratch->size;
+    return 0;
+}
+
+// Adds the number of tokens encode_text_tokens would append to count
+int count_text_tokens(const bpe_encoder_t* encoder, const unsigned char* text, Py_ssize_t length, token_buffer_t* scratch, size_t* count)
+{
+    Py_ssize_t pos = 0;
+    while (pos < length)
+    {
+        uint32_t special_length = 0;
+        uint32_t special_id = 0;
+        Py_ssize_t span_end = length;
+        if (encoder->special != NULL)
+        {
+            span_end = pos + find_special_token(encoder->special, text + pos, length - pos, &special_length, &special_id);
+        }
+        while (pos < span_end)
+        {
+            Py_ssize_t end = gpt2_next_chunk(text, span_end, pos);
+            if (count_chunk_tokens(encoder, text + pos, (int)(end - pos), scratch, count) != 0)
+            {
+                return -1;
+            }
+            pos = end;
+        }
+        if (special_length > 0)
+        {
+            (*count)++;
+            pos += special_length;
+        }
+    }
+    return 0;
+}
+
+// Gives the next count tokens, eos or padding, an empty span at the end of
+// the last one
+void set_padding_spans(token_buffer_t* buffer, size_t count)
+{
+    if (!buffer->with_spans)
+    {
+        return;
+    }
+    uint64_t end = buffer->size > 0 ? buffer->spans[buffer->size * 2 - 1] : 0;
+    for (size_t i = buffer->size; i < buffer->size + count; i++)
+    {
+        buffer->spans[2 * i] = end;
+        buffer->spans[2 * i + 1] = end;
+    }
+}
+
+// Pads with eos_token or truncates to seq_len, or with a negative seq_len
+// appends a single eos_token (if that is not negative too).
+int finish_token_buffer(token_buffer_t* buffer, int eos_token, Py_ssize_t seq_len)
+{
+    if (seq_len < 0)
+    {
+        if (eos_token < 0)
+        {
+            return 0;
+        }
+        if (token_buffer_reserve(buffer, 1) != 0)
+        {
+            return -1;
+        }
+        set_padding_spans(buffer, 1);
+        buffer->tokens[buffer->size++] = eos_token;
+        return 0;
+    }
+    if ((size_t)seq_len > buffer->size)
+    {
+        if (token_buffer_reserve(buffer, seq_len - buffer->size) != 0)
+        {
+            return -1;
+        }
+        set_padding_spans(buffer, seq_len - buffer->size);
+        while (buffer->size < (size_t)seq_len)
+        {
+            buffer->tokens[buffer->size++] = eos_token;
+        }
+    }
+    buffer->size = seq_len;
+    return 0;
+}
+
+// Copies ids into an array of 2 or 4 byte ids, which may be src itself.
+// Returns -1 if an id does not fit.
+int store_tokens(void* dst, const uint32_t* src, size_t count, int itemsize)
+{
+    if (itemsize == 4)
+    {
+        if (dst != src)
+        {
+            memcpy(dst, src, count * sizeof(uint32_t));
+        }
+        return 0;
+    }
+    uint16_t* narrow = dst;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (src[i] > UINT16_MAX)
+        {
+            return -1;
+        }
+        narrow[i] = (uint16_t)src[i];
+    }
+    return 0;
+}
+
+// Sets count ids of itemsize bytes from dst on to token
+void fill_tokens(void* dst, uint32_t token, size_t count, int itemsize)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (itemsize == 2)
+        {
+            ((uint16_t*)dst)[i] = (uint16_t)token;
+        }
+        else
+        {
+            ((uint32_t*)dst)[i] = token;
+        }
+    }
+}
+
+int init_word_counts(word_counts_t* counts, size_t capacity)
+{
+    size_t num_slots = 16;
+    while (num_slots < capacity)
+    {
+        num_slots <<= 1;
+    }
+    counts->slots = calloc(num_slots, sizeof(word_count_t));
+    counts->mask = num_slots - 1;
+    counts->size = 0;
+    return counts->slots == NULL ? -1 : 0;
+}
+
+static int word_counts_grow(word_counts_t* counts)
+{
+    size_t num_slots = (counts->mask + 1) * 2;
+    word_count_t* slots = calloc(num_slots, sizeof(word_count_t));
+    if (slots == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i <= counts->mask; i++)
+    {
+        if (counts->slots[i].word == NULL) continue;
+        size_t idx = counts->slots[i].hash & (num_slots - 1);
+        while (slots[idx].word != NULL)
+        {
+            idx = (idx + 1) & (num_slots - 1);
+        }
+        slots[idx] = counts->slots[i];
+    }
+    free(counts->slots);
+    counts->slots = slots;
+    counts->mask = num_slots - 1;
+    return 0;
+}
+
+// Adds count occurrences of word. The table keeps the word pointer, so the
+// bytes must outlive it. Returns -1 if memory runs out.
+int word_counts_add(word_counts_t* counts, const unsigned char* word, uint32_t length, uint64_t hash, bpe_count_t count)
+{
+    if ((counts->size + 1) * 2 > counts->mask + 1 && word_counts_grow(counts) != 0)
+    {
+        return -1;
+    }
+    size_t idx = hash & counts->mask;
+    while (counts->slots[idx].word != NULL)
+    {
+        word_count_t* slot = &counts->slots[idx];
+        if (slot->hash == hash && slot->length == length && memcmp(slot->word, word, length) == 0)
+        {
+            slot->count += count;
+            return 0;
+        }
+        idx = (idx + 1) & counts->mask;
+    }
+    counts->slots[idx].word = word;
+    counts->slots[idx].hash = hash;
+    counts->slots[idx].count = count;
+    counts->slots[idx].length = length;
+    counts->size++;
+    return 0;
+}
+
+void free_word_counts(word_counts_t* counts)
+{
+    free(counts->slots);
+    memset(counts, 0, sizeof(word_counts_t));
+}
+
+static inline int ascii_non_space(unsigned char c)
+{
+    return c < 0x80 && ascii_char_class[c] != CHAR_SPACE;
+}
+
+// A GPT-2 chunk starts at cut, and the chunk before it ends there whether or
+// not the text goes on: either a space joins the ASCII non-space run after
+// it, or a lone newline was matched on its own.
+static int corpus_cut_safe(const unsigned char* text, size_t length, size_t cut)
+{
+    if (cut < 2 || cut + 1 >= length)
+    {
+        return 0;
+    }
+    if (text[cut] == ' ')
+    {
+        return ascii_non_space(text[cut - 1]) && ascii_non_space(text[cut + 1]);
+    }
+    return text[cut - 1] == '\n' && ascii_non_space(text[cut - 2]) && ascii_non_space(text[cut]);
+}
+
+// Appends segments of about target bytes covering text to *segments, cut
+// only where pre-tokenizing each segment on its own gives the same chunks
+// as the whole text. Text without such a cut stays in one segment.
+int split_corpus(const unsigned char* text, size_t length, size_t target, corpus_segment_t** segments, size_t* num_segments, size_t* capacity)
+{
+    size_t start = 0;
+    while (start < length)
+    {
+        size_t end = length;
+        if (length - start > target)
+        {
+            for (size_t cut = start + target; cut < length; cut++)
+            {
+                if (corpus_cut_safe(text, length, cut))
+                {
+                    end = cut;
+                    break;
+                }
+            }
+        }
+        if (*num_segments == *capacity)
+        {
+            size_t new_capacity = *capacity ? *capacity * 2 : 64;
+            corpus_segment_t* grown = realloc(*segments, new_capacity * sizeof(corpus_segment_t));
+            if (grown == NULL)
+            {
+                return -1;
+            }
+            *segments = grown;
+            *capacity = new_capacity;
+        }
+        (*segments)[*num_segments].text = text + start;
+        (*segments)[*num_segments].length = end - start;
+        (*num_segments)++;
+        start = end;
+    }
+    return 0;
+}
+
+// Pre-tokenizes the segments a thread claims and counts the chunks in its
+// own table.
+static void count_corpus_worker(void* arg, int thread_idx, int num_threads)
+{
+    count_corpus_job_t* job = arg;
+    word_counts_t* counts = &job->counts[thread_idx];
+    // The table grows once it is half full, spill instead when that would
+    // take it past its budget
+    size_t spill_size = job->max_slots / 2;
+
+    while (!atomic_load(&job->failed))
+    {
+        size_t segment = atomic_fetch_add(&job->next_segment, 1);
+        if (segment >= job->num_segments)
+        {
+            break;
+        }
+        const unsigned char* text = job->segments[segment].text;
+        Py_ssize_t length = (Py_ssize_t)job->segments[segment].length;
+        Py_ssize_t pos = 0;
+        while (pos < length)
+        {
+            Py_ssize_t end = gpt2_next_chunk(text, length, pos);
+            // Byte 0 ends a word in the text table, as it does for str keys
+            const unsigned char* nul = memchr(text + pos, 0, end - pos);
+            size_t word_length = nul != NULL ? (size_t)(nul - (text + pos)) : (size_t)(end - pos);
+            if (word_length > 0 && word_length <= INT_MAX)
+            {
+                if (spill_size > 0 && counts->size >= spill_size && spill_word_counts(counts, &job->spills[thread_idx]) != 0)
+                {
+                    atomic_store(&job->failed, errno ? errno : EIO);
+                    return;
+                }
+                if (word_counts_add(counts, text + pos, (uint32_t)word_length, hash_bytes(text + pos, (int)word_length), 1) != 0)
+                {
+                    atomic_store(&job->failed, ENOMEM);
+                    return;
+                }
+            }
+            pos = end;
+        }
+    }
+}
+
+// Opens an anonymous temporary file in dir for spilled runs
+int open_spill_file(spill_file_t* spill, const char* dir)
+{
+    static const char name[] = "/bytephase-spill-XXXXXX";
+    size_t dir_length = strlen(dir);
+    memset(spill, 0, sizeof(spill_file_t));
+    char* path = malloc(dir_length + sizeof(name));
+    if (path == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(path, dir, dir_length);
+    memcpy(path + dir_length, name, sizeof(name));
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        free(path);
+        return -1;
+    }
+    unlink(path);
+    free(path);
+    spill->file = fdopen(fd, "w+b");
+    if (spill->file == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    setvbuf(spill->file, NULL, _IOFBF, SPILL_BUFFER_MAX);
+    return 0;
+}
+
+// Orders words by hash, then length, then bytes, the same order in every run
+static int word_count_cmp(const void* a, const void* b)
+{
+    const word_count_t* left = a;
+    const word_count_t* right = b;
+    if (left->hash != right->hash)
+    {
+        return left->hash < right->hash ? -1 : 1;
+    }
+    if (left->length != right->length)
+    {
+        return left->length < right->length ? -1 : 1;
+    }
+    return memcmp(left->word, right->word, left->length);
+}
+
+// Writes the table out as one sorted run and empties it, keeping its slots.
+// Returns -1 with errno set if the write fails.
+int spill_word_counts(word_counts_t* counts, spill_file_t* spill)
+{
+    if (spill->num_runs == spill->runs_capacity)
+    {
+        size_t capacity = spill->runs_capacity ? spill->runs_capacity * 2 : 16;
+        spill_run_t* runs = realloc(spill->runs, capacity * sizeof(spill_run_t));
+        if (runs == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        spill->runs = runs;
+        spill->runs_capacity = capacity;
+    }
+
+    // Pack the words to the front of the slots and sort them in place
+    size_t size = 0;
+    for (size_t i = 0; i <= counts->mask; i++)
+    {
+        if (counts->slots[i].word != NULL)
+        {
+            counts->slots[size++] = counts->slots[i];
+        }
+    }
+    qsort(counts->slots, size, sizeof(word_count_t), word_count_cmp);
+
+    spill_run_t* run = &spill->runs[spill->num_runs];
+    run->offset = ftello(spill->file);
+    int failed = run->offset < 0;
+    for (size_t i = 0; !failed && i < size; i++)
+    {
+        word_count_t* slot = &counts->slots[i];
+        int64_t count = slot->count;
+        failed = fwrite(&slot->hash, sizeof(slot->hash), 1, spill->file) != 1 ||
+            fwrite(&count, sizeof(count), 1, spill->file) != 1 ||
+            fwrite(&slot->length, sizeof(slot->length), 1, spill->file) != 1 ||
+            fwrite(slot->word, 1, slot->length, spill->file) != slot->length;
+    }
+    run->end = ftello(spill->file);
+    memset(counts->slots, 0, (counts->mask + 1) * sizeof(word_count_t));
+    counts->size = 0;
+    if (failed || run->end < 0)
+    {
+        if (errno == 0) errno = EIO;
+        return -1;
+    }
+    spill->num_runs++;
+    return 0;
+}
+
+void close_spill_file(spill_file_t* spill)
+{
+    if (spill->file != NULL)
+    {
+        fclose(spill->file);
+    }
+    free(spill->runs);
+    memset(spill, 0, sizeof(spill_file_t));
+}
+
+static int spill_reader_read(spill_reader_t* reader, void* dst, size_t length)
+{
+    unsigned char* out = dst;
+    while (length > 0)
+    {
+        if (reader->buffer_pos == reader->buffer_length)
+        {
+            off_t remaining = reader->end - reader->position;
+            size_t wanted = remaining < (off_t)reader->buffer_size ? (size_t)remaining : reader->buffer_size;
+            if (wanted == 0)
+            {
+                errno = EIO;
+                return -1;
+            }
+            ssize_t got = pread(reader->fd, reader->buffer, wanted, reader->position);
+            if (got <= 0)
+            {
+                if (got == 0) errno = EIO;
+                return -1;
+            }
+            reader->position += got;
+            reader->buffer_pos = 0;
+            reader->buffer_length = (size_t)got;
+        }
+        size_t take = reader->buffer_length - reader->buffer_pos;
+        if (take > length) take = length;
+        memcpy(out, reader->buffer + reader->buffer_pos, take);
+        reader->buffer_pos += take;
+        out += take;
+        length -= take;
+    }
+    return 0;
+}
+
+// Loads the next record of the run into current. Returns 0 at the end of
+// the run and -1 with errno set on a read error.
+static int spill_reader_next(spill_reader_t* reader)
+{
+    if (reader->position == reader->end && reader->buffer_pos == reader->buffer_length)
+    {
+        return 0;
+    }
+    word_count_t* current = &reader->current;
+    int64_t count;
+    if (spill_reader_read(reader, &current->hash, sizeof(current->hash)) != 0 ||
+        spill_reader_read(reader, &count, sizeof(count)) != 0 ||
+        spill_reader_read(reader, &current->length, sizeof(current->length)) != 0)
+    {
+        return -1;
+    }
+    current->count = count;
+    if (current->length > reader->word_capacity)
+    {
+        unsigned char* word = realloc(reader->word, current->length);
+        if (word == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        reader->word = word;
+        reader->word_capacity = current->length;
+    }
+    current->word = reader->word;
+    return spill_reader_read(reader, reader->word, current->length) != 0 ? -1 : 1;
+}
+
+static void spill_heap_sift_down(spill_reader_t** heap, size_t size, size_t idx)
+{
+    while (1)
+    {
+        size_t smallest = idx;
+        size_t left = 2 * idx + 1;
+        size_t right = left + 1;
+        if (left < size && word_count_cmp(&heap[left]->current, &heap[smallest]->current) < 0) smallest = left;
+        if (right < size && word_count_cmp(&heap[right]->current, &heap[smallest]->current) < 0) smallest = right;
+        if (smallest == idx) return;
+        spill_reader_t* tmp = heap[idx];
+        heap[idx] = heap[smallest];
+        heap[smallest] = tmp;
+        idx = smallest;
+    }
+}
+
+// Merges every spilled run, adding up the counts of a word across runs, and
+// appends the words seen at least min_count times to the text table. The
+// read buffers share memory bytes between them.
+int merge_spill_runs(spill_file_t* spills, int num_spills, size_t memory, bpe_count_t min_count, text_table_t* text_table, size_t* max_length)
+{
+    size_t num_runs = 0;
+    for (int i = 0; i < num_spills; i++)
+    {
+        if (fflush(spills[i].file) != 0)
+        {
+            return -1;
+        }
+        num_runs += spills[i].num_runs;
+    }
+    size_t buffer_size = num_runs > 0 ? memory / num_runs : 0;
+    if (buffer_size < SPILL_BUFFER_MIN) buffer_size = SPILL_BUFFER_MIN;
+    if (buffer_size > SPILL_BUFFER_MAX) buffer_size = SPILL_BUFFER_MAX;
+
+    spill_reader_t* readers = calloc(num_runs > 0 ? num_runs : 1, sizeof(spill_reader_t));
+    spill_reader_t** heap = malloc((num_runs > 0 ? num_runs : 1) * sizeof(spill_reader_t*));
+    unsigned char* word = NULL;
+    size_t word_capacity = 0;
+    size_t heap_size = 0;
+    int result = -1;
+    if (readers == NULL || heap == NULL)
+    {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+    size_t reader_idx = 0;
+    for (int i = 0; i < num_spills; i++)
+    {
+        for (size_t j = 0; j < spills[i].num_runs; j++, reader_idx++)
+        {
+            spill_reader_t* reader = &readers[reader_idx];
+            reader->fd = fileno(spills[i].file);
+            reader->position = spills[i].runs[j].offset;
+            reader->end = spills[i].runs[j].end;
+            reader->buffer_size = buffer_size;
+            reader->buffer = malloc(buffer_size);
+            if (reader->buffer == NULL)
+            {
+                errno = ENOMEM;
+                goto cleanup;
+            }
+            int status = spill_reader_next(reader);
+            if (status < 0)
+            {
+                goto cleanup;
+            }
+            if (status > 0)
+            {
+                heap[heap_size++] = reader;
+            }
+        }
+    }
+    for (size_t i = heap_size; i-- > 0;)
+    {
+        spill_heap_sift_down(heap, heap_size, i);
+    }
+
+    // Runs hold each word once, so equal words come out of different runs
+    // one after another. The word being summed is copied out of its reader.
+    word_count_t total = {NULL, 0, 0, 0};
+    while (heap_size > 0)
+    {
+        spill_reader_t* reader = heap[0];
+        word_count_t* current = &reader->current;
+        if (total.word != NULL && word_count_cmp(&total, current) == 0)
+        {
+            total.count += current->count;
+        }
+        else
+        {
+            if (total.word != NULL && total.count >= min_count)
+            {
+                if (text_table_add(text_table, total.word, total.length, total.count) != 0)
+                {
+                    errno = ENOMEM;
+                    goto cleanup;
+                }
+                if (total.length > *max_length) *max_length = total.length;
+            }
+            if (current->length > word_capacity)
+            {
+                unsigned char* grown = realloc(word, current->length);
+                if (grown == NULL)
+                {
+                    errno = ENOMEM;
+                    goto cleanup;
+                }
+                word = grown;
+                word_capacity = current->length;
+            }
+            memcpy(word, current->word, current->length);
+            total = *current;
+            total.word = word;
+        }
+        int status = spill_reader_next(reader);
+        if (status < 0)
+        {
+            goto cleanup;
+        }
+        if (status == 0)
+        {
+            heap[0] = heap[--heap_size];
+        }
+        spill_heap_sift_down(heap, heap_size, 0);
+    }
+    if (total.word != NULL && total.count >= min_count)
+    {
+        if (text_table_add(text_table, total.word, total.length, total.count) != 0)
+        {
+            errno = ENOMEM;
+            goto cleanup;
+        }
+        if (total.length > *max_length) *max_length = total.length;
+    }
+    result = 0;
+
+cleanup:
+    for (size_t i = 0; readers != NULL && i < num_runs; i++)
+    {
+        free(readers[i].buffer);
+        free(readers[i].word);
+    }
+    free(readers);
+    free(heap);
+    free(word);
+    return result;
+}
+
+// Threads claim the next unencoded document until none are left, so a few
+// long documents do not hold up the rest. Each thread appends to its own
+// buffer and records where every document it took ended up.
+static void encode_batch_worker(void* arg, int thread_idx, int num_threads)
+{
+    encode_batch_job_t* job = arg;
+    bpe_encoder_t encoder = {job->trie, job->merges, job->merges ? &job->caches[thread_idx] : NULL, job->special};
+    token_buffer_t* out = &job->buffers[thread_idx];
+
+    while (!atomic_load(&job->failed))
+    {
+        size_t doc = atomic_fetch_add(&job->next_doc, 1);
+        if (doc >= job->num_docs)
+        {
+            break;
+        }
+        size_t start = out->size;
+        int status = 0;
+        for (Py_ssize_t i = job->doc_pieces[doc]; status == 0 && i < job->doc_pieces[doc + 1]; i++)
+        {
+            if (job->doc_split[doc])
+            {
+                status = encode_text_tokens(&encoder, job->pieces[i], job->piece_lengths[i], out);
+            }
+            else if (job->pieces[i] == NULL)
+            {
+                status = token_buffer_reserve(out, 1);
+                if (status == 0)
+                {
+                    out->tokens[out->size++] = (uint32_t)job->piece_lengths[i];
+                }
+            }
+            else
+            {
+                status = encode_chunk_tokens(&encoder, job->pieces[i], (int)job->piece_lengths[i], out);
+            }
+        }
+        if (status == 0 && job->eos_token >= 0)
+        {
+            status = token_buffer_reserve(out, 1);
+            if (status == 0)
+            {
+                out->tokens[out->size++] = job->eos_token;
+            }
+        }
+        if (status != 0)
+        {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        job->doc_thread[doc] = thread_idx;
+        job->doc_start[doc] = start;
+        job->doc_length[doc] = out->size - start;
+    }
+}
+
+// Like encode_batch_worker, but only counts the tokens of each document
+// into doc_length. The thread's buffer is scratch space for merge-order
+// encoding.
+static void count_batch_worker(void* arg, int thread_idx, int num_threads)
+{
+    encode_batch_job_t* job = arg;
+    bpe_encoder_t encoder = {job->trie, job->merges, job->merges ? &job->caches[thread_idx] : NULL, job->special};
+    token_buffer_t* scratch = &job->buffers[thread_idx];
+
+    while (!atomic_load(&job->failed))
+    {
+        size_t doc = atomic_fetch_add(&job->next_doc, 1);
+        if (doc >= job->num_docs)
+        {
+            break;
+        }
+        size_t count = job->eos_token >= 0;
+        int status = 0;
+        for (Py_ssize_t i = job->doc_pieces[doc]; status == 0 && i < job->doc_pieces[doc + 1]; i++)
+        {
+            if (job->doc_split[doc])
+            {
+                status = count_text_tokens(&encoder, job->pieces[i], job->piece_lengths[i], scratch, &count);
+            }
+            else if (job->pieces[i] == NULL)
+            {
+                count++;
+            }
+            else
+            {
+                status = count_chunk_tokens(&encoder, job->pieces[i], (int)job->piece_lengths[i], scratch, &count);
+            }
+        }
+        if (status != 0)
+        {
+            atomic_store(&job->failed, 1);
+            break;
+        }
+        job->doc_length[doc] = count;
+    }
+}
+
+// Fills block with the next pieces of input, about ENCODE_FILES_BLOCK_SIZE
+// bytes. A document too long for the rest of the block is cut where the
+// GPT-2 chunks on either side stay the same and no special token runs
+// across, so it encodes as if whole. Empty documents are skipped. Called
+// with the job lock held.
+static int encode_files_next_block(encode_files_job_t* job, encode_block_t* block)
+{
+    size_t budget = ENCODE_FILES_BLOCK_SIZE;
+    block->num_pieces = 0;
+    while (budget > 0 && job->input_idx < job->num_inputs)
+    {
+        bpe_mapping_t* input = job->inputs[job->input_idx];
+        const unsigned char* text = input != NULL ? input->data : NULL;
+        size_t length = input != NULL ? input->length : 0;
+        size_t pos = job->input_pos;
+        if (pos >= length)
+        {
+            job->input_idx++;
+            job->input_pos = 0;
+            job->doc_end = SIZE_MAX;
+            continue;
+        }
+        if (job->doc_end == SIZE_MAX)
+        {
+            const unsigned char* separator = job->separator != NULL ?
+                memmem(text + pos, length - pos, job->separator, job->separator_length) : NULL;
+            job->doc_end = separator != NULL ? (size_t)(separator - text) : length;
+        }
+        size_t doc_end = job->doc_end;
+        size_t piece_end = doc_end;
+        if (doc_end - pos > budget)
+        {
+            for (size_t cut = pos + budget; cut < doc_end; cut++)
+            {
+                if (corpus_cut_safe(text + pos, doc_end - pos, cut - pos) &&
+                    (job->special == NULL || !special_token_spans(job->special, text + pos, doc_end - pos, cut - pos)))
+                {
+                    piece_end = cut;
+                    break;
+                }
+            }
+        }
+        if (piece_end > pos)
+        {
+            if (block->num_pieces == block->pieces_capacity)
+            {
+                size_t capacity = block->pieces_capacity ? block->pieces_capacity * 2 : 64;
+                encode_piece_t* pieces = realloc(block->pieces, capacity * sizeof(encode_piece_t));
+                if (pieces == NULL)
+                {
+                    return -1;
+                }
+                block->pieces = pieces;
+                block->pieces_capacity = capacity;
+            }
+            encode_piece_t* piece = &block->pieces[block->num_pieces++];
+            piece->text = text + pos;
+            piece->length = piece_end - pos;
+            piece->ends_doc = piece_end == doc_end;
+            budget -= piece->length < budget ? piece->length : budget;
+        }
+        job->input_pos = piece_end;
+        if (piece_end == doc_end)
+        {
+            job->input_pos = doc_end < length ? doc_end + job->separator_length : length;
+            job->doc_end = SIZE_MAX;
+        }
+    }
+    return 0;
+}
+
+static int encode_files_block(encode_files_job_t* job, encode_block_t* block, const bpe_encoder_t* encoder)
+{
+    block->tokens.size = 0;
+    block->num_doc_ends = 0;
+    for (size_t i = 0; i < block->num_pieces; i++)
+    {
+        encode_piece_t* piece = &block->pieces[i];
+        if (encode_text_tokens(encoder, piece->text, (Py_ssize_t)piece->length, &block->tokens) != 0)
+        {
+            return -1;
+        }
+        if (!piece->ends_doc)
+        {
+            continue;
+        }
+        if (job->eos_token >= 0)
+        {
+            if (token_buffer_reserve(&block->tokens, 1) != 0)
+            {
+                return -1;
+            }
+            block->tokens.tokens[block->tokens.size++] = job->eos_token;
+        }
+        if (block->num_doc_ends == block->doc_ends_capacity)
+        {
+            size_t capacity = block->doc_ends_capacity ? block->doc_ends_capacity * 2 : 64;
+            size_t* doc_ends = realloc(block->doc_ends, capacity * sizeof(size_t));
+            if (doc_ends == NULL)
+            {
+                return -1;
+            }
+            block->doc_ends = doc_ends;
+            block->doc_ends_capacity = capacity;
+        }
+        block->doc_ends[block->num_doc_ends++] = block->tokens.size;
+    }
+    return 0;
+}
+
+static void encode_files_fail(encode_files_job_t* job, int error)
+{
+    pthread_mutex_lock(&job->lock);
+    if (!job->failed)
+    {
+        job->failed = error ? error : EIO;
+    }
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void encode_files_encoder(encode_files_job_t* job, int thread_idx)
+{
+    bpe_encoder_t encoder = {job->trie, job->merges, job->merges ? &job->caches[thread_idx] : NULL, job->special};
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->failed && !job->input_done)
+    {
+        encode_block_t* block = &job->blocks[job->next_block % job->num_blocks];
+        if (block->state != ENCODE_BLOCK_FREE)
+        {
+            // Every block is in flight, wait for the writer to catch up
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+        if (encode_files_next_block(job, block) != 0)
+        {
+            job->failed = ENOMEM;
+            break;
+        }
+        if (job->input_idx == job->num_inputs)
+        {
+            job->input_done = 1;
+            pthread_cond_broadcast(&job->cond);
+        }
+        if (block->num_pieces == 0)
+        {
+            break;
+        }
+        block->state = ENCODE_BLOCK_CLAIMED;
+        job->next_block++;
+        pthread_mutex_unlock(&job->lock);
+
+        int status = encode_files_block(job, block, &encoder);
+
+        pthread_mutex_lock(&job->lock);
+        if (status != 0 && !job->failed)
+        {
+            job->failed = ENOMEM;
+        }
+        block->state = ENCODE_BLOCK_DONE;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+typedef struct encode_shard {
+    FILE* tokens;
+    FILE* index;
+    uint64_t size;
+} encode_shard_t;
+
+// Opens {prefix}_{n:05d}.bin for the tokens and .idx for the uint64 offsets
+// of the documents in it, which starts with a 0
+static int encode_files_open_shard(encode_files_job_t* job, encode_shard_t* shard)
+{
+    if (job->num_shards == job->shards_capacity)
+    {
+        size_t capacity = job->shards_capacity ? job->shards_capacity * 2 : 16;
+        char** paths = realloc(job->shard_paths, capacity * sizeof(char*));
+        if (paths == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        job->shard_paths = paths;
+        job->shards_capacity = capacity;
+    }
+    size_t path_size = strlen(job->output_prefix) + 32;
+    char* path = malloc(path_size);
+    if (path == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(path, path_size, "%s_%05zu.bin", job->output_prefix, job->num_shards);
+    job->shard_paths[job->num_shards++] = path;
+    shard->tokens = fopen(path, "wb");
+    if (shard->tokens == NULL)
+    {
+        return -1;
+    }
+    setvbuf(shard->tokens, NULL, _IOFBF, ENCODE_FILES_WRITE_BUFFER);
+    memcpy(path + strlen(path) - 4, ".idx", 4);
+    shard->index = fopen(path, "wb");
+    memcpy(path + strlen(path) - 4, ".bin", 4);
+    if (shard->index == NULL)
+    {
+        return -1;
+    }
+    shard->size = 0;
+    return fwrite(&shard->size, sizeof(shard->size), 1, shard->index) == 1 ? 0 : -1;
+}
+
+static int encode_files_close_shard(encode_shard_t* shard)
+{
+    int failed = 0;
+    if (shard->tokens != NULL && fclose(shard->tokens) != 0) failed = 1;
+    if (shard->index != NULL && fclose(shard->index) != 0) failed = 1;
+    shard->tokens = NULL;
+    shard->index = NULL;
+    return failed ? -1 : 0;
+}
+
+// Writes one done block to the open shards, moving to a new shard after the
+// document that fills the current one
+static int encode_files_write_block(encode_files_job_t* job, encode_block_t* block, encode_shard_t* shard)
+{
+    uint32_t* tokens = block->tokens.tokens;
+    if (store_tokens(tokens, tokens, block->tokens.size, job->itemsize) != 0)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i <= block->num_doc_ends; i++)
+    {
+        size_t end = i < block->num_doc_ends ? block->doc_ends[i] : block->tokens.size;
+        if (end > start && shard->tokens == NULL && encode_files_open_shard(job, shard) != 0)
+        {
+            return -1;
+        }
+        if (end > start && fwrite((unsigned char*)tokens + start * job->itemsize, job->itemsize, end - start, shard->tokens) != end - start)
+        {
+            return -1;
+        }
+        shard->size += end - start;
+        job->num_tokens += end - start;
+        start = end;
+        if (i == block->num_doc_ends)
+        {
+            break;
+        }
+        if (fwrite(&shard->size, sizeof(shard->size), 1, shard->index) != 1)
+        {
+            return -1;
+        }
+        job->num_docs++;
+        if (job->shard_tokens > 0 && shard->size >= job->shard_tokens && encode_files_close_shard(shard) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void encode_files_writer(encode_files_job_t* job)
+{
+    encode_shard_t shard = {NULL, NULL, 0};
+    int error = 0;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->failed)
+    {
+        encode_block_t* block = &job->blocks[job->next_write % job->num_blocks];
+        if (block->state != ENCODE_BLOCK_DONE)
+        {
+            if (job->input_done && job->next_write == job->next_block)
+            {
+                break;
+            }
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&job->lock);
+        error = encode_files_write_block(job, block, &shard) != 0 ? (errno ? errno : EIO) : 0;
+        pthread_mutex_lock(&job->lock);
+        if (error)
+        {
+            break;
+        }
+        block->state = ENCODE_BLOCK_FREE;
+        job->next_write++;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    // Input without any document still gets one empty shard
+    if (!error && !job->failed && job->num_shards == 0 && encode_files_open_shard(job, &shard) != 0)
+    {
+        error = errno ? errno : EIO;
+    }
+    if (encode_files_close_shard(&shard) != 0 && !error)
+    {
+        error = errno ? errno : EIO;
+    }
+    if (error)
+    {
+        encode_files_fail(job, error);
+    }
+}
+
+static void encode_files_worker(void* arg, int thread_idx, int num_threads)
+{
+    encode_files_job_t* job = arg;
+    if (thread_idx == 0)
+    {
+        encode_files_writer(job);
+    }
+    else
+    {
+        encode_files_encoder(job, thread_idx);
+    }
+}
+
+static void merges_capsule_destructor(PyObject *capsule)
+{
+    merge_table_t* table = PyCapsule_GetPointer(capsule, "bpe_merges");
+    free_merge_table(table);
+}
+
+static void special_capsule_destructor(PyObject *capsule)
+{
+    special_tokens_t* special = PyCapsule_GetPointer(capsule, "bpe_special");
+    free_special_tokens(special);
+}
+
+static void trie_capsule_destructor(PyObject *capsule) 
+{
+    Trie *trie = PyCapsule_GetPointer(capsule, "bpe_trie");
+    if (trie) {
+        free_trie(trie);
+    }
+}
+
+
+static void token_array_dealloc(TokenArrayObject* self) {
+    free(self->data);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t token_array_length(TokenArrayObject* self) {
+    return self->length;
+}
+
+static PyObject* token_array_item(TokenArrayObject* self, Py_ssize_t index) {
+    if (index < 0 || index >= self->length) {
+        PyErr_SetString(PyExc_IndexError, "TokenArray index out of range");
+        return NULL;
+    }
+    if (self->itemsize == 2) {
+        return PyLong_FromUnsignedLong(((uint16_t*)self->data)[index]);
+    }
+    if (self->itemsize == 8) {
+        return PyLong_FromUnsignedLongLong(((uint64_t*)self->data)[index]);
+    }
+    return PyLong_FromUnsignedLong(((uint32_t*)self->data)[index]);
+}
+
+static int token_array_getbuffer(TokenArrayObject* self, Py_buffer* view, int flags) {
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->length * self->itemsize;
+    view->readonly = 0;
+    view->itemsize = self->itemsize;
+    view->format = NULL;
+    if (flags & PyBUF_FORMAT) {
+        view->format = self->itemsize == 2 ? "H" : self->itemsize == 4 ? "I" : "Q";
+    }
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? &self->itemsize : NULL;
+    if (self->row_length > 0 && (flags & PyBUF_ND)) {
+        self->shape[0] = self->length / self->row_length;
+        self->shape[1] = self->row_length;
+        self->strides[0] = self->row_length * self->itemsize;
+        self->strides[1] = self->itemsize;
+        view->ndim = 2;
+        view->shape = self->shape;
+        view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? self->strides : NULL;
+    }
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyObject* token_array_tolist(TokenArrayObject* self, PyObject* Py_UNUSED(ignored)) {
+    PyObject* token_list = PyList_New(self->length);
+    if (!token_list) return NULL;
+    for (Py_ssize_t i = 0; i < self->length; i++) {
+        PyObject* token_obj = token_array_item(self, i);
+        if (!token_obj) {
+            Py_DECREF(token_list);
+            return NULL;
+        }
+        PyList_SET_ITEM(token_list, i, token_obj);
+    }
+    return token_list;
+}
+
+static PySequenceMethods token_array_as_sequence = {
+    .sq_length = (lenfunc)token_array_length,
+    .sq_item = (ssizeargfunc)token_array_item,
+};
+
+static PyBufferProcs token_array_as_buffer = {
+    .bf_getbuffer = (getbufferproc)token_array_getbuffer,
+};
+
+static PyMethodDef token_array_methods[] = {
+    {"tolist", (PyCFunction)token_array_tolist, METH_NOARGS, "Copy the token ids into a list of ints."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyObject* token_array_get_shape(TokenArrayObject* self, void* Py_UNUSED(closure)) {
+    if (self->row_length > 0) {
+        return Py_BuildValue("(nn)", self->length / self->row_length, self->row_length);
+    }
+    return Py_BuildValue("(n)", self->length);
+}
+
+static PyMemberDef token_array_members[] = {
+    {"itemsize", T_PYSSIZET, offsetof(TokenArrayObject, itemsize), READONLY, "Size of one token id in bytes."},
+    {NULL}
+};
+
+static PyGetSetDef token_array_getset[] = {
+    {"shape", (getter)token_array_get_shape, NULL, "Shape the buffer is exported with, (rows, row_length) or (length,).", NULL},
+    {NULL}
+};
+
+static PyTypeObject TokenArrayType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_bpe.TokenArray",
+    .tp_doc = "Encoded token ids in a contiguous native buffer.",
+    .tp_basicsize = sizeof(TokenArrayObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)token_array_dealloc,
+    .tp_as_sequence = &token_array_as_sequence,
+    .tp_as_buffer = &token_array_as_buffer,
+    .tp_methods = token_array_methods,
+    .tp_members = token_array_members,
+    .tp_getset = token_array_getset,
+};
+
+// Wraps a malloc'd block of 2, 4 or 8 byte ids, which the array then owns.
+// The block is freed if the array cannot be created.
+static PyObject* new_token_array(void* data, Py_ssize_t length, Py_ssize_t itemsize) {
+    TokenArrayObject* array = PyObject_New(TokenArrayObject, &TokenArrayType);
+    if (!array) {
+        free(data);
+        return NULL;
+    }
+    array->data = data;
+    array->length = length;
+    array->itemsize = itemsize;
+    array->row_length = 0;
+    return (PyObject*)array;
+}
+
+// Hands the tokens to Python as a list (itemsize 0) or as a TokenArray of
+// 2 or 4 byte ids. The array takes over the buffer's memory, narrowing it
+// in place for 2 byte ids, so the buffer is always left empty.
+static PyObject* tokens_to_python(token_buffer_t* buffer, int itemsize) {
+    if (itemsize == 0) {
+        PyObject* token_list = PyList_New(buffer->size);
+        if (!token_list) {
+            free_token_buffer(buffer);
+            return NULL;
+        }
+        for (size_t i = 0; i < buffer->size; i++) {
+            PyObject* token_obj = PyLong_FromUnsignedLong(buffer->tokens[i]);
+            if (!token_obj) {
+                free_token_buffer(buffer);
+                Py_DECREF(token_list);
+                return NULL;
+            }
+            PyList_SET_ITEM(token_list, i, token_obj);
+        }
+        free_token_buffer(buffer);
+        return token_list;
+    }
+    if (itemsize != 2 && itemsize != 4) {
+        free_token_buffer(buffer);
+        PyErr_SetString(PyExc_ValueError, "itemsize must be 0, 2 or 4");
+        return NULL;
+    }
+
+    if (store_tokens(buffer->tokens, buffer->tokens, buffer->size, itemsize) != 0) {
+        free_token_buffer(buffer);
+        PyErr_SetString(PyExc_OverflowError, "Token id does not fit in 2 bytes");
+        return NULL;
+    }
+
+    // Give back the unused capacity, keeping the block when it is empty
+    void* data = buffer->tokens;
+    if (buffer->size > 0 && buffer->size < buffer->capacity) {
+        void* shrunk = realloc(data, buffer->size * itemsize);
+        if (shrunk != NULL) data = shrunk;
+    }
+    Py_ssize_t length = buffer->size;
+    memset(buffer, 0, sizeof(token_buffer_t));
+    return new_token_array(data, length, itemsize);
+}
+
+// Fills options from the optional training arguments. Given a decode_dict
+// and its merge table, training extends that vocab: the pair behind each of
+// its merges comes from the table, in training ids (Python ids above 256 less
+// one). A token whose bytes an earlier merge already makes has no pair in the
+// table and becomes an alias of that earlier token.
+static int init_train_options(train_options_t* options, PyObject* decode_dict, PyObject* merges_capsule, int num_merges, const char* checkpoint_path, int checkpoint_every, const char* pattern, Py_ssize_t pattern_length)
+{
+    memset(options, 0, sizeof(train_options_t));
+    options->checkpoint_path = checkpoint_path;
+    options->checkpoint_every = checkpoint_every;
+    options->pattern = pattern != NULL ? pattern : "";
+    options->pattern_length = pattern != NULL ? pattern_length : 0;
+    if (checkpoint_every < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "checkpoint_every must not be negative");
+        return -1;
+    }
+    if (decode_dict == Py_None)
+    {
+        return 0;
+    }
+    if (!PyDict_Check(decode_dict))
+    {
+        PyErr_SetString(PyExc_TypeError, "decode_dict must be a dictionary");
+        return -1;
+    }
+    merge_table_t* table = PyCapsule_GetPointer(merges_capsule, "bpe_merges");
+    if (table == NULL)
+    {
+        return -1;
+    }
+
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+    long max_id = 256;
+    Py_ssize_t max_length = 1;
+    while (PyDict_Next(decode_dict, &pos, &key, &value))
+    {
+        long token_id = PyLong_AsLong(key);
+        if (token_id == -1 && PyErr_Occurred())
+        {
+            return -1;
+        }
+        if (!PyBytes_Check(value))
+        {
+            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
+            return -1;
+        }
+        if (token_id > max_id) max_id = token_id;
+        if (PyBytes_GET_SIZE(value) > max_length) max_length = PyBytes_GET_SIZE(value);
+    }
+    size_t num_prefix = max_id - 256;
+    if (num_prefix > (size_t)num_merges)
+    {
+        PyErr_SetString(PyExc_ValueError, "num_merges is smaller than the vocab being extended");
+        return -1;
+    }
+
+    bpe_token_t* prefix = calloc(num_prefix > 0 ? 2 * num_prefix : 1, sizeof(bpe_token_t));
+    uint32_t* parts = malloc(max_length * sizeof(uint32_t));
+    if (prefix == NULL || parts == NULL)
+    {
+        free(prefix);
+        free(parts);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        uint32_t token_id = table->slots[i].token_id;
+        if (token_id < 257 || token_id > (uint32_t)max_id) continue;
+        uint32_t left = (uint32_t)(table->slots[i].key >> 32);
+        uint32_t right = (uint32_t)table->slots[i].key;
+        prefix[2 * (token_id - 257)] = left > 256 ? left - 1 : left;
+        prefix[2 * (token_id - 257) + 1] = right > 256 ? right - 1 : right;
+    }
+    for (size_t i = 0; i < num_prefix; i++)
+    {
+        if (prefix[2 * i] != 0) continue;
+        PyObject* token_id = PyLong_FromSize_t(257 + i);
+        PyObject* token = token_id != NULL ? PyDict_GetItemWithError(decode_dict, token_id) : NULL;
+        Py_XDECREF(token_id);
+        int num_parts = 0;
+        if (token != NULL)
+        {
+            num_parts = bpe_merge_chunk(table, (const unsigned char*)PyBytes_AS_STRING(token), (int)PyBytes_GET_SIZE(token), parts);
+        }
+        if (PyErr_Occurred() || num_parts != 1 || parts[0] < 257 || parts[0] >= 257 + i)
+        {
+            if (!PyErr_Occurred())
+            {
+                PyErr_Format(PyExc_ValueError, "token %zu is not a merge of earlier tokens, the vocab cannot be extended", 257 + i);
+            }
+            free(prefix);
+            free(parts);
+            return -1;
+        }
+        prefix[2 * i] = parts[0] - 1;
+    }
+    free(parts);
+    options->prefix = prefix;
+    options->num_prefix = num_prefix;
+    options->replay = 1;
+    return 0;
+}
+
+// Learns num_merges merges from a filled text table, which it takes over,
+// and returns the bytes of each new token. max_length is the length in bytes of the longest word, which no
+// token can exceed. options may give the first merges and a checkpoint file.
+static PyObject* train_text_table(text_table_t* text_table, size_t max_length, int num_merges, int num_threads, const train_options_t* options)
+{
+    token_node_t** token_table = NULL;
+    bigram_table_t* bigram_table = NULL;
+    bigram_heap_t* heap = NULL;
+    train_pool_t* pool = NULL;
+    PyObject* token_output = NULL;
+    unsigned char* token = NULL;
+    size_t max_size = max_length + 1;
+    bpe_token_t token_idx_start = 256;
+    bpe_token_t token_idx = 256;
+    int token_idx_end = token_idx_start + num_merges;
+    int out_of_memory = 0;
+    int checkpoint_failed = 0;
+    int checkpoint_errno = 0;
+
+    token_table = malloc(sizeof(token_node_t*) * (num_merges + 257));
+    if (token_table == NULL)
+    {
+        PyErr_SetString(PyExc_MemoryError,"token table malloc failed");
+        goto error;    
+    }
+    memset(token_table, 0, sizeof(token_node_t*) * (num_merges + 257));
+
+    heap = create_bigram_heap(BIGRAM_HEAP_INIT_SIZE);
+    if (heap == NULL)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate bigram heap");
+        goto error;
+    }
+    if (num_threads > 1)
+    {
+        pool = create_train_pool(num_threads);
+        if (pool == NULL)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to start training threads");
+            goto error;
+        }
+    }
+
+    // Everything below works on the C copies only, so other Python threads
+    // can run until the merges are converted back to Python objects
+    Py_BEGIN_ALLOW_THREADS
+    bigram_table = build_bigram_table(text_table, heap, pool);
+    if (bigram_table != NULL)
+    {
+        bigram_node_t* max_node = NULL;
+
+        // Known merges take their ids in order. When extending a vocab they
+        // are applied to the text table, a resumed one already has them.
+        for (size_t i = 0; i < options->num_prefix && token_idx < (bpe_token_t)token_idx_end; i++, token_idx++)
+        {
+            bpe_token_t left = options->prefix[2 * i];
+            bpe_token_t right = options->prefix[2 * i + 1];
+            token_table[token_idx] = malloc(sizeof(token_node_t));
+            if (token_table[token_idx] == NULL)
+            {
+                out_of_memory = 1;
+                break;
+            }
+            token_table[token_idx]->token[0] = left;
+            token_table[token_idx]->token[1] = right;
+            if (options->replay && right != 0 && (max_node = find_bigram(bigram_table, left, right)) != NULL &&
+                retokenize(text_table, &max_node, bigram_table, heap, token_idx, pool) != 0)
+            {
+                out_of_memory = 1;
+                break;
+            }
+        }
+
+        while (!out_of_memory && token_idx < (bpe_token_t)token_idx_end)
+        {
+            int found = update_max_node(&max_node, heap, token_table, token_idx);
+            if (found < 0)
+            {
+                out_of_memory = 1;
+                break;
+            }
+            if (found == 0)
+            {
+                // No pair occurs more than zero times, the vocab cannot grow further
+                break;
+            }
+            if (retokenize(text_table, &max_node, bigram_table, heap, token_idx, pool) != 0)
+            {
+                out_of_memory = 1;
+                break;
+            }
+
+            token_idx++;
+            if (options->checkpoint_path != NULL && options->checkpoint_every > 0 &&
+                (token_idx - token_idx_start) % options->checkpoint_every == 0 && token_idx < (bpe_token_t)token_idx_end)
+            {
+                if (write_checkpoint(options, text_table, token_table, token_idx, max_length) != 0)
+                {
+                    checkpoint_failed = 1;
+                    checkpoint_errno = errno;
+                    break;
+                }
+            }
+        }
+        if (options->checkpoint_path != NULL && !checkpoint_failed && !out_of_memory &&
+            write_checkpoint(options, text_table, token_table, token_idx, max_length) != 0)
+        {
+            checkpoint_failed = 1;
+            checkpoint_errno = errno;
+        }
+    }
+    free_train_pool(pool);
+    Py_END_ALLOW_THREADS
+    if (bigram_table == NULL || out_of_memory)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate bigram table");
+        goto error;
+    }
+    if (checkpoint_failed)
+    {
+        errno = checkpoint_errno;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, options->checkpoint_path);
+        goto error;
+    }
+    token_output = PyList_New(0);
+    if (token_output == NULL)
+    {
+        goto error;
+    }
+    token = malloc(max_size);
+    if (token == NULL)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate token buffer");
+        goto error;
+    }
+
+    for (int i = token_idx_start; i < token_idx_end; i++) 
+    {
+        if (!token_table[i]) continue;
+        memset(token, 0, max_size);
+        size_t result_count = 0;
+        if (dfs(token, i, token_table, &result_count, token_idx_end, max_size) != 0)
+        {
+            PyErr_Format(PyExc_RuntimeError, "Failed to rebuild the bytes of token %d", i);
+            goto error;
+        }
+        PyObject* token_list = PyList_New(0);
+
+        if (!token_list) 
+        {
+            PyErr_SetString(PyExc_MemoryError, "Failed to create Python list for dfs token\n");
+            goto error;
+        }
+
+        // Append each byte of the token to token_list
+        for (size_t j = 0; j < result_count; j++) 
+        {
+            PyObject* py_value = PyLong_FromUnsignedLong(token[j]);
+            if (!py_value) 
+            {
+                PyErr_SetString(PyExc_MemoryError, "Failed to convert token byte to Python object\n");
+                Py_DECREF(token_list);
+                goto error;
+            }
+            if (PyList_Append(token_list, py_value) == -1) 
+            {
+                PyErr_SetString(PyExc_MemoryError, "Failed to append value to result list\n");
+                Py_DECREF(token_list);
+                Py_DECREF(py_value);
+                goto error;
+            }
+            Py_DECREF(py_value);
+        }
+
+        if (PyList_Append(token_output, token_list) == -1) 
+        {
+            PyErr_SetString(PyExc_MemoryError, "Failed to append result list to token list\n");
+            Py_DECREF(token_list);
+            goto error;
+        }
+
+        Py_DECREF(token_list);
+    }
+
+    cleanup_train_resources(text_table, bigram_table, heap, token_table, token_idx_start, token_idx_end, token);
+    return token_output;
+
+error:
+    cleanup_train_resources(text_table, bigram_table, heap, token_table, token_idx_start, token_idx_end, token);
+    Py_XDECREF(token_output);
+    return NULL;
+}
+
+static PyObject* train(PyObject* self, PyObject* args) 
+{
+    PyObject* dict;
+    int text_table_len;
+    int num_merges;
+    int num_threads = 1;
+    PyObject* decode_dict = Py_None;
+    PyObject* merges_capsule = Py_None;
+    const char* checkpoint_path = NULL;
+    int checkpoint_every = 0;
+    const char* pattern = NULL;
+    Py_ssize_t pattern_length = 0;
+    train_options_t options;
+    PyObject* key;
+    PyObject* value;
+    Py_ssize_t pos = 0;
+
+    // Parse the input dictionary and integer pass from python call
+    if (!PyArg_ParseTuple(args, "O!ii|iOOziz#", &PyDict_Type, &dict, &text_table_len, &num_merges, &num_threads,
+                          &decode_dict, &merges_capsule, &checkpoint_path, &checkpoint_every, &pattern, &pattern_length)) 
+    {
+        return NULL;
+    }
+    if (num_threads < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be a positive integer");
+        return NULL;
+    }
+    if (init_train_options(&options, decode_dict, merges_capsule, num_merges, checkpoint_path, checkpoint_every, pattern, pattern_length) != 0)
+    {
+        return NULL;
+    }
+
+    // Code points are a close lower bound on the UTF-8 bytes of the words
+    Py_ssize_t num_chars = 0;
+    while (PyDict_Next(dict, &pos, &key, &value))
+    {
+        if (PyUnicode_Check(key))
+        {
+            num_chars += PyUnicode_GET_LENGTH(key);
+        }
+    }
+    pos = 0;
+
+    text_table_t text_table;
+    if (init_text_table(&text_table, text_table_len > 0 ? text_table_len : 0, num_chars, TRAIN_WIDE_TOKENS(num_merges)) != 0)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate text table");
+        free((void*)options.prefix);
+        return NULL;
+    }
+
+    // Iterate through the input dictionary
+    size_t max_length = 0;
+
+    while (PyDict_Next(dict, &pos, &key, &value) && text_table.num_words < (size_t)text_table_len) 
+    {
+        if (PyUnicode_Check(key) && PyLong_Check(value)) 
+        {
+            const char* key_str = PyUnicode_AsUTF8(key);
+            long long count = PyLong_AsLongLong(value);
+            if (key_str == NULL || (count == -1 && PyErr_Occurred()))
+            {
+                goto error;
+            }
+
+            // Byte 0 terminates words, so a key ends at its first NUL
+            size_t length = strlen(key_str);
+            if (length > INT_MAX)
+            {
+                continue;
+            }
+            if (length > max_length)
+            {
+                max_length = length;
+            }
+
+            if (text_table_add(&text_table, (const unsigned char*)key_str, (uint32_t)length, count) != 0)
+            {
+                PyErr_NoMemory();
+                goto error;
+            }
+        }
+    }
+
+    PyObject* result = train_text_table(&text_table, max_length, num_merges, num_threads, &options);
+    free((void*)options.prefix);
+    return result;
+
+error:
+    free_text_table(&text_table);
+    free((void*)options.prefix);
+    return NULL;
+}
+
+// Trains on files without going through Python: each file is mapped, cut
+// into segments, and pre-tokenized with the GPT-2 pattern and counted on
+// num_threads threads. The merged counts fill the text table directly.
+// Words seen fewer than min_count times are left out. With max_memory set,
+// the count tables stay within it by spilling sorted runs to spill_dir,
+// which are merged back into the text table at the end.
+static PyObject* train_files(PyObject* self, PyObject* args) 
+{
+    PyObject* paths;
+    int num_merges;
+    int num_threads = 1;
+    PyObject* decode_dict = Py_None;
+    PyObject* merges_capsule = Py_None;
+    const char* checkpoint_path = NULL;
+    int checkpoint_every = 0;
+    const char* pattern = NULL;
+    Py_ssize_t pattern_length = 0;
+    long long min_count = 1;
+    Py_ssize_t max_memory = 0;
+    const char* spill_dir = NULL;
+    train_options_t options;
+
+    if (!PyArg_ParseTuple(args, "O!i|iOOziz#Lnz", &PyList_Type, &paths, &num_merges, &num_threads,
+                          &decode_dict, &merges_capsule, &checkpoint_path, &checkpoint_every, &pattern, &pattern_length,
+                          &min_count, &max_memory, &spill_dir))
+    {
+        return NULL;
+    }
+    if (num_threads < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be a positive integer");
+        return NULL;
+    }
+    if (min_count < 1 || max_memory < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "min_count must be positive and max_memory not negative");
+        return NULL;
+    }
+    if (init_train_options(&options, decode_dict, merges_capsule, num_merges, checkpoint_path, checkpoint_every, pattern, pattern_length) != 0)
+    {
+        return NULL;
+    }
+
+    Py_ssize_t num_files = PyList_GET_SIZE(paths);
+    bpe_mapping_t** mappings = calloc(num_files > 0 ? num_files : 1, sizeof(bpe_mapping_t*));
+    word_counts_t* counts = calloc(num_threads, sizeof(word_counts_t));
+    corpus_segment_t* segments = NULL;
+    size_t num_segments = 0;
+    size_t segments_capacity = 0;
+    train_pool_t* pool = NULL;
+    spill_file_t* spills = NULL;
+    text_table_t text_table;
+    size_t num_words = 0;
+    size_t max_length = 0;
+    PyObject* result = NULL;
+    memset(&text_table, 0, sizeof(text_table));
+
+    if (mappings == NULL || counts == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (Py_ssize_t i = 0; i < num_files; i++)
+    {
+        PyObject* encoded = NULL;
+        if (!PyUnicode_FSConverter(PyList_GET_ITEM(paths, i), &encoded))
+        {
+            goto cleanup;
+        }
+        const char* path = PyBytes_AS_STRING(encoded);
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_size == 0)
+        {
+            Py_DECREF(encoded);
+            continue;
+        }
+        mappings[i] = map_file(path);
+        if (mappings[i] == NULL)
+        {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            Py_DECREF(encoded);
+            goto cleanup;
+        }
+        Py_DECREF(encoded);
+        madvise(mappings[i]->data, mappings[i]->length, MADV_SEQUENTIAL);
+        if (split_corpus(mappings[i]->data, mappings[i]->length, CORPUS_SEGMENT_SIZE, &segments, &num_segments, &segments_capacity) != 0)
+        {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+    }
+
+    // Half of a memory budget goes to the per-thread tables, the other half
+    // to the table they are merged into or to the buffers reading spills
+    size_t max_slots = 0;
+    if (max_memory > 0)
+    {
+        size_t thread_budget = (size_t)max_memory / 2 / num_threads;
+        max_slots = WORD_COUNTS_MIN_SPILL;
+        while (max_slots * 2 * sizeof(word_count_t) <= thread_budget)
+        {
+            max_slots *= 2;
+        }
+        spills = calloc(num_threads, sizeof(spill_file_t));
+        if (spills == NULL)
+        {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        for (int i = 0; i < num_threads; i++)
+        {
+            if (open_spill_file(&spills[i], spill_dir != NULL ? spill_dir : P_tmpdir) != 0)
+            {
+                PyErr_SetFromErrnoWithFilename(PyExc_OSError, spill_dir != NULL ? spill_dir : P_tmpdir);
+                goto cleanup;
+            }
+        }
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        if (init_word_counts(&counts[i], max_slots > 0 && max_slots < WORD_COUNTS_INIT_SIZE ? max_slots : WORD_COUNTS_INIT_SIZE) != 0)
+        {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+    }
+    if (num_threads > 1)
+    {
+        pool = create_train_pool(num_threads);
+        if (pool == NULL)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to start training threads");
+            goto cleanup;
+        }
+    }
+
+    count_corpus_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.segments = segments;
+    job.num_segments = num_segments;
+    job.counts = counts;
+    job.max_slots = max_slots;
+    job.spills = spills;
+    atomic_init(&job.next_segment, 0);
+    atomic_init(&job.failed, 0);
+    int failed = 0;
+    int spilled = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    if (pool != NULL)
+    {
+        train_pool_run(pool, count_corpus_worker, &job);
+    }
+    else
+    {
+        count_corpus_worker(&job, 0, 1);
+    }
+    free_train_pool(pool);
+    failed = atomic_load(&job.failed);
+
+    // Once any table has spilled, or merging them could need more than the
+    // other half of the budget, every table goes to disk
+    if (!failed && spills != NULL)
+    {
+        size_t total = 0;
+        for (int i = 0; i < num_threads; i++)
+        {
+            total += counts[i].size;
+            spilled = spilled || spills[i].num_runs > 0;
+        }
+        spilled = spilled || total * 4 * sizeof(word_count_t) > (size_t)max_memory / 2;
+    }
+    for (int i = 0; spilled && !failed && i < num_threads; i++)
+    {
+        if (counts[i].size > 0 && spill_word_counts(&counts[i], &spills[i]) != 0)
+        {
+            failed = errno;
+        }
+        free_word_counts(&counts[i]);
+    }
+    for (int i = 1; !spilled && !failed && i < num_threads; i++)
+    {
+        for (size_t j = 0; j <= counts[i].mask; j++)
+        {
+            word_count_t* slot = &counts[i].slots[j];
+            if (slot->word != NULL && word_counts_add(&counts[0], slot->word, slot->length, slot->hash, slot->count) != 0)
+            {
+                failed = ENOMEM;
+                break;
+            }
+        }
+        free_word_counts(&counts[i]);
+    }
+    Py_END_ALLOW_THREADS
+    if (failed)
+    {
+        errno = failed;
+        if (failed == ENOMEM) PyErr_NoMemory();
+        else PyErr_SetFromErrno(PyExc_OSError);
+        goto cleanup;
+    }
+
+    int wide = TRAIN_WIDE_TOKENS(num_merges);
+    if (spilled)
+    {
+        // The runs hold copies, the files are no longer needed
+        for (Py_ssize_t i = 0; i < num_files; i++)
+        {
+            release_mapping(mappings[i]);
+            mappings[i] = NULL;
+        }
+        if (init_text_table(&text_table, WORD_COUNTS_INIT_SIZE, 8 * WORD_COUNTS_INIT_SIZE, wide) != 0)
+        {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        failed = merge_spill_runs(spills, num_threads, (size_t)max_memory / 2, min_count, &text_table, &max_length) != 0 ? errno : 0;
+        Py_END_ALLOW_THREADS
+        if (failed)
+        {
+            errno = failed;
+            if (failed == ENOMEM) PyErr_NoMemory();
+            else PyErr_SetFromErrno(PyExc_OSError);
+            goto cleanup;
+        }
+        num_words = text_table.num_words;
+    }
+    else
+    {
+        size_t num_tokens = 0;
+        for (size_t i = 0; i <= counts[0].mask; i++)
+        {
+            if (counts[0].slots[i].word != NULL && counts[0].slots[i].count >= min_count)
+            {
+                num_words++;
+                num_tokens += counts[0].slots[i].length;
+                if (counts[0].slots[i].length > max_length)
+                {
+                    max_length = counts[0].slots[i].length;
+                }
+            }
+        }
+        if (init_text_table(&text_table, num_words, num_tokens, wide) != 0)
+        {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        for (size_t i = 0; i <= counts[0].mask; i++)
+        {
+            word_count_t* slot = &counts[0].slots[i];
+            if (slot->word == NULL || slot->count < min_count) continue;
+            // Sized exactly above, so adding cannot fail
+            text_table_add(&text_table, slot->word, slot->length, slot->count);
+        }
+
+        // The text table holds copies, the files are no longer needed
+        free_word_counts(&counts[0]);
+        for (Py_ssize_t i = 0; i < num_files; i++)
+        {
+            release_mapping(mappings[i]);
+            mappings[i] = NULL;
+        }
+    }
+    if (num_words > INT_MAX)
+    {
+        PyErr_SetString(PyExc_OverflowError, "too many distinct words to train on");
+        goto cleanup;
+    }
+    result = train_text_table(&text_table, max_length, num_merges, num_threads, &options);
+
+cleanup:
+    free_text_table(&text_table);
+    for (int i = 0; spills != NULL && i < num_threads; i++)
+    {
+        close_spill_file(&spills[i]);
+    }
+    free(spills);
+    if (counts != NULL)
+    {
+        for (int i = 0; i < num_threads; i++)
+        {
+            free_word_counts(&counts[i]);
+        }
+        free(counts);
+    }
+    if (mappings != NULL)
+    {
+        for (Py_ssize_t i = 0; i < num_files; i++)
+        {
+            release_mapping(mappings[i]);
+        }
+        free(mappings);
+    }
+    free(segments);
+    free((void*)options.prefix);
+    return result;
+}
+
+// Continues training from a checkpoint up to num_merges merges, updating
+// the checkpoint as it goes. Returns the pattern it was trained with and
+// the bytes of every merge, the earlier ones included.
+static PyObject* resume_training(PyObject* self, PyObject* args)
+{
+    const char* path;
+    int num_merges;
+    int num_threads = 1;
+    int checkpoint_every = 0;
+
+    if (!PyArg_ParseTuple(args, "si|ii", &path, &num_merges, &num_threads, &checkpoint_every))
+    {
+        return NULL;
+    }
+    if (num_threads < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be a positive integer");
+        return NULL;
+    }
+    if (checkpoint_every < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "checkpoint_every must not be negative");
+        return NULL;
+    }
+
+    checkpoint_header_t header;
+    char* pattern = NULL;
+    bpe_token_t* prefix = NULL;
+    text_table_t text_table;
+    void* scratch = NULL;
+    PyObject* pattern_str = NULL;
+    PyObject* result = NULL;
+    memset(&text_table, 0, sizeof(text_table));
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION || header.byte_order != BINARY_BYTE_ORDER ||
+        header.num_words > INT_MAX || header.num_merges > INT_MAX || header.max_length > INT_MAX ||
+        header.pattern_length > INT_MAX)
+    {
+        goto invalid;
+    }
+    if (header.num_merges > (uint64_t)num_merges)
+    {
+        PyErr_SetString(PyExc_ValueError, "num_merges is smaller than the number of merges in the checkpoint");
+        goto cleanup;
+    }
+
+    pattern = malloc(header.pattern_length + 1);
+    prefix = malloc((header.num_merges > 0 ? 2 * header.num_merges : 1) * sizeof(bpe_token_t));
+    scratch = malloc((header.max_length > 0 ? header.max_length : 1) * sizeof(uint32_t));
+    if (pattern == NULL || prefix == NULL || scratch == NULL)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    if (header.pattern_length > 0 && fread(pattern, header.pattern_length, 1, file) != 1)
+    {
+        goto invalid;
+    }
+    pattern_str = PyUnicode_DecodeUTF8(pattern, header.pattern_length, NULL);
+    if (pattern_str == NULL)
+    {
+        goto cleanup;
+    }
+
+    // Every pair refers to earlier ids only, so the bytes of a token always
+    // come out of dfs in a bounded number of steps
+    uint64_t num_ids = 256 + header.num_merges;
+    if (header.num_merges > 0 && fread(prefix, 2 * sizeof(bpe_token_t), header.num_merges, file) != header.num_merges)
+    {
+        goto invalid;
+    }
+    for (uint64_t i = 0; i < header.num_merges; i++)
+    {
+        bpe_token_t left = prefix[2 * i];
+        bpe_token_t right = prefix[2 * i + 1];
+        if (left == 0 || left >= 256 + i || right >= 256 + i)
+        {
+            goto invalid;
+        }
+    }
+
+    // Each word takes at least its count and length, the rest of the file
+    // bounds the number of words and of tokens
+    struct stat st;
+    long position = ftell(file);
+    size_t unit = header.wide ? sizeof(uint32_t) : sizeof(uint16_t);
+    if (fstat(fileno(file), &st) != 0 || position < 0 || st.st_size < position ||
+        header.num_words > (uint64_t)(st.st_size - position) / (sizeof(int64_t) + sizeof(uint32_t)))
+    {
+        goto invalid;
+    }
+    size_t token_bytes = (size_t)(st.st_size - position) - header.num_words * (sizeof(int64_t) + sizeof(uint32_t));
+    if (init_text_table(&text_table, header.num_words, token_bytes / unit, TRAIN_WIDE_TOKENS(num_merges)) != 0)
+    {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (uint64_t i = 0; i < header.num_words; i++)
+    {
+        int64_t count;
+        uint32_t num_tokens;
+        if (fread(&count, sizeof(count), 1, file) != 1 || fread(&num_tokens, sizeof(num_tokens), 1, file) != 1 ||
+            num_tokens > header.max_length)
+        {
+            goto invalid;
+        }
+        if (num_tokens > 0 && fread(scratch, unit, num_tokens, file) != num_tokens)
+        {
+            goto invalid;
+        }
+        if (text_table_add(&text_table, NULL, num_tokens, count) != 0)
+        {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        size_t start = text_table.offsets[i];
+        for (uint32_t j = 0; j < num_tokens; j++)
+        {
+            bpe_token_t token = header.wide ? ((uint32_t*)scratch)[j] : ((uint16_t*)scratch)[j];
+            if (token == 0 || token >= num_ids)
+            {
+                goto invalid;
+            }
+            set_word_token(&text_table, start + j, token);
+        }
+    }
+    if (fgetc(file) != EOF)
+    {
+        goto invalid;
+    }
+    fclose(file);
+    file = NULL;
+
+    train_options_t options = {prefix, header.num_merges, 0, path, checkpoint_every, pattern, (Py_ssize_t)header.pattern_length};
+    PyObject* merges = train_text_table(&text_table, header.max_length, num_merges, num_threads, &options);
+    if (merges != NULL)
+    {
+        result = PyTuple_Pack(2, pattern_str, merges);
+        Py_DECREF(merges);
+    }
+    goto cleanup;
+
+invalid:
+    PyErr_Format(PyExc_ValueError, "%s is not a valid training checkpoint", path);
+cleanup:
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+    free_text_table(&text_table);
+    Py_XDECREF(pattern_str);
+    free(pattern);
+    free(prefix);
+    free(scratch);
+    return result;
+}
+
+static PyObject* build_trie(PyObject* self, PyObject* args) {
+    PyObject* decode_dict;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &decode_dict)) {
+        return NULL;
+    }
+
+    Py_ssize_t num_entries = PyDict_Size(decode_dict);
+    trie_entry_t* entries = malloc((num_entries ? num_entries : 1) * sizeof(trie_entry_t));
+    if (entries == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate trie entries");
+        return NULL;
+    }
+
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    int entry_idx = 0;
+
+    // The byte strings are borrowed from the dict values, they only need to
+    // outlive create_trie
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        if (!PyBytes_Check(value) || !PyLong_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
+            free(entries);
+            return NULL;
+        }
+    
+        char* token;
+        Py_ssize_t token_length;
+        PyBytes_AsStringAndSize(value, &token, &token_length);
+        if (token_length == 0) continue;
+
+        entries[entry_idx].bytes = (unsigned char*)token;
+        entries[entry_idx].length = (int)token_length;
+        entries[entry_idx].token_id = PyLong_AsLong(key);
+        entries[entry_idx].order = entry_idx;
+        entry_idx++;
+    }
+
+    Trie* trie = create_trie(entries, entry_idx);
+    free(entries);
+    if (trie == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate trie");
+        return NULL;
+    }
+
+    PyObject* trie_capsule = PyCapsule_New(trie, "bpe_trie", trie_capsule_destructor);
+    if (trie_capsule == NULL) {
+        free_trie(trie);
+        return NULL;
+    }
+
+    return trie_capsule;
+}
+
+static PyObject* manual_free_trie(PyObject* self, PyObject* args) {
+    PyObject* trie_capsule;
+    if (!PyArg_ParseTuple(args, "O", &trie_capsule)) {
+        return NULL;
+    }
+    
+    if (!PyCapsule_IsValid(trie_capsule, "bpe_trie")) {
+        PyErr_SetString(PyExc_ValueError, "Invalid or already freed trie capsule");
+        return NULL;
+    }
+
+    Trie* trie = PyCapsule_GetPointer(trie_capsule, "bpe_trie");
+    if (trie) {
+        free_trie(trie);
+        // Instead of setting pointer to NULL, clear the destructor
+        // This prevents the destructor from being called again
+        if (PyCapsule_SetDestructor(trie_capsule, NULL) != 0) {
+            PyErr_SetString(PyExc_RuntimeError, "Failed to clear trie capsule destructor");
+            return NULL;
+        }
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* encode_train(PyObject* self, PyObject* args) {
+    PyObject* text_iterator;
+    PyObject* trie_capsule;
+    
+    if (!PyArg_ParseTuple(args, "OO", &text_iterator, &trie_capsule)) {
+        return NULL;
+    }
+
+    if (trie_capsule == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "Trie is None. Tokenizer may not have been trained or a encode dict was not loaded.");
+        return NULL;
+    }
+
+    Trie* trie = (Trie*)PyCapsule_GetPointer(trie_capsule, "bpe_trie");
+    if (!trie) {
+        PyErr_SetString(PyExc_ValueError, "Invalid trie object");
+        return NULL;
+    }
+
+    PyObject* iter = PyObject_GetIter(text_iterator);
+    if (!iter) {
+        PyErr_SetString(PyExc_TypeError, "First argument must be iterable");
+        return NULL;
+    }
+
+    PyObject* encoded_list = PyList_New(0);
+    if (!encoded_list) return NULL;
+
+    PyObject* chunk;
+    while ((chunk = PyIter_Next(iter))) {
+        PyObject* match_str = PyObject_CallMethod(chunk, "group", NULL);
+        Py_DECREF(chunk);
+        if (!PyUnicode_Check(match_str)) {
+            PyErr_SetString(PyExc_TypeError, "Each chunk must be a string");
+            Py_DECREF(match_str);
+            Py_DECREF(encoded_list);
+            Py_DECREF(iter);
+            return NULL;
+        }
+
+        Py_ssize_t text_length;
+        const char* text = PyUnicode_AsUTF8AndSize(match_str, &text_length);
+        if (!text) {
+            Py_DECREF(match_str);
+            Py_DECREF(iter);
+            Py_DECREF(encoded_list);
+            return NULL;
+        }
+
+        Py_ssize_t i = 0;
+        while (i < text_length) {
+            int match_length;
+            int token_id = search_trie(trie, (unsigned char*)text + i, text_length - i, &match_length);
+            PyObject* token_obj;
+
+            if (token_id != -1) {
+                token_obj = PyLong_FromLong(token_id);
+                i += match_length;
+            } else {
+                token_obj = PyLong_FromLong((unsigned char)text[i]);
+                i++;
+            }
+
+            if (!token_obj) {
+                Py_DECREF(match_str);
+                Py_DECREF(encoded_list);
+                Py_DECREF(iter);
+                return NULL;
+            }
+
+            if (PyList_Append(encoded_list, token_obj) == -1) {
+                Py_DECREF(token_obj);
+                Py_DECREF(match_str);
+                Py_DECREF(encoded_list);
+                Py_DECREF(iter);
+                return NULL;
+            }
+            Py_DECREF(token_obj);
+        }
+
+        Py_DECREF(match_str);
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred()) {
+        Py_DECREF(encoded_list);
+        return NULL;
+    }
+
+    return encoded_list;
+}
+
+static PyObject* encode_inference(PyObject* self, PyObject* args) {
+    PyObject* input_chunks;
+    PyObject* trie_capsule;
+    
+    if (!PyArg_ParseTuple(args, "OO", &input_chunks, &trie_capsule)) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to parse function args. Must be a list of strings and pointer to trie.");
+
+        return NULL;
+    }
+    if (trie_capsule == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "Trie is None. Tokenizer may not have been trained or a encode dict was not loaded.");
+        return NULL;
+    }
+    Trie* trie = (Trie*)PyCapsule_GetPointer(trie_capsule, "bpe_trie");
+    if (!trie) {
+        PyErr_SetString(PyExc_ValueError, "Invalid trie object");
+        return NULL;
+    }
+    if (!PyList_Check(input_chunks)) {
+        PyErr_SetString(PyExc_TypeError, "Input must be a list of strings");
+        return NULL;
+    }
+    // Encode every chunk into one buffer and build the list once at the end
+    bpe_encoder_t encoder = {trie, NULL, NULL, NULL};
+    token_buffer_t buffer = {0};
+    for (Py_ssize_t chunk_idx = 0; chunk_idx < PyList_GET_SIZE(input_chunks); chunk_idx++) {
+        PyObject* chunk = PyList_GET_ITEM(input_chunks, chunk_idx);
+        if (!PyUnicode_Check(chunk)) {
+            PyErr_SetString(PyExc_TypeError, "Each chunk must be a string");
+            free_token_buffer(&buffer);
+            return NULL;
+        }
+        Py_ssize_t text_length;
+        const char* text = PyUnicode_AsUTF8AndSize(chunk, &text_length);
+        if (!text) {
+            free_token_buffer(&buffer);
+            return NULL;
+        }
+        if (encode_chunk_tokens(&encoder, (const unsigned char*)text, (int)text_length, &buffer) != 0) {
+            free_token_buffer(&buffer);
+            return PyErr_NoMemory();
+        }
+    }
+    return tokens_to_python(&buffer, 0);
+}
+
+static int trie_entry_id_cmp(const void* a, const void* b)
+{
+    const trie_entry_t* x = a;
+    const trie_entry_t* y = b;
+    return (x->token_id > y->token_id) - (x->token_id < y->token_id);
+}
+
+static PyObject* build_merges(PyObject* self, PyObject* args) {
+    PyObject* decode_dict;
+    Py_ssize_t cache_size = 0;
+
+    if (!PyArg_ParseTuple(args, "O!|n", &PyDict_Type, &decode_dict, &cache_size)) {
+        return NULL;
+    }
+    if (cache_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_size must not be negative");
+        return NULL;
+    }
+
+    Py_ssize_t num_entries = PyDict_Size(decode_dict);
+    trie_entry_t* entries = malloc((num_entries ? num_entries : 1) * sizeof(trie_entry_t));
+    if (entries == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate merge entries");
+        return NULL;
+    }
+
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    int entry_idx = 0;
+    int max_length = 0;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        if (!PyBytes_Check(value) || !PyLong_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
+            free(entries);
+            return NULL;
+        }
+        char* token;
+        Py_ssize_t token_length;
+        PyBytes_AsStringAndSize(value, &token, &token_length);
+        long token_id = PyLong_AsLong(key);
+        // Single bytes are the initial symbols, not merges
+        if (token_id < 256 || token_length < 2) continue;
+
+        entries[entry_idx].bytes = (unsigned char*)token;
+        entries[entry_idx].length = (int)token_length;
+        entries[entry_idx].token_id = (int)token_id;
+        entries[entry_idx].order = entry_idx;
+        if (token_length > max_length) max_length = (int)token_length;
+        entry_idx++;
+    }
+    qsort(entries, entry_idx, sizeof(trie_entry_t), trie_entry_id_cmp);
+
+    merge_table_t* table = create_merge_table(entry_idx, cache_size);
+    uint32_t* parts = malloc((max_length ? max_length : 1) * sizeof(uint32_t));
+    if (table == NULL || parts == NULL) {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate merge table");
+        free_merge_table(table);
+        free(parts);
+        free(entries);
+        return NULL;
+    }
+
+    // Only the bytes of each token are stored, so recover the pair that made
+    // it by running the earlier merges over those bytes. A learned token
+    // comes out as exactly two symbols; anything else (the EOS token, or a
+    // duplicate of an earlier token) is not a merge.
+    for (int i = 0; i < entry_idx; i++) {
+        int num_parts = bpe_merge_chunk(table, entries[i].bytes, entries[i].length, parts);
+        if (num_parts < 0) {
+            PyErr_SetString(PyExc_MemoryError, "Failed to allocate merge scratch space");
+            goto error;
+        }
+        if (num_parts == 2 && merge_table_insert(table, parts[0], parts[1], entries[i].token_id) != 0) {
+            PyErr_SetString(PyExc_MemoryError, "Failed to grow merge table");
+            goto error;
+        }
+    }
+    free(parts);
+    free(entries);
+
+    PyObject* merges_capsule = PyCapsule_New(table, "bpe_merges", merges_capsule_destructor);
+    if (merges_capsule == NULL) {
+        free_merge_table(table);
+        return NULL;
+    }
+    return merges_capsule;
+
+error:
+    free_merge_table(table);
+    free(parts);
+    free(entries);
+    return NULL;
+}
+
+static PyObject* encode_merges(PyObject* self, PyObject* args) {
+    PyObject* input_chunks;
+    PyObject* merges_capsule;
+
+    if (!PyArg_ParseTuple(args, "OO", &input_chunks, &merges_capsule)) {
+        return NULL;
+    }
+    if (merges_capsule == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "Merges are None. Tokenizer may not have been trained or a encode dict was not loaded.");
+        return NULL;
+    }
+    merge_table_t* table = PyCapsule_GetPointer(merges_capsule, "bpe_merges");
+    if (!table) {
+        return NULL;
+    }
+    if (!PyList_Check(input_chunks)) {
+        PyErr_SetString(PyExc_TypeError, "Input must be a list of strings");
+        return NULL;
+    }
+
+    Py_ssize_t num_chunks = PyList_GET_SIZE(input_chunks);
+    PyObject* encoded_list = PyList_New(0);
+    if (!encoded_list) return NULL;
+    uint32_t stack_tokens[MERGE_STACK_SIZE];
+    uint32_t* tokens = stack_tokens;
+    Py_ssize_t tokens_capacity = MERGE_STACK_SIZE;
+
+    for (Py_ssize_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
+        PyObject* chunk = PyList_GET_ITEM(input_chunks, chunk_idx);
+        if (!PyUnicode_Check(chunk)) {
+            PyErr_SetString(PyExc_TypeError, "Each chunk must be a string");
+            goto error;
+        }
+        Py_ssize_t text_length;
+        const char* text = PyUnicode_AsUTF8AndSize(chunk, &text_length);
+        if (!text) {
+            goto error;
+        }
+        if (text_length > tokens_capacity) {
+            uint32_t* new_tokens = malloc(text_length * sizeof(uint32_t));
+            if (new_tokens == NULL) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            if (tokens != stack_tokens) free(tokens);
+            tokens = new_tokens;
+            tokens_capacity = text_length;
+        }
+
+        int num_tokens = encode_chunk_merges(table, &table->cache, (const unsigned char*)text, (int)text_length, tokens);
+        if (num_tokens < 0) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (int i = 0; i < num_tokens; i++) {
+            PyObject* token_obj = PyLong_FromUnsignedLong(tokens[i]);
+            if (!token_obj || PyList_Append(encoded_list, token_obj) == -1) {
+                Py_XDECREF(token_obj);
+                goto error;
+            }
+            Py_DECREF(token_obj);
+        }
+    }
+    if (tokens != stack_tokens) free(tokens);
+    return encoded_list;
+
+error:
+    if (tokens != stack_tokens) free(tokens);
+    Py_DECREF(encoded_list);
+    return NULL;
+}
+
+static PyObject* pretokenize(PyObject* self, PyObject* args) {
+    PyObject* input_text;
+
+    if (!PyArg_ParseTuple(args, "U", &input_text)) {
+        return NULL;
+    }
+    Py_ssize_t text_length;
+    const char* text = PyUnicode_AsUTF8AndSize(input_text, &text_length);
+    if (!text) {
+        return NULL;
+    }
+
+    PyObject* chunk_list = PyList_New(0);
+    if (!chunk_list) return NULL;
+
+    Py_ssize_t pos = 0;
+    while (pos < text_length) {
+        Py_ssize_t end = gpt2_next_chunk((const unsigned char*)text, text_length, pos);
+        PyObject* chunk = PyUnicode_DecodeUTF8(text + pos, end - pos, NULL);
+        if (!chunk || PyList_Append(chunk_list, chunk) == -1) {
+            Py_XDECREF(chunk);
+            Py_DECREF(chunk_list);
+            return NULL;
+        }
+        Py_DECREF(chunk);
+        pos = end;
+    }
+    return chunk_list;
+}
+
+// Builds the special token matcher from a dict of token ids to non-empty
+// byte strings
+static PyObject* build_special_tokens(PyObject* self, PyObject* args) {
+    PyObject* special_dict;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &special_dict)) {
+        return NULL;
+    }
+
+    Py_ssize_t num_entries = PyDict_Size(special_dict);
+    trie_entry_t* entries = malloc((num_entries ? num_entries : 1) * sizeof(trie_entry_t));
+    if (entries == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    int entry_idx = 0;
+    while (PyDict_Next(special_dict, &pos, &key, &value)) {
+        if (!PyBytes_Check(value) || !PyLong_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
+            free(entries);
+            return NULL;
+        }
+        long token_id = PyLong_AsLong(key);
+        if (token_id < 0 || token_id >= UINT32_MAX || PyBytes_GET_SIZE(value) == 0) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "Special tokens must be non-empty with 32-bit ids");
+            }
+            free(entries);
+            return NULL;
+        }
+        entries[entry_idx].bytes = (unsigned char*)PyBytes_AS_STRING(value);
+        entries[entry_idx].length = (int)PyBytes_GET_SIZE(value);
+        entries[entry_idx].token_id = (int)token_id;
+        entries[entry_idx].order = entry_idx;
+        entry_idx++;
+    }
+
+    special_tokens_t* special = create_special_tokens(entries, entry_idx);
+    free(entries);
+    if (special == NULL) {
+        return PyErr_NoMemory();
+    }
+    PyObject* special_capsule = PyCapsule_New(special, "bpe_special", special_capsule_destructor);
+    if (special_capsule == NULL) {
+        free_special_tokens(special);
+        return NULL;
+    }
+    return special_capsule;
+}
+
+// Splits text at its special tokens into a list of the text between them
+// and the token ids, for custom patterns to pre-tokenize the text parts
+static PyObject* split_special_tokens(PyObject* self, PyObject* args) {
+    PyObject* input_text;
+    PyObject* special_capsule;
+
+    if (!PyArg_ParseTuple(args, "UO", &input_text, &special_capsule)) {
+        return NULL;
+    }
+    special_tokens_t* special = PyCapsule_GetPointer(special_capsule, "bpe_special");
+    if (!special) return NULL;
+    Py_ssize_t text_length;
+    const char* text = PyUnicode_AsUTF8AndSize(input_text, &text_length);
+    if (!text) return NULL;
+
+    PyObject* pieces = PyList_New(0);
+    if (!pieces) return NULL;
+
+    Py_ssize_t pos = 0;
+    while (pos < text_length) {
+        uint32_t special_length = 0;
+        uint32_t special_id = 0;
+        Py_ssize_t start = pos + find_special_token(special, (const unsigned char*)text + pos, text_length - pos, &special_length, &special_id);
+        if (start > pos) {
+            PyObject* piece = PyUnicode_DecodeUTF8(text + pos, start - pos, NULL);
+            if (!piece || PyList_Append(pieces, piece) == -1) {
+                Py_XDECREF(piece);
+                Py_DECREF(pieces);
+                return NULL;
+            }
+            Py_DECREF(piece);
+        }
+        if (special_length > 0) {
+            PyObject* token_id = PyLong_FromUnsignedLong(special_id);
+            if (!token_id || PyList_Append(pieces, token_id) == -1) {
+                Py_XDECREF(token_id);
+                Py_DECREF(pieces);
+                return NULL;
+            }
+            Py_DECREF(token_id);
+        }
+        pos = start + special_length;
+    }
+    return pieces;
+}
+
+// Merge-order encoding through the table's cache when merges are given,
+// greedy trie encoding otherwise. Special tokens are matched when a
+// special_capsule is given.
+static int get_encoder(PyObject* trie_capsule, PyObject* merges_capsule, PyObject* special_capsule, bpe_encoder_t* encoder) {
+    memset(encoder, 0, sizeof(bpe_encoder_t));
+    if (special_capsule != Py_None) {
+        encoder->special = PyCapsule_GetPointer(special_capsule, "bpe_special");
+        if (!encoder->special) return -1;
+    }
+    if (merges_capsule != Py_None) {
+        encoder->merges = PyCapsule_GetPointer(merges_capsule, "bpe_merges");
+        if (!encoder->merges) return -1;
+        encoder->cache = &encoder->merges->cache;
+        return 0;
+    }
+    if (trie_capsule == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "Trie is None. Tokenizer may not have been trained or a encode dict was not loaded.");
+        return -1;
+    }
+    encoder->trie = PyCapsule_GetPointer(trie_capsule, "bpe_trie");
+    if (!encoder->trie) {
+        PyErr_SetString(PyExc_ValueError, "Invalid trie object");
+        return -1;
+    }
+    return 0;
+}
+
+// With return_spans, returns the tokens together with a uint64 TokenArray
+// of rows (start, end), the UTF-8 byte span of each token in the text. For a
+// list of chunks the spans count through the chunks back to back, a special
+// token id taking its string's length. Eos and padding tokens get an empty
+// span at the end.
+static PyObject* encode_text(PyObject* self, PyObject* args) {
+    PyObject* input;
+    PyObject* trie_capsule;
+    PyObject* merges_capsule = Py_None;
+    int itemsize = 0;
+    int eos_token = -1;
+    Py_ssize_t seq_len = -1;
+    PyObject* special_capsule = Py_None;
+    int return_spans = 0;
+
+    if (!PyArg_ParseTuple(args, "OO|OiinOp", &input, &trie_capsule, &merges_capsule, &itemsize, &eos_token, &seq_len,
+                          &special_capsule, &return_spans)) {
+        return NULL;
+    }
+
+    bpe_encoder_t encoder;
+    if (get_encoder(trie_capsule, merges_capsule, special_capsule, &encoder) != 0) {
+        return NULL;
+    }
+    if (return_spans && encoder.merges != NULL && merge_table_token_lengths(encoder.merges) != 0) {
+        if (errno == EINVAL) {
+            PyErr_SetString(PyExc_ValueError, "Merge table has a pair that does not precede its token");
+            return NULL;
+        }
+        return PyErr_NoMemory();
+    }
+
+    token_buffer_t buffer = {0};
+    buffer.with_spans = return_spans;
+    if (PyUnicode_Check(input)) {
+        Py_ssize_t text_length;
+        const char* text = PyUnicode_AsUTF8AndSize(input, &text_length);
+        if (!text) {
+            return NULL;
+        }
+        if (encode_text_tokens(&encoder, (const unsigned char*)text, text_length, &buffer) != 0) {
+            goto nomemory;
+        }
+    }
+    else if (PyList_Check(input)) {
+        // Chunks already split by a custom pattern, and the ids of the
+        // special tokens between them
+        uint64_t pos = 0;
+        for (Py_ssize_t chunk_idx = 0; chunk_idx < PyList_GET_SIZE(input); chunk_idx++) {
+            PyObject* chunk = PyList_GET_ITEM(input, chunk_idx);
+            if (PyLong_Check(chunk)) {
+                Py_ssize_t token_id = PyLong_AsSsize_t(chunk);
+                if (token_id < 0 || token_id > UINT32_MAX) {
+                    if (!PyErr_Occurred()) {
+                        PyErr_SetString(PyExc_ValueError, "Token ids must fit in 32 bits");
+                    }
+                    goto error;
+                }
+                if (token_buffer_reserve(&buffer, 1) != 0) {
+                    goto nomemory;
+                }
+                if (return_spans) {
+                    buffer.spans[buffer.size * 2] = pos;
+                    pos += encoder.special ? special_token_length(encoder.special, (uint32_t)token_id) : 0;
+                    buffer.spans[buffer.size * 2 + 1] = pos;
+                }
+                buffer.tokens[buffer.size++] = (uint32_t)token_id;
+                continue;
+            }
+            if (!PyUnicode_Check(chunk)) {
+                PyErr_SetString(PyExc_TypeError, "Each chunk must be a string or a token id");
                 goto error;
             }
-            if (PyList_Append(token_list, py_value) == -1) 
-            {
-                PyErr_SetString(PyExc_MemoryError, "Failed to append value to result list\n");
-                Py_DECREF(token_list);
-                Py_DECREF(py_value);
+            Py_ssize_t text_length;
+            const char* text = PyUnicode_AsUTF8AndSize(chunk, &text_length);
+            if (!text) {
                 goto error;
             }
-            Py_DECREF(py_value);
+            int status = return_spans ? encode_chunk_spans(&encoder, (const unsigned char*)text, (int)text_length, pos, &buffer)
+                                      : encode_chunk_tokens(&encoder, (const unsigned char*)text, (int)text_length, &buffer);
+            if (status != 0) {
+                goto nomemory;
+            }
+            pos += text_length;
         }
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "Input must be a string or a list of strings");
+        return NULL;
+    }
 
-        if (PyList_Append(token_output, token_list) == -1) 
-        {
-            PyErr_SetString(PyExc_MemoryError, "Failed to append result list to token list\n");
-            Py_DECREF(token_list);
-            goto error;
+    if (finish_token_buffer(&buffer, eos_token, seq_len) != 0) {
+        goto nomemory;
+    }
+    if (!return_spans) {
+        return tokens_to_python(&buffer, itemsize);
+    }
+
+    // The spans array takes over their memory, less the unused capacity,
+    // before the tokens are handed on
+    uint64_t* spans = buffer.spans;
+    size_t num_spans = buffer.size;
+    buffer.spans = NULL;
+    if (spans == NULL) {
+        spans = malloc(2 * sizeof(uint64_t));
+        if (spans == NULL) goto nomemory;
+    }
+    else if (num_spans > 0 && num_spans < buffer.capacity) {
+        uint64_t* shrunk = realloc(spans, num_spans * 2 * sizeof(uint64_t));
+        if (shrunk != NULL) spans = shrunk;
+    }
+    PyObject* span_array = new_token_array(spans, num_spans * 2, sizeof(uint64_t));
+    if (!span_array) goto error;
+    ((TokenArrayObject*)span_array)->row_length = 2;
+    PyObject* tokens = tokens_to_python(&buffer, itemsize);
+    if (!tokens) {
+        Py_DECREF(span_array);
+        return NULL;
+    }
+    PyObject* result = PyTuple_Pack(2, tokens, span_array);
+    Py_DECREF(tokens);
+    Py_DECREF(span_array);
+    return result;
+
+nomemory:
+    PyErr_NoMemory();
+error:
+    free_token_buffer(&buffer);
+    return NULL;
+}
+
+// Returns len(encode_text(...)) for the same arguments without building the
+// tokens. Greedy trie counting of a str releases the GIL, merge-order
+// counting shares the table's cache and keeps it.
+static PyObject* count_tokens(PyObject* self, PyObject* args) {
+    PyObject* input;
+    PyObject* trie_capsule;
+    PyObject* merges_capsule = Py_None;
+    int eos_token = -1;
+    PyObject* special_capsule = Py_None;
+
+    if (!PyArg_ParseTuple(args, "OO|OiO", &input, &trie_capsule, &merges_capsule, &eos_token, &special_capsule)) {
+        return NULL;
+    }
+
+    bpe_encoder_t encoder;
+    if (get_encoder(trie_capsule, merges_capsule, special_capsule, &encoder) != 0) {
+        return NULL;
+    }
+
+    token_buffer_t scratch = {0};
+    size_t count = eos_token >= 0;
+    int status = 0;
+    if (PyUnicode_Check(input)) {
+        Py_ssize_t text_length;
+        const char* text = PyUnicode_AsUTF8AndSize(input, &text_length);
+        if (!text) {
+            return NULL;
+        }
+        if (encoder.merges == NULL) {
+            Py_BEGIN_ALLOW_THREADS
+            status = count_text_tokens(&encoder, (const unsigned char*)text, text_length, &scratch, &count);
+            Py_END_ALLOW_THREADS
+        }
+        else {
+            status = count_text_tokens(&encoder, (const unsigned char*)text, text_length, &scratch, &count);
+        }
+    }
+    else if (PyList_Check(input)) {
+        for (Py_ssize_t chunk_idx = 0; status == 0 && chunk_idx < PyList_GET_SIZE(input); chunk_idx++) {
+            PyObject* chunk = PyList_GET_ITEM(input, chunk_idx);
+            if (PyLong_Check(chunk)) {
+                count++;
+                continue;
+            }
+            if (!PyUnicode_Check(chunk)) {
+                PyErr_SetString(PyExc_TypeError, "Each chunk must be a string or a token id");
+                free_token_buffer(&scratch);
+                return NULL;
+            }
+            Py_ssize_t text_length;
+            const char* text = PyUnicode_AsUTF8AndSize(chunk, &text_length);
+            if (!text) {
+                free_token_buffer(&scratch);
+                return NULL;
+            }
+            status = count_chunk_tokens(&encoder, (const unsigned char*)text, (int)text_length, &scratch, &count);
         }
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "Input must be a string or a list of strings");
+        return NULL;
+    }
 
-        Py_DECREF(token_list);
+    free_token_buffer(&scratch);
+    if (status != 0) {
+        return PyErr_NoMemory();
+    }
+    return PyLong_FromSize_t(count);
+}
+
+static int encode_session_init(EncodeSessionObject* self, PyObject* args, PyObject* kwds) {
+    PyObject* trie_capsule;
+    PyObject* merges_capsule = Py_None;
+    PyObject* owner = Py_None;
+    PyObject* special_capsule = Py_None;
+    static char* kwlist[] = {"trie", "merges", "owner", "special", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOO", kwlist, &trie_capsule, &merges_capsule, &owner, &special_capsule)) {
+        return -1;
+    }
+    if (get_encoder(trie_capsule, merges_capsule, special_capsule, &self->encoder) != 0) {
+        return -1;
+    }
+    // The capsules free what they hold once the last reference is gone
+    PyObject* owned = PyTuple_Pack(4, trie_capsule, merges_capsule, owner, special_capsule);
+    if (!owned) return -1;
+    Py_XSETREF(self->owner, owned);
+    self->tokens.size = 0;
+    self->stable_tokens = 0;
+    self->tail_length = 0;
+    return 0;
+}
+
+static void encode_session_dealloc(EncodeSessionObject* self) {
+    Py_XDECREF(self->owner);
+    free_token_buffer(&self->tokens);
+    free(self->tail);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* encode_session_append(EncodeSessionObject* self, PyObject* text_obj) {
+    if (self->owner == NULL) {
+        PyErr_SetString(PyExc_ValueError, "EncodeSession is not initialized");
+        return NULL;
+    }
+    if (!PyUnicode_Check(text_obj)) {
+        PyErr_SetString(PyExc_ValueError, "Input text must be a string");
+        return NULL;
+    }
+    Py_ssize_t text_length;
+    const char* text = PyUnicode_AsUTF8AndSize(text_obj, &text_length);
+    if (!text) return NULL;
+
+    size_t first_changed = self->stable_tokens;
+    if (text_length == 0) {
+        return PyLong_FromSize_t(self->tokens.size);
+    }
+    if (self->tail_length + text_length > self->tail_capacity) {
+        size_t new_capacity = (self->tail_length + text_length) * 2;
+        unsigned char* new_tail = realloc(self->tail, new_capacity);
+        if (new_tail == NULL) return PyErr_NoMemory();
+        self->tail = new_tail;
+        self->tail_capacity = new_capacity;
+    }
+    memcpy(self->tail + self->tail_length, text, text_length);
+    self->tail_length += text_length;
+
+    // Re-encode the tail chunk by chunk, a special token being a chunk of
+    // its own. A special token completed by later text starts at or after
+    // keep_limit, and ends the text before it there, which like the end of
+    // the text can change the two chunks before it. So keep the chunk
+    // before the one holding the byte before keep_limit, which without
+    // special tokens is the second to last.
+    const special_tokens_t* special = self->encoder.special;
+    size_t reach = special != NULL && special->max_length > 0 ? special->max_length - 1 : 0;
+    size_t keep_limit = self->tail_length > reach ? self->tail_length - reach : 0;
+    self->tokens.size = self->stable_tokens;
+    size_t start = 0;
+    size_t start_tokens = self->stable_tokens;
+    size_t keep = 0;
+    size_t keep_tokens = self->stable_tokens;
+    uint32_t special_length = 0;
+    uint32_t special_id = 0;
+    Py_ssize_t special_start = self->tail_length;
+    if (special != NULL) {
+        special_start = find_special_token(special, self->tail, self->tail_length, &special_length, &special_id);
+    }
+    Py_ssize_t pos = 0;
+    while (pos < (Py_ssize_t)self->tail_length) {
+        if ((size_t)pos < keep_limit) {
+            keep = start;
+            keep_tokens = start_tokens;
+        }
+        start = pos;
+        start_tokens = self->tokens.size;
+        if (pos == special_start) {
+            if (token_buffer_reserve(&self->tokens, 1) != 0) {
+                goto nomemory;
+            }
+            self->tokens.tokens[self->tokens.size++] = special_id;
+            pos += special_length;
+            special_start = pos + find_special_token(special, self->tail + pos, self->tail_length - pos, &special_length, &special_id);
+            continue;
+        }
+        Py_ssize_t end = gpt2_next_chunk(self->tail, special_start, pos);
+        if (encode_chunk_tokens(&self->encoder, self->tail + pos, (int)(end - pos), &self->tokens) != 0) {
+            goto nomemory;
+        }
+        pos = end;
+    }
+
+    memmove(self->tail, self->tail + keep, self->tail_length - keep);
+    self->tail_length -= keep;
+    self->stable_tokens = keep_tokens;
+    return PyLong_FromSize_t(first_changed);
+
+nomemory:
+    // Leave the session as it was before the call
+    self->tail_length -= text_length;
+    self->tokens.size = self->stable_tokens;
+    return PyErr_NoMemory();
+}
+
+static PyObject* encode_session_tokens(EncodeSessionObject* self, PyObject* args) {
+    int itemsize = 0;
+
+    if (!PyArg_ParseTuple(args, "|i", &itemsize)) {
+        return NULL;
+    }
+    token_buffer_t copy = {0};
+    if (token_buffer_reserve(&copy, self->tokens.size) != 0) {
+        return PyErr_NoMemory();
+    }
+    if (self->tokens.size > 0) {
+        memcpy(copy.tokens, self->tokens.tokens, self->tokens.size * sizeof(uint32_t));
+    }
+    copy.size = self->tokens.size;
+    return tokens_to_python(&copy, itemsize);
+}
+
+static PyObject* encode_session_reset(EncodeSessionObject* self, PyObject* Py_UNUSED(ignored)) {
+    self->tokens.size = 0;
+    self->stable_tokens = 0;
+    self->tail_length = 0;
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t encode_session_length(EncodeSessionObject* self) {
+    return self->tokens.size;
+}
+
+static PySequenceMethods encode_session_as_sequence = {
+    .sq_length = (lenfunc)encode_session_length,
+};
+
+static PyMethodDef encode_session_methods[] = {
+    {"append", (PyCFunction)encode_session_append, METH_O, "Append text and return the index of the first token that may have changed."},
+    {"tokens", (PyCFunction)encode_session_tokens, METH_VARARGS, "Copy the tokens of all text so far into a list (itemsize 0) or a TokenArray."},
+    {"reset", (PyCFunction)encode_session_reset, METH_NOARGS, "Start over with no text."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject EncodeSessionType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_bpe.EncodeSession",
+    .tp_doc = "EncodeSession(trie, merges=None, owner=None, special=None)\n\nEncodes append-only text, re-encoding only its last chunks on each append.",
+    .tp_basicsize = sizeof(EncodeSessionObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)encode_session_init,
+    .tp_dealloc = (destructor)encode_session_dealloc,
+    .tp_as_sequence = &encode_session_as_sequence,
+    .tp_methods = encode_session_methods,
+};
+
+// Allocates the arrays of a batch job over texts, a list of str or chunk
+// lists, for threads threads, and captures the UTF-8 buffer of every piece.
+// Returns -1 with a Python error set, free_batch_job cleans up either way.
+static int init_batch_job(encode_batch_job_t* job, PyObject* texts, const bpe_encoder_t* encoder, int num_threads, int eos_token) {
+    memset(job, 0, sizeof(encode_batch_job_t));
+    job->trie = encoder->trie;
+    job->merges = encoder->merges;
+    job->special = encoder->special;
+    job->eos_token = eos_token;
+    atomic_init(&job->next_doc, 0);
+    atomic_init(&job->failed, 0);
+
+    // Count the pieces first so every array is allocated once
+    Py_ssize_t num_docs = PyList_GET_SIZE(texts);
+    Py_ssize_t num_pieces = 0;
+    for (Py_ssize_t i = 0; i < num_docs; i++) {
+        PyObject* doc = PyList_GET_ITEM(texts, i);
+        if (PyUnicode_Check(doc)) {
+            num_pieces++;
+        }
+        else if (PyList_Check(doc)) {
+            num_pieces += PyList_GET_SIZE(doc);
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError, "Each text must be a string or a list of strings");
+            return -1;
+        }
+    }
+
+    job->num_docs = num_docs;
+    job->num_threads = num_threads < num_docs ? num_threads : (num_docs > 0 ? (int)num_docs : 1);
+    job->owners = calloc(num_pieces ? num_pieces : 1, sizeof(PyObject*));
+    job->pieces = malloc((num_pieces ? num_pieces : 1) * sizeof(unsigned char*));
+    job->piece_lengths = malloc((num_pieces ? num_pieces : 1) * sizeof(Py_ssize_t));
+    job->doc_pieces = malloc((num_docs + 1) * sizeof(Py_ssize_t));
+    job->doc_split = malloc(num_docs ? num_docs : 1);
+    job->doc_thread = malloc((num_docs ? num_docs : 1) * sizeof(int));
+    job->doc_start = malloc((num_docs ? num_docs : 1) * sizeof(size_t));
+    job->doc_length = malloc((num_docs ? num_docs : 1) * sizeof(size_t));
+    job->buffers = calloc(job->num_threads, sizeof(token_buffer_t));
+    job->caches = calloc(job->num_threads, sizeof(encode_cache_t));
+    if (!job->owners || !job->pieces || !job->piece_lengths || !job->doc_pieces || !job->doc_split ||
+        !job->doc_thread || !job->doc_start || !job->doc_length || !job->buffers || !job->caches) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (int i = 0; job->merges && i < job->num_threads; i++) {
+        if (init_encode_cache(&job->caches[i], job->merges->cache.capacity) != 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    // Hold a reference to every string whose UTF-8 buffer is borrowed, in
+    // case the lists are changed while the GIL is released. No Python code
+    // runs between the two passes, so the counts still hold.
+    Py_ssize_t piece_idx = 0;
+    for (Py_ssize_t i = 0; i < num_docs; i++) {
+        PyObject* doc = PyList_GET_ITEM(texts, i);
+        job->doc_pieces[i] = piece_idx;
+        job->doc_split[i] = PyUnicode_Check(doc);
+        Py_ssize_t doc_size = job->doc_split[i] ? 1 : PyList_GET_SIZE(doc);
+        for (Py_ssize_t j = 0; j < doc_size; j++) {
+            PyObject* piece = job->doc_split[i] ? doc : PyList_GET_ITEM(doc, j);
+            if (PyLong_Check(piece)) {
+                job->piece_lengths[piece_idx] = PyLong_AsSsize_t(piece);
+                if (job->piece_lengths[piece_idx] < 0 || job->piece_lengths[piece_idx] > UINT32_MAX) {
+                    if (!PyErr_Occurred()) {
+                        PyErr_SetString(PyExc_ValueError, "Token ids must fit in 32 bits");
+                    }
+                    return -1;
+                }
+                job->pieces[piece_idx++] = NULL;
+                continue;
+            }
+            if (!PyUnicode_Check(piece)) {
+                PyErr_SetString(PyExc_TypeError, "Each chunk must be a string or a token id");
+                return -1;
+            }
+            const char* text = PyUnicode_AsUTF8AndSize(piece, &job->piece_lengths[piece_idx]);
+            if (!text) {
+                return -1;
+            }
+            Py_INCREF(piece);
+            job->owners[job->num_owned++] = piece;
+            job->pieces[piece_idx++] = (const unsigned char*)text;
+        }
+    }
+    job->doc_pieces[num_docs] = piece_idx;
+    return 0;
+}
+
+// Runs the job on its threads, without the GIL. Returns -1 if the threads
+// could not be started.
+static int run_batch_job(encode_batch_job_t* job) {
+    train_job_fn worker = job->count_only ? count_batch_worker : encode_batch_worker;
+    if (job->num_threads == 1) {
+        worker(job, 0, 1);
+        return 0;
+    }
+    train_pool_t* pool = create_train_pool(job->num_threads);
+    if (pool == NULL) {
+        return -1;
+    }
+    train_pool_run(pool, worker, job);
+    free_train_pool(pool);
+    return 0;
+}
+
+static void free_batch_job(encode_batch_job_t* job) {
+    for (Py_ssize_t i = 0; i < job->num_owned; i++) {
+        Py_DECREF(job->owners[i]);
+    }
+    for (int i = 0; job->buffers && job->caches && i < job->num_threads; i++) {
+        free_token_buffer(&job->buffers[i]);
+        free_encode_cache(&job->caches[i]);
+    }
+    free(job->owners);
+    free(job->pieces);
+    free(job->piece_lengths);
+    free(job->doc_pieces);
+    free(job->doc_split);
+    free(job->doc_thread);
+    free(job->doc_start);
+    free(job->doc_length);
+    free(job->buffers);
+    free(job->caches);
+}
+
+// Encodes every text followed by eos_token. Returns the tokens and uint64
+// offsets of each text, or with a seq_len the tokens as rows of seq_len:
+// one row per text, truncated and padded with eos_token, together with the
+// uint64 number of tokens in each row that are not padding, the text's eos
+// included, so an empty text counts 1. With pack, the texts run on
+// across rows and only the last row is padded, the offsets say where each
+// text starts.
+static PyObject* encode_batch(PyObject* self, PyObject* args) {
+    PyObject* texts;
+    PyObject* trie_capsule;
+    PyObject* merges_capsule;
+    int num_threads;
+    int itemsize;
+    int eos_token = -1;
+    Py_ssize_t seq_len = -1;
+    int pack = 0;
+    PyObject* special_capsule = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O!OOii|inpO", &PyList_Type, &texts, &trie_capsule, &merges_capsule, &num_threads, &itemsize,
+                          &eos_token, &seq_len, &pack, &special_capsule)) {
+        return NULL;
+    }
+    if (num_threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be a positive integer");
+        return NULL;
+    }
+    if (itemsize != 2 && itemsize != 4) {
+        PyErr_SetString(PyExc_ValueError, "itemsize must be 2 or 4");
+        return NULL;
+    }
+    if (seq_len == 0 || seq_len < -1 || (seq_len > 0 && eos_token < 0) || (pack && seq_len < 0)) {
+        PyErr_SetString(PyExc_ValueError, "seq_len must be positive and needs an eos token, pack needs a seq_len");
+        return NULL;
+    }
+    bpe_encoder_t encoder;
+    if (get_encoder(trie_capsule, merges_capsule, special_capsule, &encoder) != 0) {
+        return NULL;
+    }
+
+    encode_batch_job_t job;
+    void* tokens = NULL;
+    uint64_t* offsets = NULL;
+    int pool_failed = 0;
+    int overflow = 0;
+    size_t total = 0;
+    size_t size = 0;
+    size_t num_rows = 0;
+    size_t num_offsets = 0;
+    PyObject* token_array = NULL;
+    PyObject* offset_array = NULL;
+    PyObject* result = NULL;
+
+    if (init_batch_job(&job, texts, &encoder, num_threads, eos_token) != 0) {
+        goto cleanup;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pool_failed = run_batch_job(&job) != 0;
+
+    // Lay the documents out in input order
+    if (!pool_failed && !atomic_load(&job.failed)) {
+        for (size_t i = 0; i < job.num_docs; i++) {
+            total += job.doc_length[i];
+        }
+        // Rows of seq_len hold one document each, or when packed all of them
+        // back to back with only the last row padded
+        int too_large = 0;
+        if (seq_len > 0) {
+            num_rows = pack ? (total + seq_len - 1) / seq_len : job.num_docs;
+            too_large = num_rows > SIZE_MAX / itemsize / seq_len;
+            size = too_large ? 0 : num_rows * seq_len;
+        }
+        else {
+            size = total;
+        }
+        num_offsets = seq_len > 0 && !pack ? num_rows : job.num_docs + 1;
+        tokens = too_large ? NULL : malloc((size ? size : 1) * itemsize);
+        offsets = malloc((num_offsets ? num_offsets : 1) * sizeof(uint64_t));
+        if (tokens != NULL && offsets != NULL && seq_len > 0 && !pack) {
+            for (size_t i = 0; i < job.num_docs && !overflow; i++) {
+                token_buffer_t* buffer = &job.buffers[job.doc_thread[i]];
+                size_t length = job.doc_length[i] < (size_t)seq_len ? job.doc_length[i] : (size_t)seq_len;
+                char* row = (char*)tokens + i * seq_len * itemsize;
+                overflow = store_tokens(row, buffer->tokens + job.doc_start[i], length, itemsize) != 0;
+                fill_tokens(row + length * itemsize, eos_token, seq_len - length, itemsize);
+                offsets[i] = length;
+            }
+        }
+        else if (tokens != NULL && offsets != NULL) {
+            offsets[0] = 0;
+            for (size_t i = 0; i < job.num_docs && !overflow; i++) {
+                token_buffer_t* buffer = &job.buffers[job.doc_thread[i]];
+                overflow = store_tokens((char*)tokens + offsets[i] * itemsize, buffer->tokens + job.doc_start[i], job.doc_length[i], itemsize) != 0;
+                offsets[i + 1] = offsets[i] + job.doc_length[i];
+            }
+            fill_tokens((char*)tokens + total * itemsize, eos_token, size - total, itemsize);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    if (pool_failed) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to start encoding threads");
+        goto cleanup;
+    }
+    if (atomic_load(&job.failed) || tokens == NULL || offsets == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    if (overflow) {
+        PyErr_SetString(PyExc_OverflowError, "Token id does not fit in 2 bytes");
+        goto cleanup;
+    }
+
+    token_array = new_token_array(tokens, size, itemsize);
+    tokens = NULL;
+    if (!token_array) goto cleanup;
+    if (seq_len > 0) {
+        ((TokenArrayObject*)token_array)->row_length = seq_len;
+    }
+    offset_array = new_token_array(offsets, num_offsets, sizeof(uint64_t));
+    offsets = NULL;
+    if (!offset_array) goto cleanup;
+    result = PyTuple_Pack(2, token_array, offset_array);
+
+cleanup:
+    Py_XDECREF(token_array);
+    Py_XDECREF(offset_array);
+    free(tokens);
+    free(offsets);
+    free_batch_job(&job);
+    return result;
+}
+
+// Counts the tokens encode_batch would give each text, eos_token included,
+// on several threads without the GIL. Returns a uint64 TokenArray of counts.
+static PyObject* count_tokens_batch(PyObject* self, PyObject* args) {
+    PyObject* texts;
+    PyObject* trie_capsule;
+    PyObject* merges_capsule;
+    int num_threads;
+    int eos_token = -1;
+    PyObject* special_capsule = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O!OOi|iO", &PyList_Type, &texts, &trie_capsule, &merges_capsule, &num_threads,
+                          &eos_token, &special_capsule)) {
+        return NULL;
+    }
+    if (num_threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be a positive integer");
+        return NULL;
+    }
+    bpe_encoder_t encoder;
+    if (get_encoder(trie_capsule, merges_capsule, special_capsule, &encoder) != 0) {
+        return NULL;
+    }
+
+    encode_batch_job_t job;
+    uint64_t* counts = NULL;
+    int pool_failed = 0;
+    PyObject* result = NULL;
+
+    if (init_batch_job(&job, texts, &encoder, num_threads, eos_token) != 0) {
+        goto cleanup;
+    }
+    job.count_only = 1;
+
+    Py_BEGIN_ALLOW_THREADS
+    pool_failed = run_batch_job(&job) != 0;
+    Py_END_ALLOW_THREADS
+
+    if (pool_failed) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to start encoding threads");
+        goto cleanup;
+    }
+    counts = malloc((job.num_docs ? job.num_docs : 1) * sizeof(uint64_t));
+    if (atomic_load(&job.failed) || counts == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (size_t i = 0; i < job.num_docs; i++) {
+        counts[i] = job.doc_length[i];
+    }
+    result = new_token_array(counts, job.num_docs, sizeof(uint64_t));
+    counts = NULL;
+
+cleanup:
+    free(counts);
+    free_batch_job(&job);
+    return result;
+}
+
+// Encodes files straight to token shards without the GIL. Documents are
+// split at separator (each file is one when it is None) and written with an
+// eos token after each. Returns the paths of the .bin shards, each with an
+// .idx of uint64 document offsets next to it.
+static PyObject* encode_files(PyObject* self, PyObject* args) {
+    PyObject* paths;
+    const char* output_prefix;
+    PyObject* trie_capsule;
+    PyObject* merges_capsule;
+    int num_threads;
+    int itemsize;
+    int eos_token;
+    const char* separator = NULL;
+    Py_ssize_t separator_length = 0;
+    unsigned long long shard_tokens = 0;
+    PyObject* special_capsule = Py_None;
+
+    if (!PyArg_ParseTuple(args, "O!sOOiii|z#KO", &PyList_Type, &paths, &output_prefix, &trie_capsule, &merges_capsule,
+                          &num_threads, &itemsize, &eos_token, &separator, &separator_length, &shard_tokens, &special_capsule)) {
+        return NULL;
+    }
+    if (num_threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be a positive integer");
+        return NULL;
+    }
+    if (itemsize != 2 && itemsize != 4) {
+        PyErr_SetString(PyExc_ValueError, "itemsize must be 2 or 4");
+        return NULL;
+    }
+    if (separator != NULL && separator_length == 0) {
+        PyErr_SetString(PyExc_ValueError, "separator must not be empty");
+        return NULL;
+    }
+    bpe_encoder_t encoder;
+    if (get_encoder(trie_capsule, merges_capsule, special_capsule, &encoder) != 0) {
+        return NULL;
+    }
+
+    // Thread 0 writes, the others encode
+    int threads = num_threads + 1;
+    Py_ssize_t num_files = PyList_GET_SIZE(paths);
+    encode_files_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.num_inputs = num_files;
+    job.separator = (const unsigned char*)separator;
+    job.separator_length = separator_length;
+    job.trie = encoder.trie;
+    job.merges = encoder.merges;
+    job.special = encoder.special;
+    job.eos_token = eos_token;
+    job.itemsize = itemsize;
+    job.output_prefix = output_prefix;
+    job.shard_tokens = shard_tokens;
+    job.num_blocks = 2 * (size_t)num_threads;
+    job.doc_end = SIZE_MAX;
+    job.inputs = calloc(num_files > 0 ? num_files : 1, sizeof(bpe_mapping_t*));
+    job.blocks = calloc(job.num_blocks, sizeof(encode_block_t));
+    job.caches = calloc(threads, sizeof(encode_cache_t));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    int pool_failed = 0;
+    PyObject* result = NULL;
+
+    if (!job.inputs || !job.blocks || !job.caches) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (int i = 0; job.merges && i < threads; i++) {
+        if (init_encode_cache(&job.caches[i], job.merges->cache.capacity) != 0) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+    }
+    for (Py_ssize_t i = 0; i < num_files; i++) {
+        PyObject* encoded = NULL;
+        if (!PyUnicode_FSConverter(PyList_GET_ITEM(paths, i), &encoded)) {
+            goto cleanup;
+        }
+        const char* path = PyBytes_AS_STRING(encoded);
+        struct stat st;
+        if (stat(path, &st) == 0 && st.st_size == 0) {
+            Py_DECREF(encoded);
+            continue;
+        }
+        job.inputs[i] = map_file(path);
+        if (job.inputs[i] == NULL) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            Py_DECREF(encoded);
+            goto cleanup;
+        }
+        Py_DECREF(encoded);
+        madvise(job.inputs[i]->data, job.inputs[i]->length, MADV_SEQUENTIAL);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    train_pool_t* pool = create_train_pool(threads);
+    if (pool == NULL) {
+        pool_failed = 1;
+    }
+    else {
+        train_pool_run(pool, encode_files_worker, &job);
+        free_train_pool(pool);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (pool_failed) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to start encoding threads");
+        goto cleanup;
+    }
+    if (job.failed == ENOMEM) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    if (job.failed == ERANGE) {
+        PyErr_SetString(PyExc_OverflowError, "Token id does not fit in 2 bytes");
+        goto cleanup;
+    }
+    if (job.failed) {
+        errno = job.failed;
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, job.num_shards > 0 ? job.shard_paths[job.num_shards - 1] : output_prefix);
+        goto cleanup;
+    }
+
+    result = PyList_New(job.num_shards);
+    for (size_t i = 0; result && i < job.num_shards; i++) {
+        PyObject* path = PyUnicode_DecodeFSDefault(job.shard_paths[i]);
+        if (!path) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, path);
+    }
+
+cleanup:
+    for (size_t i = 0; i < job.num_shards; i++) {
+        // Shards of a failed run are incomplete, remove them
+        if (result == NULL) {
+            char* path = job.shard_paths[i];
+            unlink(path);
+            memcpy(path + strlen(path) - 4, ".idx", 4);
+            unlink(path);
+        }
+        free(job.shard_paths[i]);
+    }
+    free(job.shard_paths);
+    for (size_t i = 0; job.blocks && i < job.num_blocks; i++) {
+        free(job.blocks[i].pieces);
+        free(job.blocks[i].doc_ends);
+        free_token_buffer(&job.blocks[i].tokens);
+    }
+    for (int i = 0; job.caches && i < threads; i++) {
+        free_encode_cache(&job.caches[i]);
+    }
+    for (Py_ssize_t i = 0; job.inputs && i < num_files; i++) {
+        release_mapping(job.inputs[i]);
+    }
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    free(job.inputs);
+    free(job.blocks);
+    free(job.caches);
+    return result;
+}
+
+static void vocab_capsule_destructor(PyObject *capsule)
+{
+    vocab_t* vocab = PyCapsule_GetPointer(capsule, "bpe_vocab");
+    free_vocab(vocab);
+}
+
+static PyObject* build_vocab(PyObject* self, PyObject* args) {
+    PyObject* decode_dict;
+
+    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &decode_dict)) {
+        return NULL;
+    }
+
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long max_id = -1;
+    uint64_t pool_length = 0;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        if (!PyBytes_Check(value) || !PyLong_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
+            return NULL;
+        }
+        long token_id = PyLong_AsLong(key);
+        if (token_id < 0 || token_id >= UINT32_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Token ids must fit in 32 bits");
+            return NULL;
+        }
+        if (token_id > max_id) max_id = token_id;
+        pool_length += PyBytes_GET_SIZE(value);
+    }
+
+    // One allocation: the header, the offsets, then the pool
+    uint64_t num_ids = max_id + 1;
+    vocab_t* vocab = malloc(sizeof(vocab_t) + (num_ids + 1) * sizeof(uint64_t) + pool_length);
+    if (vocab == NULL) {
+        return PyErr_NoMemory();
+    }
+    uint64_t* offsets = (uint64_t*)(vocab + 1);
+    unsigned char* pool = (unsigned char*)(offsets + num_ids + 1);
+    memset(offsets, 0, (num_ids + 1) * sizeof(uint64_t));
+    pos = 0;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        offsets[PyLong_AsLong(key) + 1] = PyBytes_GET_SIZE(value);
+    }
+    for (uint64_t i = 0; i < num_ids; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    pos = 0;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        memcpy(pool + offsets[PyLong_AsLong(key)], PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value));
     }
+    vocab->num_ids = num_ids;
+    vocab->offsets = offsets;
+    vocab->pool = pool;
+    vocab->mapping = NULL;
 
-    cleanup_train_resources(text_table, text_table_len, bigram_table, token_table, token_idx_start, token_idx_end, token);
-    return token_output;
-
-error:
-    cleanup_train_resources(text_table, text_table_len, bigram_table, token_table, token_idx_start, token_idx_end, token);
-    Py_XDECREF(token_output);
-    return NULL;
+    PyObject* vocab_capsule = PyCapsule_New(vocab, "bpe_vocab", vocab_capsule_destructor);
+    if (vocab_capsule == NULL) {
+        free_vocab(vocab);
+        return NULL;
+    }
+    return vocab_capsule;
 }
 
-static PyObject* build_trie(PyObject* self, PyObject* args) {
-    PyObject* decode_dict;
+static int open_token_source(PyObject* tokens, token_source_t* source) {
+    memset(source, 0, sizeof(token_source_t));
+    if (PyList_Check(tokens)) {
+        source->list = tokens;
+        source->length = PyList_GET_SIZE(tokens);
+        return 0;
+    }
+    if (!PyObject_CheckBuffer(tokens) || PyObject_GetBuffer(tokens, &source->view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError, "Input must be a list of integers or a buffer of token ids");
+        return -1;
+    }
 
-    if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &decode_dict)) {
-        return NULL;
+    // Native byte order only, e.g. "H", "=I" or "<q" on a little-endian machine
+    const char* format = source->view.format ? source->view.format : "B";
+    const uint16_t byte_order = 1;
+    int little_endian = *(const unsigned char*)&byte_order == 1;
+    if (*format == '@' || *format == '=' || (*format == '<' && little_endian) || ((*format == '>' || *format == '!') && !little_endian)) {
+        format++;
+    }
+    Py_ssize_t itemsize = source->view.itemsize;
+    if (format[0] == '\0' || format[1] != '\0' || strchr("bBhHiIlLqQnN", format[0]) == NULL ||
+        (itemsize != 1 && itemsize != 2 && itemsize != 4 && itemsize != 8)) {
+        PyBuffer_Release(&source->view);
+        PyErr_SetString(PyExc_ValueError, "Token buffer must hold integers");
+        return -1;
     }
+    source->is_signed = strchr("bhilqn", format[0]) != NULL;
+    source->length = source->view.len / itemsize;
+    return 0;
+}
 
-    Trie* trie = create_trie();
+// Returns -1 with an exception set if the item is not an integer
+static int token_source_get(token_source_t* source, Py_ssize_t index, long long* token_id) {
+    if (source->list) {
+        // Only real ints, so no Python code can run and change the list
+        PyObject* item = PyList_GET_ITEM(source->list, index);
+        if (!PyLong_Check(item)) {
+            PyErr_SetString(PyExc_ValueError, "Input must be a list of integers");
+            return -1;
+        }
+        int overflow;
+        *token_id = PyLong_AsLongLongAndOverflow(item, &overflow);
+        if (overflow) {
+            *token_id = overflow > 0 ? LLONG_MAX : LLONG_MIN;
+        }
+        return 0;
+    }
+    const char* item = (const char*)source->view.buf + index * source->view.itemsize;
+    switch (source->view.itemsize) {
+        case 1: *token_id = source->is_signed ? (long long)*(const int8_t*)item : (long long)*(const uint8_t*)item; break;
+        case 2: *token_id = source->is_signed ? (long long)*(const int16_t*)item : (long long)*(const uint16_t*)item; break;
+        case 4: *token_id = source->is_signed ? (long long)*(const int32_t*)item : (long long)*(const uint32_t*)item; break;
+        // Anything past INT64_MAX is out of range either way
+        default: *token_id = source->is_signed ? (long long)*(const int64_t*)item :
+                 *(const uint64_t*)item > INT64_MAX ? LLONG_MAX : (long long)*(const uint64_t*)item; break;
+    }
+    return 0;
+}
 
-    PyObject *key, *value;
-    Py_ssize_t pos = 0;
+static void close_token_source(token_source_t* source) {
+    if (!source->list) {
+        PyBuffer_Release(&source->view);
+    }
+}
 
-    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
-        if (!PyBytes_Check(value) || !PyLong_Check(key)) {
-            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
-            free_trie(trie);
+// Decodes tokens [begin, end) of the source, skipping eos_token. The bytes
+// are measured first so they are gathered into a single allocation.
+static PyObject* decode_tokens(vocab_t* vocab, token_source_t* source, Py_ssize_t begin, Py_ssize_t end, long long eos_token) {
+    size_t total = 0;
+    for (Py_ssize_t i = begin; i < end; i++) {
+        long long token_id;
+        if (token_source_get(source, i, &token_id) != 0) {
             return NULL;
         }
-    
-        char* token;
-        Py_ssize_t token_length;
-        PyBytes_AsStringAndSize(value, &token, &token_length);
-
-        int token_id = PyLong_AsLong(key);
+        if (token_id == eos_token) continue;
+        if (token_id < 0 || (uint64_t)token_id >= vocab->num_ids || vocab->offsets[token_id] == vocab->offsets[token_id + 1]) {
+            PyErr_Format(PyExc_ValueError, "Invalid token id: %lld", token_id);
+            return NULL;
+        }
+        total += vocab->offsets[token_id + 1] - vocab->offsets[token_id];
+    }
 
-        insert_trie(trie, (unsigned char*)token, token_length, token_id);
+    char* bytes = malloc(total ? total : 1);
+    if (bytes == NULL) {
+        return PyErr_NoMemory();
+    }
+    char* out = bytes;
+    for (Py_ssize_t i = begin; i < end; i++) {
+        long long token_id;
+        token_source_get(source, i, &token_id);
+        if (token_id == eos_token) continue;
+        size_t length = vocab->offsets[token_id + 1] - vocab->offsets[token_id];
+        memcpy(out, vocab->pool + vocab->offsets[token_id], length);
+        out += length;
     }
+    PyObject* text = PyUnicode_DecodeUTF8(bytes, total, "replace");
+    free(bytes);
+    return text;
+}
 
-    PyObject* trie_capsule = PyCapsule_New(trie, "bpe_trie",NULL);// (PyCapsule_Destructor)free_trie);
-    if (trie_capsule == NULL) {
-        free_trie(trie);
+static vocab_t* get_vocab(PyObject* vocab_capsule) {
+    if (vocab_capsule == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "Vocab is None. Tokenizer may not have been trained or a encode dict was not loaded.");
         return NULL;
     }
+    return PyCapsule_GetPointer(vocab_capsule, "bpe_vocab");
+}
 
-    return trie_capsule;
+static int stream_decoder_init(StreamDecoderObject* self, PyObject* args, PyObject* kwds) {
+    PyObject* vocab_capsule;
+    long long eos_token = -1;
+    static char* kwlist[] = {"vocab", "eos_token", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|L", kwlist, &vocab_capsule, &eos_token)) {
+        return -1;
+    }
+    vocab_t* vocab = get_vocab(vocab_capsule);
+    if (!vocab) return -1;
+    Py_INCREF(vocab_capsule);
+    Py_XSETREF(self->vocab_capsule, vocab_capsule);
+    self->vocab = vocab;
+    self->eos_token = eos_token;
+    self->num_pending = 0;
+    return 0;
 }
 
-static PyObject* manual_free_trie(PyObject* self, PyObject* args) {
-    PyObject* trie_capsule;
-    if (!PyArg_ParseTuple(args, "O", &trie_capsule)) {
-        return NULL;
+static void stream_decoder_dealloc(StreamDecoderObject* self) {
+    Py_XDECREF(self->vocab_capsule);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+// Decodes the pending bytes followed by the given ones, keeping an
+// incomplete trailing character pending for the next call
+static PyObject* stream_decoder_feed(StreamDecoderObject* self, const unsigned char* bytes, size_t length, int final) {
+    unsigned char stack_buffer[256];
+    size_t total = self->num_pending + length;
+    unsigned char* buffer = total <= sizeof(stack_buffer) ? stack_buffer : malloc(total);
+    if (buffer == NULL) {
+        return PyErr_NoMemory();
     }
-    
-    if (!PyCapsule_IsValid(trie_capsule, "bpe_trie")) {
-        PyErr_SetString(PyExc_ValueError, "Invalid or already freed trie capsule");
-        return NULL;
+    memcpy(buffer, self->pending, self->num_pending);
+    memcpy(buffer + self->num_pending, bytes, length);
+
+    Py_ssize_t consumed = total;
+    PyObject* text = PyUnicode_DecodeUTF8Stateful((const char*)buffer, total, "replace", final ? NULL : &consumed);
+    if (text != NULL) {
+        self->num_pending = (int)(total - consumed);
+        memcpy(self->pending, buffer + consumed, self->num_pending);
     }
+    if (buffer != stack_buffer) free(buffer);
+    return text;
+}
 
-    Trie* trie = PyCapsule_GetPointer(trie_capsule, "bpe_trie");
-    if (trie) {
-        free_trie(trie);
-        // Instead of setting pointer to NULL, clear the destructor
-        // This prevents the destructor from being called again
-        if (PyCapsule_SetDestructor(trie_capsule, NULL) != 0) {
-            PyErr_SetString(PyExc_RuntimeError, "Failed to clear trie capsule destructor");
+static PyObject* stream_decoder_push(StreamDecoderObject* self, PyObject* tokens) {
+    if (self->vocab == NULL) {
+        PyErr_SetString(PyExc_ValueError, "StreamDecoder is not initialized");
+        return NULL;
+    }
+    vocab_t* vocab = self->vocab;
+    if (PyLong_Check(tokens)) {
+        int overflow;
+        long long token_id = PyLong_AsLongLongAndOverflow(tokens, &overflow);
+        if (token_id == self->eos_token && !overflow) {
+            return PyUnicode_FromStringAndSize(NULL, 0);
+        }
+        if (overflow || token_id < 0 || (uint64_t)token_id >= vocab->num_ids || vocab->offsets[token_id] == vocab->offsets[token_id + 1]) {
+            PyErr_Format(PyExc_ValueError, "Invalid token id: %S", tokens);
             return NULL;
         }
+        return stream_decoder_feed(self, vocab->pool + vocab->offsets[token_id], vocab->offsets[token_id + 1] - vocab->offsets[token_id], 0);
     }
 
-    Py_RETURN_NONE;
-}
-
-static PyObject* encode_train(PyObject* self, PyObject* args) {
-    PyObject* text_iterator;
-    PyObject* trie_capsule;
-    
-    if (!PyArg_ParseTuple(args, "OO", &text_iterator, &trie_capsule)) {
+    // Several tokens at once: gather their bytes like decode does
+    token_source_t source;
+    if (open_token_source(tokens, &source) != 0) {
         return NULL;
     }
+    size_t total = 0;
+    for (Py_ssize_t i = 0; i < source.length; i++) {
+        long long token_id;
+        if (token_source_get(&source, i, &token_id) != 0) {
+            close_token_source(&source);
+            return NULL;
+        }
+        if (token_id == self->eos_token) continue;
+        if (token_id < 0 || (uint64_t)token_id >= vocab->num_ids || vocab->offsets[token_id] == vocab->offsets[token_id + 1]) {
+            PyErr_Format(PyExc_ValueError, "Invalid token id: %lld", token_id);
+            close_token_source(&source);
+            return NULL;
+        }
+        total += vocab->offsets[token_id + 1] - vocab->offsets[token_id];
+    }
+    unsigned char* bytes = malloc(total ? total : 1);
+    if (bytes == NULL) {
+        close_token_source(&source);
+        return PyErr_NoMemory();
+    }
+    unsigned char* out = bytes;
+    for (Py_ssize_t i = 0; i < source.length; i++) {
+        long long token_id;
+        token_source_get(&source, i, &token_id);
+        if (token_id == self->eos_token) continue;
+        size_t length = vocab->offsets[token_id + 1] - vocab->offsets[token_id];
+        memcpy(out, vocab->pool + vocab->offsets[token_id], length);
+        out += length;
+    }
+    close_token_source(&source);
+    PyObject* text = stream_decoder_feed(self, bytes, total, 0);
+    free(bytes);
+    return text;
+}
 
-    if (trie_capsule == Py_None) {
-        PyErr_SetString(PyExc_ValueError, "Trie is None. Tokenizer may not have been trained or a encode dict was not loaded.");
+static PyObject* stream_decoder_flush(StreamDecoderObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (self->vocab == NULL) {
+        PyErr_SetString(PyExc_ValueError, "StreamDecoder is not initialized");
         return NULL;
     }
+    return stream_decoder_feed(self, NULL, 0, 1);
+}
 
-    Trie* trie = (Trie*)PyCapsule_GetPointer(trie_capsule, "bpe_trie");
-    if (!trie) {
-        PyErr_SetString(PyExc_ValueError, "Invalid trie object");
+static PyObject* stream_decoder_reset(StreamDecoderObject* self, PyObject* Py_UNUSED(ignored)) {
+    self->num_pending = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject* stream_decoder_get_pending(StreamDecoderObject* self, void* closure) {
+    return PyBytes_FromStringAndSize((const char*)self->pending, self->num_pending);
+}
+
+static PyMethodDef stream_decoder_methods[] = {
+    {"push", (PyCFunction)stream_decoder_push, METH_O, "Add a token id, or a list or buffer of them, and return the text completed so far."},
+    {"flush", (PyCFunction)stream_decoder_flush, METH_NOARGS, "Return any held back bytes, decoded with replacement characters."},
+    {"reset", (PyCFunction)stream_decoder_reset, METH_NOARGS, "Drop any held back bytes."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef stream_decoder_getset[] = {
+    {"pending", (getter)stream_decoder_get_pending, NULL, "Bytes of an incomplete character held back.", NULL},
+    {NULL}
+};
+
+static PyTypeObject StreamDecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_bpe.StreamDecoder",
+    .tp_doc = "StreamDecoder(vocab, eos_token=-1)\n\nDecodes token ids one at a time, emitting only complete characters.",
+    .tp_basicsize = sizeof(StreamDecoderObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)stream_decoder_init,
+    .tp_dealloc = (destructor)stream_decoder_dealloc,
+    .tp_methods = stream_decoder_methods,
+    .tp_getset = stream_decoder_getset,
+};
+
+static PyObject* decode(PyObject* self, PyObject* args) {
+    PyObject* tokens;
+    PyObject* vocab_capsule;
+    long long eos_token = -1;
+
+    if (!PyArg_ParseTuple(args, "OO|L", &tokens, &vocab_capsule, &eos_token)) {
         return NULL;
     }
+    vocab_t* vocab = get_vocab(vocab_capsule);
+    if (!vocab) return NULL;
 
-    PyObject* iter = PyObject_GetIter(text_iterator);
-    if (!iter) {
-        PyErr_SetString(PyExc_TypeError, "First argument must be iterable");
+    token_source_t source;
+    if (open_token_source(tokens, &source) != 0) {
         return NULL;
     }
+    PyObject* text = decode_tokens(vocab, &source, 0, source.length, eos_token);
+    close_token_source(&source);
+    return text;
+}
 
-    PyObject* encoded_list = PyList_New(0);
-    if (!encoded_list) return NULL;
+static PyObject* decode_batch(PyObject* self, PyObject* args) {
+    PyObject* sequences;
+    PyObject* vocab_capsule;
+    long long eos_token = -1;
+    PyObject* offsets = Py_None;
 
-    PyObject* chunk;
-    while ((chunk = PyIter_Next(iter))) {
-        PyObject* match_str = PyObject_CallMethod(chunk, "group", NULL);
-        Py_DECREF(chunk);
-        if (!PyUnicode_Check(match_str)) {
-            PyErr_SetString(PyExc_TypeError, "Each chunk must be a string");
-            Py_DECREF(match_str);
-            Py_DECREF(encoded_list);
-            Py_DECREF(iter);
-            return NULL;
-        }
+    if (!PyArg_ParseTuple(args, "OO|LO", &sequences, &vocab_capsule, &eos_token, &offsets)) {
+        return NULL;
+    }
+    vocab_t* vocab = get_vocab(vocab_capsule);
+    if (!vocab) return NULL;
 
-        Py_ssize_t text_length;
-        const char* text = PyUnicode_AsUTF8AndSize(match_str, &text_length);
-        if (!text) {
-            Py_DECREF(match_str);
-            Py_DECREF(iter);
-            Py_DECREF(encoded_list);
+    // A list of sequences
+    if (offsets == Py_None) {
+        if (!PyList_Check(sequences)) {
+            PyErr_SetString(PyExc_ValueError, "Input must be a list of token sequences");
             return NULL;
         }
-
-        Py_ssize_t i = 0;
-        while (i < text_length) {
-            int match_length;
-            int token_id = search_trie(trie, (unsigned char*)text + i, text_length - i, &match_length);
-            PyObject* token_obj;
-
-            if (token_id != -1) {
-                token_obj = PyLong_FromLong(token_id);
-                i += match_length;
-            } else {
-                token_obj = PyLong_FromLong((unsigned char)text[i]);
-                i++;
-            }
-
-            if (!token_obj) {
-                Py_DECREF(match_str);
-                Py_DECREF(encoded_list);
-                Py_DECREF(iter);
+        Py_ssize_t num_sequences = PyList_GET_SIZE(sequences);
+        PyObject* texts = PyList_New(num_sequences);
+        if (!texts) return NULL;
+        for (Py_ssize_t i = 0; i < num_sequences; i++) {
+            token_source_t source;
+            if (open_token_source(PyList_GET_ITEM(sequences, i), &source) != 0) {
+                Py_DECREF(texts);
                 return NULL;
             }
-
-            if (PyList_Append(encoded_list, token_obj) == -1) {
-                Py_DECREF(token_obj);
-                Py_DECREF(match_str);
-                Py_DECREF(encoded_list);
-                Py_DECREF(iter);
+            PyObject* text = decode_tokens(vocab, &source, 0, source.length, eos_token);
+            close_token_source(&source);
+            if (!text) {
+                Py_DECREF(texts);
                 return NULL;
             }
-            Py_DECREF(token_obj);
+            PyList_SET_ITEM(texts, i, text);
         }
+        return texts;
+    }
 
-        Py_DECREF(match_str);
+    // One flat sequence split at offsets, as returned by encode_batch
+    token_source_t source;
+    token_source_t bounds;
+    if (open_token_source(sequences, &source) != 0) {
+        return NULL;
     }
-    Py_DECREF(iter);
-    if (PyErr_Occurred()) {
-        Py_DECREF(encoded_list);
+    if (open_token_source(offsets, &bounds) != 0) {
+        close_token_source(&source);
         return NULL;
     }
+    PyObject* texts = NULL;
+    if (bounds.length < 1) {
+        PyErr_SetString(PyExc_ValueError, "offsets must hold at least one entry");
+        goto cleanup;
+    }
+    texts = PyList_New(bounds.length - 1);
+    if (!texts) goto cleanup;
+    long long begin;
+    if (token_source_get(&bounds, 0, &begin) != 0) goto error;
+    for (Py_ssize_t i = 0; i + 1 < bounds.length; i++) {
+        long long end;
+        if (token_source_get(&bounds, i + 1, &end) != 0) goto error;
+        if (begin < 0 || end < begin || end > source.length) {
+            PyErr_SetString(PyExc_ValueError, "offsets must be ascending and within the tokens");
+            goto error;
+        }
+        PyObject* text = decode_tokens(vocab, &source, begin, end, eos_token);
+        if (!text) goto error;
+        PyList_SET_ITEM(texts, i, text);
+        begin = end;
+    }
+    goto cleanup;
 
-    return encoded_list;
+error:
+    Py_CLEAR(texts);
+cleanup:
+    close_token_source(&source);
+    close_token_source(&bounds);
+    return texts;
 }
 
-static PyObject* encode_inference(PyObject* self, PyObject* args) {
-    PyObject* input_chunks;
-    PyObject* trie_capsule;
-    
-    if (!PyArg_ParseTuple(args, "OO", &input_chunks, &trie_capsule)) {
-        PyErr_SetString(PyExc_RuntimeError, "Failed to parse function args. Must be a list of strings and pointer to trie.");
-
-        return NULL;
-    }
-    if (trie_capsule == Py_None) {
-        PyErr_SetString(PyExc_ValueError, "Trie is None. Tokenizer may not have been trained or a encode dict was not loaded.");
-        return NULL;
+// Writes data followed by zeros up to the next 8 byte boundary
+static int write_section(FILE* file, const void* data, size_t length) {
+    static const char padding[8] = {0};
+    if (length > 0 && fwrite(data, 1, length, file) != length) {
+        return -1;
     }
-    Trie* trie = (Trie*)PyCapsule_GetPointer(trie_capsule, "bpe_trie");
-    if (!trie) {
-        PyErr_SetString(PyExc_ValueError, "Invalid trie object");
-        return NULL;
+    size_t padded = BINARY_ALIGN(length) - length;
+    if (padded > 0 && fwrite(padding, 1, padded, file) != padded) {
+        return -1;
     }
-    if (!PyList_Check(input_chunks)) {
-        PyErr_SetString(PyExc_TypeError, "Input must be a list of strings");
+    return 0;
+}
+
+static PyObject* save_binary(PyObject* self, PyObject* args) {
+    const char* path;
+    PyObject* decode_dict;
+    PyObject* pattern;
+    PyObject* trie_capsule;
+    PyObject* merges_capsule;
+    PyObject* special_ids;
+
+    if (!PyArg_ParseTuple(args, "sO!UOOO!", &path, &PyDict_Type, &decode_dict, &pattern, &trie_capsule, &merges_capsule,
+                          &PyList_Type, &special_ids)) {
         return NULL;
     }
-    Py_ssize_t num_chunks = PyList_Size(input_chunks);
-    PyObject* encoded_list = PyList_New(0);
-    for (Py_ssize_t chunk_idx = 0; chunk_idx < num_chunks; chunk_idx++) {
-        PyObject* chunk = PyList_GetItem(input_chunks, chunk_idx);
-        if (!PyUnicode_Check(chunk)) {
-            PyErr_SetString(PyExc_TypeError, "Each chunk must be a string");
-            Py_DECREF(encoded_list);
+    Trie* trie = PyCapsule_GetPointer(trie_capsule, "bpe_trie");
+    if (!trie) return NULL;
+    merge_table_t* merges = PyCapsule_GetPointer(merges_capsule, "bpe_merges");
+    if (!merges) return NULL;
+    Py_ssize_t pattern_length;
+    const char* pattern_bytes = PyUnicode_AsUTF8AndSize(pattern, &pattern_length);
+    if (!pattern_bytes) return NULL;
+
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    long max_id = -1;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        if (!PyBytes_Check(value) || !PyLong_Check(key)) {
+            PyErr_SetString(PyExc_TypeError, "Dictionary must contain integer keys and byte values");
             return NULL;
         }
-        const char* text = PyUnicode_AsUTF8(chunk);
-        if (!text) {
-            Py_DECREF(encoded_list);
+        long token_id = PyLong_AsLong(key);
+        if (token_id < 0 || token_id >= UINT32_MAX) {
+            PyErr_SetString(PyExc_ValueError, "Token ids must fit in 32 bits");
             return NULL;
         }
-        int text_length = strlen(text);
-        int i = 0;
-        while (i < text_length) {
-            int match_length;
-            int token_id = search_trie(trie, (unsigned char*)text + i, text_length - i, &match_length);
-            if (token_id != -1) {
-                PyList_Append(encoded_list, PyLong_FromLong(token_id));
-                i += match_length;
-            } 
-            else {
-                PyList_Append(encoded_list, PyLong_FromLong((unsigned char)text[i]));
-                i++;
+        if (token_id > max_id) max_id = token_id;
+    }
+
+    // Lay the vocab out by id: lengths first, then their running sum
+    uint64_t num_ids = max_id + 1;
+    uint64_t* vocab_offsets = calloc(num_ids + 1, sizeof(uint64_t));
+    if (vocab_offsets == NULL) {
+        return PyErr_NoMemory();
+    }
+    pos = 0;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        vocab_offsets[PyLong_AsLong(key) + 1] = PyBytes_GET_SIZE(value);
+    }
+    for (uint64_t i = 0; i < num_ids; i++) {
+        vocab_offsets[i + 1] += vocab_offsets[i];
+    }
+    char* vocab_pool = malloc(vocab_offsets[num_ids] ? vocab_offsets[num_ids] : 1);
+    uint64_t num_special = PyList_GET_SIZE(special_ids);
+    uint32_t* special = malloc((num_special ? num_special : 1) * sizeof(uint32_t));
+    if (vocab_pool == NULL || special == NULL) {
+        free(vocab_offsets);
+        free(vocab_pool);
+        free(special);
+        return PyErr_NoMemory();
+    }
+    for (uint64_t i = 0; i < num_special; i++) {
+        long token_id = PyLong_AsLong(PyList_GET_ITEM(special_ids, i));
+        if (token_id < 0 || (uint64_t)token_id >= num_ids) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError, "Special token ids must be in the vocab");
             }
+            free(vocab_offsets);
+            free(vocab_pool);
+            free(special);
+            return NULL;
         }
+        special[i] = (uint32_t)token_id;
     }
-    return encoded_list;
+    pos = 0;
+    while (PyDict_Next(decode_dict, &pos, &key, &value)) {
+        long token_id = PyLong_AsLong(key);
+        memcpy(vocab_pool + vocab_offsets[token_id], PyBytes_AS_STRING(value), PyBytes_GET_SIZE(value));
+    }
+
+    binary_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_MAGIC, 8);
+    header.version = BINARY_VERSION;
+    header.byte_order = BINARY_BYTE_ORDER;
+    header.pattern_offset = BINARY_ALIGN(sizeof(binary_header_t));
+    header.pattern_length = pattern_length;
+    header.num_ids = num_ids;
+    header.vocab_offsets_offset = header.pattern_offset + BINARY_ALIGN(header.pattern_length);
+    header.vocab_pool_offset = header.vocab_offsets_offset + BINARY_ALIGN((num_ids + 1) * sizeof(uint64_t));
+    header.vocab_pool_length = vocab_offsets[num_ids];
+    header.trie_offset = header.vocab_pool_offset + BINARY_ALIGN(header.vocab_pool_length);
+    header.trie_num_nodes = trie->num_nodes;
+    header.merges_offset = header.trie_offset + BINARY_ALIGN(trie->num_nodes * sizeof(trie_node));
+    header.merges_num_slots = merges->mask + 1;
+    header.merges_size = merges->size;
+    header.special_offset = header.merges_offset + BINARY_ALIGN(header.merges_num_slots * sizeof(merge_slot_t));
+    header.num_special = num_special;
+    header.file_size = header.special_offset + BINARY_ALIGN(num_special * sizeof(uint32_t));
+
+    FILE* file = fopen(path, "wb");
+    int failed = file == NULL;
+    if (!failed) {
+        failed = write_section(file, &header, sizeof(header)) != 0 ||
+            write_section(file, pattern_bytes, pattern_length) != 0 ||
+            write_section(file, vocab_offsets, (num_ids + 1) * sizeof(uint64_t)) != 0 ||
+            write_section(file, vocab_pool, header.vocab_pool_length) != 0 ||
+            write_section(file, trie->nodes, trie->num_nodes * sizeof(trie_node)) != 0 ||
+            write_section(file, merges->slots, header.merges_num_slots * sizeof(merge_slot_t)) != 0 ||
+            write_section(file, special, num_special * sizeof(uint32_t)) != 0;
+        failed = (fclose(file) != 0) || failed;
+    }
+    free(vocab_offsets);
+    free(vocab_pool);
+    free(special);
+    if (failed) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* load_binary(PyObject* self, PyObject* args) {
+    const char* path;
+    Py_ssize_t cache_size = 0;
+
+    if (!PyArg_ParseTuple(args, "s|n", &path, &cache_size)) {
+        return NULL;
+    }
+    if (cache_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache_size must not be negative");
+        return NULL;
+    }
+
+    bpe_mapping_t* mapping = map_file(path);
+    if (mapping == NULL) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    const unsigned char* data = mapping->data;
+    if (validate_binary(data, mapping->length) != 0) {
+        release_mapping(mapping);
+        PyErr_Format(PyExc_ValueError, "Invalid or unsupported tokenizer file: %s", path);
+        return NULL;
+    }
+    const binary_header_t* header = (const binary_header_t*)data;
+
+    PyObject* pattern = NULL;
+    PyObject* decode_dict = NULL;
+    PyObject* trie_capsule = NULL;
+    PyObject* merges_capsule = NULL;
+    PyObject* vocab_capsule = NULL;
+    PyObject* special_ids = NULL;
+    PyObject* result = NULL;
+    Trie* trie = NULL;
+    merge_table_t* merges = NULL;
+    vocab_t* vocab = NULL;
+
+    pattern = PyUnicode_DecodeUTF8((const char*)data + header->pattern_offset, header->pattern_length, NULL);
+    decode_dict = PyDict_New();
+    uint64_t num_special = header->version >= 2 ? header->num_special : 0;
+    special_ids = PyList_New(num_special);
+    if (!pattern || !decode_dict || !special_ids) goto cleanup;
+    const uint32_t* special = (const uint32_t*)(data + header->special_offset);
+    for (uint64_t i = 0; i < num_special; i++) {
+        PyObject* token_id = PyLong_FromUnsignedLong(special[i]);
+        if (!token_id) goto cleanup;
+        PyList_SET_ITEM(special_ids, i, token_id);
+    }
+
+    const uint64_t* vocab_offsets = (const uint64_t*)(data + header->vocab_offsets_offset);
+    const char* vocab_pool = (const char*)data + header->vocab_pool_offset;
+    for (uint64_t i = 0; i < header->num_ids; i++) {
+        if (vocab_offsets[i] == vocab_offsets[i + 1]) continue;
+        PyObject* token_id = PyLong_FromUnsignedLongLong(i);
+        PyObject* token = PyBytes_FromStringAndSize(vocab_pool + vocab_offsets[i], vocab_offsets[i + 1] - vocab_offsets[i]);
+        int failed = !token_id || !token || PyDict_SetItem(decode_dict, token_id, token) != 0;
+        Py_XDECREF(token_id);
+        Py_XDECREF(token);
+        if (failed) goto cleanup;
+    }
+
+    // The vocab, trie and merge table point into the mapping and each hold
+    // a reference to it
+    vocab = malloc(sizeof(vocab_t));
+    if (vocab == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    vocab->num_ids = header->num_ids;
+    vocab->offsets = vocab_offsets;
+    vocab->pool = (const unsigned char*)vocab_pool;
+    vocab->mapping = mapping;
+    atomic_fetch_add(&mapping->refs, 1);
+
+    trie = malloc(sizeof(Trie));
+    if (trie == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    trie->num_nodes = header->trie_num_nodes;
+    trie->nodes = (trie_node*)(data + header->trie_offset);
+    trie->mapping = mapping;
+    atomic_fetch_add(&mapping->refs, 1);
+
+    merges = calloc(1, sizeof(merge_table_t));
+    if (merges == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    merges->slots = (merge_slot_t*)(data + header->merges_offset);
+    merges->mask = header->merges_num_slots - 1;
+    merges->size = header->merges_size;
+    merges->mapping = mapping;
+    atomic_fetch_add(&mapping->refs, 1);
+    if (init_encode_cache(&merges->cache, cache_size) != 0) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    trie_capsule = PyCapsule_New(trie, "bpe_trie", trie_capsule_destructor);
+    if (!trie_capsule) goto cleanup;
+    trie = NULL;
+    merges_capsule = PyCapsule_New(merges, "bpe_merges", merges_capsule_destructor);
+    if (!merges_capsule) goto cleanup;
+    merges = NULL;
+    vocab_capsule = PyCapsule_New(vocab, "bpe_vocab", vocab_capsule_destructor);
+    if (!vocab_capsule) goto cleanup;
+    vocab = NULL;
+    result = PyTuple_Pack(6, pattern, decode_dict, trie_capsule, merges_capsule, vocab_capsule, special_ids);
+
+cleanup:
+    Py_XDECREF(pattern);
+    Py_XDECREF(decode_dict);
+    Py_XDECREF(special_ids);
+    Py_XDECREF(trie_capsule);
+    Py_XDECREF(merges_capsule);
+    Py_XDECREF(vocab_capsule);
+    free_vocab(vocab);
+    if (trie) free_trie(trie);
+    if (merges) free_merge_table(merges);
+    release_mapping(mapping);
+    return result;
 }
 
 // Method definitions
 static PyMethodDef _BpeMethods[] = {
     {"train", train, METH_VARARGS, "Train a text tokenizer using byte-pair encoding."},
+    {"train_files", train_files, METH_VARARGS, "Count and train on files natively with the GPT-2 pattern."},
+    {"resume_training", resume_training, METH_VARARGS, "Continue training from a checkpoint file."},
     {"build_trie", build_trie, METH_VARARGS, "Build a trie from an encoding dictionary."},
     {"manual_free_trie", manual_free_trie, METH_VARARGS, "Manually free the trie structure."},
     {"encode_train", encode_train, METH_VARARGS, "Encode text using the trained BPE model. Uses less memory but slower."},
     {"encode_inference", encode_inference, METH_VARARGS, "Encode text using the trained BPE model. Faster but uses more memory."},
+    {"build_merges", build_merges, METH_VARARGS, "Recover the merge table from an encoding dictionary."},
+    {"encode_merges", encode_merges, METH_VARARGS, "Encode text by applying the learned merges in training order."},
+    {"pretokenize", pretokenize, METH_VARARGS, "Split text into chunks with the built-in GPT-2 pattern."},
+    {"build_special_tokens", build_special_tokens, METH_VARARGS, "Build the special token matcher from a dict of ids to byte strings."},
+    {"split_special_tokens", split_special_tokens, METH_VARARGS, "Split text into the text between special tokens and their ids."},
+    {"encode_text", encode_text, METH_VARARGS, "Encode text pre-tokenized natively with the GPT-2 pattern, or a list of chunks, into a list or TokenArray."},
+    {"encode_batch", encode_batch, METH_VARARGS, "Encode a list of texts on several threads into one token array plus document offsets."},
+    {"count_tokens", count_tokens, METH_VARARGS, "Count the tokens encode_text would return without building them."},
+    {"count_tokens_batch", count_tokens_batch, METH_VARARGS, "Count the tokens of each text in a list on several threads."},
+    {"encode_files", encode_files, METH_VARARGS, "Encode files on several threads straight to token shards with document offset indexes."},
+    {"build_vocab", build_vocab, METH_VARARGS, "Build the flat byte pool used for decoding from an encoding dictionary."},
+    {"decode", decode, METH_VARARGS, "Decode a list or buffer of token ids into text."},
+    {"decode_batch", decode_batch, METH_VARARGS, "Decode a list of token sequences, or one sequence split at offsets, into texts."},
+    {"save_binary", save_binary, METH_VARARGS, "Write the vocab, pattern, trie and merge table to a binary tokenizer file."},
+    {"load_binary", load_binary, METH_VARARGS, "Map a binary tokenizer file and use its trie and merge table in place."},
 
     {NULL, NULL, 0, NULL}
 };
@@ -759,5 +6740,30 @@ static struct PyModuleDef _bpe_module = {
 
 // Module initialization function
 PyMODINIT_FUNC PyInit__bpe(void) {
-    return PyModule_Create(&_bpe_module);
+    init_ascii_runs();
+    if (PyType_Ready(&TokenArrayType) < 0 || PyType_Ready(&StreamDecoderType) < 0 || PyType_Ready(&EncodeSessionType) < 0) {
+        return NULL;
+    }
+    PyObject* module = PyModule_Create(&_bpe_module);
+    if (!module) return NULL;
+
+    Py_INCREF(&TokenArrayType);
+    if (PyModule_AddObject(module, "TokenArray", (PyObject*)&TokenArrayType) < 0) {
+        Py_DECREF(&TokenArrayType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&StreamDecoderType);
+    if (PyModule_AddObject(module, "StreamDecoder", (PyObject*)&StreamDecoderType) < 0) {
+        Py_DECREF(&StreamDecoderType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&EncodeSessionType);
+    if (PyModule_AddObject(module, "EncodeSession", (PyObject*)&EncodeSessionType) < 0) {
+        Py_DECREF(&EncodeSessionType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
@@ -2,69 +2,668 @@
 #define _BPE_H
 
 #include <Python.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
 
-#define BIGRAM_TABLE_SIZE 1048576 // 2^20
+// SIMD scans of ASCII runs, picked at import by what the CPU supports
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ASCII_RUN_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define BIGRAM_TABLE_MIN_SIZE 1024
+#define BIGRAM_HEAP_INIT_SIZE 65536
+#define WORD_COUNTS_INIT_SIZE 65536
+#define CORPUS_SEGMENT_SIZE (1 << 20)
+#define WORD_COUNTS_MIN_SPILL 1024
+#define SPILL_BUFFER_MIN (1 << 12)
+#define SPILL_BUFFER_MAX (1 << 20)
+#define ENCODE_FILES_BLOCK_SIZE (1 << 20)
+#define ENCODE_FILES_WRITE_BUFFER (1 << 20)
+#define BIGRAM_ARENA_BLOCK_BITS 16
+#define BIGRAM_ARENA_BLOCK_SIZE (1 << BIGRAM_ARENA_BLOCK_BITS)
+#define BIGRAM_NODE_NONE UINT32_MAX
+#define TRAIN_PARALLEL_MIN_WORDS 1024
+// Unigrams are never 0 (byte 0 ends words), so a key of 0 marks an empty slot
+#define BIGRAM_KEY(unigram1, unigram2) (((uint64_t)(unigram1) << 32) | (uint64_t)(unigram2))
+// Words are stored as uint16 while every token id fits, ids run up to 255 + num_merges
+#define TRAIN_WIDE_TOKENS(num_merges) ((num_merges) > UINT16_MAX - 255)
 #define MAX_CHILDREN 256
+#define TRIE_FREE -1
+#define TRIE_ROOT -2
+#define TRIE_INIT_SIZE 1024
+
+// Token ids during training, and word and pair frequencies, which are signed
+// so that parallel steps can accumulate negative deltas
+typedef uint32_t bpe_token_t;
+typedef int64_t bpe_count_t;
 
-typedef struct text_chunk_node {
-    unsigned short count;
-    size_t array_size;
-    size_t num_elements;
-    unsigned short bytes[];
-} text_chunk_node_t;
+// The distinct words of the corpus and how often each occurs, with the
+// tokens of all words in one block. Word i is the lengths[i] tokens from
+// offsets[i], merges shorten it in place. Tokens are uint16 unless wide
+// is set, then uint32.
+typedef struct text_table {
+    unsigned char* tokens;
+    size_t* offsets;
+    uint32_t* lengths;
+    bpe_count_t* counts;
+    size_t num_words;
+    size_t words_capacity;
+    size_t num_tokens;
+    size_t tokens_capacity;
+    int wide;
+} text_table_t;
 
 typedef struct bigram_node {
-    unsigned short bigram[2];
-    int freq;
-    struct bigram_node* next;
+    bpe_token_t bigram[2];
+    bpe_count_t freq;
+    size_t heap_idx;
+    unsigned int* words;        // text_table indices of words containing the pair
+    unsigned int num_words;
+    unsigned int words_capacity;
 } bigram_node_t;
 
+typedef struct bigram_slot {
+    uint64_t key;
+    uint32_t node_idx;
+} bigram_slot_t;
+
+// Open-addressing (linear probing) table from packed pair keys to nodes.
+// Nodes live in an arena of fixed-size blocks so pointers to them, as held
+// by the heap, stay valid as the table grows.
+typedef struct bigram_table {
+    bigram_slot_t* slots;
+    size_t mask;
+    size_t size;
+    bigram_node_t** blocks;
+    size_t num_blocks;
+    uint32_t num_nodes;
+    uint32_t free_node;
+} bigram_table_t;
+
+// Indexed binary max-heap over the bigram nodes, ordered by freq with ties
+// broken by the smaller (unigram1, unigram2) pair. Each node tracks its own
+// position so a count change can be re-sifted in place.
+typedef struct bigram_heap {
+    bigram_node_t** nodes;
+    size_t size;
+    size_t capacity;
+} bigram_heap_t;
+
+typedef void (*train_job_fn)(void* job_arg, int thread_idx, int num_threads);
+
+typedef struct train_worker {
+    pthread_t thread;
+    struct train_pool* pool;
+    int thread_idx;
+    int started;
+} train_worker_t;
+
+// Persistent worker threads for training, woken once per parallel step.
+// deltas holds one bigram delta table per thread.
+typedef struct train_pool {
+    train_worker_t* workers;
+    int num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned long generation;
+    int pending;
+    int shutdown;
+    train_job_fn job;
+    void* job_arg;
+    bigram_table_t** deltas;
+} train_pool_t;
+
+typedef struct train_job {
+    struct text_table* text_table;
+    unsigned int* words;        // word indices to shard, NULL for the whole text table
+    unsigned int num_words;
+    bpe_token_t merge_pair[2];
+    bpe_token_t token_idx;
+    bigram_table_t** deltas;
+    atomic_int failed;          // set by any thread that runs out of memory
+} train_job_t;
+
+// The pair a token was merged from. A right token of 0 marks an alias: a
+// token with the same bytes as the left one, which nothing merges into.
 typedef struct token_node {
-    unsigned short token[2];
+    bpe_token_t token[2];
 } token_node_t;
 
+// How training starts and saves its progress. The first num_prefix merges
+// are given as (left, right) pairs, replayed over the text table when a
+// vocab is extended or already applied when resuming from a checkpoint.
+// A checkpoint is written every checkpoint_every merges and at the end.
+typedef struct train_options {
+    const bpe_token_t* prefix;
+    size_t num_prefix;
+    int replay;
+    const char* checkpoint_path;    // NULL for none
+    int checkpoint_every;
+    const char* pattern;
+    Py_ssize_t pattern_length;
+} train_options_t;
+
+#define CHECKPOINT_MAGIC "bytephck"
+#define CHECKPOINT_VERSION 1
+
+// Header of a training checkpoint. It is followed by the pattern, the
+// (left, right) uint32 pair of each of the num_merges merges from id 256
+// on, and for each word its int64 count, uint32 number of tokens and the
+// tokens, uint32 if wide is set, uint16 otherwise. Pair counts follow from
+// the words, so they are rebuilt rather than stored.
+typedef struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t pattern_length;
+    uint64_t num_merges;
+    uint64_t num_words;
+    uint64_t max_length;        // longest word in bytes
+    uint32_t wide;
+    uint32_t reserved;
+} checkpoint_header_t;
+
+// Double-array trie state. The child along byte c lives at base + c and
+// belongs to this state only if its check holds this state's index. All
+// links are indices, so the node array can be copied or mapped as is.
 typedef struct trie_node {
-    struct trie_node* children[MAX_CHILDREN];
-    int token_id;
+    int32_t base;
+    int32_t check;
+    int32_t token_id;
 } trie_node;
 
+// Read-only mapping of a binary tokenizer file, shared by the trie and
+// merge table loaded from it and unmapped when the last one is freed
+typedef struct bpe_mapping {
+    void* data;
+    size_t length;
+    atomic_int refs;
+} bpe_mapping_t;
+
 typedef struct Trie {
-    trie_node* root;
+    size_t num_nodes;
+    trie_node* nodes;
+    bpe_mapping_t* mapping;     // holds the nodes if loaded from a file
 } Trie;
 
+typedef struct trie_builder {
+    trie_node* nodes;
+    size_t capacity;
+    size_t size;
+    size_t first_free;
+} trie_builder_t;
+
+typedef struct trie_entry {
+    const unsigned char* bytes;
+    int length;
+    int token_id;
+    int order;
+} trie_entry_t;
+
+// Aho-Corasick automaton over the special token strings. The failure links
+// are folded into a full transition table, so a scan costs one lookup per
+// byte of text however many tokens there are. depth is the length of the
+// prefix a state spells, match_length that of the longest token ending in it.
+typedef struct special_tokens {
+    int32_t* next;              // 256 transitions per state
+    uint32_t* depth;
+    uint32_t* match_length;     // 0 if no token ends in the state
+    uint32_t* match_id;
+    uint32_t num_states;
+    uint32_t max_length;
+    int first_byte;             // the byte every token starts with, or -1
+    unsigned char starts[256];  // whether some token starts with the byte
+} special_tokens_t;
+
+#define MERGE_TABLE_MIN_SIZE 1024
+#define MERGE_STACK_SIZE 64
+#define MERGE_DEAD UINT32_MAX
+#define MERGE_KEY(left, right) (((uint64_t)(left) << 32) | (uint64_t)(right))
+#define ENCODE_CACHE_MAX_KEY 256
+#define ENCODE_CACHE_KEY(entry) ((unsigned char*)((entry)->tokens + (entry)->num_tokens))
+
+typedef struct merge_slot {
+    uint64_t key;
+    uint32_t token_id;      // also the merge's rank, 0 if the slot is empty
+} merge_slot_t;
+
+typedef struct merge_candidate {
+    uint32_t rank;
+    int left;
+    int right;
+} merge_candidate_t;
+
+// Cached merge-order encoding of one chunk. The chunk bytes are stored
+// after the token ids.
+typedef struct encode_cache_entry {
+    uint64_t hash;
+    uint64_t last_used;
+    struct encode_cache_entry* bucket_next;
+    struct encode_cache_entry* lru_prev;
+    struct encode_cache_entry* lru_next;
+    uint32_t key_length;
+    uint32_t num_tokens;
+    uint32_t tokens[];
+} encode_cache_entry_t;
+
+// Bounded LRU cache of chunk encodings, most recently used at the head.
+typedef struct encode_cache {
+    encode_cache_entry_t** buckets;
+    size_t mask;
+    size_t size;
+    size_t capacity;
+    uint64_t clock;         // ticks on every insert or promotion
+    encode_cache_entry_t* lru_head;
+    encode_cache_entry_t* lru_tail;
+} encode_cache_t;
+
+// Learned merges keyed on the (left, right) token pair.
+typedef struct merge_table {
+    merge_slot_t* slots;
+    size_t mask;
+    size_t size;
+    encode_cache_t cache;
+    bpe_mapping_t* mapping;     // holds the (read-only) slots if loaded from a file
+    uint32_t* token_lengths;    // byte length by token id, built on first use
+    size_t num_token_lengths;
+} merge_table_t;
+
+// Token bytes by id for decoding: token i is pool[offsets[i]:offsets[i + 1]],
+// empty for ids that are not in the vocab. The same layout as the vocab
+// sections of a binary file, so a loaded vocab points into the mapping.
+typedef struct vocab {
+    uint64_t num_ids;
+    const uint64_t* offsets;
+    const unsigned char* pool;
+    bpe_mapping_t* mapping;
+} vocab_t;
+
+// Token ids to decode, read from a list of ints or any C-contiguous buffer
+// of integers
+typedef struct token_source {
+    PyObject* list;
+    Py_buffer view;
+    Py_ssize_t length;
+    int is_signed;
+} token_source_t;
+
+// Incremental decoder holding back the bytes of a UTF-8 character that is
+// split across tokens (at most 3)
+typedef struct {
+    PyObject_HEAD
+    PyObject* vocab_capsule;
+    vocab_t* vocab;
+    long long eos_token;
+    unsigned char pending[4];
+    int num_pending;
+} StreamDecoderObject;
+
+#define BINARY_MAGIC "bytephas"
+#define BINARY_VERSION 2
+#define BINARY_BYTE_ORDER 0x01020304
+#define BINARY_ALIGN(offset) (((offset) + 7) & ~(uint64_t)7)
+
+// Header of a binary tokenizer file. Each section starts on an 8 byte
+// boundary at the given offset and is used in place from the mapping.
+// Token i's bytes are vocab_pool[vocab_offsets[i]:vocab_offsets[i + 1]],
+// empty for ids that are not in the vocab. Version 1 files end the header
+// before the special token ids.
+typedef struct binary_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t file_size;
+    uint64_t pattern_offset;
+    uint64_t pattern_length;
+    uint64_t num_ids;
+    uint64_t vocab_offsets_offset;  // num_ids + 1 uint64 offsets
+    uint64_t vocab_pool_offset;
+    uint64_t vocab_pool_length;
+    uint64_t trie_offset;
+    uint64_t trie_num_nodes;
+    uint64_t merges_offset;
+    uint64_t merges_num_slots;
+    uint64_t merges_size;
+    uint64_t special_offset;        // num_special uint32 ids
+    uint64_t num_special;
+} binary_header_t;
+
+// Character classes of the GPT-2 pattern, matching \p{L}, \p{N} and \s
+#define CHAR_OTHER 0
+#define CHAR_LETTER 1
+#define CHAR_NUMBER 2
+#define CHAR_SPACE 3
+#define NUM_CHAR_CLASSES 4
+
+// End of the run of ASCII bytes of one class that starts at pos
+typedef Py_ssize_t (*ascii_run_fn)(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos, int char_class);
+
+typedef struct unicode_range {
+    uint32_t first;
+    uint32_t last;
+    unsigned char char_class;
+} unicode_range_t;
+
+typedef struct token_buffer {
+    uint32_t* tokens;
+    uint64_t* spans;    // start and end byte of each token, kept if with_spans
+    size_t size;
+    size_t capacity;
+    int with_spans;
+} token_buffer_t;
+
+// What a chunk is encoded with: the merge table and an LRU cache for
+// merge-order encoding, or the trie for greedy longest-match when merges is
+// NULL. Several threads can share one only if each has its own cache.
+typedef struct bpe_encoder {
+    Trie* trie;
+    merge_table_t* merges;
+    encode_cache_t* cache;
+    const special_tokens_t* special;    // NULL to encode special tokens as text
+} bpe_encoder_t;
+
+// Documents of one encode_batch call, captured up front so the GIL can be
+// released. Document i covers pieces doc_pieces[i] to doc_pieces[i + 1]: a
+// str is one piece that gets pre-tokenized natively (doc_split), a list of
+// chunks has one piece per chunk. A token id in the list is a NULL piece
+// with the id as its length. With count_only, only doc_length is filled in.
+typedef struct encode_batch_job {
+    Trie* trie;
+    merge_table_t* merges;
+    const special_tokens_t* special;
+    int num_threads;
+    int count_only;
+    encode_cache_t* caches;         // one per thread
+    token_buffer_t* buffers;        // one per thread
+    PyObject** owners;              // the strings pieces point into
+    Py_ssize_t num_owned;
+    const unsigned char** pieces;
+    Py_ssize_t* piece_lengths;
+    Py_ssize_t* doc_pieces;
+    unsigned char* doc_split;
+    size_t num_docs;
+    int eos_token;
+    atomic_size_t next_doc;
+    atomic_int failed;
+    int* doc_thread;                // where each document's tokens landed
+    size_t* doc_start;
+    size_t* doc_length;
+} encode_batch_job_t;
+
+// A stretch of one document read by encode_files, ends_doc is set on the
+// last piece of each document
+typedef struct encode_piece {
+    const unsigned char* text;
+    size_t length;
+    int ends_doc;
+} encode_piece_t;
+
+enum { ENCODE_BLOCK_FREE, ENCODE_BLOCK_CLAIMED, ENCODE_BLOCK_DONE };
+
+// About ENCODE_FILES_BLOCK_SIZE bytes of input encoded by one thread. The
+// documents ending in the block end at doc_ends in tokens, eos included.
+typedef struct encode_block {
+    encode_piece_t* pieces;
+    size_t num_pieces;
+    size_t pieces_capacity;
+    token_buffer_t tokens;
+    size_t* doc_ends;
+    size_t num_doc_ends;
+    size_t doc_ends_capacity;
+    int state;
+} encode_block_t;
+
+// An encode_files run. Threads other than 0 take the next block of input
+// under the lock, encode it outside of it and mark it done. Thread 0 writes
+// the done blocks in order, so reading, encoding and writing overlap with
+// at most num_blocks blocks in flight.
+typedef struct encode_files_job {
+    bpe_mapping_t** inputs;         // NULL for empty files
+    size_t num_inputs;
+    const unsigned char* separator; // NULL when each file is one document
+    size_t separator_length;
+    Trie* trie;
+    merge_table_t* merges;
+    const special_tokens_t* special;
+    encode_cache_t* caches;         // one per thread
+    int eos_token;
+    int itemsize;
+    const char* output_prefix;
+    uint64_t shard_tokens;          // 0 for a single shard
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    encode_block_t* blocks;
+    size_t num_blocks;
+    size_t input_idx;               // where the next block starts
+    size_t input_pos;
+    size_t doc_end;                 // SIZE_MAX when a document starts at input_pos
+    uint64_t next_block;
+    uint64_t next_write;
+    int input_done;
+    int failed;                     // errno of the first failure
+    char** shard_paths;
+    size_t num_shards;
+    size_t shards_capacity;
+    uint64_t num_docs;
+    uint64_t num_tokens;
+} encode_files_job_t;
+
+// Number of times one pre-token occurs in a training corpus. word points
+// into the mapped file it was first seen in.
+typedef struct word_count {
+    const unsigned char* word;
+    uint64_t hash;
+    bpe_count_t count;
+    uint32_t length;
+} word_count_t;
+
+// Open-addressing word counts, an empty slot has a NULL word
+typedef struct word_counts {
+    word_count_t* slots;
+    size_t mask;
+    size_t size;
+} word_counts_t;
+
+typedef struct corpus_segment {
+    const unsigned char* text;
+    size_t length;
+} corpus_segment_t;
+
+// Word counts written out to a temporary file when a table outgrows its
+// memory budget. Each run is one table sorted by word_count_cmp, as records
+// of hash, count, length and the word bytes.
+typedef struct spill_run {
+    off_t offset;
+    off_t end;
+} spill_run_t;
+
+typedef struct spill_file {
+    FILE* file;                     // unlinked already, closing removes it
+    spill_run_t* runs;
+    size_t num_runs;
+    size_t runs_capacity;
+} spill_file_t;
+
+// Reads back the records of one run, current holds the last one read
+typedef struct spill_reader {
+    int fd;
+    off_t position;
+    off_t end;
+    unsigned char* buffer;
+    size_t buffer_size;
+    size_t buffer_pos;
+    size_t buffer_length;
+    word_count_t current;
+    unsigned char* word;
+    size_t word_capacity;
+} spill_reader_t;
+
+// Mapped training files cut into segments at pre-token boundaries. Threads
+// claim segments one at a time and count into their own table, which is
+// spilled once it would grow past max_slots.
+typedef struct count_corpus_job {
+    corpus_segment_t* segments;
+    size_t num_segments;
+    atomic_size_t next_segment;
+    atomic_int failed;              // errno of the first failure
+    word_counts_t* counts;          // one per thread
+    size_t max_slots;               // 0 to never spill
+    spill_file_t* spills;           // one per thread when max_slots is set
+} count_corpus_job_t;
+
+// Encoding of append-only text. Appending can only change the last two
+// GPT-2 chunks (a trailing "'l" becomes "'ll") and a special token cut off
+// at the end, so only their bytes are kept and re-encoded along with the
+// new text.
+typedef struct {
+    PyObject_HEAD
+    PyObject* owner;            // keeps the trie and merges alive
+    bpe_encoder_t encoder;
+    token_buffer_t tokens;
+    size_t stable_tokens;       // tokens before the tail
+    unsigned char* tail;
+    size_t tail_length;
+    size_t tail_capacity;
+} EncodeSessionObject;
+
+// Read-write token ids in one malloc'd block, exported through the buffer
+// protocol as uint16 ("H") or uint32 ("I") so NumPy and PyTorch can wrap
+// it without copying. Offsets into other arrays use uint64 ("Q"). With a
+// row_length the buffer is exported as rows of it, len and indexing still
+// go over every id.
+typedef struct {
+    PyObject_HEAD
+    void* data;
+    Py_ssize_t length;
+    Py_ssize_t itemsize;
+    Py_ssize_t row_length;      // 0 for a flat array
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+} TokenArrayObject;
+
 // Function prototypes
-void print_bytes(text_chunk_node_t* node);
-unsigned long hash_text(unsigned short unigram1, unsigned short unigram2);
-void dfs(unsigned short* token, unsigned short index, token_node_t** token_table, int* result_count, unsigned short token_idx_end, size_t max_size);
+size_t hash_bigram(uint64_t key, size_t mask);
+int dfs(unsigned char* token, bpe_token_t index, token_node_t** token_table, size_t* result_count, bpe_token_t token_idx_end, size_t max_size);
 token_node_t* create_token(bigram_node_t** max_node);
-text_chunk_node_t* create_text_chunk_node(unsigned short* word, size_t size, unsigned short count);
-bigram_node_t* create_bigram_node(unsigned short unigram1, unsigned short unigram2, int freq);
-void update_text_table(text_chunk_node_t** text_table, unsigned short* word, size_t size, unsigned short count, unsigned int* text_table_idx);
-void update_bigram_table(unsigned short unigram1, unsigned short unigram2, int count, bigram_node_t **bigram_table);
-unsigned short* word_to_ints(char* word);
-void init_stats(text_chunk_node_t* text_node, bigram_node_t **bigram_table);
-bigram_node_t** build_bigram_table(text_chunk_node_t** text_table, unsigned int text_table_len);
-void word_retokenize(text_chunk_node_t* text_chunk_node, bigram_node_t **max_node, bigram_node_t** bigram_table, unsigned short token_idx);
-void retokenize(int text_table_len, text_chunk_node_t** text_table, bigram_node_t** max_node,  bigram_node_t** bigram_table, unsigned short token_idx);
-void update_max_node(bigram_node_t** max_node, bigram_node_t** bigram_table, token_node_t** token_table, unsigned short token_idx);
-void free_bigram_table(bigram_node_t** bigram_table);
-size_t get_array_size(unsigned short* array);
-void cleanup_train_resources(text_chunk_node_t **text_table, int text_table_len, bigram_node_t **bigram_table, token_node_t **token_table, int token_idx_start, int token_idx_end, unsigned short *token);
+int init_text_table(text_table_t* text_table, size_t num_words, size_t num_tokens, int wide);
+int text_table_add(text_table_t* text_table, const unsigned char* word, uint32_t length, bpe_count_t count);
+void free_text_table(text_table_t* text_table);
+bigram_table_t* create_bigram_table(size_t expected_size);
+void remove_bigram(bigram_table_t* table, bigram_heap_t* heap, bigram_node_t* node);
+int update_bigram_table(bpe_token_t unigram1, bpe_token_t unigram2, bpe_count_t count, unsigned int word_idx, bigram_table_t* bigram_table, bigram_heap_t* heap);
+int merge_bigram_table(bigram_table_t* bigram_table, bigram_heap_t* heap, bigram_table_t* delta);
+void clear_bigram_table(bigram_table_t* bigram_table);
+int init_stats(const text_table_t* text_table, unsigned int word_idx, bigram_table_t* bigram_table, bigram_heap_t* heap);
+bigram_table_t* build_bigram_table(text_table_t* text_table, bigram_heap_t* heap, train_pool_t* pool);
+int word_retokenize(text_table_t* text_table, unsigned int word_idx, const bpe_token_t* merge_pair, bigram_table_t* bigram_table, bigram_heap_t* heap, bpe_token_t token_idx);
+int retokenize(text_table_t* text_table, bigram_node_t** max_node, bigram_table_t* bigram_table, bigram_heap_t* heap, bpe_token_t token_idx, train_pool_t* pool);
+int update_max_node(bigram_node_t** max_node, bigram_heap_t* heap, token_node_t** token_table, bpe_token_t token_idx);
+void free_bigram_table(bigram_table_t* bigram_table);
+bigram_node_t* find_bigram(bigram_table_t* bigram_table, bpe_token_t unigram1, bpe_token_t unigram2);
+int write_checkpoint(const train_options_t* options, const text_table_t* text_table, token_node_t** token_table, bpe_token_t token_idx, size_t max_length);
+void cleanup_train_resources(text_table_t* text_table, bigram_table_t* bigram_table, bigram_heap_t* heap, token_node_t **token_table, int token_idx_start, int token_idx_end, unsigned char *token);
+
+// Training thread pool functions
+train_pool_t* create_train_pool(int num_threads);
+void train_pool_run(train_pool_t* pool, train_job_fn job, void* job_arg);
+void free_train_pool(train_pool_t* pool);
+
+// Bigram heap functions
+bigram_heap_t* create_bigram_heap(size_t capacity);
+int bigram_heap_push(bigram_heap_t* heap, bigram_node_t* node);
+void bigram_heap_update(bigram_heap_t* heap, bigram_node_t* node);
+void bigram_heap_remove(bigram_heap_t* heap, bigram_node_t* node);
+void free_bigram_heap(bigram_heap_t* heap);
 
 // Trie functions
-trie_node* create_node();
-Trie* create_trie();
-void insert_trie(Trie* trie, unsigned char* token, int token_length, int token_id);
+Trie* create_trie(trie_entry_t* entries, int num_entries);
 int search_trie(Trie* trie, unsigned char* text, int text_length, int* match_length);
-void free_trie_node(trie_node* node);
 void free_trie(Trie* trie);
 
+// Special token functions
+special_tokens_t* create_special_tokens(const trie_entry_t* entries, int num_entries);
+Py_ssize_t find_special_token(const special_tokens_t* special, const unsigned char* text, Py_ssize_t length, uint32_t* match_length, uint32_t* token_id);
+uint32_t special_token_length(const special_tokens_t* special, uint32_t token_id);
+int special_token_spans(const special_tokens_t* special, const unsigned char* text, size_t length, size_t cut);
+void free_special_tokens(special_tokens_t* special);
+
+// Merge-order encoding functions
+merge_table_t* create_merge_table(size_t expected_size, size_t cache_capacity);
+uint32_t merge_table_lookup(merge_table_t* table, uint32_t left, uint32_t right);
+int merge_table_insert(merge_table_t* table, uint32_t left, uint32_t right, uint32_t token_id);
+int bpe_merge_chunk(merge_table_t* table, const unsigned char* text, int length, uint32_t* out);
+int encode_chunk_merges(merge_table_t* table, encode_cache_t* cache, const unsigned char* text, int length, uint32_t* out);
+int merge_table_token_lengths(merge_table_t* table);
+void free_merge_table(merge_table_t* table);
+int init_encode_cache(encode_cache_t* cache, size_t capacity);
+encode_cache_entry_t* encode_cache_get(encode_cache_t* cache, const unsigned char* text, int length, uint64_t hash);
+void encode_cache_put(encode_cache_t* cache, const unsigned char* text, int length, uint64_t hash, const uint32_t* tokens, int num_tokens);
+void free_encode_cache(encode_cache_t* cache);
+
+// Decoding functions
+void free_vocab(vocab_t* vocab);
+
+// Binary file functions
+bpe_mapping_t* map_file(const char* path);
+void release_mapping(bpe_mapping_t* mapping);
+int validate_binary(const unsigned char* data, size_t length);
+
+// Native pre-tokenization and encoding functions
+int unicode_char_class(uint32_t codepoint);
+void init_ascii_runs(void);
+Py_ssize_t gpt2_next_chunk(const unsigned char* text, Py_ssize_t length, Py_ssize_t pos);
+int encode_chunk_trie(Trie* trie, const unsigned char* text, int length, uint32_t* out);
+int token_buffer_reserve(token_buffer_t* buffer, size_t extra);
+void free_token_buffer(token_buffer_t* buffer);
+int encode_chunk_tokens(const bpe_encoder_t* encoder, const unsigned char* text, int length, token_buffer_t* out);
+int encode_chunk_spans(const bpe_encoder_t* encoder, const unsigned char* text, int length, uint64_t start, token_buffer_t* out);
+int encode_text_tokens(const bpe_encoder_t* encoder, const unsigned char* text, Py_ssize_t length, token_buffer_t* out);
+int count_chunk_trie(Trie* trie, const unsigned char* text, int length);
+int count_chunk_tokens(const bpe_encoder_t* encoder, const unsigned char* text, int length, token_buffer_t* scratch, size_t* count);
+int count_text_tokens(const bpe_encoder_t* encoder, const unsigned char* text, Py_ssize_t length, token_buffer_t* scratch, size_t* count);
+void set_padding_spans(token_buffer_t* buffer, size_t count);
+int finish_token_buffer(token_buffer_t* buffer, int eos_token, Py_ssize_t seq_len);
+int store_tokens(void* dst, const uint32_t* src, size_t count, int itemsize);
+void fill_tokens(void* dst, uint32_t token, size_t count, int itemsize);
+int init_word_counts(word_counts_t* counts, size_t capacity);
+int word_counts_add(word_counts_t* counts, const unsigned char* word, uint32_t length, uint64_t hash, bpe_count_t count);
+void free_word_counts(word_counts_t* counts);
+int open_spill_file(spill_file_t* spill, const char* dir);
+int spill_word_counts(word_counts_t* counts, spill_file_t* spill);
+void close_spill_file(spill_file_t* spill);
+int merge_spill_runs(spill_file_t* spills, int num_spills, size_t memory, bpe_count_t min_count, text_table_t* text_table, size_t* max_length);
+int split_corpus(const unsigned char* text, size_t length, size_t target, corpus_segment_t** segments, size_t* num_segments, size_t* capacity);
+
 // Python C API functions
 static void trie_capsule_destructor(PyObject *capsule);
+static PyObject* train_text_table(text_table_t* text_table, size_t max_length, int num_merges, int num_threads, const train_options_t* options);
+static int init_train_options(train_options_t* options, PyObject* decode_dict, PyObject* merges_capsule, int num_merges, const char* checkpoint_path, int checkpoint_every, const char* pattern, Py_ssize_t pattern_length);
 static PyObject* train(PyObject* self, PyObject* args);
+static PyObject* train_files(PyObject* self, PyObject* args);
+static PyObject* resume_training(PyObject* self, PyObject* args);
 static PyObject* build_trie(PyObject* self, PyObject* args);
+static PyObject* build_special_tokens(PyObject* self, PyObject* args);
+static PyObject* split_special_tokens(PyObject* self, PyObject* args);
 static PyObject* encode_train(PyObject* self, PyObject* args);
 static PyObject* encode_inference(PyObject* self, PyObject* args);
+static PyObject* build_merges(PyObject* self, PyObject* args);
+static PyObject* encode_merges(PyObject* self, PyObject* args);
+static PyObject* pretokenize(PyObject* self, PyObject* args);
+static PyObject* encode_text(PyObject* self, PyObject* args);
+static PyObject* tokens_to_python(token_buffer_t* buffer, int itemsize);
+static PyObject* encode_batch(PyObject* self, PyObject* args);
+static PyObject* count_tokens(PyObject* self, PyObject* args);
+static PyObject* count_tokens_batch(PyObject* self, PyObject* args);
+static PyObject* encode_files(PyObject* self, PyObject* args);
+static PyObject* build_vocab(PyObject* self, PyObject* args);
+static PyObject* decode(PyObject* self, PyObject* args);
+static PyObject* decode_batch(PyObject* self, PyObject* args);
+static PyObject* save_binary(PyObject* self, PyObject* args);
+static PyObject* load_binary(PyObject* self, PyObject* args);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,872 @@
+// Generated from the `regex` package (2026.9.29, Unicode 14.0.0) by classifying every
+// code point against \p{L}, \p{N} and \s, in that order. Do not edit by hand.
+#ifndef _UNICODE_TABLES_H
+#define _UNICODE_TABLES_H
+
+// CHAR_* class of each ASCII byte
+static const unsigned char ascii_char_class[128] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 3, 3, 3, 3, 3, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+};
+
+// Sorted, non-overlapping code point ranges above ASCII; anything not
+// listed is CHAR_OTHER
+static const unicode_range_t unicode_char_ranges[] = {
+    {0x0085, 0x0085, CHAR_SPACE},
+    {0x00A0, 0x00A0, CHAR_SPACE},
+    {0x00AA, 0x00AA, CHAR_LETTER},
+    {0x00B2, 0x00B3, CHAR_NUMBER},
+    {0x00B5, 0x00B5, CHAR_LETTER},
+    {0x00B9, 0x00B9, CHAR_NUMBER},
+    {0x00BA, 0x00BA, CHAR_LETTER},
+    {0x00BC, 0x00BE, CHAR_NUMBER},
+    {0x00C0, 0x00D6, CHAR_LETTER},
+    {0x00D8, 0x00F6, CHAR_LETTER},
+    {0x00F8, 0x02C1, CHAR_LETTER},
+    {0x02C6, 0x02D1, CHAR_LETTER},
+    {0x02E0, 0x02E4, CHAR_LETTER},
+    {0x02EC, 0x02EC, CHAR_LETTER},
+    {0x02EE, 0x02EE, CHAR_LETTER},
+    {0x0370, 0x0374, CHAR_LETTER},
+    {0x0376, 0x0377, CHAR_LETTER},
+    {0x037A, 0x037D, CHAR_LETTER},
+    {0x037F, 0x037F, CHAR_LETTER},
+    {0x0386, 0x0386, CHAR_LETTER},
+    {0x0388, 0x038A, CHAR_LETTER},
+    {0x038C, 0x038C, CHAR_LETTER},
+    {0x038E, 0x03A1, CHAR_LETTER},
+    {0x03A3, 0x03F5, CHAR_LETTER},
+    {0x03F7, 0x0481, CHAR_LETTER},
+    {0x048A, 0x052F, CHAR_LETTER},
+    {0x0531, 0x0556, CHAR_LETTER},
+    {0x0558, 0x0559, CHAR_LETTER},
+    {0x0560, 0x0588, CHAR_LETTER},
+    {0x058B, 0x058C, CHAR_LETTER},
+    {0x05D0, 0x05EA, CHAR_LETTER},
+    {0x05EF, 0x05F2, CHAR_LETTER},
+    {0x0620, 0x064A, CHAR_LETTER},
+    {0x0660, 0x0669, CHAR_NUMBER},
+    {0x066E, 0x066F, CHAR_LETTER},
+    {0x0671, 0x06D3, CHAR_LETTER},
+    {0x06D5, 0x06D5, CHAR_LETTER},
+    {0x06E5, 0x06E6, CHAR_LETTER},
+    {0x06EE, 0x06EF, CHAR_LETTER},
+    {0x06F0, 0x06F9, CHAR_NUMBER},
+    {0x06FA, 0x06FC, CHAR_LETTER},
+    {0x06FF, 0x06FF, CHAR_LETTER},
+    {0x0710, 0x0710, CHAR_LETTER},
+    {0x0712, 0x072F, CHAR_LETTER},
+    {0x074D, 0x07A5, CHAR_LETTER},
+    {0x07B1, 0x07B1, CHAR_LETTER},
+    {0x07C0, 0x07C9, CHAR_NUMBER},
+    {0x07CA, 0x07EA, CHAR_LETTER},
+    {0x07F4, 0x07F5, CHAR_LETTER},
+    {0x07FA, 0x07FA, CHAR_LETTER},
+    {0x0800, 0x0815, CHAR_LETTER},
+    {0x081A, 0x081A, CHAR_LETTER},
+    {0x0824, 0x0824, CHAR_LETTER},
+    {0x0828, 0x0828, CHAR_LETTER},
+    {0x0840, 0x0858, CHAR_LETTER},
+    {0x0860, 0x086A, CHAR_LETTER},
+    {0x0870, 0x0887, CHAR_LETTER},
+    {0x0889, 0x088F, CHAR_LETTER},
+    {0x08A0, 0x08C9, CHAR_LETTER},
+    {0x0904, 0x0939, CHAR_LETTER},
+    {0x093D, 0x093D, CHAR_LETTER},
+    {0x0950, 0x0950, CHAR_LETTER},
+    {0x0958, 0x0961, CHAR_LETTER},
+    {0x0966, 0x096F, CHAR_NUMBER},
+    {0x0971, 0x0980, CHAR_LETTER},
+    {0x0985, 0x098C, CHAR_LETTER},
+    {0x098F, 0x0990, CHAR_LETTER},
+    {0x0993, 0x09A8, CHAR_LETTER},
+    {0x09AA, 0x09B0, CHAR_LETTER},
+    {0x09B2, 0x09B2, CHAR_LETTER},
+    {0x09B6, 0x09B9, CHAR_LETTER},
+    {0x09BD, 0x09BD, CHAR_LETTER},
+    {0x09CE, 0x09CE, CHAR_LETTER},
+    {0x09DC, 0x09DD, CHAR_LETTER},
+    {0x09DF, 0x09E1, CHAR_LETTER},
+    {0x09E6, 0x09EF, CHAR_NUMBER},
+    {0x09F0, 0x09F1, CHAR_LETTER},
+    {0x09F4, 0x09F9, CHAR_NUMBER},
+    {0x09FC, 0x09FC, CHAR_LETTER},
+    {0x0A05, 0x0A0A, CHAR_LETTER},
+    {0x0A0F, 0x0A10, CHAR_LETTER},
+    {0x0A13, 0x0A28, CHAR_LETTER},
+    {0x0A2A, 0x0A30, CHAR_LETTER},
+    {0x0A32, 0x0A33, CHAR_LETTER},
+    {0x0A35, 0x0A36, CHAR_LETTER},
+    {0x0A38, 0x0A39, CHAR_LETTER},
+    {0x0A59, 0x0A5C, CHAR_LETTER},
+    {0x0A5E, 0x0A5E, CHAR_LETTER},
+    {0x0A66, 0x0A6F, CHAR_NUMBER},
+    {0x0A72, 0x0A74, CHAR_LETTER},
+    {0x0A85, 0x0A8D, CHAR_LETTER},
+    {0x0A8F, 0x0A91, CHAR_LETTER},
+    {0x0A93, 0x0AA8, CHAR_LETTER},
+    {0x0AAA, 0x0AB0, CHAR_LETTER},
+    {0x0AB2, 0x0AB3, CHAR_LETTER},
+    {0x0AB5, 0x0AB9, CHAR_LETTER},
+    {0x0ABD, 0x0ABD, CHAR_LETTER},
+    {0x0AD0, 0x0AD0, CHAR_LETTER},
+    {0x0AE0, 0x0AE1, CHAR_LETTER},
+    {0x0AE6, 0x0AEF, CHAR_NUMBER},
+    {0x0AF9, 0x0AF9, CHAR_LETTER},
+    {0x0B05, 0x0B0C, CHAR_LETTER},
+    {0x0B0F, 0x0B10, CHAR_LETTER},
+    {0x0B13, 0x0B28, CHAR_LETTER},
+    {0x0B2A, 0x0B30, CHAR_LETTER},
+    {0x0B32, 0x0B33, CHAR_LETTER},
+    {0x0B35, 0x0B39, CHAR_LETTER},
+    {0x0B3D, 0x0B3D, CHAR_LETTER},
+    {0x0B5C, 0x0B5D, CHAR_LETTER},
+    {0x0B5F, 0x0B61, CHAR_LETTER},
+    {0x0B66, 0x0B6F, CHAR_NUMBER},
+    {0x0B71, 0x0B71, CHAR_LETTER},
+    {0x0B72, 0x0B77, CHAR_NUMBER},
+    {0x0B83, 0x0B83, CHAR_LETTER},
+    {0x0B85, 0x0B8A, CHAR_LETTER},
+    {0x0B8E, 0x0B90, CHAR_LETTER},
+    {0x0B92, 0x0B95, CHAR_LETTER},
+    {0x0B99, 0x0B9A, CHAR_LETTER},
+    {0x0B9C, 0x0B9C, CHAR_LETTER},
+    {0x0B9E, 0x0B9F, CHAR_LETTER},
+    {0x0BA3, 0x0BA4, CHAR_LETTER},
+    {0x0BA8, 0x0BAA, CHAR_LETTER},
+    {0x0BAE, 0x0BB9, CHAR_LETTER},
+    {0x0BD0, 0x0BD0, CHAR_LETTER},
+    {0x0BE6, 0x0BF2, CHAR_NUMBER},
+    {0x0C05, 0x0C0C, CHAR_LETTER},
+    {0x0C0E, 0x0C10, CHAR_LETTER},
+    {0x0C12, 0x0C28, CHAR_LETTER},
+    {0x0C2A, 0x0C39, CHAR_LETTER},
+    {0x0C3D, 0x0C3D, CHAR_LETTER},
+    {0x0C58, 0x0C5A, CHAR_LETTER},
+    {0x0C5C, 0x0C5D, CHAR_LETTER},
+    {0x0C60, 0x0C61, CHAR_LETTER},
+    {0x0C66, 0x0C6F, CHAR_NUMBER},
+    {0x0C78, 0x0C7E, CHAR_NUMBER},
+    {0x0C80, 0x0C80, CHAR_LETTER},
+    {0x0C85, 0x0C8C, CHAR_LETTER},
+    {0x0C8E, 0x0C90, CHAR_LETTER},
+    {0x0C92, 0x0CA8, CHAR_LETTER},
+    {0x0CAA, 0x0CB3, CHAR_LETTER},
+    {0x0CB5, 0x0CB9, CHAR_LETTER},
+    {0x0CBD, 0x0CBD, CHAR_LETTER},
+    {0x0CDC, 0x0CDE, CHAR_LETTER},
+    {0x0CE0, 0x0CE1, CHAR_LETTER},
+    {0x0CE6, 0x0CEF, CHAR_NUMBER},
+    {0x0CF1, 0x0CF2, CHAR_LETTER},
+    {0x0D04, 0x0D0C, CHAR_LETTER},
+    {0x0D0E, 0x0D10, CHAR_LETTER},
+    {0x0D12, 0x0D3A, CHAR_LETTER},
+    {0x0D3D, 0x0D3D, CHAR_LETTER},
+    {0x0D4E, 0x0D4E, CHAR_LETTER},
+    {0x0D54, 0x0D56, CHAR_LETTER},
+    {0x0D58, 0x0D5E, CHAR_NUMBER},
+    {0x0D5F, 0x0D61, CHAR_LETTER},
+    {0x0D66, 0x0D78, CHAR_NUMBER},
+    {0x0D7A, 0x0D7F, CHAR_LETTER},
+    {0x0D85, 0x0D96, CHAR_LETTER},
+    {0x0D9A, 0x0DB1, CHAR_LETTER},
+    {0x0DB3, 0x0DBB, CHAR_LETTER},
+    {0x0DBD, 0x0DBD, CHAR_LETTER},
+    {0x0DC0, 0x0DC6, CHAR_LETTER},
+    {0x0DE6, 0x0DEF, CHAR_NUMBER},
+    {0x0E01, 0x0E30, CHAR_LETTER},
+    {0x0E32, 0x0E33, CHAR_LETTER},
+    {0x0E40, 0x0E46, CHAR_LETTER},
+    {0x0E50, 0x0E59, CHAR_NUMBER},
+    {0x0E81, 0x0E82, CHAR_LETTER},
+    {0x0E84, 0x0E84, CHAR_LETTER},
+    {0x0E86, 0x0E8A, CHAR_LETTER},
+    {0x0E8C, 0x0EA3, CHAR_LETTER},
+    {0x0EA5, 0x0EA5, CHAR_LETTER},
+    {0x0EA7, 0x0EB0, CHAR_LETTER},
+    {0x0EB2, 0x0EB3, CHAR_LETTER},
+    {0x0EBD, 0x0EBD, CHAR_LETTER},
+    {0x0EC0, 0x0EC4, CHAR_LETTER},
+    {0x0EC6, 0x0EC6, CHAR_LETTER},
+    {0x0ED0, 0x0ED9, CHAR_NUMBER},
+    {0x0EDC, 0x0EDF, CHAR_LETTER},
+    {0x0F00, 0x0F00, CHAR_LETTER},
+    {0x0F20, 0x0F33, CHAR_NUMBER},
+    {0x0F40, 0x0F47, CHAR_LETTER},
+    {0x0F49, 0x0F6C, CHAR_LETTER},
+    {0x0F88, 0x0F8C, CHAR_LETTER},
+    {0x1000, 0x102A, CHAR_LETTER},
+    {0x103F, 0x103F, CHAR_LETTER},
+    {0x1040, 0x1049, CHAR_NUMBER},
+    {0x1050, 0x1055, CHAR_LETTER},
+    {0x105A, 0x105D, CHAR_LETTER},
+    {0x1061, 0x1061, CHAR_LETTER},
+    {0x1065, 0x1066, CHAR_LETTER},
+    {0x106E, 0x1070, CHAR_LETTER},
+    {0x1075, 0x1081, CHAR_LETTER},
+    {0x108E, 0x108E, CHAR_LETTER},
+    {0x1090, 0x1099, CHAR_NUMBER},
+    {0x10A0, 0x10C5, CHAR_LETTER},
+    {0x10C7, 0x10C7, CHAR_LETTER},
+    {0x10CD, 0x10CD, CHAR_LETTER},
+    {0x10D0, 0x10FA, CHAR_LETTER},
+    {0x10FC, 0x1248, CHAR_LETTER},
+    {0x124A, 0x124D, CHAR_LETTER},
+    {0x1250, 0x1256, CHAR_LETTER},
+    {0x1258, 0x1258, CHAR_LETTER},
+    {0x125A, 0x125D, CHAR_LETTER},
+    {0x1260, 0x1288, CHAR_LETTER},
+    {0x128A, 0x128D, CHAR_LETTER},
+    {0x1290, 0x12B0, CHAR_LETTER},
+    {0x12B2, 0x12B5, CHAR_LETTER},
+    {0x12B8, 0x12BE, CHAR_LETTER},
+    {0x12C0, 0x12C0, CHAR_LETTER},
+    {0x12C2, 0x12C5, CHAR_LETTER},
+    {0x12C8, 0x12D6, CHAR_LETTER},
+    {0x12D8, 0x1310, CHAR_LETTER},
+    {0x1312, 0x1315, CHAR_LETTER},
+    {0x1318, 0x135A, CHAR_LETTER},
+    {0x1369, 0x137C, CHAR_NUMBER},
+    {0x1380, 0x138F, CHAR_LETTER},
+    {0x13A0, 0x13F5, CHAR_LETTER},
+    {0x13F8, 0x13FD, CHAR_LETTER},
+    {0x1401, 0x166C, CHAR_LETTER},
+    {0x166F, 0x167F, CHAR_LETTER},
+    {0x1680, 0x1680, CHAR_SPACE},
+    {0x1681, 0x169A, CHAR_LETTER},
+    {0x16A0, 0x16EA, CHAR_LETTER},
+    {0x16EE, 0x16F0, CHAR_NUMBER},
+    {0x16F1, 0x16F8, CHAR_LETTER},
+    {0x1700, 0x1711, CHAR_LETTER},
+    {0x171F, 0x1731, CHAR_LETTER},
+    {0x1740, 0x1751, CHAR_LETTER},
+    {0x1760, 0x176C, CHAR_LETTER},
+    {0x176E, 0x1770, CHAR_LETTER},
+    {0x1780, 0x17B3, CHAR_LETTER},
+    {0x17D7, 0x17D7, CHAR_LETTER},
+    {0x17DC, 0x17DC, CHAR_LETTER},
+    {0x17E0, 0x17E9, CHAR_NUMBER},
+    {0x17F0, 0x17F9, CHAR_NUMBER},
+    {0x1810, 0x1819, CHAR_NUMBER},
+    {0x1820, 0x1878, CHAR_LETTER},
+    {0x1880, 0x1884, CHAR_LETTER},
+    {0x1887, 0x18A8, CHAR_LETTER},
+    {0x18AA, 0x18AA, CHAR_LETTER},
+    {0x18B0, 0x18F5, CHAR_LETTER},
+    {0x1900, 0x191E, CHAR_LETTER},
+    {0x1946, 0x194F, CHAR_NUMBER},
+    {0x1950, 0x196D, CHAR_LETTER},
+    {0x1970, 0x1974, CHAR_LETTER},
+    {0x1980, 0x19AB, CHAR_LETTER},
+    {0x19B0, 0x19C9, CHAR_LETTER},
+    {0x19D0, 0x19DA, CHAR_NUMBER},
+    {0x1A00, 0x1A16, CHAR_LETTER},
+    {0x1A20, 0x1A54, CHAR_LETTER},
+    {0x1A80, 0x1A89, CHAR_NUMBER},
+    {0x1A90, 0x1A99, CHAR_NUMBER},
+    {0x1AA7, 0x1AA7, CHAR_LETTER},
+    {0x1B05, 0x1B33, CHAR_LETTER},
+    {0x1B45, 0x1B4C, CHAR_LETTER},
+    {0x1B50, 0x1B59, CHAR_NUMBER},
+    {0x1B83, 0x1BA0, CHAR_LETTER},
+    {0x1BAE, 0x1BAF, CHAR_LETTER},
+    {0x1BB0, 0x1BB9, CHAR_NUMBER},
+    {0x1BBA, 0x1BE5, CHAR_LETTER},
+    {0x1C00, 0x1C23, CHAR_LETTER},
+    {0x1C40, 0x1C49, CHAR_NUMBER},
+    {0x1C4D, 0x1C4F, CHAR_LETTER},
+    {0x1C50, 0x1C59, CHAR_NUMBER},
+    {0x1C5A, 0x1C7D, CHAR_LETTER},
+    {0x1C80, 0x1C8A, CHAR_LETTER},
+    {0x1C90, 0x1CBA, CHAR_LETTER},
+    {0x1CBD, 0x1CBF, CHAR_LETTER},
+    {0x1CE9, 0x1CEC, CHAR_LETTER},
+    {0x1CEE, 0x1CF3, CHAR_LETTER},
+    {0x1CF5, 0x1CF6, CHAR_LETTER},
+    {0x1CFA, 0x1CFA, CHAR_LETTER},
+    {0x1D00, 0x1DBF, CHAR_LETTER},
+    {0x1E00, 0x1F15, CHAR_LETTER},
+    {0x1F18, 0x1F1D, CHAR_LETTER},
+    {0x1F20, 0x1F45, CHAR_LETTER},
+    {0x1F48, 0x1F4D, CHAR_LETTER},
+    {0x1F50, 0x1F57, CHAR_LETTER},
+    {0x1F59, 0x1F59, CHAR_LETTER},
+    {0x1F5B, 0x1F5B, CHAR_LETTER},
+    {0x1F5D, 0x1F5D, CHAR_LETTER},
+    {0x1F5F, 0x1F7D, CHAR_LETTER},
+    {0x1F80, 0x1FB4, CHAR_LETTER},
+    {0x1FB6, 0x1FBC, CHAR_LETTER},
+    {0x1FBE, 0x1FBE, CHAR_LETTER},
+    {0x1FC2, 0x1FC4, CHAR_LETTER},
+    {0x1FC6, 0x1FCC, CHAR_LETTER},
+    {0x1FD0, 0x1FD3, CHAR_LETTER},
+    {0x1FD6, 0x1FDB, CHAR_LETTER},
+    {0x1FE0, 0x1FEC, CHAR_LETTER},
+    {0x1FF2, 0x1FF4, CHAR_LETTER},
+    {0x1FF6, 0x1FFC, CHAR_LETTER},
+    {0x2000, 0x200A, CHAR_SPACE},
+    {0x2028, 0x2029, CHAR_SPACE},
+    {0x202F, 0x202F, CHAR_SPACE},
+    {0x205F, 0x205F, CHAR_SPACE},
+    {0x2070, 0x2070, CHAR_NUMBER},
+    {0x2071, 0x2071, CHAR_LETTER},
+    {0x2074, 0x2079, CHAR_NUMBER},
+    {0x207F, 0x207F, CHAR_LETTER},
+    {0x2080, 0x2089, CHAR_NUMBER},
+    {0x208F, 0x209F, CHAR_LETTER},
+    {0x2102, 0x2102, CHAR_LETTER},
+    {0x2107, 0x2107, CHAR_LETTER},
+    {0x210A, 0x2113, CHAR_LETTER},
+    {0x2115, 0x2115, CHAR_LETTER},
+    {0x2119, 0x211D, CHAR_LETTER},
+    {0x2124, 0x2124, CHAR_LETTER},
+    {0x2126, 0x2126, CHAR_LETTER},
+    {0x2128, 0x2128, CHAR_LETTER},
+    {0x212A, 0x212D, CHAR_LETTER},
+    {0x212F, 0x2139, CHAR_LETTER},
+    {0x213C, 0x213F, CHAR_LETTER},
+    {0x2145, 0x2149, CHAR_LETTER},
+    {0x214E, 0x214E, CHAR_LETTER},
+    {0x2150, 0x2182, CHAR_NUMBER},
+    {0x2183, 0x2184, CHAR_LETTER},
+    {0x2185, 0x2189, CHAR_NUMBER},
+    {0x2460, 0x249B, CHAR_NUMBER},
+    {0x24EA, 0x24FF, CHAR_NUMBER},
+    {0x2776, 0x2793, CHAR_NUMBER},
+    {0x2C00, 0x2CE4, CHAR_LETTER},
+    {0x2CEB, 0x2CEE, CHAR_LETTER},
+    {0x2CF2, 0x2CF3, CHAR_LETTER},
+    {0x2CFD, 0x2CFD, CHAR_NUMBER},
+    {0x2D00, 0x2D25, CHAR_LETTER},
+    {0x2D27, 0x2D27, CHAR_LETTER},
+    {0x2D2D, 0x2D2D, CHAR_LETTER},
+    {0x2D30, 0x2D67, CHAR_LETTER},
+    {0x2D6F, 0x2D6F, CHAR_LETTER},
+    {0x2D80, 0x2D96, CHAR_LETTER},
+    {0x2DA0, 0x2DA6, CHAR_LETTER},
+    {0x2DA8, 0x2DAE, CHAR_LETTER},
+    {0x2DB0, 0x2DB6, CHAR_LETTER},
+    {0x2DB8, 0x2DBE, CHAR_LETTER},
+    {0x2DC0, 0x2DC6, CHAR_LETTER},
+    {0x2DC8, 0x2DCE, CHAR_LETTER},
+    {0x2DD0, 0x2DD6, CHAR_LETTER},
+    {0x2DD8, 0x2DDE, CHAR_LETTER},
+    {0x2E2F, 0x2E2F, CHAR_LETTER},
+    {0x3000, 0x3000, CHAR_SPACE},
+    {0x3005, 0x3006, CHAR_LETTER},
+    {0x3007, 0x3007, CHAR_NUMBER},
+    {0x3021, 0x3029, CHAR_NUMBER},
+    {0x3031, 0x3035, CHAR_LETTER},
+    {0x3038, 0x303A, CHAR_NUMBER},
+    {0x303B, 0x303C, CHAR_LETTER},
+    {0x3041, 0x3096, CHAR_LETTER},
+    {0x309D, 0x309F, CHAR_LETTER},
+    {0x30A1, 0x30FA, CHAR_LETTER},
+    {0x30FC, 0x30FF, CHAR_LETTER},
+    {0x3105, 0x312F, CHAR_LETTER},
+    {0x3131, 0x318E, CHAR_LETTER},
+    {0x3192, 0x3195, CHAR_NUMBER},
+    {0x31A0, 0x31BF, CHAR_LETTER},
+    {0x31F0, 0x31FF, CHAR_LETTER},
+    {0x3220, 0x3229, CHAR_NUMBER},
+    {0x3248, 0x324F, CHAR_NUMBER},
+    {0x3251, 0x325F, CHAR_NUMBER},
+    {0x3280, 0x3289, CHAR_NUMBER},
+    {0x32B1, 0x32BF, CHAR_NUMBER},
+    {0x3400, 0x4DBF, CHAR_LETTER},
+    {0x4E00, 0xA48C, CHAR_LETTER},
+    {0xA4D0, 0xA4FD, CHAR_LETTER},
+    {0xA500, 0xA60C, CHAR_LETTER},
+    {0xA610, 0xA61F, CHAR_LETTER},
+    {0xA620, 0xA629, CHAR_NUMBER},
+    {0xA62A, 0xA62B, CHAR_LETTER},
+    {0xA640, 0xA66E, CHAR_LETTER},
+    {0xA67F, 0xA69D, CHAR_LETTER},
+    {0xA6A0, 0xA6E5, CHAR_LETTER},
+    {0xA6E6, 0xA6EF, CHAR_NUMBER},
+    {0xA717, 0xA71F, CHAR_LETTER},
+    {0xA722, 0xA788, CHAR_LETTER},
+    {0xA78B, 0xA7DD, CHAR_LETTER},
+    {0xA7E2, 0xA7E2, CHAR_LETTER},
+    {0xA7F1, 0xA801, CHAR_LETTER},
+    {0xA803, 0xA805, CHAR_LETTER},
+    {0xA807, 0xA80A, CHAR_LETTER},
+    {0xA80C, 0xA822, CHAR_LETTER},
+    {0xA830, 0xA835, CHAR_NUMBER},
+    {0xA840, 0xA873, CHAR_LETTER},
+    {0xA882, 0xA8B3, CHAR_LETTER},
+    {0xA8D0, 0xA8D9, CHAR_NUMBER},
+    {0xA8F2, 0xA8F7, CHAR_LETTER},
+    {0xA8FB, 0xA8FB, CHAR_LETTER},
+    {0xA8FD, 0xA8FE, CHAR_LETTER},
+    {0xA900, 0xA909, CHAR_NUMBER},
+    {0xA90A, 0xA925, CHAR_LETTER},
+    {0xA930, 0xA946, CHAR_LETTER},
+    {0xA960, 0xA97C, CHAR_LETTER},
+    {0xA984, 0xA9B2, CHAR_LETTER},
+    {0xA9CF, 0xA9CF, CHAR_LETTER},
+    {0xA9D0, 0xA9D9, CHAR_NUMBER},
+    {0xA9E0, 0xA9E4, CHAR_LETTER},
+    {0xA9E6, 0xA9EF, CHAR_LETTER},
+    {0xA9F0, 0xA9F9, CHAR_NUMBER},
+    {0xA9FA, 0xA9FE, CHAR_LETTER},
+    {0xAA00, 0xAA28, CHAR_LETTER},
+    {0xAA40, 0xAA42, CHAR_LETTER},
+    {0xAA44, 0xAA4B, CHAR_LETTER},
+    {0xAA50, 0xAA59, CHAR_NUMBER},
+    {0xAA60, 0xAA76, CHAR_LETTER},
+    {0xAA7A, 0xAA7A, CHAR_LETTER},
+    {0xAA7E, 0xAAAF, CHAR_LETTER},
+    {0xAAB1, 0xAAB1, CHAR_LETTER},
+    {0xAAB5, 0xAAB6, CHAR_LETTER},
+    {0xAAB9, 0xAABD, CHAR_LETTER},
+    {0xAAC0, 0xAAC0, CHAR_LETTER},
+    {0xAAC2, 0xAAC2, CHAR_LETTER},
+    {0xAADB, 0xAADD, CHAR_LETTER},
+    {0xAAE0, 0xAAEA, CHAR_LETTER},
+    {0xAAF2, 0xAAF4, CHAR_LETTER},
+    {0xAB01, 0xAB06, CHAR_LETTER},
+    {0xAB09, 0xAB0E, CHAR_LETTER},
+    {0xAB11, 0xAB16, CHAR_LETTER},
+    {0xAB20, 0xAB26, CHAR_LETTER},
+    {0xAB28, 0xAB2E, CHAR_LETTER},
+    {0xAB30, 0xAB5A, CHAR_LETTER},
+    {0xAB5C, 0xAB69, CHAR_LETTER},
+    {0xAB6C, 0xAB6D, CHAR_LETTER},
+    {0xAB70, 0xABE2, CHAR_LETTER},
+    {0xABF0, 0xABF9, CHAR_NUMBER},
+    {0xAC00, 0xD7A3, CHAR_LETTER},
+    {0xD7B0, 0xD7C6, CHAR_LETTER},
+    {0xD7CB, 0xD7FB, CHAR_LETTER},
+    {0xF900, 0xFA6D, CHAR_LETTER},
+    {0xFA70, 0xFAD9, CHAR_LETTER},
+    {0xFB00, 0xFB06, CHAR_LETTER},
+    {0xFB13, 0xFB17, CHAR_LETTER},
+    {0xFB1D, 0xFB1D, CHAR_LETTER},
+    {0xFB1F, 0xFB28, CHAR_LETTER},
+    {0xFB2A, 0xFB36, CHAR_LETTER},
+    {0xFB38, 0xFB3C, CHAR_LETTER},
+    {0xFB3E, 0xFB3E, CHAR_LETTER},
+    {0xFB40, 0xFB41, CHAR_LETTER},
+    {0xFB43, 0xFB44, CHAR_LETTER},
+    {0xFB46, 0xFBB1, CHAR_LETTER},
+    {0xFBD3, 0xFD3D, CHAR_LETTER},
+    {0xFD50, 0xFD8F, CHAR_LETTER},
+    {0xFD92, 0xFDC7, CHAR_LETTER},
+    {0xFDF0, 0xFDFB, CHAR_LETTER},
+    {0xFE70, 0xFE74, CHAR_LETTER},
+    {0xFE76, 0xFEFC, CHAR_LETTER},
+    {0xFF10, 0xFF19, CHAR_NUMBER},
+    {0xFF21, 0xFF3A, CHAR_LETTER},
+    {0xFF41, 0xFF5A, CHAR_LETTER},
+    {0xFF66, 0xFFBE, CHAR_LETTER},
+    {0xFFC2, 0xFFC7, CHAR_LETTER},
+    {0xFFCA, 0xFFCF, CHAR_LETTER},
+    {0xFFD2, 0xFFD7, CHAR_LETTER},
+    {0xFFDA, 0xFFDC, CHAR_LETTER},
+    {0x10000, 0x1000B, CHAR_LETTER},
+    {0x1000D, 0x10026, CHAR_LETTER},
+    {0x10028, 0x1003A, CHAR_LETTER},
+    {0x1003C, 0x1003D, CHAR_LETTER},
+    {0x1003F, 0x1004D, CHAR_LETTER},
+    {0x10050, 0x1005D, CHAR_LETTER},
+    {0x10080, 0x100FA, CHAR_LETTER},
+    {0x10107, 0x10133, CHAR_NUMBER},
+    {0x10140, 0x10178, CHAR_NUMBER},
+    {0x1018A, 0x1018B, CHAR_NUMBER},
+    {0x10280, 0x1029C, CHAR_LETTER},
+    {0x102A0, 0x102D0, CHAR_LETTER},
+    {0x102E1, 0x102FB, CHAR_NUMBER},
+    {0x10300, 0x1031F, CHAR_LETTER},
+    {0x10320, 0x10323, CHAR_NUMBER},
+    {0x1032D, 0x10340, CHAR_LETTER},
+    {0x10341, 0x10341, CHAR_NUMBER},
+    {0x10342, 0x10349, CHAR_LETTER},
+    {0x1034A, 0x1034A, CHAR_NUMBER},
+    {0x10350, 0x10375, CHAR_LETTER},
+    {0x10380, 0x1039D, CHAR_LETTER},
+    {0x103A0, 0x103C3, CHAR_LETTER},
+    {0x103C8, 0x103CF, CHAR_LETTER},
+    {0x103D1, 0x103D5, CHAR_NUMBER},
+    {0x10400, 0x1049D, CHAR_LETTER},
+    {0x104A0, 0x104A9, CHAR_NUMBER},
+    {0x104B0, 0x104D3, CHAR_LETTER},
+    {0x104D8, 0x104FB, CHAR_LETTER},
+    {0x10500, 0x10527, CHAR_LETTER},
+    {0x10530, 0x10563, CHAR_LETTER},
+    {0x10570, 0x1057A, CHAR_LETTER},
+    {0x1057C, 0x1058A, CHAR_LETTER},
+    {0x1058C, 0x10592, CHAR_LETTER},
+    {0x10594, 0x10595, CHAR_LETTER},
+    {0x10597, 0x105A1, CHAR_LETTER},
+    {0x105A3, 0x105B1, CHAR_LETTER},
+    {0x105B3, 0x105B9, CHAR_LETTER},
+    {0x105BB, 0x105BC, CHAR_LETTER},
+    {0x105C0, 0x105F3, CHAR_LETTER},
+    {0x10600, 0x10736, CHAR_LETTER},
+    {0x10740, 0x10755, CHAR_LETTER},
+    {0x10760, 0x10767, CHAR_LETTER},
+    {0x10780, 0x10785, CHAR_LETTER},
+    {0x10787, 0x107B0, CHAR_LETTER},
+    {0x107B2, 0x107BF, CHAR_LETTER},
+    {0x10800, 0x10805, CHAR_LETTER},
+    {0x10808, 0x10808, CHAR_LETTER},
+    {0x1080A, 0x10835, CHAR_LETTER},
+    {0x10837, 0x10838, CHAR_LETTER},
+    {0x1083C, 0x1083C, CHAR_LETTER},
+    {0x1083F, 0x10855, CHAR_LETTER},
+    {0x10858, 0x1085F, CHAR_NUMBER},
+    {0x10860, 0x10876, CHAR_LETTER},
+    {0x10879, 0x1087F, CHAR_NUMBER},
+    {0x10880, 0x1089E, CHAR_LETTER},
+    {0x108A7, 0x108AF, CHAR_NUMBER},
+    {0x108E0, 0x108F2, CHAR_LETTER},
+    {0x108F4, 0x108F5, CHAR_LETTER},
+    {0x108FB, 0x108FF, CHAR_NUMBER},
+    {0x10900, 0x10915, CHAR_LETTER},
+    {0x10916, 0x1091B, CHAR_NUMBER},
+    {0x10920, 0x10939, CHAR_LETTER},
+    {0x10940, 0x10959, CHAR_LETTER},
+    {0x10980, 0x109B7, CHAR_LETTER},
+    {0x109BC, 0x109BD, CHAR_NUMBER},
+    {0x109BE, 0x109BF, CHAR_LETTER},
+    {0x109C0, 0x109CF, CHAR_NUMBER},
+    {0x109D2, 0x109FF, CHAR_NUMBER},
+    {0x10A00, 0x10A00, CHAR_LETTER},
+    {0x10A10, 0x10A13, CHAR_LETTER},
+    {0x10A15, 0x10A17, CHAR_LETTER},
+    {0x10A19, 0x10A35, CHAR_LETTER},
+    {0x10A40, 0x10A48, CHAR_NUMBER},
+    {0x10A60, 0x10A7C, CHAR_LETTER},
+    {0x10A7D, 0x10A7E, CHAR_NUMBER},
+    {0x10A80, 0x10A9C, CHAR_LETTER},
+    {0x10A9D, 0x10A9F, CHAR_NUMBER},
+    {0x10AC0, 0x10AC7, CHAR_LETTER},
+    {0x10AC9, 0x10AE4, CHAR_LETTER},
+    {0x10AEB, 0x10AEF, CHAR_NUMBER},
+    {0x10B00, 0x10B35, CHAR_LETTER},
+    {0x10B40, 0x10B55, CHAR_LETTER},
+    {0x10B58, 0x10B5F, CHAR_NUMBER},
+    {0x10B60, 0x10B72, CHAR_LETTER},
+    {0x10B78, 0x10B7F, CHAR_NUMBER},
+    {0x10B80, 0x10B91, CHAR_LETTER},
+    {0x10BA9, 0x10BAF, CHAR_NUMBER},
+    {0x10C00, 0x10C48, CHAR_LETTER},
+    {0x10C80, 0x10CB2, CHAR_LETTER},
+    {0x10CC0, 0x10CF2, CHAR_LETTER},
+    {0x10CFA, 0x10CFF, CHAR_NUMBER},
+    {0x10D00, 0x10D23, CHAR_LETTER},
+    {0x10D30, 0x10D39, CHAR_NUMBER},
+    {0x10D40, 0x10D49, CHAR_NUMBER},
+    {0x10D4A, 0x10D65, CHAR_LETTER},
+    {0x10D6F, 0x10D85, CHAR_LETTER},
+    {0x10E60, 0x10E7E, CHAR_NUMBER},
+    {0x10E80, 0x10EA9, CHAR_LETTER},
+    {0x10EB0, 0x10EB1, CHAR_LETTER},
+    {0x10EC2, 0x10EC7, CHAR_LETTER},
+    {0x10ED9, 0x10EEE, CHAR_LETTER},
+    {0x10F00, 0x10F1C, CHAR_LETTER},
+    {0x10F1D, 0x10F26, CHAR_NUMBER},
+    {0x10F27, 0x10F27, CHAR_LETTER},
+    {0x10F30, 0x10F45, CHAR_LETTER},
+    {0x10F51, 0x10F54, CHAR_NUMBER},
+    {0x10F70, 0x10F81, CHAR_LETTER},
+    {0x10FB0, 0x10FC4, CHAR_LETTER},
+    {0x10FC5, 0x10FCB, CHAR_NUMBER},
+    {0x10FE0, 0x10FF6, CHAR_LETTER},
+    {0x11003, 0x11037, CHAR_LETTER},
+    {0x11052, 0x1106F, CHAR_NUMBER},
+    {0x11071, 0x11072, CHAR_LETTER},
+    {0x11075, 0x11075, CHAR_LETTER},
+    {0x11083, 0x110AF, CHAR_LETTER},
+    {0x110D0, 0x110E8, CHAR_LETTER},
+    {0x110F0, 0x110F9, CHAR_NUMBER},
+    {0x11103, 0x11126, CHAR_LETTER},
+    {0x11136, 0x1113F, CHAR_NUMBER},
+    {0x11144, 0x11144, CHAR_LETTER},
+    {0x11147, 0x11147, CHAR_LETTER},
+    {0x11150, 0x11172, CHAR_LETTER},
+    {0x11176, 0x11176, CHAR_LETTER},
+    {0x11183, 0x111B2, CHAR_LETTER},
+    {0x111C1, 0x111C4, CHAR_LETTER},
+    {0x111D0, 0x111D9, CHAR_NUMBER},
+    {0x111DA, 0x111DA, CHAR_LETTER},
+    {0x111DC, 0x111DC, CHAR_LETTER},
+    {0x111E1, 0x111F4, CHAR_NUMBER},
+    {0x11200, 0x11211, CHAR_LETTER},
+    {0x11213, 0x1122B, CHAR_LETTER},
+    {0x1123F, 0x11240, CHAR_LETTER},
+    {0x11280, 0x11286, CHAR_LETTER},
+    {0x11288, 0x11288, CHAR_LETTER},
+    {0x1128A, 0x1128D, CHAR_LETTER},
+    {0x1128F, 0x1129D, CHAR_LETTER},
+    {0x1129F, 0x112A8, CHAR_LETTER},
+    {0x112B0, 0x112DE, CHAR_LETTER},
+    {0x112F0, 0x112F9, CHAR_NUMBER},
+    {0x11305, 0x1130C, CHAR_LETTER},
+    {0x1130F, 0x11310, CHAR_LETTER},
+    {0x11313, 0x11328, CHAR_LETTER},
+    {0x1132A, 0x11330, CHAR_LETTER},
+    {0x11332, 0x11333, CHAR_LETTER},
+    {0x11335, 0x11339, CHAR_LETTER},
+    {0x1133D, 0x1133D, CHAR_LETTER},
+    {0x11350, 0x11350, CHAR_LETTER},
+    {0x1135D, 0x11361, CHAR_LETTER},
+    {0x11380, 0x11389, CHAR_LETTER},
+    {0x1138B, 0x1138B, CHAR_LETTER},
+    {0x1138E, 0x1138E, CHAR_LETTER},
+    {0x11390, 0x113B5, CHAR_LETTER},
+    {0x113B7, 0x113B7, CHAR_LETTER},
+    {0x113D1, 0x113D1, CHAR_LETTER},
+    {0x113D3, 0x113D3, CHAR_LETTER},
+    {0x11400, 0x11434, CHAR_LETTER},
+    {0x11447, 0x1144A, CHAR_LETTER},
+    {0x11450, 0x11459, CHAR_NUMBER},
+    {0x1145F, 0x11461, CHAR_LETTER},
+    {0x11480, 0x114AF, CHAR_LETTER},
+    {0x114C4, 0x114C5, CHAR_LETTER},
+    {0x114C7, 0x114C7, CHAR_LETTER},
+    {0x114D0, 0x114D9, CHAR_NUMBER},
+    {0x11580, 0x115AE, CHAR_LETTER},
+    {0x115D8, 0x115DB, CHAR_LETTER},
+    {0x11600, 0x1162F, CHAR_LETTER},
+    {0x11644, 0x11644, CHAR_LETTER},
+    {0x11650, 0x11659, CHAR_NUMBER},
+    {0x11680, 0x116AA, CHAR_LETTER},
+    {0x116B8, 0x116B8, CHAR_LETTER},
+    {0x116C0, 0x116C9, CHAR_NUMBER},
+    {0x116D0, 0x116E3, CHAR_NUMBER},
+    {0x11700, 0x1171A, CHAR_LETTER},
+    {0x11730, 0x1173B, CHAR_NUMBER},
+    {0x11740, 0x11746, CHAR_LETTER},
+    {0x11800, 0x1182B, CHAR_LETTER},
+    {0x118A0, 0x118DF, CHAR_LETTER},
+    {0x118E0, 0x118F2, CHAR_NUMBER},
+    {0x118FF, 0x11906, CHAR_LETTER},
+    {0x11909, 0x11909, CHAR_LETTER},
+    {0x1190C, 0x11913, CHAR_LETTER},
+    {0x11915, 0x11916, CHAR_LETTER},
+    {0x11918, 0x1192F, CHAR_LETTER},
+    {0x1193F, 0x1193F, CHAR_LETTER},
+    {0x11941, 0x11941, CHAR_LETTER},
+    {0x11950, 0x11959, CHAR_NUMBER},
+    {0x119A0, 0x119A7, CHAR_LETTER},
+    {0x119AA, 0x119D0, CHAR_LETTER},
+    {0x119E1, 0x119E1, CHAR_LETTER},
+    {0x119E3, 0x119E3, CHAR_LETTER},
+    {0x11A00, 0x11A00, CHAR_LETTER},
+    {0x11A0B, 0x11A32, CHAR_LETTER},
+    {0x11A3A, 0x11A3A, CHAR_LETTER},
+    {0x11A50, 0x11A50, CHAR_LETTER},
+    {0x11A5C, 0x11A89, CHAR_LETTER},
+    {0x11A9D, 0x11A9D, CHAR_LETTER},
+    {0x11AB0, 0x11AF8, CHAR_LETTER},
+    {0x11B0A, 0x11B0A, CHAR_LETTER},
+    {0x11BC0, 0x11BE0, CHAR_LETTER},
+    {0x11BF0, 0x11BF9, CHAR_NUMBER},
+    {0x11C00, 0x11C08, CHAR_LETTER},
+    {0x11C0A, 0x11C2E, CHAR_LETTER},
+    {0x11C40, 0x11C40, CHAR_LETTER},
+    {0x11C50, 0x11C6C, CHAR_NUMBER},
+    {0x11C72, 0x11C8F, CHAR_LETTER},
+    {0x11D00, 0x11D06, CHAR_LETTER},
+    {0x11D08, 0x11D09, CHAR_LETTER},
+    {0x11D0B, 0x11D30, CHAR_LETTER},
+    {0x11D46, 0x11D46, CHAR_LETTER},
+    {0x11D50, 0x11D59, CHAR_NUMBER},
+    {0x11D60, 0x11D65, CHAR_LETTER},
+    {0x11D67, 0x11D68, CHAR_LETTER},
+    {0x11D6A, 0x11D89, CHAR_LETTER},
+    {0x11D98, 0x11D98, CHAR_LETTER},
+    {0x11DA0, 0x11DA9, CHAR_NUMBER},
+    {0x11DB0, 0x11DDB, CHAR_LETTER},
+    {0x11DE0, 0x11DE9, CHAR_NUMBER},
+    {0x11DF1, 0x11DF1, CHAR_LETTER},
+    {0x11EE0, 0x11EF2, CHAR_LETTER},
+    {0x11F02, 0x11F02, CHAR_LETTER},
+    {0x11F04, 0x11F10, CHAR_LETTER},
+    {0x11F12, 0x11F33, CHAR_LETTER},
+    {0x11F50, 0x11F59, CHAR_NUMBER},
+    {0x11FB0, 0x11FB0, CHAR_LETTER},
+    {0x11FC0, 0x11FD4, CHAR_NUMBER},
+    {0x12000, 0x12399, CHAR_LETTER},
+    {0x12400, 0x1246F, CHAR_NUMBER},
+    {0x12475, 0x1247F, CHAR_NUMBER},
+    {0x12480, 0x12543, CHAR_LETTER},
+    {0x12550, 0x12686, CHAR_NUMBER},
+    {0x12F90, 0x12FF0, CHAR_LETTER},
+    {0x13000, 0x1342F, CHAR_LETTER},
+    {0x13441, 0x13446, CHAR_LETTER},
+    {0x13460, 0x143FA, CHAR_LETTER},
+    {0x14400, 0x14646, CHAR_LETTER},
+    {0x16100, 0x1611D, CHAR_LETTER},
+    {0x16130, 0x16139, CHAR_NUMBER},
+    {0x16800, 0x16A38, CHAR_LETTER},
+    {0x16A40, 0x16A5E, CHAR_LETTER},
+    {0x16A60, 0x16A69, CHAR_NUMBER},
+    {0x16A70, 0x16ABE, CHAR_LETTER},
+    {0x16AC0, 0x16AC9, CHAR_NUMBER},
+    {0x16AD0, 0x16AED, CHAR_LETTER},
+    {0x16B00, 0x16B2F, CHAR_LETTER},
+    {0x16B40, 0x16B43, CHAR_LETTER},
+    {0x16B50, 0x16B59, CHAR_NUMBER},
+    {0x16B5B, 0x16B61, CHAR_NUMBER},
+    {0x16B63, 0x16B77, CHAR_LETTER},
+    {0x16B7D, 0x16B8F, CHAR_LETTER},
+    {0x16D40, 0x16D6C, CHAR_LETTER},
+    {0x16D70, 0x16D79, CHAR_NUMBER},
+    {0x16E40, 0x16E7F, CHAR_LETTER},
+    {0x16E80, 0x16E96, CHAR_NUMBER},
+    {0x16EA0, 0x16EB8, CHAR_LETTER},
+    {0x16EBB, 0x16ED3, CHAR_LETTER},
+    {0x16F00, 0x16F4A, CHAR_LETTER},
+    {0x16F50, 0x16F50, CHAR_LETTER},
+    {0x16F93, 0x16F9F, CHAR_LETTER},
+    {0x16FE0, 0x16FE1, CHAR_LETTER},
+    {0x16FE3, 0x16FE3, CHAR_LETTER},
+    {0x16FF2, 0x16FF3, CHAR_LETTER},
+    {0x16FF4, 0x16FF6, CHAR_NUMBER},
+    {0x17000, 0x18CDA, CHAR_LETTER},
+    {0x18CFF, 0x18D20, CHAR_LETTER},
+    {0x18D80, 0x18DF2, CHAR_LETTER},
+    {0x18E00, 0x19191, CHAR_LETTER},
+    {0x191A0, 0x191D2, CHAR_LETTER},
+    {0x1AFF0, 0x1AFF3, CHAR_LETTER},
+    {0x1AFF5, 0x1AFFB, CHAR_LETTER},
+    {0x1AFFD, 0x1AFFE, CHAR_LETTER},
+    {0x1B000, 0x1B128, CHAR_LETTER},
+    {0x1B132, 0x1B132, CHAR_LETTER},
+    {0x1B150, 0x1B152, CHAR_LETTER},
+    {0x1B155, 0x1B155, CHAR_LETTER},
+    {0x1B164, 0x1B168, CHAR_LETTER},
+    {0x1B170, 0x1B2FB, CHAR_LETTER},
+    {0x1BC00, 0x1BC6A, CHAR_LETTER},
+    {0x1BC70, 0x1BC7C, CHAR_LETTER},
+    {0x1BC80, 0x1BC88, CHAR_LETTER},
+    {0x1BC90, 0x1BC99, CHAR_LETTER},
+    {0x1CCF0, 0x1CCF9, CHAR_NUMBER},
+    {0x1D2C0, 0x1D2D3, CHAR_NUMBER},
+    {0x1D2E0, 0x1D2F3, CHAR_NUMBER},
+    {0x1D360, 0x1D378, CHAR_NUMBER},
+    {0x1D400, 0x1D454, CHAR_LETTER},
+    {0x1D456, 0x1D49C, CHAR_LETTER},
+    {0x1D49E, 0x1D49F, CHAR_LETTER},
+    {0x1D4A2, 0x1D4A2, CHAR_LETTER},
+    {0x1D4A5, 0x1D4A6, CHAR_LETTER},
+    {0x1D4A9, 0x1D4AC, CHAR_LETTER},
+    {0x1D4AE, 0x1D4B9, CHAR_LETTER},
+    {0x1D4BB, 0x1D4BB, CHAR_LETTER},
+    {0x1D4BD, 0x1D4C3, CHAR_LETTER},
+    {0x1D4C5, 0x1D505, CHAR_LETTER},
+    {0x1D507, 0x1D50A, CHAR_LETTER},
+    {0x1D50D, 0x1D514, CHAR_LETTER},
+    {0x1D516, 0x1D51C, CHAR_LETTER},
+    {0x1D51E, 0x1D539, CHAR_LETTER},
+    {0x1D53B, 0x1D53E, CHAR_LETTER},
+    {0x1D540, 0x1D544, CHAR_LETTER},
+    {0x1D546, 0x1D546, CHAR_LETTER},
+    {0x1D54A, 0x1D550, CHAR_LETTER},
+    {0x1D552, 0x1D6A6, CHAR_LETTER},
+    {0x1D6A8, 0x1D6C0, CHAR_LETTER},
+    {0x1D6C2, 0x1D6DA, CHAR_LETTER},
+    {0x1D6DC, 0x1D6FA, CHAR_LETTER},
+    {0x1D6FC, 0x1D714, CHAR_LETTER},
+    {0x1D716, 0x1D734, CHAR_LETTER},
+    {0x1D736, 0x1D74E, CHAR_LETTER},
+    {0x1D750, 0x1D76E, CHAR_LETTER},
+    {0x1D770, 0x1D788, CHAR_LETTER},
+    {0x1D78A, 0x1D7A8, CHAR_LETTER},
+    {0x1D7AA, 0x1D7C2, CHAR_LETTER},
+    {0x1D7C4, 0x1D7CB, CHAR_LETTER},
+    {0x1D7CE, 0x1D7FF, CHAR_NUMBER},
+    {0x1DF00, 0x1DF81, CHAR_LETTER},
+    {0x1DF90, 0x1DF96, CHAR_LETTER},
+    {0x1DFCD, 0x1DFFF, CHAR_LETTER},
+    {0x1E030, 0x1E06D, CHAR_LETTER},
+    {0x1E100, 0x1E12C, CHAR_LETTER},
+    {0x1E137, 0x1E13D, CHAR_LETTER},
+    {0x1E140, 0x1E149, CHAR_NUMBER},
+    {0x1E14E, 0x1E14E, CHAR_LETTER},
+    {0x1E290, 0x1E2AD, CHAR_LETTER},
+    {0x1E2C0, 0x1E2EB, CHAR_LETTER},
+    {0x1E2F0, 0x1E2F9, CHAR_NUMBER},
+    {0x1E4D0, 0x1E4EB, CHAR_LETTER},
+    {0x1E4F0, 0x1E4F9, CHAR_NUMBER},
+    {0x1E5D0, 0x1E5ED, CHAR_LETTER},
+    {0x1E5F0, 0x1E5F0, CHAR_LETTER},
+    {0x1E5F1, 0x1E5FA, CHAR_NUMBER},
+    {0x1E6C0, 0x1E6DE, CHAR_LETTER},
+    {0x1E6E0, 0x1E6E2, CHAR_LETTER},
+    {0x1E6E4, 0x1E6E5, CHAR_LETTER},
+    {0x1E6E7, 0x1E6ED, CHAR_LETTER},
+    {0x1E6F0, 0x1E6F4, CHAR_LETTER},
+    {0x1E6FE, 0x1E6FF, CHAR_LETTER},
+    {0x1E7E0, 0x1E7E6, CHAR_LETTER},
+    {0x1E7E8, 0x1E7EB, CHAR_LETTER},
+    {0x1E7ED, 0x1E7EE, CHAR_LETTER},
+    {0x1E7F0, 0x1E7FE, CHAR_LETTER},
+    {0x1E800, 0x1E8C4, CHAR_LETTER},
+    {0x1E8C7, 0x1E8CF, CHAR_NUMBER},
+    {0x1E900, 0x1E943, CHAR_LETTER},
+    {0x1E94B, 0x1E94B, CHAR_LETTER},
+    {0x1E950, 0x1E959, CHAR_NUMBER},
+    {0x1EC71, 0x1ECAB, CHAR_NUMBER},
+    {0x1ECAD, 0x1ECAF, CHAR_NUMBER},
+    {0x1ECB1, 0x1ECB4, CHAR_NUMBER},
+    {0x1ED01, 0x1ED2D, CHAR_NUMBER},
+    {0x1ED2F, 0x1ED3D, CHAR_NUMBER},
+    {0x1EE00, 0x1EE03, CHAR_LETTER},
+    {0x1EE05, 0x1EE1F, CHAR_LETTER},
+    {0x1EE21, 0x1EE22, CHAR_LETTER},
+    {0x1EE24, 0x1EE24, CHAR_LETTER},
+    {0x1EE27, 0x1EE27, CHAR_LETTER},
+    {0x1EE29, 0x1EE32, CHAR_LETTER},
+    {0x1EE34, 0x1EE37, CHAR_LETTER},
+    {0x1EE39, 0x1EE39, CHAR_LETTER},
+    {0x1EE3B, 0x1EE3B, CHAR_LETTER},
+    {0x1EE42, 0x1EE42, CHAR_LETTER},
+    {0x1EE47, 0x1EE47, CHAR_LETTER},
+    {0x1EE49, 0x1EE49, CHAR_LETTER},
+    {0x1EE4B, 0x1EE4B, CHAR_LETTER},
+    {0x1EE4D, 0x1EE4F, CHAR_LETTER},
+    {0x1EE51, 0x1EE52, CHAR_LETTER},
+    {0x1EE54, 0x1EE54, CHAR_LETTER},
+    {0x1EE57, 0x1EE57, CHAR_LETTER},
+    {0x1EE59, 0x1EE59, CHAR_LETTER},
+    {0x1EE5B, 0x1EE5B, CHAR_LETTER},
+    {0x1EE5D, 0x1EE5D, CHAR_LETTER},
+    {0x1EE5F, 0x1EE5F, CHAR_LETTER},
+    {0x1EE61, 0x1EE62, CHAR_LETTER},
+    {0x1EE64, 0x1EE64, CHAR_LETTER},
+    {0x1EE67, 0x1EE6A, CHAR_LETTER},
+    {0x1EE6C, 0x1EE72, CHAR_LETTER},
+    {0x1EE74, 0x1EE77, CHAR_LETTER},
+    {0x1EE79, 0x1EE7C, CHAR_LETTER},
+    {0x1EE7E, 0x1EE7E, CHAR_LETTER},
+    {0x1EE80, 0x1EE89, CHAR_LETTER},
+    {0x1EE8B, 0x1EE9B, CHAR_LETTER},
+    {0x1EEA1, 0x1EEA3, CHAR_LETTER},
+    {0x1EEA5, 0x1EEA9, CHAR_LETTER},
+    {0x1EEAB, 0x1EEBB, CHAR_LETTER},
+    {0x1F100, 0x1F10C, CHAR_NUMBER},
+    {0x1FBF0, 0x1FBF9, CHAR_NUMBER},
+    {0x20000, 0x2A6DF, CHAR_LETTER},
+    {0x2A700, 0x2B81E, CHAR_LETTER},
+    {0x2B820, 0x2CEAD, CHAR_LETTER},
+    {0x2CEB0, 0x2EBE0, CHAR_LETTER},
+    {0x2EBF0, 0x2EE5D, CHAR_LETTER},
+    {0x2F800, 0x2FA1D, CHAR_LETTER},
+    {0x30000, 0x3134A, CHAR_LETTER},
+    {0x31350, 0x33479, CHAR_LETTER},
+    {0x3D000, 0x3FC3F, CHAR_LETTER},
+};
+
+#define NUM_UNICODE_CHAR_RANGES (sizeof(unicode_char_ranges) / sizeof(unicode_char_ranges[0]))
+
+#endif
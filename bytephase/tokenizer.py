@@ -1,9 +1,36 @@
 from collections import Counter
-from typing import Dict, Generator, List, Union
+from typing import Dict, Generator, List, Tuple, Union
 import json
+import os
+import tempfile
 
 import regex
-from _bpe import build_trie, encode_inference, encode_train, manual_free_trie, train
+from _bpe import (
+    EncodeSession,
+    StreamDecoder,
+    TokenArray,
+    build_merges,
+    build_special_tokens,
+    build_trie,
+    build_vocab,
+    count_tokens,
+    count_tokens_batch,
+    decode,
+    decode_batch,
+    encode_batch,
+    encode_files,
+    encode_inference,
+    encode_merges,
+    encode_text,
+    encode_train,
+    load_binary,
+    pretokenize,
+    resume_training,
+    save_binary,
+    split_special_tokens,
+    train,
+    train_files,
+)
 
 __version__ = "1.0"
 
@@ -24,8 +51,15 @@ class Tokenizer:
         pattern (str): Regex pattern used for tokenization.
         compiled_pattern (regex.Pattern): Compiled regex pattern.
         file_read_buffer (int): Size of the buffer used when reading files during training.
+        encode_cache_size (int): Number of chunk encodings kept by the merge-order encoder.
         decode_dict (dict): Mapping of token IDs to byte sequences.
         _trie: Internal trie structure for efficient encoding (C extension).
+        _merges: Internal merge table and chunk cache for merge-order encoding (C extension).
+        _vocab: Internal byte pool and offsets of the token bytes, for decoding (C extension).
+        _itemsize (int): Bytes per token id in array output, 2 while the vocab fits in uint16.
+        special_tokens (dict): Mapping of special token strings to their IDs, the
+            eos token included. Encoding emits them as these IDs wherever they occur.
+        _special: Internal Aho-Corasick matcher of the special tokens (C extension).
 
     Note:
         The tokenizer uses a trie data structure implemented in C for fast encoding.
@@ -36,14 +70,23 @@ class Tokenizer:
         "pattern",
         "compiled_pattern",
         "file_read_buffer",
+        "encode_cache_size",
         "decode_dict",
         "_trie",
+        "_merges",
+        "_vocab",
+        "_itemsize",
         "eos_token",
         "eos_token_idx",
+        "special_tokens",
+        "_special",
     )
 
     def __init__(
-        self, pattern: Union[str, None] = None, file_read_buffer: int = 2097152
+        self,
+        pattern: Union[str, None] = None,
+        file_read_buffer: int = 2097152,
+        encode_cache_size: int = 65536,
     ) -> None:
         """
         Initialize the Tokenizer with an optional regex pattern and buffer size.
@@ -53,6 +96,8 @@ class Tokenizer:
                 If None, uses the default GPT-2 pattern. Defaults to None.
             file_read_buffer (int, optional): Size of the buffer (in bytes) used when
                 reading files for tokenization. Defaults to 2,097,152 (2MB).
+            encode_cache_size (int, optional): Number of chunk encodings cached by the
+                merge-order encoder, 0 disables the cache. Defaults to 65,536.
 
         Note:
             This method initializes eos_token and eos_token_idx.
@@ -61,15 +106,16 @@ class Tokenizer:
         self.pattern = GPT2_REGEX_PATTERN if pattern is None else pattern
         self.compiled_pattern = regex.compile(self.pattern)
         self.file_read_buffer = file_read_buffer
+        self.encode_cache_size = encode_cache_size
         self.decode_dict: Dict[int, bytes] = {}
         self._trie = None
+        self._merges = None
+        self._vocab = build_vocab(self.decode_dict)
+        self._itemsize = 2
         self.eos_token = "<|endoftext|>"
         self.eos_token_idx = 256
-
-    def __del__(self):
-        if self._trie is not None:
-            manual_free_trie(self._trie)
-            self._trie = None
+        self.special_tokens: Dict[str, int] = {self.eos_token: self.eos_token_idx}
+        self._special = build_special_tokens({256: self.eos_token.encode("utf-8")})
 
     def _read_file_in_chunks(self, file_path) -> Generator:
         """Generator function to read a file in chunks."""
@@ -81,6 +127,24 @@ class Tokenizer:
                     break
                 yield chunk
 
+    def _split(self, text: str) -> List[str]:
+        """Split text into chunks, natively when the pattern is the default GPT-2 one."""
+
+        if self.pattern == GPT2_REGEX_PATTERN:
+            return pretokenize(text)
+        return self.compiled_pattern.findall(text)
+
+    def _split_custom(self, pieces: List[Union[str, int]]) -> List[Union[str, int]]:
+        """Split text pieces with the custom pattern, keeping special token IDs as they are."""
+
+        chunks = []
+        for piece in pieces:
+            if isinstance(piece, int):
+                chunks.append(piece)
+            else:
+                chunks.extend(self.compiled_pattern.findall(piece))
+        return chunks
+
     def _process_chunks(self, file_path) -> Generator:
         """Process chunks of the file using the provided regex pattern."""
 
@@ -88,7 +152,7 @@ class Tokenizer:
         for chunk in self._read_file_in_chunks(file_path):
             chunk_str = chunk.decode("utf-8", errors="ignore")
             combined_data = buffer + chunk_str
-            matches = self.compiled_pattern.findall(combined_data)
+            matches = self._split(combined_data)
 
             if len(matches) > 0:
                 yield matches[:-1]
@@ -99,9 +163,98 @@ class Tokenizer:
                 buffer = ""
 
         if buffer:
-            yield buffer
+            yield [buffer]
+
+    def _base_vocab(self) -> Dict[int, bytes]:
+        """The vocabulary without the special tokens added after it."""
+
+        extra = set(self.special_tokens.values()) - {self.eos_token_idx}
+        return {idx: token for idx, token in self.decode_dict.items() if idx not in extra}
+
+    def _set_special_tokens(self, special_tokens: Dict[str, int]) -> None:
+        """Rebuild the special token matcher and the decoding vocabulary."""
+
+        self.special_tokens = special_tokens
+        for token, idx in special_tokens.items():
+            self.decode_dict[idx] = token.encode("utf-8")
+        self._special = build_special_tokens(
+            {idx: token.encode("utf-8") for token, idx in special_tokens.items()}
+        )
+        self._vocab = build_vocab(self.decode_dict)
+        self._itemsize = 2 if max(self.decode_dict) < 65536 else 4
+
+    def _set_merges(self, merges: List[List[int]]) -> None:
+        """Build the vocabulary and encoders from the bytes of each merge, in id order.
+
+        Special tokens other than the eos token are given new IDs after the merges.
+        """
+
+        extra = [
+            token
+            for token, idx in sorted(self.special_tokens.items(), key=lambda item: item[1])
+            if idx != self.eos_token_idx
+        ]
+        self.decode_dict = {idx: bytes([idx]) for idx in range(256)}
+        self.decode_dict[self.eos_token_idx] = self.eos_token.encode("utf-8")
+
+        for idx, merge in enumerate(merges, start=257):
+            byte_array = bytes(merge)
+            self.decode_dict[idx] = byte_array
+
+        self._trie = build_trie(self.decode_dict)
+        self._merges = build_merges(self.decode_dict, self.encode_cache_size)
+        special_tokens = {self.eos_token: self.eos_token_idx}
+        for idx, token in enumerate(extra, start=max(self.decode_dict) + 1):
+            special_tokens[token] = idx
+        self._set_special_tokens(special_tokens)
+
+    def add_special_tokens(self, tokens: List[str]) -> List[int]:
+        """
+        Register special tokens, such as chat role markers or FIM tokens.
+
+        Encoding finds them in the text before pre-tokenization, in a single pass
+        whose cost does not grow with the number of special tokens, and emits each
+        as its own ID. Where special tokens overlap, the one that starts first is
+        taken, and the longest of those starting at the same place.
+
+        Args:
+            tokens (List[str]): The special tokens. Ones already registered keep their IDs.
+
+        Returns:
+            List[int]: The ID of each token, after the rest of the vocabulary.
+
+        Raises:
+            ValueError: If tokens is not a list of non-empty strings.
 
-    def train(self, file_path: str, vocab_size: int) -> None:
+        Note:
+            Training again gives the special tokens new IDs after the learned merges.
+        """
+        if not isinstance(tokens, list) or not all(
+            isinstance(token, str) and token for token in tokens
+        ):
+            raise ValueError("Special tokens must be a list of non-empty strings")
+
+        special_tokens = dict(self.special_tokens)
+        next_idx = max(max(self.decode_dict, default=0), max(special_tokens.values())) + 1
+        for token in tokens:
+            if token not in special_tokens:
+                special_tokens[token] = next_idx
+                next_idx += 1
+        self._set_special_tokens(special_tokens)
+        return [special_tokens[token] for token in tokens]
+
+    def train(
+        self,
+        file_path: Union[str, List[str]],
+        vocab_size: int,
+        num_threads: int = 1,
+        checkpoint_path: str = None,
+        checkpoint_every: int = 0,
+        extend: bool = False,
+        min_count: int = 1,
+        max_memory: int = None,
+        spill_dir: str = None,
+    ) -> None:
         """
         Train the tokenizer on the given file using the BPE algorithm.
 
@@ -110,68 +263,243 @@ class Tokenizer:
         specified size. It updates the tokenizer's decode dictionary and builds
         a trie structure for efficient encoding.
 
+        With the default GPT-2 pattern the files are memory-mapped and counted
+        natively on num_threads threads, without building a Python dictionary.
+        Bytes that are not valid UTF-8 are then kept as single-byte words
+        rather than dropped.
+
         Args:
-            file_path (str): The path to the file containing the training data.
+            file_path (str or list of str): The path to the file containing the
+                training data, or a list of such paths.
             vocab_size (int): The desired size of the final vocabulary.
+            num_threads (int, optional): Number of threads used for counting and
+                for the merge phase. The learned merges do not depend on it.
+                Defaults to 1.
+            checkpoint_path (str, optional): File to save the training state to,
+                every checkpoint_every merges and when training ends. Training
+                can be continued from it with resume_training.
+            checkpoint_every (int, optional): Merges between checkpoints, 0 to
+                only save at the end. Defaults to 0.
+            extend (bool, optional): Keep the current vocabulary and learn only
+                the merges after it. Trained on the same data, this gives the
+                vocabulary a single run to vocab_size would. Defaults to False.
+            min_count (int, optional): Leave out words seen fewer times than this.
+                Defaults to 1.
+            max_memory (int, optional): Bytes the word counts may take while
+                counting. Counts past it are spilled to sorted files in spill_dir
+                and merged afterwards, with the same result. Needs the default
+                pattern. Defaults to None, no limit.
+            spill_dir (str, optional): Directory for spilled counts. Defaults to
+                the system temporary directory.
 
         Raises:
-            ValueError: If file_path is not a string or vocab_size is not a positive integer.
+            ValueError: If file_path is not a string or list of strings,
+                vocab_size or num_threads is not a positive integer,
+                checkpoint_every is negative, extend is set without a
+                vocabulary at least vocab_size - 1 tokens smaller, min_count
+                is not a positive integer, or max_memory is not a positive
+                integer or is set with a custom pattern.
 
         Note:
             The resulting vocabulary includes 256 byte tokens plus additional merged tokens.
+            Token ids are 32-bit and word frequencies 64-bit, so vocab_size may exceed
+            65,536; training stores words as 16-bit ids while the vocabulary fits.
         """
 
-        if not isinstance(file_path, str):
-            raise ValueError("Input data must be a file path as a string")
+        file_paths = [file_path] if isinstance(file_path, str) else file_path
+        if not isinstance(file_paths, list) or not all(
+            isinstance(path, str) for path in file_paths
+        ):
+            raise ValueError(
+                "Input data must be a file path as a string or a list of them"
+            )
         if not isinstance(vocab_size, int) or vocab_size <= 0:
             raise ValueError("vocab_size must be a positive integer")
-
-        text_stats = Counter()
-        for matches in self._process_chunks(file_path):
-            text_stats.update(matches)
-        text_stats = dict(text_stats)
+        if not isinstance(num_threads, int) or num_threads <= 0:
+            raise ValueError("num_threads must be a positive integer")
+        if not isinstance(checkpoint_every, int) or checkpoint_every < 0:
+            raise ValueError("checkpoint_every must be a non-negative integer")
+        if extend and self._merges is None:
+            raise ValueError("extend needs a trained or loaded vocabulary")
+        if not isinstance(min_count, int) or min_count <= 0:
+            raise ValueError("min_count must be a positive integer")
+        if max_memory is not None:
+            if not isinstance(max_memory, int) or max_memory <= 0:
+                raise ValueError("max_memory must be a positive integer")
+            if self.pattern != GPT2_REGEX_PATTERN:
+                raise ValueError("max_memory needs the default GPT-2 pattern")
 
         num_merges = vocab_size - 257
-        merges = train(text_stats, len(text_stats), num_merges)
+        options = (
+            self._base_vocab() if extend else None,
+            self._merges if extend else None,
+            checkpoint_path,
+            checkpoint_every,
+            self.pattern,
+        )
+        if self.pattern == GPT2_REGEX_PATTERN:
+            merges = train_files(
+                file_paths,
+                num_merges,
+                num_threads,
+                *options,
+                min_count,
+                max_memory or 0,
+                spill_dir or tempfile.gettempdir(),
+            )
+        else:
+            text_stats = Counter()
+            for path in file_paths:
+                for matches in self._process_chunks(path):
+                    text_stats.update(matches)
+            text_stats = {
+                word: count for word, count in text_stats.items() if count >= min_count
+            }
+            merges = train(
+                text_stats, len(text_stats), num_merges, num_threads, *options
+            )
+
+        self._set_merges(merges)
+
+    def resume_training(
+        self,
+        checkpoint_path: str,
+        vocab_size: int,
+        num_threads: int = 1,
+        checkpoint_every: int = 0,
+    ) -> None:
+        """
+        Continue training from a checkpoint written by train.
 
-        self.decode_dict = {idx: bytes([idx]) for idx in range(256)}
-        self.decode_dict[self.eos_token_idx] = self.eos_token.encode("utf-8")
+        The text and merges are taken from the checkpoint, so the training files
+        are not needed, and the result is the same as an uninterrupted run. The
+        checkpoint is updated as training goes on, so it can be resumed again.
 
-        for idx, merge in enumerate(merges, start=257):
-            byte_array = bytes(merge)
-            self.decode_dict[idx] = byte_array
+        Args:
+            checkpoint_path (str): The checkpoint file.
+            vocab_size (int): The desired size of the final vocabulary, at least
+                the size reached by the checkpoint.
+            num_threads (int, optional): Number of threads used for the merge
+                phase. Defaults to 1.
+            checkpoint_every (int, optional): Merges between checkpoints, 0 to
+                only save at the end. Defaults to 0.
 
-        self._trie = build_trie(self.decode_dict)
+        Raises:
+            ValueError: If the file is not a checkpoint, or vocab_size is smaller
+                than the checkpoint's vocabulary.
+        """
+
+        if not isinstance(vocab_size, int) or vocab_size <= 0:
+            raise ValueError("vocab_size must be a positive integer")
+        if not isinstance(num_threads, int) or num_threads <= 0:
+            raise ValueError("num_threads must be a positive integer")
+        if not isinstance(checkpoint_every, int) or checkpoint_every < 0:
+            raise ValueError("checkpoint_every must be a non-negative integer")
+
+        pattern, merges = resume_training(
+            checkpoint_path, vocab_size - 257, num_threads, checkpoint_every
+        )
+        self.pattern = pattern
+        self.compiled_pattern = regex.compile(self.pattern)
+        self._set_merges(merges)
 
     def encode(
-        self, input_text: str, train_mode: bool = True, seq_len: int = None
-    ) -> List[int]:
+        self,
+        input_text: str,
+        train_mode: bool = True,
+        seq_len: int = None,
+        use_merges: bool = False,
+        return_array: bool = False,
+        allow_special: bool = True,
+        return_offsets: bool = False,
+    ) -> Union[List[int], TokenArray, Tuple[Union[List[int], TokenArray], TokenArray]]:
         """
         Encode the input text into a list of token IDs using a C-based trie structure.
 
         This method first tokenizes the input text using the compiled regex pattern,
-        then encodes these tokens into token IDs using the C extension.
+        then encodes these tokens into token IDs using the C extension. With the
+        default GPT-2 pattern both steps run in C in a single pass.
 
         Args:
             input_text (str): The input text to encode.
             train_mode (bool, optional): Flag to indicate if the encoding is in training mode. Defaults to True.
             seq_len (int, optional): The target sequence length. Defaults to None.
+            use_merges (bool, optional): Apply the learned merges in training order
+                instead of greedy longest-match through the trie. Defaults to False.
+            return_array (bool, optional): Return a TokenArray of uint16 ids (uint32 if the
+                vocab does not fit) instead of a list. Defaults to False.
+            allow_special (bool, optional): Emit the special tokens in the text as their
+                IDs. If False they are encoded as ordinary text. Defaults to True.
+            return_offsets (bool, optional): Also return the UTF-8 byte span of each
+                token in the text, computed by the encoder itself. Defaults to False.
 
         Returns:
-            List[int]: A list of token IDs representing the encoded text.
+            Union[List[int], TokenArray]: The token IDs representing the encoded text. A
+                TokenArray supports the buffer protocol, so e.g. numpy.frombuffer or
+                torch.frombuffer can wrap it without a copy. With return_offsets, a
+                tuple of the token IDs and a uint64 TokenArray of shape (tokens, 2)
+                holding each token's (start, end) byte offsets into
+                input_text.encode("utf-8"). Eos and padding tokens get the empty span
+                at the end of the text.
 
         Raises:
-            ValueError: If input_text is not a string.
+            ValueError: If input_text is not a string, or return_offsets is set with a
+                custom pattern whose chunks leave out part of the text.
 
         Note:
             Encoding when train_mode is True will use less memory, but is slower.
             When train_mode is False, encoding will be faster but use more memory, which is more appropriate
-            at inference time.
+            at inference time. train_mode only applies to custom patterns encoded to a list.
+            With use_merges, the output matches the merge sequence learned by train, and repeated
+            chunks are served from a cache of encode_cache_size entries.
         """
         if not isinstance(input_text, str):
             raise ValueError("Input text must be a string")
 
-        if train_mode:
+        special = self._special if allow_special else None
+        if return_offsets and self.pattern != GPT2_REGEX_PATTERN:
+            # Spans count through the chunks, so they must tile the text
+            text = input_text
+            input_text = self._split_custom(
+                [text] if special is None else split_special_tokens(text, special)
+            )
+            special_strings = {v: k for k, v in self.special_tokens.items()}
+            covered = "".join(
+                special_strings[chunk] if isinstance(chunk, int) else chunk
+                for chunk in input_text
+            )
+            if covered != text:
+                raise ValueError(
+                    "return_offsets needs a pattern whose chunks cover the whole text"
+                )
+        elif self.pattern != GPT2_REGEX_PATTERN and special is not None:
+            # Text holding special tokens goes through the native encoder as chunks
+            pieces = split_special_tokens(input_text, special)
+            if any(isinstance(piece, int) for piece in pieces):
+                input_text = self._split_custom(pieces)
+
+        if self.pattern == GPT2_REGEX_PATTERN or return_array or isinstance(input_text, list):
+            if isinstance(input_text, str) and self.pattern != GPT2_REGEX_PATTERN:
+                input_text = self.compiled_pattern.findall(input_text)
+            merges = self._merges if use_merges else None
+            itemsize = self._itemsize if return_array else 0
+            seq_len = -1 if seq_len is None else seq_len
+            return encode_text(
+                input_text,
+                self._trie,
+                merges,
+                itemsize,
+                self.eos_token_idx,
+                seq_len,
+                special,
+                return_offsets,
+            )
+
+        if use_merges:
+            text_chunks = self.compiled_pattern.findall(input_text)
+            encoded = encode_merges(text_chunks, self._merges)
+
+        elif train_mode:
             chunk_iterator = self.compiled_pattern.finditer(input_text)
             encoded = encode_train(chunk_iterator, self._trie)
 
@@ -189,12 +517,292 @@ class Tokenizer:
 
         return encoded
 
-    def decode(self, input_tokens: List[int]) -> str:
+    def encode_batch(
+        self,
+        input_texts: List[str],
+        num_threads: int = 1,
+        use_merges: bool = False,
+        seq_len: int = None,
+        pack: bool = False,
+        allow_special: bool = True,
+    ) -> Tuple[TokenArray, TokenArray]:
+        """
+        Encode a list of texts on several threads without holding the GIL.
+
+        Every text is encoded as by encode with return_array=True, including its
+        trailing eos token, and the results are concatenated in input order.
+        With seq_len, the tokens are written straight into rows of seq_len
+        instead, ready to use as a [batch, seq_len] array.
+
+        Args:
+            input_texts (List[str]): The texts to encode.
+            num_threads (int, optional): Number of threads to encode on. Defaults to 1.
+            use_merges (bool, optional): Apply the learned merges in training order
+                instead of greedy longest-match through the trie. Defaults to False.
+            seq_len (int, optional): Length of each row. Each text gets its own row,
+                truncated or padded with the eos token like encode with seq_len.
+                Defaults to None.
+            pack (bool, optional): With seq_len, run the texts on across rows with
+                their eos tokens between them, so only the last row is padded.
+                Defaults to False.
+            allow_special (bool, optional): Emit the special tokens in the texts as
+                their IDs. Defaults to True.
+
+        Returns:
+            Tuple[TokenArray, TokenArray]: The token IDs of all texts, and uint64 offsets
+                such that text i is tokens[offsets[i]:offsets[i + 1]]. With seq_len the
+                tokens are exported as a 2-D buffer, and the second array holds the
+                number of tokens of each row that are not padding, eos included. With
+                pack it holds the offsets again, into the flattened rows.
+
+        Raises:
+            ValueError: If input_texts is not a list, num_threads or seq_len is not a
+                positive integer, or pack is set without seq_len.
+
+        Note:
+            Custom patterns are applied with the regex module before the GIL is released,
+            so only the encoding itself runs in parallel for them.
+        """
+        if not isinstance(input_texts, list):
+            raise ValueError("Input texts must be a list of strings")
+        if not isinstance(num_threads, int) or num_threads <= 0:
+            raise ValueError("num_threads must be a positive integer")
+        if seq_len is not None and (not isinstance(seq_len, int) or seq_len <= 0):
+            raise ValueError("seq_len must be a positive integer")
+        if pack and seq_len is None:
+            raise ValueError("pack needs a seq_len")
+
+        special = self._special if allow_special else None
+        if self.pattern != GPT2_REGEX_PATTERN:
+            input_texts = [
+                self._split_custom(
+                    [text] if special is None else split_special_tokens(text, special)
+                )
+                for text in input_texts
+            ]
+        merges = self._merges if use_merges else None
+        return encode_batch(
+            input_texts,
+            self._trie,
+            merges,
+            num_threads,
+            self._itemsize,
+            self.eos_token_idx,
+            -1 if seq_len is None else seq_len,
+            pack,
+            special,
+        )
+
+    def count_tokens(
+        self, input_text: str, use_merges: bool = False, allow_special: bool = True
+    ) -> int:
+        """
+        Count the tokens encode would return for the text, without building them.
+
+        Args:
+            input_text (str): The text to count.
+            use_merges (bool, optional): Count the merge-order encoding instead of
+                greedy longest-match through the trie. Defaults to False.
+            allow_special (bool, optional): Count the special tokens in the text as
+                one token each. Defaults to True.
+
+        Returns:
+            int: len(encode(input_text)), the eos token included.
+
+        Raises:
+            ValueError: If input_text is not a string.
+
+        Note:
+            With the default pattern and without use_merges, the GIL is released while
+            counting.
+        """
+        if not isinstance(input_text, str):
+            raise ValueError("Input text must be a string")
+
+        special = self._special if allow_special else None
+        if self.pattern != GPT2_REGEX_PATTERN:
+            input_text = self._split_custom(
+                [input_text] if special is None else split_special_tokens(input_text, special)
+            )
+        merges = self._merges if use_merges else None
+        return count_tokens(input_text, self._trie, merges, self.eos_token_idx, special)
+
+    def count_tokens_batch(
+        self,
+        input_texts: List[str],
+        num_threads: int = 1,
+        use_merges: bool = False,
+        allow_special: bool = True,
+    ) -> TokenArray:
+        """
+        Count the tokens of each text on several threads without holding the GIL.
+
+        Args:
+            input_texts (List[str]): The texts to count.
+            num_threads (int, optional): Number of threads to count on. Defaults to 1.
+            use_merges (bool, optional): Count the merge-order encoding instead of
+                greedy longest-match through the trie. Defaults to False.
+            allow_special (bool, optional): Count the special tokens in the texts as
+                one token each. Defaults to True.
+
+        Returns:
+            TokenArray: uint64 counts, count i being len(encode(input_texts[i])), the
+                same as the differences of the offsets returned by encode_batch.
+
+        Raises:
+            ValueError: If input_texts is not a list or num_threads is not a positive integer.
+        """
+        if not isinstance(input_texts, list):
+            raise ValueError("Input texts must be a list of strings")
+        if not isinstance(num_threads, int) or num_threads <= 0:
+            raise ValueError("num_threads must be a positive integer")
+
+        special = self._special if allow_special else None
+        if self.pattern != GPT2_REGEX_PATTERN:
+            input_texts = [
+                self._split_custom(
+                    [text] if special is None else split_special_tokens(text, special)
+                )
+                for text in input_texts
+            ]
+        merges = self._merges if use_merges else None
+        return count_tokens_batch(
+            input_texts,
+            self._trie,
+            merges,
+            num_threads,
+            self.eos_token_idx,
+            special,
+        )
+
+    def encode_files(
+        self,
+        input_paths: List[str],
+        output_prefix: str,
+        num_threads: int = 1,
+        separator: Union[str, bytes] = None,
+        shard_size: int = None,
+        use_merges: bool = False,
+        allow_special: bool = True,
+    ) -> List[str]:
+        """
+        Encode files straight to token shards on disk without holding the GIL.
+
+        The files are memory-mapped and encoded in blocks on num_threads threads
+        while another thread writes the finished blocks in order. Every document
+        is followed by the eos token, as in encode_batch.
+
+        Args:
+            input_paths (List[str]): The files to encode.
+            output_prefix (str): Shards are written to {output_prefix}_00000.bin,
+                {output_prefix}_00001.bin and so on.
+            num_threads (int, optional): Number of threads to encode on. Defaults to 1.
+            separator (str or bytes, optional): Text that separates documents within
+                a file, such as "<|endoftext|>". It is not encoded, and empty documents
+                are skipped. Defaults to None, each file is one document.
+            shard_size (int, optional): Start a new shard after the document that
+                brings the current one to this many tokens. Defaults to None, a single shard.
+            use_merges (bool, optional): Apply the learned merges in training order
+                instead of greedy longest-match through the trie. Defaults to False.
+            allow_special (bool, optional): Emit the special tokens in the files as
+                their IDs. Defaults to True.
+
+        Returns:
+            List[str]: The paths of the shards. Each holds the token IDs as raw uint16
+                (uint32 if the vocab does not fit), and the .idx file next to it holds
+                uint64 offsets such that document i is tokens[offsets[i]:offsets[i + 1]].
+
+        Raises:
+            ValueError: If input_paths is not a list of strings, num_threads or shard_size
+                is not a positive integer, separator is empty, or the tokenizer uses a
+                custom pattern.
+            OSError: If a file cannot be read or written. Shards written by a failed call
+                are removed.
+        """
+        if not isinstance(input_paths, list) or not all(
+            isinstance(path, str) for path in input_paths
+        ):
+            raise ValueError("Input paths must be a list of strings")
+        if not isinstance(num_threads, int) or num_threads <= 0:
+            raise ValueError("num_threads must be a positive integer")
+        if shard_size is not None and (not isinstance(shard_size, int) or shard_size <= 0):
+            raise ValueError("shard_size must be a positive integer")
+        if self.pattern != GPT2_REGEX_PATTERN:
+            raise ValueError("encode_files requires the default GPT-2 pattern")
+        if isinstance(separator, str):
+            separator = separator.encode("utf-8")
+
+        merges = self._merges if use_merges else None
+        return encode_files(
+            input_paths,
+            output_prefix,
+            self._trie,
+            merges,
+            num_threads,
+            self._itemsize,
+            self.eos_token_idx,
+            separator,
+            shard_size or 0,
+            self._special if allow_special else None,
+        )
+
+    def encode_file(
+        self,
+        input_path: str,
+        output_prefix: str,
+        num_threads: int = 1,
+        separator: Union[str, bytes] = None,
+        shard_size: int = None,
+        use_merges: bool = False,
+        allow_special: bool = True,
+    ) -> List[str]:
+        """
+        Encode one file straight to token shards on disk. See encode_files.
+        """
+        return self.encode_files(
+            [input_path],
+            output_prefix,
+            num_threads,
+            separator,
+            shard_size,
+            use_merges,
+            allow_special,
+        )
+
+    def encode_session(
+        self, use_merges: bool = False, allow_special: bool = True
+    ) -> EncodeSession:
+        """
+        Create an encoder for text that only grows, such as a chat transcript.
+
+        Args:
+            use_merges (bool, optional): Apply the learned merges in training order
+                instead of greedy longest-match through the trie. Defaults to False.
+            allow_special (bool, optional): Emit the special tokens in the text as
+                their IDs, also when one is split across appends. Defaults to True.
+
+        Returns:
+            EncodeSession: An object whose append(text) adds text and returns the index
+                of the first token that may have changed, and whose tokens() returns the
+                encoding of all text so far, equal to encode without the eos token. Only
+                the last two chunks are re-encoded on each append.
+
+        Raises:
+            ValueError: If the tokenizer uses a custom pattern.
+        """
+        if self.pattern != GPT2_REGEX_PATTERN:
+            raise ValueError("Encode sessions require the default GPT-2 pattern")
+        merges = self._merges if use_merges else None
+        special = self._special if allow_special else None
+        return EncodeSession(self._trie, merges, self, special)
+
+    def decode(self, input_tokens: Union[List[int], TokenArray]) -> str:
         """
         Decode a list of token IDs back into text.
 
         Args:
-            input_tokens (List[int]): A list of token IDs to decode.
+            input_tokens (Union[List[int], TokenArray]): A list of token IDs to decode, or
+                any buffer of integers such as a TokenArray or NumPy array.
 
         Returns:
             str: The decoded text.
@@ -205,49 +813,89 @@ class Tokenizer:
         Note:
             This method removes pad tokens (eos_token_idx) before decoding.
         """
-        if not isinstance(input_tokens, List):
-            raise ValueError("Input must be a list of integers")
+        return decode(input_tokens, self._vocab, self.eos_token_idx)
 
-        input_tokens = [token for token in input_tokens if token != self.eos_token_idx]
+    def decode_batch(
+        self,
+        input_tokens: Union[List[List[int]], TokenArray],
+        offsets: Union[TokenArray, None] = None,
+    ) -> List[str]:
+        """
+        Decode several token sequences back into texts.
 
-        bytes_array = bytearray()
-        for token in input_tokens:
-            if token in self.decode_dict:
-                bytes_array.extend(self.decode_dict[token])
-            else:
-                raise ValueError(f"Invalid token id: {token}")
+        Args:
+            input_tokens: A list of token sequences (lists or buffers of IDs), or with
+                offsets a single sequence holding all of them, as returned by encode_batch.
+            offsets (TokenArray, optional): Sequence i is input_tokens[offsets[i]:offsets[i + 1]].
+                Defaults to None.
+
+        Returns:
+            List[str]: The decoded texts, in order.
+
+        Raises:
+            ValueError: If the input is malformed or an invalid token ID is encountered.
+        """
+        return decode_batch(input_tokens, self._vocab, self.eos_token_idx, offsets)
+
+    def stream_decoder(self) -> StreamDecoder:
+        """
+        Create a decoder for text generated one token at a time.
 
-        decoded_text = bytes_array.decode("utf-8", errors="replace")
-        return decoded_text
+        Returns:
+            StreamDecoder: An object whose push(token) returns the text completed by
+                that token. Bytes of a character split across tokens are held back until
+                the character is complete, and flush() returns whatever is left.
+
+        Note:
+            Pad tokens (eos_token_idx) are skipped, as in decode.
+        """
+        return StreamDecoder(self._vocab, self.eos_token_idx)
 
-    def save(self, file_name: str, debug=False) -> None:
+    def save(self, file_name: str, debug=False, binary=False) -> None:
         """
-        Save the trained tokenizer to a JSON file.
+        Save the trained tokenizer to a JSON or binary file.
 
         Args:
             file_name (str): The base name for the output file(s).
             debug (bool, optional): If True, also saves a human-readable
                 version of the tokenizer. Defaults to False.
+            binary (bool, optional): If True, saves the binary format instead,
+                which load maps into memory without parsing. Defaults to False.
 
         Note:
-            Saves the tokenizer to '{file_name}.json'.
+            Saves the tokenizer to '{file_name}.json', or '{file_name}.bpe' in binary.
             If debug is True, also saves a human-readable version of the
             tokenizer to '{file_name}_debug.json'.
 
         """
 
-        output_file = file_name + ".json"
         tokenizer_data = {
             "version": "bytephase tokenizer by benjamin arnav v1",
             "regex_pattern": self.pattern,
             "tokens": {},
+            "special_tokens": self.special_tokens,
         }
 
         for idx, token in self.decode_dict.items():
             tokenizer_data["tokens"][str(idx)] = [int(t) for t in token]
 
-        with open(output_file, "w", encoding="utf-8") as f:
-            json.dump(tokenizer_data, f, indent=2)
+        if binary:
+            # Replace rather than overwrite, processes may have the old file mapped
+            output_file = file_name + ".bpe"
+            temp_file = output_file + ".tmp"
+            save_binary(
+                temp_file,
+                self.decode_dict,
+                self.pattern,
+                self._trie,
+                self._merges,
+                list(self.special_tokens.values()),
+            )
+            os.replace(temp_file, output_file)
+        else:
+            output_file = file_name + ".json"
+            with open(output_file, "w", encoding="utf-8") as f:
+                json.dump(tokenizer_data, f, indent=2)
 
         if debug:
             # Outputs a human-readable version
@@ -261,18 +909,41 @@ class Tokenizer:
 
     def load(self, file: str) -> None:
         """
-        Load a previously saved tokenizer from a .json file.
+        Load a previously saved tokenizer from a .json or .bpe file.
 
         Args:
-            file (str): The path to the .json file to load.
+            file (str): The path to the .json or .bpe file to load.
 
         Raises:
             AssertionError: If the file format is invalid or incompatible.
+            ValueError: If a .bpe file is corrupt or from an unsupported version.
 
         Note:
             This method updates the regex pattern attribute, decode_dict attribute
-            and rebuilds the C-based trie structure.
+            and rebuilds the C-based trie structure. A .bpe file is memory-mapped
+            instead, and its trie and merge table are used in place, so processes
+            loading the same file share them through the page cache.
         """
+        if file.endswith(".bpe"):
+            (
+                self.pattern,
+                self.decode_dict,
+                self._trie,
+                self._merges,
+                self._vocab,
+                special_ids,
+            ) = load_binary(file, self.encode_cache_size)
+            self.compiled_pattern = regex.compile(self.pattern)
+            # The special tokens are in the mapped vocab already
+            self.special_tokens = {
+                self.decode_dict[idx].decode("utf-8"): idx for idx in special_ids
+            } or {self.eos_token: self.eos_token_idx}
+            self._special = build_special_tokens(
+                {idx: token.encode("utf-8") for token, idx in self.special_tokens.items()}
+            )
+            self._itemsize = 2 if max(self.decode_dict) < 65536 else 4
+            return
+
         assert file.endswith(".json")
 
         try:
@@ -291,8 +962,14 @@ class Tokenizer:
         self.decode_dict = {
             int(idx): bytes(token) for idx, token in tokenizer_data["tokens"].items()
         }
-
-        self._trie = build_trie(self.decode_dict)
+        self.special_tokens = tokenizer_data.get(
+            "special_tokens", {self.eos_token: self.eos_token_idx}
+        )
+
+        base_vocab = self._base_vocab()
+        self._trie = build_trie(base_vocab)
+        self._merges = build_merges(base_vocab, self.encode_cache_size)
+        self._set_special_tokens(self.special_tokens)
 
     def get_vocab_size(self) -> int:
         """
@@ -9,7 +9,8 @@ module = Extension(
     "_bpe",
     sources=sources,
     include_dirs=[extension_dir],
-    extra_compile_args=["-O3"],
+    extra_compile_args=["-O3", "-pthread"],
+    extra_link_args=["-pthread"],
 )
 
 setup(
@@ -0,0 +1,52 @@
+import random
+
+import pytest
+
+from bytephase import Tokenizer
+
+
+def make_corpus(seed: int = 0, num_lines: int = 3000) -> str:
+    """Mixed-script text with numbers, punctuation and whitespace runs.
+
+    Made-up words give a few thousand distinct words, so common pairs are in
+    enough of them for training to split work across threads.
+    """
+    rng = random.Random(seed)
+    syllables = ["ka", "to", "ri", "mo", "ne", "sha", "lu", "pe", "di", "qua", "zo", "bel"]
+    words = [
+        "the", "tokenizer", "merges", "byte", "pairs", "into", "tokens", "and",
+        "writes", "them", "out", "again", "naïve", "café", "Straße", "日本語",
+        "テキスト", "Привет", "мир", "γειά", "🙂", "don't", "we'll", "it's",
+        "2024", "3.14", "x86_64", "#include", "<stdio.h>", "{", "}", "->",
+    ]
+    spaces = [" ", " ", " ", "  ", "\t", " \n", "\n\n", "   "]
+    lines = []
+    for _ in range(num_lines):
+        parts = []
+        for _ in range(rng.randint(1, 12)):
+            if rng.random() < 0.5:
+                word = rng.choice(words)
+            else:
+                word = "".join(rng.choice(syllables) for _ in range(rng.randint(1, 4)))
+            parts.append(word + rng.choice(spaces))
+        lines.append("".join(parts).rstrip(" ") + "\n")
+    return "".join(lines)
+
+
+@pytest.fixture(scope="session")
+def corpus() -> str:
+    return make_corpus()
+
+
+@pytest.fixture(scope="session")
+def corpus_path(tmp_path_factory, corpus) -> str:
+    path = tmp_path_factory.mktemp("corpus") / "corpus.txt"
+    path.write_text(corpus, encoding="utf-8")
+    return str(path)
+
+
+@pytest.fixture(scope="session")
+def tokenizer(corpus_path) -> Tokenizer:
+    tok = Tokenizer()
+    tok.train(corpus_path, vocab_size=600)
+    return tok
@@ -0,0 +1,126 @@
+import gc
+import os
+import struct
+
+import pytest
+
+from bytephase import Tokenizer
+
+HEADER = struct.Struct("<8sII15Q")
+HEADER_FIELDS = (
+    "magic", "version", "byte_order", "file_size", "pattern_offset", "pattern_length",
+    "num_ids", "vocab_offsets_offset", "vocab_pool_offset", "vocab_pool_length",
+    "trie_offset", "trie_num_nodes", "merges_offset", "merges_num_slots", "merges_size",
+    "special_offset", "num_special",
+)
+TRIE_NODE = struct.Struct("<iii")
+MERGE_SLOT = struct.Struct("<QI4x")
+
+
+@pytest.fixture(scope="module")
+def saved(tmp_path_factory, tokenizer):
+    path = tmp_path_factory.mktemp("binary") / "tok"
+    tokenizer.save(str(path), binary=True)
+    data = (path.parent / "tok.bpe").read_bytes()
+    return data, dict(zip(HEADER_FIELDS, HEADER.unpack_from(data)))
+
+
+def first_merge_slot(data, header):
+    for i in range(header["merges_num_slots"]):
+        offset = header["merges_offset"] + i * MERGE_SLOT.size
+        key, token_id = MERGE_SLOT.unpack_from(data, offset)
+        if token_id != 0:
+            return offset, key, token_id
+    raise AssertionError("no merges in the table")
+
+
+def test_round_trip(tmp_path, tokenizer, corpus):
+    tokenizer.save(str(tmp_path / "tok"), binary=True)
+    loaded = Tokenizer()
+    loaded.load(str(tmp_path / "tok.bpe"))
+    assert loaded.decode_dict == tokenizer.decode_dict
+    assert loaded.special_tokens == tokenizer.special_tokens
+    assert loaded.encode(corpus[:20000]) == tokenizer.encode(corpus[:20000])
+    assert loaded.encode(corpus[:20000], use_merges=True) == tokenizer.encode(corpus[:20000], use_merges=True)
+
+    loaded.save(str(tmp_path / "again"), binary=True)
+    assert (tmp_path / "again.bpe").read_bytes() == (tmp_path / "tok.bpe").read_bytes()
+
+
+def corrupt_truncated(data, header):
+    del data[-8:]
+
+
+def corrupt_magic(data, header):
+    data[0:8] = b"NOTBPE\0\0"
+
+
+def corrupt_pair_above_token(data, header):
+    offset, _, _ = first_merge_slot(data, header)
+    struct.pack_into("<Q", data, offset, (0x7FFFFFF0 << 32) | 0x7FFFFFF0)
+
+
+def corrupt_pair_is_token(data, header):
+    offset, _, token_id = first_merge_slot(data, header)
+    struct.pack_into("<Q", data, offset, (token_id << 32) | ord("a"))
+
+
+def corrupt_merge_id(data, header):
+    offset, _, _ = first_merge_slot(data, header)
+    struct.pack_into("<I", data, offset + 8, header["num_ids"])
+
+
+def corrupt_trie_id(data, header):
+    node = header["trie_offset"] + 5 * TRIE_NODE.size
+    struct.pack_into("<i", data, node + 8, header["num_ids"])
+
+
+def corrupt_trie_negative_id(data, header):
+    node = header["trie_offset"] + 5 * TRIE_NODE.size
+    struct.pack_into("<i", data, node + 8, -2)
+
+
+@pytest.mark.parametrize(
+    "corrupt",
+    [
+        corrupt_truncated,
+        corrupt_magic,
+        corrupt_pair_above_token,
+        corrupt_pair_is_token,
+        corrupt_merge_id,
+        corrupt_trie_id,
+        corrupt_trie_negative_id,
+    ],
+)
+def test_corrupt_file_rejected(tmp_path, saved, corrupt):
+    data, header = saved
+    data = bytearray(data)
+    corrupt(data, header)
+    path = tmp_path / "corrupt.bpe"
+    path.write_bytes(data)
+    with pytest.raises(ValueError):
+        Tokenizer().load(str(path))
+
+
+@pytest.mark.skipif(not os.path.exists("/proc/self/maps"), reason="needs /proc/self/maps")
+def test_reload_releases_mapping(tmp_path, tokenizer):
+    tokenizer.save(str(tmp_path / "tok"), binary=True)
+    path = str(tmp_path / "tok.bpe")
+
+    def num_mappings():
+        with open("/proc/self/maps") as f:
+            return sum(path in line for line in f)
+
+    loaded = Tokenizer()
+    for _ in range(10):
+        loaded.load(path)
+    assert num_mappings() == 1
+
+    session = loaded.encode_session()
+    del loaded
+    gc.collect()
+    assert num_mappings() == 1
+    session.append("still mapped")
+    del session
+    gc.collect()
+    assert num_mappings() == 0
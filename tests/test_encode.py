@@ -0,0 +1,118 @@
+import random
+from array import array
+
+import pytest
+
+
+@pytest.fixture(scope="module")
+def documents(corpus):
+    lines = corpus.splitlines(keepends=True)
+    return ["".join(lines[i : i + 40]) for i in range(0, len(lines), 40)]
+
+
+@pytest.mark.parametrize("use_merges", [False, True])
+def test_session_matches_encode(tokenizer, corpus, use_merges):
+    text = corpus[:30000]
+    rng = random.Random(2)
+    session = tokenizer.encode_session(use_merges)
+    previous = []
+    pos = 0
+    while pos < len(text):
+        piece = text[pos : pos + rng.choice([1, 2, 3, 10, 100])]
+        pos += len(piece)
+        first_changed = session.append(piece)
+        tokens = list(session.tokens())
+        assert tokens[:first_changed] == previous[:first_changed]
+        previous = tokens
+    # encode ends the text with the eos token, a session does not
+    assert previous == tokenizer.encode(text, use_merges=use_merges)[:-1]
+
+
+def test_session_splits_special_tokens_across_appends(tokenizer):
+    text = "before<|endoftext|>after"
+    session = tokenizer.encode_session()
+    for i in range(0, len(text), 3):
+        session.append(text[i : i + 3])
+    assert list(session.tokens()) == tokenizer.encode(text)[:-1]
+
+
+def test_stream_decoder_matches_decode(tokenizer, corpus):
+    tokens = tokenizer.encode(corpus[:30000])[:-1]
+    decoder = tokenizer.stream_decoder()
+    assert "".join(decoder.push(token) for token in tokens) + decoder.flush() == tokenizer.decode(tokens)
+
+    rng = random.Random(3)
+    decoder = tokenizer.stream_decoder()
+    parts = []
+    pos = 0
+    while pos < len(tokens):
+        step = rng.randint(0, 7)
+        parts.append(decoder.push(tokens[pos : pos + step]))
+        pos += step
+    assert "".join(parts) + decoder.flush() == tokenizer.decode(tokens)
+
+
+def test_stream_decoder_holds_split_characters(tokenizer):
+    text = "€ and 😀"
+    decoder = tokenizer.stream_decoder()
+    out = "".join(decoder.push(byte) for byte in text.encode("utf-8")) + decoder.flush()
+    assert out == text
+
+    rng = random.Random(4)
+    choices = [0x41, 0xC3, 0xA9, 0xE2, 0x82, 0xAC, 0xF0, 0x9F, 0x98, 0x80, 0xFF, 0x80]
+    for _ in range(500):
+        data = [rng.choice(choices) for _ in range(rng.randint(0, 12))]
+        decoder = tokenizer.stream_decoder()
+        out = "".join(decoder.push(byte) for byte in data) + decoder.flush()
+        assert out == bytes(data).decode("utf-8", "replace")
+
+
+def read_shards(paths, itemsize):
+    documents = []
+    for path in paths:
+        tokens = array("H" if itemsize == 2 else "I")
+        offsets = array("Q")
+        with open(path, "rb") as f:
+            tokens.frombytes(f.read())
+        with open(path[: -len(".bin")] + ".idx", "rb") as f:
+            offsets.frombytes(f.read())
+        assert offsets[0] == 0 and offsets[-1] == len(tokens)
+        documents.extend(tokens[offsets[i] : offsets[i + 1]].tolist() for i in range(len(offsets) - 1))
+    return documents
+
+
+@pytest.mark.parametrize(
+    "num_threads,shard_size,use_merges",
+    [(1, None, False), (4, None, False), (3, 2000, False), (2, 1, True)],
+)
+def test_encode_files_shards_decode_to_documents(tmp_path, tokenizer, documents, num_threads, shard_size, use_merges):
+    path = tmp_path / "docs.txt"
+    path.write_text("<|endoftext|>".join(documents + [""]), encoding="utf-8")
+    shards = tokenizer.encode_files(
+        [str(path)],
+        str(tmp_path / "shard"),
+        num_threads=num_threads,
+        separator="<|endoftext|>",
+        shard_size=shard_size,
+        use_merges=use_merges,
+    )
+    if shard_size == 1:
+        assert len(shards) == len(documents)
+
+    encoded = read_shards(shards, tokenizer._itemsize)
+    assert len(encoded) == len(documents)
+    for tokens, document in zip(encoded, documents):
+        assert tokens[-1] == tokenizer.eos_token_idx
+        assert tokenizer.decode(tokens[:-1]) == document
+        assert tokens == tokenizer.encode(document, use_merges=use_merges)
+
+
+def test_encode_files_one_document_per_file(tmp_path, tokenizer, documents):
+    paths = []
+    for i, document in enumerate(documents[:5]):
+        path = tmp_path / f"doc{i}.txt"
+        path.write_text(document, encoding="utf-8")
+        paths.append(str(path))
+    shards = tokenizer.encode_files(paths, str(tmp_path / "shard"), num_threads=2)
+    encoded = read_shards(shards, tokenizer._itemsize)
+    assert [tokenizer.decode(tokens[:-1]) for tokens in encoded] == documents[:5]
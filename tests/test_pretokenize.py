@@ -0,0 +1,54 @@
+import random
+
+import pytest
+import regex
+
+from _bpe import pretokenize
+from bytephase.tokenizer import GPT2_REGEX_PATTERN
+
+PATTERN = regex.compile(GPT2_REGEX_PATTERN)
+
+EDGE_CASES = [
+    "",
+    " ",
+    "   ",
+    "\n",
+    "\r\n\r\n",
+    "a  b",
+    "a   \n  b",
+    "trailing spaces   ",
+    "   leading spaces",
+    "tabs\t\tand\x0b\x0cfeeds",
+    "no-break\xa0space and　ideographic space",
+    "next line\x85here",
+    "don't we'll I'd they're you've it's 'S 'LL",
+    "'s' 'tis ''",
+    "1234567 3.14 -42 ١٢٣ Ⅻ ²",
+    "naïve café Straße ÉCOLE",
+    "é combininǵ marks",
+    "日本語のテキスト、中文。",
+    "Привет, мир! γειά σου",
+    "emoji 🙂🙂 and 👍🏽 flags 🇺🇳",
+    "mixed123abc___---!!!",
+    "x" * 100 + " " + "7" * 70 + "  " + "." * 40,
+    " " * 65 + "word" + "\n" * 33,
+]
+
+
+@pytest.mark.parametrize("text", EDGE_CASES)
+def test_matches_regex_on_edge_cases(text):
+    assert pretokenize(text) == PATTERN.findall(text)
+
+
+def test_matches_regex_on_corpus(corpus):
+    assert pretokenize(corpus) == PATTERN.findall(corpus)
+
+
+def test_matches_regex_on_random_text():
+    alphabet = list(" \t\n\r\x0b\x0c\x85\xa0　'sdmtlvre") + [
+        "a", "Z", "1", "٣", "Ⅻ", ".", "!", "é", "中", "😀", "́", "_", "-", "ß", "²",
+    ]
+    rng = random.Random(1)
+    for _ in range(5000):
+        text = "".join(rng.choice(alphabet) for _ in range(rng.randint(0, 40)))
+        assert pretokenize(text) == PATTERN.findall(text), text
@@ -0,0 +1,115 @@
+from collections import Counter
+
+import pytest
+import regex
+
+from bytephase import Tokenizer
+from bytephase.tokenizer import GPT2_REGEX_PATTERN
+
+VOCAB_SIZE = 600
+
+
+def reference_train(text: str, num_merges: int):
+    """The trainer as it was before the heap and pair index: recount every
+    pair on each step and merge the most frequent, the smallest pair on ties."""
+    counts = Counter(regex.findall(GPT2_REGEX_PATTERN, text))
+    words = [(list(word.encode("utf-8")), count) for word, count in counts.items()]
+    vocab = {idx: bytes([idx]) for idx in range(256)}
+    merges = []
+    for new_id in range(256, 256 + num_merges):
+        stats = Counter()
+        for word, count in words:
+            for pair in zip(word, word[1:]):
+                stats[pair] += count
+        if not stats:
+            break
+        pair = max(stats.items(), key=lambda item: (item[1], -item[0][0], -item[0][1]))[0]
+        for i, (word, count) in enumerate(words):
+            merged = []
+            j = 0
+            while j < len(word):
+                if j + 1 < len(word) and (word[j], word[j + 1]) == pair:
+                    merged.append(new_id)
+                    j += 2
+                else:
+                    merged.append(word[j])
+                    j += 1
+            words[i] = (merged, count)
+        vocab[new_id] = vocab[pair[0]] + vocab[pair[1]]
+        merges.append(vocab[new_id])
+    return merges
+
+
+def learned(tok: Tokenizer):
+    return [tok.decode_dict[idx] for idx in range(257, len(tok.decode_dict))]
+
+
+@pytest.fixture(scope="module")
+def straight(corpus_path):
+    tok = Tokenizer()
+    tok.train(corpus_path, vocab_size=VOCAB_SIZE)
+    return learned(tok)
+
+
+def test_matches_reference_trainer(corpus, straight):
+    assert straight == reference_train(corpus, VOCAB_SIZE - 257)
+
+
+@pytest.mark.parametrize("num_threads", [2, 4])
+def test_threads_give_same_merges(corpus_path, straight, num_threads):
+    tok = Tokenizer()
+    tok.train(corpus_path, vocab_size=VOCAB_SIZE, num_threads=num_threads)
+    assert learned(tok) == straight
+
+
+@pytest.mark.parametrize("num_threads", [1, 2, 4])
+def test_custom_pattern_threads_give_same_merges(corpus_path, num_threads):
+    # A custom pattern counts in Python and trains through _bpe.train
+    pattern = GPT2_REGEX_PATTERN + "|x"
+    single = Tokenizer(pattern=pattern)
+    single.train(corpus_path, vocab_size=400)
+    tok = Tokenizer(pattern=pattern)
+    tok.train(corpus_path, vocab_size=400, num_threads=num_threads)
+    assert learned(tok) == learned(single)
+
+
+def test_resume_matches_straight_run(tmp_path, corpus_path, straight):
+    checkpoint = str(tmp_path / "train.ckpt")
+    tok = Tokenizer()
+    tok.train(corpus_path, vocab_size=400, checkpoint_path=checkpoint, checkpoint_every=50)
+    assert learned(tok) == straight[: 400 - 257]
+
+    resumed = Tokenizer()
+    resumed.resume_training(checkpoint, vocab_size=VOCAB_SIZE, num_threads=2)
+    assert learned(resumed) == straight
+
+
+def test_extend_matches_straight_run(corpus_path, straight):
+    tok = Tokenizer()
+    tok.train(corpus_path, vocab_size=400)
+    tok.train(corpus_path, vocab_size=VOCAB_SIZE, extend=True)
+    assert learned(tok) == straight
+
+
+@pytest.mark.parametrize("num_threads", [1, 3])
+def test_spilled_counts_match_in_memory(tmp_path, corpus_path, straight, num_threads):
+    tok = Tokenizer()
+    tok.train(
+        corpus_path,
+        vocab_size=VOCAB_SIZE,
+        num_threads=num_threads,
+        max_memory=4096,
+        spill_dir=str(tmp_path),
+    )
+    assert learned(tok) == straight
+    assert list(tmp_path.iterdir()) == []
+
+
+def test_spilled_min_count_matches_in_memory(tmp_path, corpus_path):
+    in_memory = Tokenizer()
+    in_memory.train(corpus_path, vocab_size=VOCAB_SIZE, min_count=3)
+    spilled = Tokenizer()
+    spilled.train(
+        corpus_path, vocab_size=VOCAB_SIZE, min_count=3, max_memory=4096, spill_dir=str(tmp_path)
+    )
+    assert learned(spilled) == learned(in_memory)